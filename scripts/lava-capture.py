@@ -48,6 +48,10 @@ def args():
 	parser.add_argument('--delayfence-threshold', dest='delayfence_threshold', metavar='<nanoseconds>', help='Only delay fence waits with a timeout at or below this threshold in nanoseconds')
 	parser.add_argument('--gpu', dest='gpu', metavar='<gpu>', help='Use the specified GPU for tracing')
 	parser.add_argument('--automate', dest='automate', action='store_true', help='Try to automate the run as much as possible if app supports CBS')
+	parser.add_argument('--compression-threads', dest='compression_threads', metavar='<count>', help='Number of shared compression and writeout worker threads')
+	parser.add_argument('--inflight-budget', dest='inflight_budget', metavar='<megabytes>', help='Maximum amount of trace data waiting for compression and writeout before app threads are made to wait')
+	parser.add_argument('--adaptive-compression', dest='adaptive', action='store_true', help='Pick compression algorithm for each chunk, storing incompressible chunks uncompressed')
+	parser.add_argument('--patch-opcodes', dest='patch_opcodes', action='store_true', help='Store memory updates with fill and copy records where possible')
 	parser.add_argument('--no-multithread', dest='nomp', action='store_true', help='Turn off multi-threaded compression and disk writeout (saves memory)')
 	parser.add_argument('--trust-flushing', dest='explicit', action='store_true', help='Trust app to flush modified host memory instead of tracking usage')
 	parser.add_argument('--blacklist-extensions', dest='blacklist_extensions', metavar='<LIST>', help='Comma-separated Vulkan extensions to hide during capture')
@@ -111,6 +115,10 @@ if __name__ == '__main__':
 	if args.file: os.environ['LAVATUBE_DESTINATION'] = os.path.abspath(args.file)
 	if args.log: os.environ['LAVATUBE_DEBUG_FILE'] = args.log
 	if args.compression_type: os.environ['LAVATUBE_COMPRESSION_TYPE'] = compression_types[args.compression_type]
+	if args.compression_threads: os.environ['LAVATUBE_COMPRESSION_THREADS'] = args.compression_threads
+	if args.inflight_budget: os.environ['LAVATUBE_INFLIGHT_BUDGET'] = args.inflight_budget
+	if args.adaptive: os.environ['LAVATUBE_ADAPTIVE_COMPRESSION'] = '1'
+	if args.patch_opcodes: os.environ['LAVATUBE_PATCH_OPCODES'] = '1'
 	if args.explicit: os.environ['LAVATUBE_TRUST_HOST_FLUSHING'] = '1'
 	if args.blacklist_extensions is not None: os.environ['LAVATUBE_BLACKLIST_EXTENSIONS'] = args.blacklist_extensions
 	if 'LAVATUBE_BLACKLIST_EXTENSIONS' in os.environ:
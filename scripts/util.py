@@ -1253,7 +1253,7 @@ class parameter(spec.base_parameter):
 			z.brace_begin()
 			z.do('assert(real_memory_properties.memoryTypeCount > 0);')
 			z.do('assert(virtual_memory_properties.memoryTypeCount > pAllocateInfo_ORIGINAL->memoryTypeIndex);')
-			z.do('pAllocateInfo->memoryTypeIndex = remap_memory_types_to_real[pAllocateInfo->memoryTypeIndex]; // remap memory index')
+			z.do('pAllocateInfo->memoryTypeIndex = backing_memory_type(pAllocateInfo_ORIGINAL); // remap memory index')
 			z.do('assert(real_memory_properties.memoryTypeCount > pAllocateInfo->memoryTypeIndex);')
 			z.do('if (p__external_memory == 1 && (virtual_memory_properties.memoryTypes[pAllocateInfo_ORIGINAL->memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))')
 			z.brace_begin()
@@ -1278,6 +1278,7 @@ class parameter(spec.base_parameter):
 			z.do('for (uint32_t i = virtual_memory_properties.memoryTypeCount; i <= pAllocateInfo_ORIGINAL->memoryTypeIndex && i < VK_MAX_MEMORY_TYPES; i++)')
 			z.brace_begin()
 			z.do('remap_memory_types_to_real[i] = i;')
+			z.do('backing_memory_types[i] = i;')
 			z.do('virtual_memory_properties.memoryTypes[i] = {};')
 			z.do('real_memory_properties.memoryTypes[i] = {};')
 			z.brace_end()
@@ -1478,6 +1479,11 @@ def save_add_tracking(name):
 		elif type == 'VkDeviceMemory':
 			z.do('frame_mutex.lock();')
 			z.do('add->propertyFlags = (virtual_memory_properties.memoryTypeCount > pAllocateInfo_ORIGINAL->memoryTypeIndex) ? virtual_memory_properties.memoryTypes[pAllocateInfo_ORIGINAL->memoryTypeIndex].propertyFlags : 0;')
+			z.do('add->requested_type = pAllocateInfo_ORIGINAL->memoryTypeIndex;')
+			z.do('add->requested_heap = (virtual_memory_properties.memoryTypeCount > pAllocateInfo_ORIGINAL->memoryTypeIndex) ? virtual_memory_properties.memoryTypes[pAllocateInfo_ORIGINAL->memoryTypeIndex].heapIndex : 0;')
+			z.do('add->backing_type = pAllocateInfo->memoryTypeIndex;')
+			z.do('add->backing_heap = (real_memory_properties.memoryTypeCount > pAllocateInfo->memoryTypeIndex) ? real_memory_properties.memoryTypes[pAllocateInfo->memoryTypeIndex].heapIndex : 0;')
+			z.do('add->backing_flags = (real_memory_properties.memoryTypeCount > pAllocateInfo->memoryTypeIndex) ? real_memory_properties.memoryTypes[pAllocateInfo->memoryTypeIndex].propertyFlags : 0;')
 			z.do('add->allocationSize = pAllocateInfo->allocationSize;')
 			z.do('add->backing = *pMemory;')
 			z.do('add->extmem = extmem;')
@@ -1606,10 +1612,13 @@ def save_add_tracking(name):
 		elif type in ['VkBuffer', 'VkImage', 'VkAccelerationStructureKHR', 'VkTensorARM']:
 			z.do('if (meta->backing != VK_NULL_HANDLE)')
 			z.brace_begin()
-			z.do('writer.parent->memory_mutex.lock();')
 			z.do('auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(meta->backing);')
-			z.do('if (memory_data) memory_data->unbind(meta);')
-			z.do('writer.parent->memory_mutex.unlock();')
+			z.do('if (memory_data)')
+			z.brace_begin()
+			z.do('writer.parent->lock_memory(memory_data);')
+			z.do('memory_data->unbind(meta);')
+			z.do('writer.parent->unlock_memory(memory_data);')
+			z.brace_end()
 			z.brace_end()
 		z.brace_end()
 	elif name == 'vkGetDescriptorSetLayoutSizeEXT':
@@ -230,7 +230,7 @@ trackable_type_map_general = { 'VkBuffer': 'trackedbuffer', 'VkImage': 'trackedi
 	'VkIndirectExecutionSetEXT': 'trackedindirectexecutionset', 'VkIndirectCommandsLayoutEXT': 'trackedindirectcommandslayout', 'VkSurfaceKHR': 'trackedsurface',
 	'VkDataGraphPipelineSessionARM': 'trackeddatagraphpipelinesession' }
 trackable_type_map_trace = trackable_type_map_general.copy()
-trackable_type_map_trace.update({ 'VkCommandBuffer': 'trackedcmdbuffer_trace', 'VkSwapchainKHR': 'trackedswapchain', 'VkDescriptorSet': 'trackeddescriptorset_trace',
+trackable_type_map_trace.update({ 'VkCommandBuffer': 'trackedcmdbuffer_trace', 'VkDeviceMemory': 'trackedmemory_trace', 'VkSwapchainKHR': 'trackedswapchain', 'VkDescriptorSet': 'trackeddescriptorset_trace',
 	'VkEvent': 'trackedevent_trace', 'VkDescriptorPool': 'trackeddescriptorpool_trace', 'VkCommandPool': 'trackedcommandpool_trace' })
 trackable_type_map_replay = trackable_type_map_general.copy()
 trackable_type_map_replay.update({ 'VkCommandBuffer': 'trackedcmdbuffer', 'VkDescriptorSet': 'trackeddescriptorset', 'VkSwapchainKHR': 'trackedswapchain_replay' })
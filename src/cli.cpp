@@ -82,7 +82,7 @@ void usage()
 	printf("    show TYPE INDEX          Print JSON metadata for replay object TYPE with INDEX.\n");
 	printf("    info objects             Print object creation counts from limits metadata.\n");
 	printf("    info trace               Print JSON information about the replayed trace file.\n");
-	printf("    info threads             List traced threads.\n");
+	printf("    info threads             List traced threads and how long they have waited.\n");
 	printf("    info thread THREAD       Print JSON metadata for THREAD.\n");
 	printf("    info frame THREAD FRAME  Print JSON metadata for FRAME in THREAD.\n");
 	printf("    info memory              Print current Vulkan memory heap usage and budgets.\n");
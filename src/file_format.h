@@ -1,9 +1,83 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 
 struct packet_checkpoint
 {
 	uint32_t packet = 0;
 	uint64_t position = 0;
 };
+
+/// Stream versions stored in the LAVABIN stream header. Every chunk in a stream starts with a header of
+/// two uint64_t values, the size of the chunk payload that follows and its uncompressed size.
+enum lavatube_stream_version : uint8_t
+{
+	/// Each chunk payload is a single compressed block
+	LAVATUBE_STREAM_VERSION_CHUNKED = 3,
+	/// Each chunk payload starts with a sub-block table, followed by independently compressed sub-blocks
+	LAVATUBE_STREAM_VERSION_SUBBLOCKS = 4,
+	/// Each chunk payload starts with a chunk_tag telling how the rest of it is compressed and laid out
+	LAVATUBE_STREAM_VERSION_TAGGED = 5,
+	/// As tagged streams, but memory patches may also contain fill and copy records, see lavatube_patch_opcode
+	LAVATUBE_STREAM_VERSION_PATCH_OPCODES = 6,
+};
+
+/// How the payload of a chunk is laid out after its chunk_tag in tagged streams
+enum lavatube_chunk_layout : uint8_t
+{
+	LAVATUBE_CHUNK_LAYOUT_SINGLE = 0, ///< a single compressed block, as in version 3 streams
+	LAVATUBE_CHUNK_LAYOUT_SUBBLOCKS = 1, ///< a sub-block table and sub-blocks, as in version 4 streams
+};
+
+/// Start of each chunk payload in tagged streams. The codec is one of the lavatube_compression_type values
+/// and may change from chunk to chunk, so readers must not rely on the algorithm in the stream header.
+struct chunk_tag
+{
+	uint8_t codec = 0;
+	uint8_t layout = LAVATUBE_CHUNK_LAYOUT_SINGLE;
+	uint16_t reserved = 0;
+};
+
+/// Start of the sub-block table at the beginning of each chunk payload in sub-block streams. It is followed
+/// by block_count uint32_t compressed sizes, and then by the compressed sub-blocks back to back. Each sub-block
+/// holds block_size uncompressed bytes, except the last one, which holds whatever remains of the chunk.
+struct subblock_table_header
+{
+	uint32_t block_count = 0;
+	uint32_t block_size = 0;
+};
+
+/// Chunks stored without compression in a single block may be followed by padding, which is counted in the size of
+/// the chunk payload but not in its uncompressed size. Writers use it to make the data of the next chunk start at
+/// the same offset into a page of this size as it has in the uncompressed stream, so that readers can move whole
+/// pages of stored data from their file mapping instead of copying them.
+static constexpr uint64_t stored_chunk_alignment = 64 * 1024;
+
+static inline uint64_t subblock_table_size(uint32_t block_count) { return sizeof(subblock_table_header) + sizeof(uint32_t) * (uint64_t)block_count; }
+
+/// Compressed size of a sub-block, read from the sub-block table at the start of a chunk payload.
+static inline uint32_t subblock_compressed_size(const char* payload, uint32_t index)
+{
+	uint32_t size;
+	memcpy(&size, payload + sizeof(subblock_table_header) + sizeof(uint32_t) * (uint64_t)index, sizeof(size)); // may be unaligned
+	return size;
+}
+
+/// Memory patches are a list of records, each starting with a uint32_t offset from the end of the previous record
+/// and a uint32_t size field, and ending with a record where both are zero. In patch opcode streams, the top bits
+/// of the size field tell what kind of record it is, and the rest is the number of bytes it covers. In older
+/// streams, all records are raw.
+enum lavatube_patch_opcode : uint32_t
+{
+	/// Followed by the bytes to copy in
+	LAVATUBE_PATCH_RAW = 0,
+	/// Followed by a uint8_t pattern width of 1, 4 or 8 and then the pattern, which is repeated over the record
+	LAVATUBE_PATCH_FILL = 1,
+	/// Followed by a uint32_t distance back from the start of the record to copy from, as if copied one byte at
+	/// a time, so the source may overlap the record. The source is always written earlier in the same patch.
+	LAVATUBE_PATCH_COPY = 2,
+};
+
+static constexpr uint32_t patch_opcode_shift = 30;
+static constexpr uint32_t patch_size_mask = (1u << patch_opcode_shift) - 1;
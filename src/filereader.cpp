@@ -4,6 +4,7 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <lz4.h>
+#include <algorithm>
 
 #include "util.h"
 #include "filereader.h"
@@ -32,6 +33,7 @@ void file_reader::init(int fd, size_t uncompressed_size, size_t uncompressed_tar
 		stream_version = version;
 		compression_algorithm = compressed_data[1];
 		assert(compression_algorithm == LAVATUBE_COMPRESSION_DENSITY || compression_algorithm == LAVATUBE_COMPRESSION_LZ4 || compression_algorithm == LAVATUBE_COMPRESSION_UNCOMPRESSED);
+		if (version > LAVATUBE_STREAM_VERSION_PATCH_OPCODES) ABORT("Input file \"%s\" has unsupported stream version %u", mFilename.c_str(), (unsigned)version);
 		const size_t header_bytes = strlen(magic_word) + 32;
 		assert(total_left >= header_bytes);
 		compressed_data += 32; // the rest is reserved space
@@ -41,11 +43,10 @@ void file_reader::init(int fd, size_t uncompressed_size, size_t uncompressed_tar
 	total_compressed_stream = total_left;
 	madvise(fstart, mapped_size, MADV_SEQUENTIAL);
 
-	const uint64_t padded_size = (compression_algorithm == LAVATUBE_COMPRESSION_DENSITY) ? density_decompress_safe_size(uncompressed_size) : uncompressed_size;
-	uncompressed_data = (char*)mmap(nullptr, padded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	map_uncompressed(uncompressed_size);
 
 	done_decompressing = false;
-	decompressor_thread = std::thread(&file_reader::decompressor, this);
+	decompression_pool::instance().attach(this);
 }
 
 void file_reader::init_mapped(const packed& pf, size_t uncompressed_size, size_t uncompressed_target)
@@ -69,6 +70,7 @@ void file_reader::init_mapped(const packed& pf, size_t uncompressed_size, size_t
 		stream_version = version;
 		compression_algorithm = compressed_data[1];
 		assert(compression_algorithm == LAVATUBE_COMPRESSION_DENSITY || compression_algorithm == LAVATUBE_COMPRESSION_LZ4 || compression_algorithm == LAVATUBE_COMPRESSION_UNCOMPRESSED);
+		if (version > LAVATUBE_STREAM_VERSION_PATCH_OPCODES) ABORT("Input file \"%s\" has unsupported stream version %u", mFilename.c_str(), (unsigned)version);
 		const size_t header_bytes = strlen(magic_word) + 32;
 		assert(total_left >= header_bytes);
 		compressed_data += 32;
@@ -78,11 +80,120 @@ void file_reader::init_mapped(const packed& pf, size_t uncompressed_size, size_t
 	total_compressed_stream = total_left;
 	madvise(fstart, mapped_size, MADV_SEQUENTIAL);
 
-	const uint64_t padded_size = (compression_algorithm == LAVATUBE_COMPRESSION_DENSITY) ? density_decompress_safe_size(uncompressed_size) : uncompressed_size;
-	uncompressed_data = (char*)mmap(nullptr, padded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	map_uncompressed(uncompressed_size);
 
 	done_decompressing = false;
-	decompressor_thread = std::thread(&file_reader::decompressor, this);
+	decompression_pool::instance().attach(this);
+}
+
+/// Size of a transparent huge page, or zero if we do not know of any
+static uint64_t huge_page_size()
+{
+	static uint64_t size = []
+	{
+		unsigned long value = 0;
+		FILE* fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+		if (!fp) return (uint64_t)0;
+		if (fscanf(fp, "%lu", &value) != 1) value = 0;
+		fclose(fp);
+		return (uint64_t)value;
+	}();
+	return size;
+}
+
+/// Reserve address space aligned to the given alignment, so that it can be backed by huge pages
+static char* map_aligned(uint64_t size, uint64_t alignment, int prot)
+{
+	char* raw = (char*)mmap(nullptr, size + alignment, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) return (char*)MAP_FAILED;
+	char* aligned = (char*)(((uintptr_t)raw + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	if (aligned > raw) munmap(raw, aligned - raw);
+	if (raw + size + alignment > aligned + size) munmap(aligned + size, raw + size + alignment - (aligned + size));
+	return aligned;
+}
+
+void file_reader::prefault(char* start, uint64_t size)
+{
+	const uint64_t startns = gettime();
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(start, size, MADV_POPULATE_WRITE) != 0) // needs linux 5.14
+#endif
+	{
+		for (uint64_t offset = 0; offset < size; offset += page_size) ((volatile char*)start)[offset] = 0;
+	}
+	DLOG("Prefaulted %lu bytes for thread %u in %lu us", (unsigned long)size, tid, (unsigned long)((gettime() - startns) / 1000));
+}
+
+bool file_reader::map_stored(uint64_t uncompressed_size)
+{
+	// start our data at the same offset into a page as the data of the first chunk in the file mapping, so that
+	// whole pages of it can be moved over; writers pad stored chunks to keep later chunks lined up the same way
+	const uint64_t payload_start = sizeof(uint64_t) * 2 + ((stream_version >= LAVATUBE_STREAM_VERSION_TAGGED) ? sizeof(chunk_tag) : 0);
+	const uint64_t offset = ((uintptr_t)compressed_stream_start + payload_start) & (page_size - 1);
+	const uint64_t size = padded_size(uncompressed_size) + page_size;
+	char* base = (char*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) return false;
+	uncompressed_data = base + offset;
+	mapping_offset = offset;
+	mapping_size = size;
+	move_stored = true;
+	return true;
+}
+
+void file_reader::map_uncompressed(uint64_t uncompressed_size)
+{
+	// stored data mostly stays in the file mapping, so we neither need a window nor want huge pages or prefaulting
+	if (compression_algorithm == LAVATUBE_COMPRESSION_UNCOMPRESSED && map_stored(uncompressed_size)) return;
+	const uint64_t window = (uint64_t)p__uncompressed_window * 1024 * 1024;
+	const uint64_t full_size = padded_size(uncompressed_size);
+	if (window > 0 && window < full_size) return map_window(window);
+	mapping_size = full_size;
+	const uint64_t huge_page = p__huge_pages ? huge_page_size() : 0;
+	if (huge_page && full_size >= huge_page)
+	{
+		uncompressed_data = map_aligned(mapping_size, huge_page, PROT_READ | PROT_WRITE);
+		if (uncompressed_data != MAP_FAILED && madvise(uncompressed_data, mapping_size, MADV_HUGEPAGE) != 0)
+		{
+			WLOG("Failed to use huge pages for thread %u: %s", tid, strerror(errno));
+		}
+	}
+	else uncompressed_data = (char*)mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (uncompressed_data != MAP_FAILED)
+	{
+		if (p__prefault) prefault(uncompressed_data, std::min<uint64_t>(mapping_size, (uint64_t)p__preload * 1024 * 1024));
+		return;
+	}
+	// typically because we run out of address space on 32-bit or with huge traces
+	const uint64_t fallback = 256 * 1024 * 1024;
+	if (fallback >= full_size) ABORT("Failed to map %lu bytes of memory for thread %u: %s", (unsigned long)full_size, tid, strerror(errno));
+	WLOG("Failed to map %lu bytes of memory for thread %u (%s), using a %lu byte window instead", (unsigned long)full_size, tid, strerror(errno), (unsigned long)fallback);
+	map_window(fallback);
+}
+
+void file_reader::map_window(uint64_t size)
+{
+	const uint64_t huge_page = p__huge_pages ? huge_page_size() : 0;
+	window_size = std::bit_ceil(std::max<uint64_t>({ size, page_size, huge_page }));
+	window_mask = window_size - 1;
+	mapping_size = window_size * 2;
+	// map the same memory twice in a row, so that reads and writes can wrap around the end without being split up
+	const int fd = memfd_create("lavatube window", MFD_CLOEXEC);
+	if (fd == -1) ABORT("Failed to create uncompressed window for thread %u: %s", tid, strerror(errno));
+	if (ftruncate(fd, window_size) != 0) ABORT("Failed to size uncompressed window for thread %u: %s", tid, strerror(errno));
+	uncompressed_data = map_aligned(mapping_size, std::max<uint64_t>(huge_page, page_size), PROT_NONE);
+	if (uncompressed_data == MAP_FAILED) ABORT("Failed to reserve uncompressed window for thread %u: %s", tid, strerror(errno));
+	for (uint64_t offset = 0; offset < mapping_size; offset += window_size)
+	{
+		if (mmap(uncompressed_data + offset, window_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		{
+			ABORT("Failed to map uncompressed window for thread %u: %s", tid, strerror(errno));
+		}
+	}
+	close(fd);
+	// only does anything if shared memory huge pages are enabled in /sys/kernel/mm/transparent_hugepage/shmem_enabled
+	if (huge_page && madvise(uncompressed_data, mapping_size, MADV_HUGEPAGE) != 0) WLOG("Failed to use huge pages for thread %u: %s", tid, strerror(errno));
+	if (p__prefault) prefault(uncompressed_data, window_size); // both mappings share the same pages, and we reuse them forever
+	DLOG("Thread %u uses a %lu byte uncompressed window", tid, (unsigned long)window_size);
 }
 
 file_reader::file_reader(const std::string& filename, unsigned mytid, size_t uncompressed_size, size_t uncompressed_target, bool preload_active)
@@ -96,7 +207,7 @@ file_reader::file_reader(const std::string& filename, unsigned mytid, size_t unc
 	init(fd, uncompressed_size, uncompressed_target);
 	close(fd);
 	(void)tid; // silence compiler
-	DLOG("%s opened for reading (size %lu) and decompressor thread %u launched!", filename.c_str(), (unsigned long)total_left, tid);
+	DLOG("%s opened for reading (size %lu) and attached to decompression pool for thread %u!", filename.c_str(), (unsigned long)total_left, tid);
 }
 
 file_reader::file_reader(packed pf, unsigned mytid, size_t uncompressed_size, size_t uncompressed_target, bool preload_active)
@@ -107,7 +218,7 @@ file_reader::file_reader(packed pf, unsigned mytid, size_t uncompressed_size, si
 	zip_handle = pf.zip_handle;
 	zip_mapping = pf.zip_mapping;
 	init_mapped(pf, uncompressed_size, uncompressed_target);
-	DLOG("%u : %s opened for reading from inside %s (size %lu) and decompressor thread launched!", tid, pf.inside.c_str(), pf.pack.c_str(), (unsigned long)pf.filesize);
+	DLOG("%u : %s opened for reading from inside %s (size %lu) and attached to decompression pool!", tid, pf.inside.c_str(), pf.pack.c_str(), (unsigned long)pf.filesize);
 }
 
 file_reader::file_reader(fixed_buffer_input, const char* data, size_t size, unsigned mytid, uint8_t version)
@@ -126,7 +237,7 @@ void file_reader::reset_fixed_buffer(const char* data, size_t size, uint8_t vers
 	read_position = 0;
 	freed_position = 0;
 	checkpoint_position = UINT64_MAX;
-	last_chunk_uncompressed_size = 0;
+	last_chunk_uncompressed_size.store(0, std::memory_order_relaxed);
 	uncompressed_bytes.store(0, std::memory_order_relaxed);
 	needed_write_position.store(0, std::memory_order_relaxed);
 	write_position.store(size, std::memory_order_relaxed);
@@ -138,9 +249,14 @@ void file_reader::reset_fixed_buffer(const char* data, size_t size, uint8_t vers
 void file_reader::release_checkpoint()
 {
 	if (checkpoint_position == UINT64_MAX) return;
-	if (fixed_buffer)
+	if (fixed_buffer || window_size)
 	{
-		checkpoint_position = UINT64_MAX;
+		checkpoint_position = UINT64_MAX; // window pages are reused rather than given back
+		if (unlikely(publish_on_release.load(std::memory_order_relaxed)))
+		{
+			publish_on_release.store(false, std::memory_order_relaxed);
+			publish_progress();
+		}
 		return;
 	}
 	assert(checkpoint_position >= freed_position);
@@ -176,111 +292,174 @@ file_reader::~file_reader()
 {
 	if (fixed_buffer) return;
 	done_decompressing = true;
-	if (decompressor_thread.joinable()) decompressor_thread.join();
+	decompression_pool::instance().detach(this);
 	if (zip_handle)
 	{
 		zipc_unmap_read(zip_handle, zip_mapping);
 		zipc_close(zip_handle);
 	}
 	else munmap(fstart, mapped_size);
-	const uint64_t padded_size = (compression_algorithm == LAVATUBE_COMPRESSION_DENSITY) ? density_decompress_safe_size(total_uncompressed) : total_uncompressed;
-	munmap(uncompressed_data, padded_size);
+	munmap(uncompressed_data - mapping_offset, mapping_size);
+	if (move_stored) DLOG("Thread %u moved %lu of %lu bytes out of its file mapping", tid, (unsigned long)moved_bytes.load(), (unsigned long)uncompressed_bytes.load());
 }
 
-/// Only call this from the decompressor thread (or main thread if not using multi-threaded file reading).
-void file_reader::decompress_chunk()
+uint64_t file_reader::padded_size(uint64_t size) const
 {
-	const uint64_t *header = (const uint64_t*)compressed_data;
-	const uint64_t compressed_size = header[0];
-	const uint64_t uncompressed_size = header[1];
-	const uint64_t header_size = sizeof(uint64_t) * 2;
-	compressed_data += header_size;
-	assert(compressed_size <= total_left);
-	uint8_t* destination = (uint8_t*)uncompressed_data + write_position.load(std::memory_order_relaxed);
-	assert(uncompressed_data + total_uncompressed >= (char*)destination + uncompressed_size);
-	if (compression_algorithm == LAVATUBE_COMPRESSION_DENSITY)
+	// density may write past the end of its output, and tagged streams may contain density chunks whatever the stream header says
+	if (compression_algorithm == LAVATUBE_COMPRESSION_DENSITY || stream_version >= LAVATUBE_STREAM_VERSION_TAGGED) return density_decompress_safe_size(size);
+	return size;
+}
+
+void file_reader::decompress_block(uint8_t codec, const char* source, uint64_t compressed_size, uint8_t* destination, uint64_t uncompressed_size)
+{
+	if (codec == LAVATUBE_COMPRESSION_DENSITY)
 	{
 		const uint64_t estimated_size = density_decompress_safe_size(uncompressed_size);
-		assert(uncompressed_data + density_decompress_safe_size(total_uncompressed) >= (char*)destination + estimated_size);
-		density_processing_result result = density_decompress((const uint8_t*)compressed_data, compressed_size, destination, estimated_size);
+		assert(uncompressed_data + mapping_size >= (char*)destination + estimated_size);
+		density_processing_result result = density_decompress((const uint8_t*)source, compressed_size, destination, estimated_size);
 		if (result.state != DENSITY_STATE_OK) ABORT("Failed to decompress infile - aborting");
 	}
-	else if (compression_algorithm == LAVATUBE_COMPRESSION_LZ4)
+	else if (codec == LAVATUBE_COMPRESSION_LZ4)
 	{
-		int result = LZ4_decompress_safe(compressed_data, (char*)destination, compressed_size, uncompressed_size);
+		int result = LZ4_decompress_safe(source, (char*)destination, compressed_size, uncompressed_size);
 		if (result < 0) ABORT("Failed to decompress infile - aborting read thread");
 		if ((uint64_t)result != uncompressed_size) ABORT("Failed to decompress the full chunk in infile - aborting read thread");
 	}
-	else // uncompressed
+	else if (codec == LAVATUBE_COMPRESSION_UNCOMPRESSED)
 	{
-		assert(compression_algorithm == LAVATUBE_COMPRESSION_UNCOMPRESSED);
-		memcpy(destination, compressed_data, uncompressed_size);
+		memcpy(destination, source, uncompressed_size);
 	}
-	compressed_data += compressed_size;
-	compressed_stream_consumed_bytes.store((uint64_t)(compressed_data - compressed_stream_start), std::memory_order_relaxed);
-	write_position.fetch_add(uncompressed_size, std::memory_order_release);
-	write_position.notify_one();
-	last_chunk_uncompressed_size = uncompressed_size;
-	total_left -= compressed_size + header_size;
-	uncompressed_bytes += uncompressed_size;
-	release_compressed_pages();
-	if (total_left == 0 || write_position >= uncompressed_wanted) done_decompressing = true;  // all done!
+	else ABORT("Bad compression algorithm %u in infile - aborting read thread", (unsigned)codec);
 }
 
-/// Decompressor thread
-void file_reader::decompressor()
+void file_reader::move_block(const char* source, uint8_t* destination, uint64_t size)
 {
-	set_thread_name("decompressor");
-
-	const size_t fixed_preload = p__preload * 1024 * 1024;
-	while (!done_decompressing)
+	const uintptr_t start = (uintptr_t)destination;
+	const uintptr_t first = (start + page_size - 1) & page_mask(); // start of the first whole page
+	const uintptr_t last = (start + size) & page_mask(); // end of the last whole page
+	if (!move_stored || ((uintptr_t)source & (page_size - 1)) != (start & (page_size - 1)) || last <= first)
 	{
-		// Throttle unless the replayer is blocked waiting for data (needed_write_position > write_position),
-		// which can happen when a packet spans more than one chunk in one-chunk-ahead mode.
-		while (!done_decompressing)
-		{
-			const size_t active_preload = preload_activated.load(std::memory_order_relaxed) ? fixed_preload : 0;
-			const size_t preload_size = active_preload > 0 ? active_preload : last_chunk_uncompressed_size;
-			if (!(preload_size > 0
-			      && write_position.load(std::memory_order_relaxed) > read_position + preload_size
-			      && write_position.load(std::memory_order_relaxed) >= needed_write_position.load(std::memory_order_relaxed)))
-			{
-				break;
-			}
-			usleep(1000); // we're too far ahead and replayer is not blocked
-		}
-		if (done_decompressing) break;
-		decompress_chunk();
+		memcpy(destination, source, size);
+		return;
+	}
+	// the partial pages at either end are shared with chunk headers, so we copy those
+	const uint64_t head = first - start;
+	const uint64_t tail = start + size - last;
+	memcpy(destination, source, head);
+	memcpy((char*)last, source + size - tail, tail);
+	// we never read the compressed stream behind us again, so we can take its pages
+	if (mremap((void*)(source + head), last - first, last - first, MREMAP_MAYMOVE | MREMAP_FIXED, (void*)first) == MAP_FAILED)
+	{
+		WLOG("Failed to move stored data for thread %u, copying it instead: %s", tid, strerror(errno));
+		move_stored = false;
+		memcpy((char*)first, source + head, last - first);
+		return;
+	}
+	// take the page faults here rather than in the replayer
+#ifdef MADV_POPULATE_READ
+	if (madvise((void*)first, last - first, MADV_POPULATE_READ) != 0) // needs linux 5.14
+#endif
+	{
+		madvise((void*)first, last - first, MADV_WILLNEED);
 	}
+	moved_bytes.fetch_add(last - first, std::memory_order_relaxed);
+}
 
-	clockid_t id;
-	int r = pthread_getcpuclockid(pthread_self(), &id);
-	if (r != 0)
+uint64_t file_reader::next_chunk_window_bytes() const
+{
+	const uint64_t *header = (const uint64_t*)compressed_data;
+	return padded_size(header[1]);
+}
+
+/// Only call this from the decompression pool (or main thread if not using multi-threaded file reading).
+void file_reader::decompress_chunk()
+{
+	const uint64_t *header = (const uint64_t*)compressed_data;
+	const uint64_t compressed_size = header[0];
+	const uint64_t uncompressed_size = header[1];
+	const uint64_t header_size = sizeof(uint64_t) * 2;
+	compressed_data += header_size;
+	assert(compressed_size <= total_left);
+	const uint64_t write = write_position.load(std::memory_order_relaxed);
+	uint8_t* destination = (uint8_t*)uncompressed_data + (write & window_mask);
+	assert(write + uncompressed_size <= total_uncompressed);
+	if (!multithreaded_read && window_size && write + padded_size(uncompressed_size) > std::min(checkpoint_position, read_position) + window_size)
 	{
-		ELOG("Failed to get worker thread %u ID: %s", tid, strerror(r));
+		ABORT("Thread %u needs more than its %lu byte uncompressed window, try a bigger LAVATUBE_UNCOMPRESSED_WINDOW", tid, (unsigned long)window_size);
 	}
-	else if (clock_gettime(id, &stop_worker_cpu_usage) != 0)
+	// work out how this chunk is stored; tagged streams say so for each chunk
+	uint8_t codec = compression_algorithm;
+	uint8_t layout = (stream_version == LAVATUBE_STREAM_VERSION_SUBBLOCKS) ? LAVATUBE_CHUNK_LAYOUT_SUBBLOCKS : LAVATUBE_CHUNK_LAYOUT_SINGLE;
+	const char* payload = compressed_data;
+	uint64_t payload_size = compressed_size;
+	if (stream_version >= LAVATUBE_STREAM_VERSION_TAGGED)
 	{
-		ELOG("Failed to get worker thread %u CPU usage: %s", tid, strerror(errno));
+		chunk_tag tag;
+		if (compressed_size < sizeof(tag)) ABORT("Truncated chunk tag in infile - aborting read thread");
+		memcpy(&tag, compressed_data, sizeof(tag));
+		codec = tag.codec;
+		layout = tag.layout;
+		payload += sizeof(tag);
+		payload_size -= sizeof(tag);
 	}
-	else
+	if (layout == LAVATUBE_CHUNK_LAYOUT_SUBBLOCKS)
+	{
+		subblock_table_header table;
+		memcpy(&table, payload, sizeof(table));
+		if (table.block_count == 0 || table.block_size == 0 || subblock_table_size(table.block_count) > payload_size)
+		{
+			ABORT("Bad sub-block table in infile - aborting read thread");
+		}
+		// hand over each sub-block as soon as it is ready, so that the replayer does not wait for the whole chunk
+		const char* source = payload + subblock_table_size(table.block_count);
+		uint64_t remaining = uncompressed_size;
+		for (uint32_t i = 0; i < table.block_count; i++)
+		{
+			const uint64_t size = std::min<uint64_t>(table.block_size, remaining);
+			const uint32_t block_compressed_size = subblock_compressed_size(payload, i);
+			assert(source + block_compressed_size <= payload + payload_size);
+			decompress_block(codec, source, block_compressed_size, destination, size);
+			source += block_compressed_size;
+			destination += size;
+			remaining -= size;
+			write_position.fetch_add(size, std::memory_order_release);
+			write_position.notify_one();
+		}
+		if (remaining != 0) ABORT("Sub-blocks do not cover the whole chunk in infile - aborting read thread");
+		compressed_data += compressed_size;
+		compressed_stream_consumed_bytes.store((uint64_t)(compressed_data - compressed_stream_start), std::memory_order_relaxed);
+	}
+	else if (layout == LAVATUBE_CHUNK_LAYOUT_SINGLE)
 	{
-		worker_measurement_ready.store(true, std::memory_order_release);
+		if (codec == LAVATUBE_COMPRESSION_UNCOMPRESSED) move_block(payload, destination, uncompressed_size);
+		else decompress_block(codec, payload, payload_size, destination, uncompressed_size);
+		compressed_data += compressed_size;
+		compressed_stream_consumed_bytes.store((uint64_t)(compressed_data - compressed_stream_start), std::memory_order_relaxed);
+		write_position.fetch_add(uncompressed_size, std::memory_order_release);
+		write_position.notify_one();
 	}
+	else ABORT("Bad chunk layout %u in infile - aborting read thread", (unsigned)layout);
+	last_chunk_uncompressed_size.store(uncompressed_size, std::memory_order_relaxed);
+	total_left -= compressed_size + header_size;
+	uncompressed_bytes += uncompressed_size;
+	release_compressed_pages();
+	if (total_left == 0 || write_position >= uncompressed_wanted) done_decompressing = true;  // all done!
 }
 
 void file_reader::start_measurement()
 {
 	preload_activated.store(true, std::memory_order_release);
+	if (multithreaded_read) publish_progress(); // we may now read further ahead
 	measurement_stopped.store(false, std::memory_order_release);
 	cached_worker_time = 0;
 	cached_runner_time = 0;
-	worker_measurement_ready.store(false, std::memory_order_release);
+	cached_worker_bytes = 0;
 
 	if (multithreaded_read && p__preload > 0)
 	{
 		const size_t fixed_preload = p__preload * 1024 * 1024;
 		uint64_t target = read_position + fixed_preload;
+		if (window_size) target = std::min(target, read_position + window_size / 4); // we cannot preload more than fits
 		if (target > uncompressed_wanted) target = uncompressed_wanted;
 		if (target > total_uncompressed) target = total_uncompressed;
 
@@ -296,8 +475,12 @@ void file_reader::start_measurement()
 	clockid_t id;
 	pthread_t runner = pthread_self();
 	if (runner_thread_bound.load(std::memory_order_acquire)) runner = runner_thread;
-	int r = pthread_getcpuclockid(runner, &id);
-	if (r != 0)
+	int r = runner_measured ? pthread_getcpuclockid(runner, &id) : 0;
+	if (!runner_measured)
+	{
+		// nothing to do
+	}
+	else if (r != 0)
 	{
 		ELOG("Failed to get API runner thread %u ID: %s", tid, strerror(r));
 	}
@@ -306,25 +489,8 @@ void file_reader::start_measurement()
 		ELOG("Failed to get API runner thread %u CPU usage: %s", tid, strerror(errno));
 	}
 
-	if (!multithreaded_read)
-	{
-		// No longer valid
-		clear_timespec(&worker_cpu_usage);
-		clear_timespec(&stop_worker_cpu_usage);
-		return;
-	}
-	pthread_t t = decompressor_thread.native_handle();
-	r = pthread_getcpuclockid(t, &id);
-	if (r != 0)
-	{
-		// This usually means our read-ahead worker is already done.
-		clear_timespec(&worker_cpu_usage);
-		clear_timespec(&stop_worker_cpu_usage);
-	}
-	else if (clock_gettime(id, &worker_cpu_usage) != 0)
-	{
-		ELOG("Failed to get worker thread %u CPU usage: %s", tid, strerror(errno));
-	}
+	worker_cpu_start = decompress_cpu_ns.load(std::memory_order_relaxed);
+	worker_bytes_start = uncompressed_bytes.load(std::memory_order_relaxed);
 }
 
 void file_reader::bind_runner_thread()
@@ -345,8 +511,12 @@ void file_reader::stop_measurement(uint64_t& worker, uint64_t& runner)
 	clockid_t id;
 	pthread_t runner_handle = pthread_self();
 	if (runner_thread_bound.load(std::memory_order_acquire)) runner_handle = runner_thread;
-	int r = pthread_getcpuclockid(runner_handle, &id);
-	if (r != 0)
+	int r = runner_measured ? pthread_getcpuclockid(runner_handle, &id) : 0;
+	if (!runner_measured)
+	{
+		runner = 0;
+	}
+	else if (r != 0)
 	{
 		ELOG("Failed to get runner thread %u ID: %s", tid, strerror(r));
 		runner = 0;
@@ -369,56 +539,153 @@ void file_reader::stop_measurement(uint64_t& worker, uint64_t& runner)
 		}
 	}
 
-	if (!multithreaded_read)
+	// pool workers may still be decompressing, but what they spent so far is close enough
+	worker = multithreaded_read ? (decompress_cpu_ns.load(std::memory_order_relaxed) - worker_cpu_start) / 1000 : 0;
+	cached_worker_bytes = uncompressed_bytes.load(std::memory_order_relaxed) - worker_bytes_start;
+	cached_worker_time = worker;
+	cached_runner_time = runner;
+	measurement_stopped.store(true, std::memory_order_release);
+}
+
+// --- decompression pool
+
+unsigned decompression_pool::worker_count()
+{
+	if (p__decompression_threads > 0) return p__decompression_threads;
+	// leave most of the cores for the API runner threads, but let one big stream not hold up all the others
+	const unsigned cores = std::thread::hardware_concurrency();
+	return std::clamp(cores / 4, 2u, 8u);
+}
+
+decompression_pool& decompression_pool::instance()
+{
+	// never destroyed, since readers may be destroyed from static destructors
+	static decompression_pool* pool = new decompression_pool;
+	return *pool;
+}
+
+void decompression_pool::attach(file_reader* reader)
+{
+	lava::lock_guard lifecycle(lifecycle_mutex);
+	mutex.lock();
+	readers.push_back(reader);
+	const size_t count = readers.size();
+	mutex.unlock();
+	if (threads.empty()) done.store(false);
+	if (threads.size() < std::min<size_t>(worker_count(), count))
+	{
+		threads.emplace_back(&decompression_pool::worker, this);
+		DLOG("Launched decompression worker %u", (unsigned)threads.size());
+	}
+	wake();
+}
+
+void decompression_pool::detach(file_reader* reader)
+{
+	lava::lock_guard lifecycle(lifecycle_mutex);
+	uint32_t seen = release_epoch.load();
+	mutex.lock();
+	readers.erase(std::remove(readers.begin(), readers.end(), reader), readers.end());
+	const bool last = readers.empty();
+	bool busy = reader->pool_busy;
+	mutex.unlock();
+	while (busy) // wait for the worker to let go of it, since it is about to go away
 	{
-		worker = 0;
-		cached_worker_time = worker;
-		cached_runner_time = runner;
-		measurement_stopped.store(true, std::memory_order_release);
-		return;
+		release_epoch.wait(seen);
+		seen = release_epoch.load();
+		mutex.lock();
+		busy = reader->pool_busy;
+		mutex.unlock();
 	}
-	pthread_t t = decompressor_thread.native_handle();
-	r = pthread_getcpuclockid(t, &id);
-	if (r != 0)
+	if (!last || threads.empty()) return;
+	done.store(true);
+	work_epoch.fetch_add(1);
+	work_epoch.notify_all();
+	for (std::thread& t : threads) t.join();
+	threads.clear();
+}
+
+bool decompression_pool::run_job()
+{
+	const size_t fixed_preload = p__preload * 1024 * 1024;
+	file_reader* reader = nullptr;
+	uint64_t best = UINT64_MAX;
+	mutex.lock();
+	for (file_reader* candidate : readers)
 	{
-		// Read-ahead worker is already done. This is ok if it stopped during frame range,
-		// in which case the worker thread saved its final CPU timestamp for us.
-		if (worker_measurement_ready.load(std::memory_order_acquire))
+		if (candidate->pool_busy || candidate->done_decompressing.load(std::memory_order_relaxed)) continue;
+		const uint64_t write = candidate->write_position.load(std::memory_order_relaxed);
+		const uint64_t read = candidate->read_progress.load(std::memory_order_acquire);
+		const uint64_t ahead = write - read;
+		const bool blocked = candidate->needed_write_position.load(std::memory_order_acquire) > write;
+		// without an active preload we stay one chunk ahead, in case a packet spans more than one chunk
+		const size_t active_preload = candidate->preload_activated.load(std::memory_order_relaxed) ? fixed_preload : 0;
+		const size_t preload_size = active_preload > 0 ? active_preload : candidate->last_chunk_uncompressed_size.load(std::memory_order_relaxed);
+		if (!blocked && preload_size > 0 && ahead > preload_size)
 		{
-			if (timespec_less(&stop_worker_cpu_usage, &worker_cpu_usage))
+			// too far ahead and the replayer is not blocked, so ask it to tell us once it has caught up enough
+			candidate->wake_position.store(write - preload_size, std::memory_order_relaxed);
+			continue;
+		}
+		if (candidate->window_size)
+		{
+			const uint64_t needed = candidate->next_chunk_window_bytes();
+			const uint64_t retained = candidate->retained_progress.load(std::memory_order_acquire);
+			if (needed > candidate->window_size / 2)
 			{
-				ELOG("Failed to measure worker thread %u CPU usage: stop time precedes start time", tid);
-				worker = 0;
+				ABORT("Chunk of %lu bytes on thread %u does not fit in its %lu byte uncompressed window, try a bigger LAVATUBE_UNCOMPRESSED_WINDOW",
+				      (unsigned long)needed, candidate->tid, (unsigned long)candidate->window_size);
 			}
-			else
+			if (write + needed > retained + candidate->window_size)
 			{
-				worker = diff_timespec(&stop_worker_cpu_usage, &worker_cpu_usage);
+				// no room for the next chunk until the reader lets go of what is at the start of the window
+				if (blocked) ABORT("Thread %u needs more than its %lu byte uncompressed window, try a bigger LAVATUBE_UNCOMPRESSED_WINDOW", candidate->tid, (unsigned long)candidate->window_size);
+				const uint64_t target = write + needed - candidate->window_size;
+				if (read >= target) candidate->publish_on_release.store(true, std::memory_order_relaxed); // only its checkpoint holds us back
+				else candidate->wake_position.store(target, std::memory_order_relaxed);
+				continue;
 			}
 		}
-		else
+		// keep our idea of its progress fresh to within about a chunk, so that we pick the right reader next time
+		candidate->wake_position.store(read + candidate->last_chunk_uncompressed_size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		const uint64_t priority = blocked ? 0 : ahead + 1; // lowest goes first
+		if (priority < best)
 		{
-			worker = 0;
+			reader = candidate;
+			best = priority;
 		}
 	}
-	else if (clock_gettime(id, &stop_worker_cpu_usage) != 0)
+	if (reader) reader->pool_busy = true;
+	mutex.unlock();
+	if (!reader) return false;
+	struct timespec start_cpu_usage = {};
+	struct timespec stop_cpu_usage = {};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start_cpu_usage);
+	reader->decompress_chunk();
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stop_cpu_usage);
+	const int64_t ns = (int64_t)(stop_cpu_usage.tv_sec - start_cpu_usage.tv_sec) * 1000000000ll + (stop_cpu_usage.tv_nsec - start_cpu_usage.tv_nsec);
+	reader->decompress_cpu_ns.fetch_add(ns > 0 ? ns : 0, std::memory_order_relaxed);
+	mutex.lock();
+	reader->pool_busy = false; // after this we may no longer touch this reader, since it may be destroyed
+	mutex.unlock();
+	release_epoch.fetch_add(1);
+	release_epoch.notify_all();
+	return true;
+}
+
+void decompression_pool::worker()
+{
+	set_thread_name("decompressor");
+	while (1)
 	{
-		ELOG("Failed to get worker thread %u CPU usage: %s", tid, strerror(errno));
-		worker = 0;
+		const uint32_t seen = work_epoch.load();
+		if (run_job()) continue;
+		// note that we only exit thread if we have no more work to do
+		if (done.load()) break;
+		// sleep until a reader is attached, has caught up enough with us, or needs data; if that happened since we
+		// started looking, we return immediately
+		sleepers++;
+		work_epoch.wait(seen);
+		sleepers--;
 	}
-	else
-	{
-		worker_measurement_ready.store(true, std::memory_order_release);
-		if (timespec_less(&stop_worker_cpu_usage, &worker_cpu_usage))
-		{
-			ELOG("Failed to measure worker thread %u CPU usage: stop time precedes start time", tid);
-			worker = 0;
-		}
-		else
-		{
-			worker = diff_timespec(&stop_worker_cpu_usage, &worker_cpu_usage);
-		}
-	}
-	cached_worker_time = worker;
-	cached_runner_time = runner;
-	measurement_stopped.store(true, std::memory_order_release);
 }
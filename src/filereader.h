@@ -1,7 +1,9 @@
 #pragma once
 
 #include <assert.h>
+#include <algorithm>
 #include <atomic>
+#include <bit>
 #include <thread>
 #include <cstdint>
 #include <thread>
@@ -10,13 +12,87 @@
 #include <stdarg.h>
 
 #include "packfile.h"
+#include "file_format.h"
 #include "containers.h"
+#include "lavamutex.h"
 #include "util.h"
 
 struct fixed_buffer_input
 {
 };
 
+/// How often and for how long a replay thread had to wait for something. Updated only by the thread that waits, but
+/// may be read from other threads at any time.
+struct wait_stats
+{
+	/// Bucket 0 counts waits shorter than a microsecond, bucket i those shorter than 2^i microseconds, and the last
+	/// bucket all longer ones.
+	static constexpr unsigned buckets = 16;
+	std::atomic_uint64_t count { 0 };
+	std::atomic_uint64_t time_ns { 0 };
+	std::atomic_uint64_t histogram[buckets] = {};
+
+	void add(uint64_t ns)
+	{
+		count.fetch_add(1, std::memory_order_relaxed);
+		time_ns.fetch_add(ns, std::memory_order_relaxed);
+		const unsigned bucket = std::min<unsigned>(buckets - 1, std::bit_width(ns / 1000));
+		histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+	}
+};
+
+class file_reader;
+
+/// Process-wide pool of worker threads that decompress chunks for all attached file readers, so that a reader
+/// with a lot of data to get through, such as the one holding the big asset uploads, can use decompressor time
+/// that the other readers do not need. Each reader is worked on by at most one worker at a time, since its chunks
+/// must be decompressed in order. Workers always pick the reader closest to starving: first any reader that is
+/// blocked waiting for data, then the one with the least decompressed data ahead of its read position. Readers
+/// that are further ahead than their preload size are left alone until their reader has caught up enough. Idle
+/// workers sleep on a futex until a reader is attached, publishes new progress, or blocks waiting for data.
+class decompression_pool
+{
+	decompression_pool(const decompression_pool&) = delete;
+	decompression_pool& operator=(const decompression_pool&) = delete;
+
+public:
+	decompression_pool() {}
+
+	static decompression_pool& instance();
+
+	/// Start decompressing chunks for this reader. Launches another worker thread if needed.
+	void attach(file_reader* reader);
+
+	/// Stop decompressing chunks for this reader, and wait for any worker still working on it. Stops worker
+	/// threads when the last reader is detached. Safe to call for a reader that is not attached.
+	void detach(file_reader* reader);
+
+	/// Tell the workers that a reader needs data, or has made progress that they asked to hear about
+	inline void wake()
+	{
+		work_epoch.fetch_add(1);
+		if (sleepers.load()) work_epoch.notify_one();
+	}
+
+	/// Most worker threads we will run while any reader is attached. We never run more than one for each reader.
+	static unsigned worker_count();
+
+private:
+	bool run_job(); // decompress one chunk for the reader most in need of it, returns false if none needs any
+	void worker(); // runs in separate threads, moves chunks from files to uncompressed buffers
+
+	lava::mutex lifecycle_mutex; // serializes attach and detach, held while launching or joining workers
+	lava::mutex mutex;
+	std::vector<file_reader*> readers GUARDED_BY(mutex);
+	std::vector<std::thread> threads;
+	std::atomic_bool done { false };
+	/// Bumped whenever a reader is attached, publishes progress or needs data, idle workers wait for it to change
+	std::atomic_uint32_t work_epoch { 0 };
+	std::atomic_uint32_t sleepers { 0 };
+	/// Bumped whenever a worker lets go of a reader, detach waits for it to change
+	std::atomic_uint32_t release_epoch { 0 };
+};
+
 class file_reader
 {
 	file_reader(const file_reader&) = delete;
@@ -25,15 +101,19 @@ class file_reader
 protected:
 	inline void check_space(unsigned size)
 	{
+		if (unlikely(read_position >= wake_position.load(std::memory_order_relaxed))) publish_progress();
 		uint64_t current_write = write_position.load(std::memory_order_acquire);
 		if (unlikely(size > current_write - read_position))
 		{
 			if (fixed_buffer) ABORT("Attempt to read past fixed input buffer");
-			// Publish the position we need so the decompressor skips its throttle sleep while we're blocked.
+			// Publish the position we need so that the decompression pool puts us first in line.
+			if (multithreaded_read) store_progress();
 			needed_write_position.store(read_position + size, std::memory_order_release);
+			if (multithreaded_read) decompression_pool::instance().wake();
+			const uint64_t start = multithreaded_read ? gettime() : 0;
 			while (size > current_write - read_position)
 			{
-				assert(current_write + size < total_uncompressed);
+				assert(read_position + size <= total_uncompressed);
 
 				if (multithreaded_read) write_position.wait(current_write, std::memory_order_acquire);
 				else decompress_chunk();
@@ -45,10 +125,28 @@ protected:
 					ABORT("We caught up with our file read thread! Performance data may become unreliable, so aborting!");
 				}
 			}
+			if (multithreaded_read) starved.add(gettime() - start);
 			needed_write_position.store(0, std::memory_order_release);
 		}
 	}
 
+	/// Let the decompression pool know how far we have read, since it asked to be told once we got this far.
+	void publish_progress()
+	{
+		store_progress();
+		decompression_pool::instance().wake();
+	}
+
+	void store_progress()
+	{
+		wake_position.store(UINT64_MAX, std::memory_order_relaxed); // until the pool asks again
+		read_progress.store(read_position, std::memory_order_release);
+		retained_progress.store(std::min(checkpoint_position, read_position), std::memory_order_release);
+	}
+
+	/// Pointer to the uncompressed data at this stream position
+	inline const char* window_pointer(uint64_t pos) const { return uncompressed_data + (pos & window_mask); }
+
 	/// Do not release any memory past this point until it has been released again.
 	void set_checkpoint() { checkpoint_position = read_position; }
 
@@ -59,12 +157,16 @@ protected:
 	std::atomic_uint64_t uncompressed_bytes { 0 };
 
 	void decompress_chunk();
+	void decompress_block(uint8_t codec, const char* source, uint64_t compressed_size, uint8_t* destination, uint64_t uncompressed_size);
+	void move_block(const char* source, uint8_t* destination, uint64_t size); // stored data, moves whole pages if it can
+	uint64_t padded_size(uint64_t size) const; // size of our uncompressed mapping for a given stream size
 	void reset_fixed_buffer(const char* data, size_t size, uint8_t version);
+	uint64_t next_chunk_window_bytes() const; // how much of our window the next chunk needs
 
 	template <typename T> inline void read_value(T* val)
 	{
 		check_space(sizeof(T));
-		const char* uptr = uncompressed_data + read_position; // pointer into current uncompressed chunk
+		const char* uptr = window_pointer(read_position); // pointer into current uncompressed chunk
 		memcpy(val, uptr, sizeof(T)); // memcpy to avoid aliasing issues
 		read_position += sizeof(T);
 		DLOG3("%u : read value of size %u (value %lu; %lu left in file)", tid, (unsigned)sizeof(T), (unsigned long)*val, (unsigned long)total_left); // unsafe read of total_left
@@ -78,6 +180,9 @@ public:
 	file_reader(fixed_buffer_input, const char* data, size_t size, unsigned mytid, uint8_t version);
 	~file_reader();
 
+	/// Times we had to wait for the decompressor to catch up with us
+	wait_stats starved;
+
 	inline uint8_t read_uint8_t() { uint8_t t; read_value(&t); return t; }
 	inline uint16_t read_uint16_t() { uint16_t t; read_value(&t); return t; }
 	inline uint32_t read_uint32_t() { uint32_t t; read_value(&t); return t; }
@@ -92,27 +197,63 @@ public:
 	inline int read_int() { uint32_t t; read_value(&t); return static_cast<int>(t); }
 	inline long read_long() { uint64_t t; read_value(&t); return static_cast<long>(t); }
 
+	/// Read the rest of a patch record with the given size field, and apply it to dst unless it is null.
+	/// Returns the number of bytes the record covers.
+	uint32_t read_patch_record(char* dst, uint32_t field)
+	{
+		const uint32_t opcode = (stream_version >= LAVATUBE_STREAM_VERSION_PATCH_OPCODES) ? field >> patch_opcode_shift : LAVATUBE_PATCH_RAW;
+		const uint32_t size = (stream_version >= LAVATUBE_STREAM_VERSION_PATCH_OPCODES) ? field & patch_size_mask : field;
+		if (opcode == LAVATUBE_PATCH_RAW)
+		{
+			check_space(size);
+			const char* uptr = window_pointer(read_position);
+			if (dst && size) memcpy(dst, uptr, size);
+			read_position += size;
+		}
+		else if (opcode == LAVATUBE_PATCH_FILL)
+		{
+			const uint8_t width = read_uint8_t();
+			if (width != 1 && width != 4 && width != 8) ABORT("Bad patch fill width %u", (unsigned)width);
+			check_space(width);
+			const char* pattern = window_pointer(read_position);
+			if (dst && width == 1) memset(dst, pattern[0], size);
+			else if (dst) for (uint32_t i = 0; i < size; i++) dst[i] = pattern[i % width];
+			read_position += width;
+		}
+		else if (opcode == LAVATUBE_PATCH_COPY)
+		{
+			const uint32_t distance = read_uint32_t();
+			if (distance == 0) ABORT("Bad patch copy distance");
+			// the source may overlap the destination, so copy no more than the distance at a time
+			for (uint32_t done = 0; dst && done < size; )
+			{
+				const uint32_t len = std::min(size - done, distance);
+				memcpy(dst + done, dst + done - distance, len);
+				done += len;
+			}
+		}
+		else ABORT("Bad patch opcode %u", (unsigned)opcode);
+		return size;
+	}
+
 	/// Patch a memory area, return number of bytes changed.
 	uint32_t read_patch(char* buf, uint64_t maxsize)
 	{
 		uint64_t position = 0;
 		uint32_t offset;
-		uint32_t size;
+		uint32_t field;
 		uint64_t changed = 0;
 		do {
 			offset = read_uint32_t();
 			position += offset;
 			assert(maxsize == 0 || position <= maxsize);
-			size = read_uint32_t();
-			check_space(size);
-			const char* uptr = uncompressed_data + read_position;
-			if (buf && size) memcpy(buf + position, uptr, size);
-			read_position += size;
+			field = read_uint32_t();
+			const uint32_t size = read_patch_record(buf ? buf + position : nullptr, field);
 			position += size;
 			changed += size;
 			assert(maxsize == 0 || position <= maxsize);
 		}
-		while (!(offset == 0 && size == 0));
+		while (!(offset == 0 && field == 0));
 		return changed;
 	}
 
@@ -121,7 +262,7 @@ public:
 		assert((arr && count) || (!arr && !count));
 		const unsigned size = sizeof(T) * count;
 		check_space(size);
-		const char* uptr = uncompressed_data + read_position;
+		const char* uptr = window_pointer(read_position);
 		if (arr) memcpy(arr, uptr, size); // values are already made portable by the time we get here
 		DLOG3("%u : read array of size %u * %u, first value is %lu", tid, (unsigned)sizeof(T), (unsigned)count, (unsigned long)((count > 0) ? arr[0] : 0));
 		read_position += size;
@@ -184,7 +325,7 @@ public:
 	void disable_multithreaded_read() // we can only disable on the fly, enable makes less sense
 	{
 		done_decompressing = true;
-		decompressor_thread.join();
+		decompression_pool::instance().detach(this);
 		multithreaded_read = false;
 	}
 
@@ -199,7 +340,7 @@ public:
 		assert(read_position <= write);
 		assert(write <= total_uncompressed);
 		assert(freed_position <= read_position);
-		assert(last_chunk_uncompressed_size <= total_uncompressed);
+		assert(last_chunk_uncompressed_size.load(std::memory_order_relaxed) <= total_uncompressed);
 		if (checkpoint_valid)
 		{
 			assert(freed_position <= checkpoint_position);
@@ -210,6 +351,7 @@ public:
 			assert(needed >= read_position);
 			assert(needed <= total_uncompressed);
 		}
+		if (window_size) assert(write - std::min(checkpoint_position, read_position) <= window_size);
 	}
 
 	/// Start measuring worker thread CPU usage
@@ -218,22 +360,42 @@ public:
 	/// Bind our API runner CPU accounting to the current thread.
 	void bind_runner_thread();
 
+	/// Our API calls are not run by any single thread, so do not measure their CPU usage.
+	void skip_runner_measurement() { runner_measured = false; }
+
 	/// Return spent CPU time in microseconds in worker thread
 	void stop_measurement(uint64_t& worker, uint64_t& runner);
 
+	/// Bytes decompressed between start_measurement() and stop_measurement()
+	uint64_t measured_bytes() const { return cached_worker_bytes; }
+
 	uint8_t version() const { return stream_version; }
 
 private:
-	void decompressor(); // runs in separate thread, moves chunks from file to uncompressed chunks
+	friend class decompression_pool;
+
 	void init(int fd, size_t uncompressed_size, size_t uncompressed_target);
 	void init_mapped(const packed& pf, size_t uncompressed_size, size_t uncompressed_target);
+	void map_uncompressed(uint64_t uncompressed_size);
+	void map_window(uint64_t size);
+	bool map_stored(uint64_t uncompressed_size);
+	void prefault(char* start, uint64_t size);
 
 	bool multithreaded_read = true;
 	bool fixed_buffer = false;
-	size_t last_chunk_uncompressed_size = 0;
+	std::atomic_size_t last_chunk_uncompressed_size { 0 }; // may be read by the main thread for self tests
 	std::atomic<bool> preload_activated{ true };
-	/// Set by check_space() when waiting for data; tells decompressor to skip throttle sleep until satisfied.
+	/// Set by check_space() when waiting for data; tells the decompression pool to skip its throttling and put us first.
 	std::atomic<uint64_t> needed_write_position{ 0 };
+	bool pool_busy = false; // whether a pool worker is decompressing for us, guarded by the pool mutex
+	/// Our read position as last published to the decompression pool. Only updated by the main thread.
+	std::atomic_uint64_t read_progress { 0 };
+	/// Read position at which the decompression pool wants to hear about our progress again
+	std::atomic_uint64_t wake_position { UINT64_MAX };
+	/// Position before which we no longer need any data, as last published to the decompression pool
+	std::atomic_uint64_t retained_progress { 0 };
+	/// Set by the decompression pool when it waits for our checkpoint to be released to make room in our window
+	std::atomic_bool publish_on_release { false };
 
 	unsigned tid = -1; // only used for logging
 	/// Pointer to mapped memory of compressed file
@@ -247,23 +409,26 @@ private:
 	std::string mFilename;
 	zipc* zip_handle = nullptr;
 	zipc_mapping zip_mapping = {};
-	/// Start CPU usage for our worker thread
-	struct timespec worker_cpu_usage = {};
+	/// CPU time pool workers have spent decompressing our chunks, in nanoseconds
+	std::atomic_uint64_t decompress_cpu_ns { 0 };
+	/// Decompression CPU time when measurement started
+	uint64_t worker_cpu_start = 0;
+	/// Decompressed bytes when measurement started
+	uint64_t worker_bytes_start = 0;
+	uint64_t cached_worker_bytes = 0;
 	/// Start CPU usage for our runner thread
 	struct timespec runner_cpu_usage = {};
 	std::thread::native_handle_type runner_thread = {};
 	std::atomic_bool runner_thread_bound{ false };
+	bool runner_measured = true;
 	std::atomic_bool measurement_stopped{ true };
 	uint64_t cached_worker_time = 0;
 	uint64_t cached_runner_time = 0;
-	/// Stop CPU usage for our worker thread
-	struct timespec stop_worker_cpu_usage = {};
-	std::atomic_bool worker_measurement_ready{ false };
 	/// Amount of memory mapped compressed data
 	uint64_t mapped_size = 0;
 	uint64_t total_compressed_stream = 0;
 	/// Checkpoint position - from where we have last started reading, but need to preserve data from. Only updated from main thread.
-	uint64_t checkpoint_position = 0;
+	uint64_t checkpoint_position = UINT64_MAX;
 	/// Tip of the uncompressed buffer, the end of where we have last put data
 	std::atomic_uint64_t write_position { 0 };
 	/// Last freed position, page-aligned position before the last checkpoint. Only updated by main thread.
@@ -274,15 +439,24 @@ private:
 protected:
 	const uintptr_t page_size = sysconf(_SC_PAGE_SIZE); // for doing page-alignment
 	uintptr_t page_mask() const { return ~(page_size - 1); } // for doing page-alignment
-	uint64_t total_left = 0; // amount of compressed bytes left in input file, only use from decompressor thread
+	uint64_t total_left = 0; // amount of compressed bytes left in input file, only use from the decompression pool
 	uint64_t total_uncompressed = 0; // amount of uncompressed bytes that will come from the input file
 	uint64_t uncompressed_wanted = 0; // amount of uncompressed bytes that we want to read
-	/// Start of anonymous memory map for uncompressed data
+	/// Start of anonymous memory map for uncompressed data. If we use a window, it is mapped twice in a row,
+	/// so that data that wraps around its end can still be read in one go.
 	char* uncompressed_data = nullptr;
+	/// Mask to get from stream position to offset into uncompressed_data, which is all ones if the whole stream is mapped
+	uint64_t window_mask = UINT64_MAX;
+	uint64_t window_size = 0; // zero if the whole stream is mapped
+	uint64_t mapping_size = 0;
+	uint64_t mapping_offset = 0; // offset of uncompressed_data into its mapping
+	/// Whether pages of chunks stored without compression are moved over from the file mapping rather than copied.
+	/// Only ever cleared after that, and only by whoever decompresses for us.
+	bool move_stored = false;
+	std::atomic_uint64_t moved_bytes { 0 };
 	/// Current position in the uncompressed buffer. Only modified by the main thread.
 	uint64_t read_position = 0;
 
 private:
-	std::thread decompressor_thread;
 	std::atomic_bool done_decompressing;
 };
@@ -1,8 +1,17 @@
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <lz4.h>
+#include <math.h>
+#include <algorithm>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "filewriter.h"
 #include "density/src/density_api.h"
@@ -12,30 +21,185 @@ void file_writer::write_memory_span(const char* ptr, uint64_t offset, uint64_t s
 	assert(ptr || size == 0);
 	assert(offset <= UINT32_MAX);
 	assert(size <= UINT32_MAX);
+	if (stream_version >= LAVATUBE_STREAM_VERSION_PATCH_OPCODES)
+	{
+		write_patch_span(offset, ptr, size);
+		write_uint32_t(0);
+		write_uint32_t(0);
+		return;
+	}
 	write_uint32_t(offset);
 	write_uint32_t(size);
-	check_space(size);
-	char* uptr = chunk.data() + uidx; // pointer into current uncompressed chunk
-	memcpy(uptr, ptr, size);
-	uidx += size;
-	assert(uidx <= chunk.size());
-	uncompressed_bytes += size;
+	if (direct_span(size)) write_direct(ptr, size);
+	else
+	{
+		check_space(size);
+		char* uptr = chunk.data() + uidx; // pointer into current uncompressed chunk
+		memcpy(uptr, ptr, size);
+		uidx += size;
+		assert(uidx <= chunk.size());
+		uncompressed_bytes += size;
+	}
 	write_uint32_t(0);
 	write_uint32_t(0);
 }
 
+void file_writer::write_patch_record(uint32_t offset, uint32_t opcode, uint32_t size, const char* payload, uint32_t payload_size)
+{
+	assert(size <= patch_size_mask);
+	const uint32_t field = (opcode << patch_opcode_shift) | size;
+	const bool direct = direct_span(payload_size);
+	check_space(direct ? 8 : 8 + payload_size);
+	char* uptr = chunk.data() + uidx; // pointer into current uncompressed chunk
+	memcpy(uptr, &offset, 4);
+	memcpy(uptr + 4, &field, 4);
+	if (direct)
+	{
+		uidx += 8;
+		uncompressed_bytes += 8;
+		write_direct(payload, payload_size);
+		return;
+	}
+	memcpy(uptr + 8, payload, payload_size);
+	uidx += 8 + payload_size;
+	assert(uidx <= chunk.size());
+	uncompressed_bytes += 8 + payload_size;
+}
+
+// --- patch opcode encoding
+
+static constexpr uint64_t patch_match_min = 64; // shortest fill or copy that gets a record of its own
+static constexpr uint64_t patch_copy_span_min = 1024; // only look for copies in spans at least this big
+static constexpr unsigned patch_hash_bits = 10;
+static constexpr uint64_t patch_search_give_up = 64 * 1024; // stop looking for copies after this many bytes without one
+
+static inline uint64_t patch_word(const char* ptr)
+{
+	uint64_t word;
+	memcpy(&word, ptr, sizeof(word));
+	return word;
+}
+
+// Length of the repetition of the first eight bytes of data
+static inline uint64_t fill_length(const char* data, uint64_t size)
+{
+	const uint64_t word = patch_word(data);
+	uint64_t len = sizeof(word);
+	while (size - len >= sizeof(word) && patch_word(data + len) == word) len += sizeof(word);
+	while (len < size && data[len] == data[len % sizeof(word)]) len++;
+	return len;
+}
+
+// Length of the match between data at pos and earlier data at src, which may overlap
+static inline uint64_t copy_length(const char* data, uint64_t src, uint64_t pos, uint64_t size)
+{
+	uint64_t len = 0;
+	while (size - pos - len >= sizeof(uint64_t) && patch_word(data + src + len) == patch_word(data + pos + len)) len += sizeof(uint64_t);
+	while (pos + len < size && data[src + len] == data[pos + len]) len++;
+	return len;
+}
+
+void file_writer::write_patch_span(uint32_t offset, const char* data, uint64_t size)
+{
+	std::array<uint32_t, 1u << patch_hash_bits> table; // position + 1 of the last word seen with this hash
+	const bool find_copies = (size >= patch_copy_span_min);
+	if (find_copies) table.fill(0);
+	uint64_t pos = 0;
+	uint64_t literal = 0; // start of bytes not yet written out
+	uint64_t last_match = 0;
+
+	// Raw bytes are written in records no bigger than the size field can hold
+	auto flush_literal = [&](uint64_t end)
+	{
+		while (literal < end)
+		{
+			const uint32_t len = std::min<uint64_t>(end - literal, patch_size_mask);
+			write_patch_record(offset, LAVATUBE_PATCH_RAW, len, data + literal, len);
+			literal += len;
+			offset = 0; // offset is relative
+		}
+	};
+
+	while (size - pos >= patch_match_min)
+	{
+		const uint64_t word = patch_word(data + pos);
+		if (word == patch_word(data + pos + sizeof(word)))
+		{
+			const uint64_t len = std::min<uint64_t>(fill_length(data + pos, size - pos), patch_size_mask);
+			if (len >= patch_match_min)
+			{
+				flush_literal(pos);
+				char payload[1 + sizeof(word)];
+				const uint64_t low_byte = word & 0xff;
+				const uint8_t width = (word == low_byte * 0x0101010101010101ull) ? 1 : ((word >> 32) == (word & 0xffffffff)) ? 4 : 8;
+				payload[0] = width;
+				memcpy(payload + 1, &word, width);
+				write_patch_record(offset, LAVATUBE_PATCH_FILL, len, payload, 1 + width);
+				offset = 0;
+				pos += len;
+				literal = last_match = pos;
+				continue;
+			}
+		}
+		if (find_copies && pos - last_match < patch_search_give_up)
+		{
+			const uint32_t hash = (word * 0x9e3779b97f4a7c15ull) >> (64 - patch_hash_bits);
+			const uint32_t candidate = table[hash];
+			table[hash] = pos + 1;
+			if (candidate)
+			{
+				const uint64_t src = candidate - 1;
+				const uint64_t len = std::min<uint64_t>(copy_length(data, src, pos, size), patch_size_mask);
+				if (len >= patch_match_min)
+				{
+					flush_literal(pos);
+					const uint32_t distance = pos - src;
+					write_patch_record(offset, LAVATUBE_PATCH_COPY, len, (const char*)&distance, sizeof(distance));
+					offset = 0;
+					pos += len;
+					literal = last_match = pos;
+					continue;
+				}
+			}
+		}
+		pos += sizeof(word);
+	}
+	flush_literal(size);
+}
+
 void file_writer::write_memory(const char* const ptr, uint64_t offset, uint64_t size)
 {
 	write_memory_span(ptr + offset, offset, size);
 }
 
-// memory areas should be 64bit aligned
-// size is number of bytes to scan for changes
-uint64_t file_writer::find_patch_start(const char* orig, const char* chng, uint64_t offset, uint64_t size)
+// --- host memory diffing kernels
+
+// Word by word comparison of what is left after the vector loops
+static inline uint64_t find_change_words(const char* orig, const char* chng, uint64_t size)
+{
+	uint64_t pos = 0;
+	while (size - pos >= sizeof(uint64_t))
+	{
+		if (memcmp(orig + pos, chng + pos, sizeof(uint64_t)) != 0) return pos;
+		pos += sizeof(uint64_t);
+	}
+	if (pos < size && memcmp(orig + pos, chng + pos, size - pos) != 0) return pos;
+	return size;
+}
+
+static inline uint64_t copy_change_words(char* __restrict__ orig, const char* __restrict__ chng, uint64_t size)
+{
+	uint64_t pos = 0;
+	for (; size - pos >= sizeof(uint64_t) && memcmp(orig + pos, chng + pos, sizeof(uint64_t)) != 0; pos += sizeof(uint64_t))
+	{
+		memcpy(orig + pos, chng + pos, sizeof(uint64_t));
+	}
+	return pos;
+}
+
+static uint64_t find_change_scalar(const char* orig, const char* chng, uint64_t size)
 {
 	static constexpr uint64_t chunk_size = 256;
-	orig += offset;
-	chng += offset;
 	uint64_t pos = 0;
 	if (size >= sizeof(uint64_t))
 	{
@@ -47,35 +211,224 @@ uint64_t file_writer::find_patch_start(const char* orig, const char* chng, uint6
 		if (memcmp(orig + pos, chng + pos, chunk_size) != 0) break;
 		pos += chunk_size;
 	}
-	while (size - pos >= sizeof(uint64_t))
+	return pos + find_change_words(orig + pos, chng + pos, size - pos);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2"))) static uint64_t find_change_avx2(const char* orig, const char* chng, uint64_t size)
+{
+	if (size >= sizeof(uint64_t) && memcmp(orig, chng, sizeof(uint64_t)) != 0) return 0; // changes are often close together
+	uint64_t pos = 0;
+	while (size - pos >= 64)
 	{
-		if (memcmp(orig + pos, chng + pos, sizeof(uint64_t)) != 0) return pos;
-		pos += sizeof(uint64_t);
+		const __m256i eq0 = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(orig + pos)), _mm256_loadu_si256((const __m256i*)(chng + pos)));
+		const __m256i eq1 = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(orig + pos + 32)), _mm256_loadu_si256((const __m256i*)(chng + pos + 32)));
+		const unsigned equal = _mm256_movemask_pd(_mm256_castsi256_pd(eq0)) | (_mm256_movemask_pd(_mm256_castsi256_pd(eq1)) << 4);
+		if (equal != 0xff) return pos + __builtin_ctz(~equal) * sizeof(uint64_t);
+		pos += 64;
 	}
-	if (pos < size && memcmp(orig + pos, chng + pos, size - pos) != 0) return pos;
-	return size;
+	return pos + find_change_words(orig + pos, chng + pos, size - pos);
 }
 
-uint64_t file_writer::write_patch(char* __restrict__ orig, const char* __restrict__ chng, uint32_t offset, uint64_t size)
+__attribute__((target("avx2"))) static uint64_t copy_change_avx2(char* __restrict__ orig, const char* __restrict__ chng, uint64_t size)
+{
+	if (size < 2 * sizeof(uint64_t) || memcmp(orig + sizeof(uint64_t), chng + sizeof(uint64_t), sizeof(uint64_t)) == 0) return copy_change_words(orig, chng, size); // short runs are common
+	uint64_t pos = 0;
+	while (size - pos >= 32)
+	{
+		const __m256i changed = _mm256_loadu_si256((const __m256i*)(chng + pos));
+		const __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(orig + pos)), changed);
+		if (_mm256_movemask_pd(_mm256_castsi256_pd(eq))) break; // the word loop copies up to the identical word
+		_mm256_storeu_si256((__m256i*)(orig + pos), changed);
+		pos += 32;
+	}
+	return pos + copy_change_words(orig + pos, chng + pos, size - pos);
+}
+
+__attribute__((target("avx512f"))) static uint64_t find_change_avx512(const char* orig, const char* chng, uint64_t size)
+{
+	if (size >= sizeof(uint64_t) && memcmp(orig, chng, sizeof(uint64_t)) != 0) return 0; // changes are often close together
+	uint64_t pos = 0;
+	while (size - pos >= 128)
+	{
+		const __mmask8 ne0 = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(orig + pos), _mm512_loadu_si512(chng + pos));
+		const __mmask8 ne1 = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(orig + pos + 64), _mm512_loadu_si512(chng + pos + 64));
+		const unsigned differs = (unsigned)ne0 | ((unsigned)ne1 << 8);
+		if (differs) return pos + __builtin_ctz(differs) * sizeof(uint64_t);
+		pos += 128;
+	}
+	return pos + find_change_words(orig + pos, chng + pos, size - pos);
+}
+
+__attribute__((target("avx512f"))) static uint64_t copy_change_avx512(char* __restrict__ orig, const char* __restrict__ chng, uint64_t size)
+{
+	if (size < 2 * sizeof(uint64_t) || memcmp(orig + sizeof(uint64_t), chng + sizeof(uint64_t), sizeof(uint64_t)) == 0) return copy_change_words(orig, chng, size); // short runs are common
+	uint64_t pos = 0;
+	while (size - pos >= 64)
+	{
+		const __m512i changed = _mm512_loadu_si512(chng + pos);
+		const unsigned differs = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512(orig + pos), changed);
+		if (differs != 0xff) // copy up to the first identical word and stop there
+		{
+			const unsigned words = __builtin_ctz(~differs);
+			_mm512_mask_storeu_epi64(orig + pos, (__mmask8)((1u << words) - 1), changed);
+			return pos + words * sizeof(uint64_t);
+		}
+		_mm512_storeu_si512(orig + pos, changed);
+		pos += 64;
+	}
+	return pos + copy_change_words(orig + pos, chng + pos, size - pos);
+}
+
+#elif defined(__aarch64__)
+
+static uint64_t find_change_neon(const char* orig, const char* chng, uint64_t size)
+{
+	if (size >= sizeof(uint64_t) && memcmp(orig, chng, sizeof(uint64_t)) != 0) return 0; // changes are often close together
+	uint64_t pos = 0;
+	while (size - pos >= 64)
+	{
+		const uint64x2_t eq0 = vceqq_u64(vld1q_u64((const uint64_t*)(orig + pos)), vld1q_u64((const uint64_t*)(chng + pos)));
+		const uint64x2_t eq1 = vceqq_u64(vld1q_u64((const uint64_t*)(orig + pos + 16)), vld1q_u64((const uint64_t*)(chng + pos + 16)));
+		const uint64x2_t eq2 = vceqq_u64(vld1q_u64((const uint64_t*)(orig + pos + 32)), vld1q_u64((const uint64_t*)(chng + pos + 32)));
+		const uint64x2_t eq3 = vceqq_u64(vld1q_u64((const uint64_t*)(orig + pos + 48)), vld1q_u64((const uint64_t*)(chng + pos + 48)));
+		const uint64x2_t equal = vandq_u64(vandq_u64(eq0, eq1), vandq_u64(eq2, eq3));
+		if (vminvq_u32(vreinterpretq_u32_u64(equal)) == 0) break; // the word loop finds the exact position
+		pos += 64;
+	}
+	return pos + find_change_words(orig + pos, chng + pos, size - pos);
+}
+
+static uint64_t copy_change_neon(char* __restrict__ orig, const char* __restrict__ chng, uint64_t size)
+{
+	if (size < 2 * sizeof(uint64_t) || memcmp(orig + sizeof(uint64_t), chng + sizeof(uint64_t), sizeof(uint64_t)) == 0) return copy_change_words(orig, chng, size); // short runs are common
+	uint64_t pos = 0;
+	while (size - pos >= 16)
+	{
+		const uint64x2_t changed = vld1q_u64((const uint64_t*)(chng + pos));
+		const uint64x2_t eq = vceqq_u64(vld1q_u64((const uint64_t*)(orig + pos)), changed);
+		if (vmaxvq_u32(vreinterpretq_u32_u64(eq)) != 0) break; // the word loop copies up to the identical word
+		vst1q_u64((uint64_t*)(orig + pos), changed);
+		pos += 16;
+	}
+	return pos + copy_change_words(orig + pos, chng + pos, size - pos);
+}
+
+#endif
+
+static const patch_kernel scalar_patch_kernel = { "scalar", find_change_scalar, copy_change_words };
+#if defined(__x86_64__)
+static const patch_kernel avx2_patch_kernel = { "avx2", find_change_avx2, copy_change_avx2 };
+static const patch_kernel avx512_patch_kernel = { "avx512", find_change_avx512, copy_change_avx512 };
+#elif defined(__aarch64__)
+static const patch_kernel neon_patch_kernel = { "neon", find_change_neon, copy_change_neon };
+#endif
+
+const std::vector<const patch_kernel*>& file_writer::patch_kernels()
 {
+	static const std::vector<const patch_kernel*> kernels = []
+	{
+		std::vector<const patch_kernel*> supported = { &scalar_patch_kernel };
+#if defined(__x86_64__)
+		if (__builtin_cpu_supports("avx2")) supported.push_back(&avx2_patch_kernel);
+		if (__builtin_cpu_supports("avx512f")) supported.push_back(&avx512_patch_kernel);
+#elif defined(__aarch64__)
+		supported.push_back(&neon_patch_kernel);
+#endif
+		return supported;
+	}();
+	return kernels;
+}
+
+static const patch_kernel*& current_patch_kernel()
+{
+	static const patch_kernel* kernel = []
+	{
+		const std::vector<const patch_kernel*>& kernels = file_writer::patch_kernels();
+		if (p__patch_kernel)
+		{
+			for (const patch_kernel* k : kernels) if (strcmp(k->name, p__patch_kernel) == 0) return k;
+			ELOG("Patch kernel \"%s\" is not supported on this CPU, using %s instead", p__patch_kernel, kernels.back()->name);
+		}
+		return kernels.back(); // best one last
+	}();
+	return kernel;
+}
+
+const patch_kernel& file_writer::active_patch_kernel()
+{
+	return *current_patch_kernel();
+}
+
+void file_writer::use_patch_kernel(const patch_kernel& kernel)
+{
+	current_patch_kernel() = &kernel;
+}
+
+// memory areas should be 64bit aligned
+// size is number of bytes to scan for changes
+uint64_t file_writer::find_patch_start(const char* orig, const char* chng, uint64_t offset, uint64_t size)
+{
+	return active_patch_kernel().find_change(orig + offset, chng + offset, size);
+}
+
+/// Below this, committing pages up front is not worth a system call
+static constexpr uint64_t clone_commit_min = 64 * 1024;
+/// Long runs of changes are looked ahead into and committed this much at a time
+static constexpr uint64_t clone_commit_slice = 4 * 1024 * 1024;
+
+/// Copy the rest of a long run of changes into the clone like patch_kernel::copy_change(), but first commit the clone
+/// pages that each slice of it covers, so that they are not faulted in one at a time. Only what actually differs is
+/// committed, so that a clone stays sparse where the app did not change anything.
+static uint64_t commit_and_copy_change(const patch_kernel& kernel, char* __restrict__ orig, const char* __restrict__ chng, uint64_t size)
+{
+	uint64_t done = 0;
+	while (done < size)
+	{
+		const uint64_t slice = std::min(size - done, clone_commit_slice);
+		uint64_t end = 0; // in whole words, as copy_change() works
+		for (uint64_t a, b; end + sizeof(uint64_t) <= slice; end += sizeof(uint64_t))
+		{
+			memcpy(&a, orig + done + end, sizeof(a));
+			memcpy(&b, chng + done + end, sizeof(b));
+			if (a == b) break;
+		}
+		clone_commit(orig + done, end);
+		done += kernel.copy_change(orig + done, chng + done, end);
+		if (end < slice) break; // end of the run
+	}
+	return done;
+}
+
+// The diffing loop shared by write_patch() and diff_patch(). Calls emit(offset, data, size) for each run of changed
+// bytes, after the clone has been updated, with data pointing into the clone and offset relative to the previous run.
+template <typename F>
+static inline uint64_t for_each_patch_run(char* __restrict__ orig, const char* __restrict__ chng, uint32_t offset, uint64_t size, F&& emit)
+{
+	const patch_kernel& kernel = file_writer::active_patch_kernel();
 	uint64_t total_left = size;
 	uint32_t c;
 	uint64_t changed = 0;
 	orig += offset;
 	chng += offset;
-	const char* startchng;
+	const char* startorig;
 	while (total_left)
 	{
 		// Skip identical sequence
-		const uint64_t identical = find_patch_start(orig, chng, 0, total_left);
+		const uint64_t identical = kernel.find_change(orig, chng, total_left);
 		orig += identical;
 		chng += identical;
 		offset += identical;
 		total_left -= identical;
 
-		// Process difference sequence and update the clone
-		startchng = chng;
-		for (c = 0; total_left >= 8 && *((uint64_t*)orig) != *((uint64_t*)chng); orig += 8, chng += 8, c += 8, total_left -= 8) { *((uint64_t*)orig) = *((uint64_t*)chng); }
+		// Process difference sequence and update the clone; most runs are short, and only long ones are committed
+		startorig = orig;
+		c = kernel.copy_change(orig, chng, std::min(total_left, clone_commit_min));
+		if (c == clone_commit_min) c += commit_and_copy_change(kernel, orig + c, chng + c, total_left - c);
+		orig += c;
+		chng += c;
+		total_left -= c;
 
 		// Check remainder
 		if (total_left < 8 && memcmp(chng, orig, total_left) == 0) total_left = 0;
@@ -83,19 +436,47 @@ uint64_t file_writer::write_patch(char* __restrict__ orig, const char* __restric
 
 		if (c)
 		{
-			check_space(8 + c);
-			char* uptr = chunk.data() + uidx; // pointer into current uncompressed chunk
-			memcpy(uptr, &offset, 4); // write offset
-			uptr += 4;
-			memcpy(uptr, &c, 4); // write size of patch
-			uptr += 4;
-			memcpy(uptr, startchng, c); // write payload
-			uidx += 8 + c;
-			uncompressed_bytes += 8 + c;
+			emit(offset, startorig, c);
 			changed += c;
 			offset = 0; // offset is relative
 		}
 	}
+	return changed;
+}
+
+void file_writer::write_patch_run(uint32_t offset, const char* data, uint32_t size)
+{
+	if (stream_version >= LAVATUBE_STREAM_VERSION_PATCH_OPCODES)
+	{
+		write_patch_span(offset, data, size);
+	}
+	else if (direct_span(size))
+	{
+		write_uint32_t(offset);
+		write_uint32_t(size);
+		write_direct(data, size);
+	}
+	else
+	{
+		check_space(8 + size);
+		char* uptr = chunk.data() + uidx; // pointer into current uncompressed chunk
+		memcpy(uptr, &offset, 4); // write offset
+		uptr += 4;
+		memcpy(uptr, &size, 4); // write size of patch
+		uptr += 4;
+		memcpy(uptr, data, size); // write payload
+		uidx += 8 + size;
+		uncompressed_bytes += 8 + size;
+	}
+}
+
+uint64_t file_writer::write_patch(char* __restrict__ orig, const char* __restrict__ chng, uint32_t offset, uint64_t size)
+{
+	// runs are written from our clone, which by then has the changes; the app may still be writing to its memory
+	const uint64_t changed = for_each_patch_run(orig, chng, offset, size, [this](uint32_t run_offset, const char* data, uint32_t run_size)
+	{
+		write_patch_run(run_offset, data, run_size);
+	});
 	// terminate with zero offset, zero size
 	assert(uidx <= chunk.size());
 	write_uint32_t(0);
@@ -103,10 +484,31 @@ uint64_t file_writer::write_patch(char* __restrict__ orig, const char* __restric
 	return changed;
 }
 
-file_writer::file_writer(int mytid) : mTid(mytid), done_feeding(false), done_compressing(false)
+uint64_t file_writer::diff_patch(char* __restrict__ orig, const char* __restrict__ chng, uint32_t offset, uint64_t size, std::vector<patch_run>& runs)
+{
+	return for_each_patch_run(orig, chng, offset, size, [&runs](uint32_t run_offset, const char*, uint32_t run_size)
+	{
+		runs.push_back({ run_offset, run_size });
+	});
+}
+
+void file_writer::write_patch_runs(const char* orig, const std::vector<patch_run>& runs)
+{
+	const char* data = orig;
+	for (const patch_run& run : runs)
+	{
+		data += run.offset;
+		write_patch_run(run.offset, data, run.size);
+		data += run.size;
+	}
+	write_uint32_t(0);
+	write_uint32_t(0);
+}
+
+file_writer::file_writer(int mytid) : mTid(mytid)
 {
 	uncompressed_chunk_size = p__chunksize;
-	chunk = buffer(uncompressed_chunk_size);
+	chunk = acquire_buffer(uncompressed_chunk_size);
 }
 
 void file_writer::set(const std::string& filename)
@@ -122,15 +524,27 @@ void file_writer::set(const std::string& filename)
 		ABORT("Failed to create \"%s\": %s", filename.c_str(), strerror(errno));
 	}
 
+	// Split chunks into sub-blocks that can be compressed and decompressed in parallel?
+	subblock_size = std::max(p__subblock_size, 0);
+	stream_version = subblock_size ? LAVATUBE_STREAM_VERSION_SUBBLOCKS : LAVATUBE_STREAM_VERSION_CHUNKED;
+	// Pick compression for each chunk separately? Then each chunk needs to be tagged with its codec.
+	adaptive_codec = p__adaptive_compression;
+	if (adaptive_codec) stream_version = LAVATUBE_STREAM_VERSION_TAGGED;
+	// Encode memory patches with fill and copy records? Builds on tagged streams.
+	if (p__patch_opcodes) stream_version = LAVATUBE_STREAM_VERSION_PATCH_OPCODES;
+
 	// Write file header
 	const char* magic_word = "LAVABIN";
 	buffer header(strlen(magic_word) + 32);
 	memset(header.data(), 0, header.size());
 	memcpy(header.data(), magic_word, strlen(magic_word)); // bytes 0..7
 	uint8_t* headerptr = (uint8_t*)header.data() + strlen(magic_word);
-	headerptr[0] = 3; // file version
+	headerptr[0] = stream_version; // file version
 	headerptr[1] = p__compression_type; // compression algorithm
+	file_bytes = 0;
+	stored_bytes = 0;
 	write_chunk(header);
+	stream_start = file_bytes;
 
 	if (p__compression_type == LAVATUBE_COMPRESSION_DENSITY && p__compression_level == 0)
 	{
@@ -138,9 +552,12 @@ void file_writer::set(const std::string& filename)
 	}
 	if (p__compression_type > LAVATUBE_COMPRESSION_LZ4) ABORT("Bad compression algorithm selected!");
 
-	// launch serialization threads
-	if (!compressor_thread.joinable()) compressor_thread = std::thread(&file_writer::compressor, this);
-	if (!serializer_thread.joinable()) serializer_thread = std::thread(&file_writer::serializer, this);
+	// start feeding our shared compression and serialization workers
+	if (!attached && (multithreaded_compress || multithreaded_write))
+	{
+		compression_pool::instance().attach(this);
+		attached = true;
+	}
 }
 
 void file_writer::finalize()
@@ -149,32 +566,24 @@ void file_writer::finalize()
 	{
 		return;
 	}
+	thaw(); // put in any spans that were filled since our last packet
 	// whatever is left in our current buffer, move to work list
-	chunk_mutex.lock();
 	assert(held_chunks.size() == 0);
 	printf("Filewriter finalizing thread %u: %lu total bytes, %lu in last chunk, %d uncompressed chunks, and %d compressed chunks to be written out\n",
-	       mTid, (unsigned long)uncompressed_bytes, (unsigned long)uidx, (int)uncompressed_chunks.size(), (int)compressed_chunks.size());
+	       mTid, (unsigned long)uncompressed_bytes, (unsigned long)uidx, count_uncompressed_chunks(), count_compressed_chunks());
 	chunk.shrink(uidx);
-	if (!multithreaded_compress)
+	submit_chunk(chunk);
+	chunk = acquire_buffer(uncompressed_chunk_size); // ready to go again
+	uidx = 0;
+	// wrap up work in work lists
+	wait_for_writeout();
+	if (attached)
 	{
-		chunk = compress_chunk(chunk);
-		if (multithreaded_write) compressed_chunks.push_front(chunk);
-		else write_chunk(chunk);
+		compression_pool::instance().detach(this);
+		attached = false;
 	}
-	else uncompressed_chunks.push_front(chunk);
-	chunk = buffer(uncompressed_chunk_size); // ready to go again
-	chunk_mutex.unlock();
-	// wrap up work in work lists
-	done_feeding.exchange(true);
-	if (compressor_thread.joinable()) compressor_thread.join();
-	done_compressing.exchange(true);
-	if (serializer_thread.joinable()) serializer_thread.join();
-	compressor_thread = std::thread();
-	serializer_thread = std::thread();
-	chunk_mutex.lock();
-	assert(uncompressed_chunks.size() == 0);
-	assert(compressed_chunks.size() == 0);
-	chunk_mutex.unlock();
+	assert(count_uncompressed_chunks() == 0);
+	assert(count_compressed_chunks() == 0);
 	int err = fclose(fp);
 	if (err != 0)
 	{
@@ -186,7 +595,7 @@ void file_writer::finalize()
 file_writer::~file_writer()
 {
 	finalize();
-	chunk.release();
+	chunk_buffer_pool::instance().recycle(chunk);
 }
 
 void file_writer::write_chunk(buffer& active)
@@ -201,145 +610,1018 @@ void file_writer::write_chunk(buffer& active)
 		size -= written;
 		err = ferror(fp);
 	} while (size > 0 && (err == EAGAIN || err == EWOULDBLOCK || err == EINTR));
+	file_bytes += active.size();
 	if (size > 0)
 	{
 		ELOG("Failed to write out file (%u bytes left): %s", (unsigned)size, strerror(ferror(fp)));
 	}
 	DLOG3("Filewriter thread %d wrote out compressed buffer of %lu size\n", mTid, (unsigned long)active.size());
-	active.release();
+	chunk_buffer_pool::instance().recycle(active);
 }
 
-void file_writer::serializer()
+uint64_t file_writer::stored_padding(const buffer& compressed) const
 {
-	// lock, steal compressed buffer, unlock, store to disk, sleep, repeat
-	set_thread_name("serializer");
-	while (1)
+	uint64_t header[2]; // compressed and uncompressed sizes
+	memcpy(header, compressed.data(), sizeof(header));
+	if (header[1] < stored_padding_threshold) return 0; // not worth it
+	if (p__compression_type != LAVATUBE_COMPRESSION_UNCOMPRESSED) return 0; // readers only move data of uncompressed streams
+	uint8_t codec = p__compression_type;
+	uint8_t layout = (stream_version == LAVATUBE_STREAM_VERSION_SUBBLOCKS) ? LAVATUBE_CHUNK_LAYOUT_SUBBLOCKS : LAVATUBE_CHUNK_LAYOUT_SINGLE;
+	if (stream_version >= LAVATUBE_STREAM_VERSION_TAGGED)
+	{
+		chunk_tag tag;
+		memcpy(&tag, compressed.data() + sizeof(header), sizeof(tag));
+		codec = tag.codec;
+		layout = tag.layout;
+	}
+	if (codec != LAVATUBE_COMPRESSION_UNCOMPRESSED || layout != LAVATUBE_CHUNK_LAYOUT_SINGLE) return 0;
+	// line up the data of the next chunk with its stream position the same way as the data of our first chunk
+	const uint64_t payload_start = sizeof(header) + chunk_tag_size();
+	const uint64_t first_data = stream_start + payload_start;
+	const uint64_t next_data = file_bytes + compressed.size() + payload_start;
+	const uint64_t wanted = first_data + stored_bytes + header[1];
+	return (wanted - next_data) & (stored_chunk_alignment - 1);
+}
+
+void file_writer::store_chunk(buffer& compressed)
+{
+	uint64_t header[2]; // compressed and uncompressed sizes
+	memcpy(header, compressed.data(), sizeof(header));
+	const uint64_t padding = stored_padding(compressed);
+	if (padding)
+	{
+		header[0] += padding;
+		memcpy(compressed.data(), header, sizeof(header));
+	}
+	compressed_sizes.push_back(header[0]);
+	uncompressed_sizes.push_back(header[1]);
+	write_chunk(compressed);
+	if (padding)
+	{
+		buffer pad(padding);
+		memset(pad.data(), 0, padding);
+		write_chunk(pad);
+	}
+	stored_bytes += header[1];
+}
+
+void file_writer::submit_chunk(buffer& uncompressed)
+{
+	if (uncompressed.size() == 0) // nothing to store
+	{
+		uncompressed.release();
+		return;
+	}
+	if (multithreaded_compress)
+	{
+		publish_chunk(uncompressed, CHUNK_UNCOMPRESSED);
+		return;
+	}
+	buffer compressed = compress_chunk(uncompressed);
+	submit_compressed(compressed);
+}
+
+void file_writer::submit_compressed(buffer& compressed)
+{
+	if (multithreaded_write)
+	{
+		publish_chunk(compressed, CHUNK_COMPRESSED);
+		return;
+	}
+	store_chunk(compressed);
+	chunks_submitted++;
+	chunks_claimed++;
+	chunks_compressed++;
+	chunks_written++;
+}
+
+void file_writer::write_direct(const char* data, uint64_t size)
+{
+	DLOG2("Filewriter thread %d compressing span of %lu bytes directly", mTid, (unsigned long)size);
+	// the span must come after what we already have, so end the current chunk here
+	chunk.shrink(uidx);
+	if (holding) held_chunks.push_front({ chunk }); // keeps any pointers into it valid
+	else submit_chunk(chunk);
+	for (uint64_t done = 0; done < size; )
 	{
-		buffer active;
-		chunk_mutex.lock();
-		// try to steal a compressed buffer
-		if (compressed_chunks.size()) // we have buffers to compress
+		const uint64_t len = std::min<uint64_t>(size - done, uncompressed_chunk_size);
+		buffer compressed = compress_span(data + done, len);
+		// inside a frozen packet, queue it behind the packet header until we thaw
+		if (holding) held_chunks.push_front({ compressed, nullptr, true });
+		else submit_compressed(compressed);
+		done += len;
+	}
+	uncompressed_bytes += size;
+	direct_bytes += size;
+	chunk = acquire_buffer(uncompressed_chunk_size);
+	uidx = 0;
+}
+
+stream_span* file_writer::reserve_span()
+{
+	freeze();
+	stream_span* span = new stream_span;
+	chunk.shrink(uidx);
+	span->prefix = chunk; // joined up with the span once it is filled, so that it does not cost us a chunk boundary
+	held_chunks.push_front({ buffer(), span });
+	chunk = acquire_buffer(uncompressed_chunk_size);
+	uidx = 0;
+	return span;
+}
+
+void file_writer::fill_span(stream_span* span)
+{
+	chunk.shrink(uidx);
+	held_chunks.push_front({ chunk });
+	while (held_chunks.size()) // oldest chunk is at the back
+	{
+		assert(!held_chunks.back().span && !held_chunks.back().compressed);
+		span->chunks.push_back(held_chunks.back().data);
+		held_chunks.pop_back();
+	}
+	span->size = uncompressed_bytes;
+	uncompressed_bytes = 0;
+	chunk = acquire_buffer(uncompressed_chunk_size);
+	uidx = 0;
+	span->filled.store(true, std::memory_order_release);
+}
+
+bool file_writer::take_span(stream_span* span)
+{
+	if (!span->filled.load(std::memory_order_acquire)) return false;
+	// join the span up with what came before it, and with what came after it if that is still in our current chunk,
+	// as long as it all fits in one chunk, so that we get much the same chunks as if we had written it ourselves
+	buffer joined = span->prefix;
+	for (buffer& part : span->chunks)
+	{
+		if (joined.size() + part.size() <= std::min<uint64_t>(joined.mCapacity, uncompressed_chunk_size))
 		{
-			active = compressed_chunks.back();
-			compressed_chunks.pop_back();
+			memcpy(joined.data() + joined.size(), part.data(), part.size());
+			joined.shrink(joined.size() + part.size());
+			chunk_buffer_pool::instance().recycle(part);
 		}
-		// note that we only exit thread if we have no more work to do
-		else if (done_compressing)
+		else
+		{
+			submit_chunk(joined);
+			joined = part;
+		}
+	}
+	uncompressed_bytes += span->size;
+	if (held_chunks.size() == 1 && joined.size() + uidx <= std::min<uint64_t>(joined.mCapacity, chunk.size()))
+	{
+		memcpy(joined.data() + joined.size(), chunk.data(), uidx);
+		uidx += joined.size();
+		joined.shrink(std::min<uint64_t>(joined.mCapacity, chunk.size())); // the rest is room to keep writing into
+		chunk_buffer_pool::instance().recycle(chunk);
+		chunk = joined;
+	}
+	else submit_chunk(joined);
+	DLOG3("Filewriter thread %d put in span of %lu bytes", mTid, (unsigned long)span->size);
+	if (span->on_written) span->on_written(span->size);
+	delete span;
+	return true;
+}
+
+void file_writer::publish_chunk(buffer& data, chunk_state state)
+{
+	compression_pool& pool = compression_pool::instance();
+	const uint64_t sequence = chunks_submitted.load(); // only we ever change this
+	// if the ring is full, wait for the oldest chunk to be written out
+	uint64_t written = chunks_written.load();
+	if (sequence - written >= chunk_ring_size)
+	{
+		const uint64_t start = gettime();
+		while (sequence - written >= chunk_ring_size)
 		{
-			chunk_mutex.unlock();
-			break; // exit thread
+			chunks_written.wait(written);
+			written = chunks_written.load();
 		}
-		chunk_mutex.unlock();
-		// save compressed buffer
-		if (active.size() > 0)
+		pool.record_stall(start);
+	}
+	pool.reserve(this, data.size());
+	chunk_slot& slot = chunk_ring[sequence % chunk_ring_size];
+	assert(slot.state.load() == CHUNK_EMPTY);
+	slot.data = data;
+	slot.bytes = data.size();
+	slot.blocks = 0;
+	if (state == CHUNK_UNCOMPRESSED && subblock_size) // codec is picked by whichever worker claims the first sub-block
+	{
+		slot.prepared.store(false);
+		slot.blocks = (data.size() + subblock_size - 1) / subblock_size;
+		slot.blocks_claimed = 0;
+		slot.blocks_done.store(0);
+	}
+	if (state == CHUNK_COMPRESSED) chunks_compressed++;
+	slot.state.store(state);
+	chunks_submitted.store(sequence + 1);
+	if (state == CHUNK_COMPRESSED) // already compressed, nothing to claim, unless earlier chunks still are
+	{
+		uint64_t expected = sequence;
+		chunks_claimed.compare_exchange_strong(expected, sequence + 1);
+	}
+	pool.record_depth(this);
+	pool.wake(); // sub-blocks beyond the first are handed out once the codec is picked
+}
+
+file_writer::pool_job file_writer::take_job(uint64_t& sequence, uint32_t& block)
+{
+	uint64_t claimed = chunks_claimed.load();
+	while (claimed < chunks_submitted.load())
+	{
+		chunk_slot& slot = chunk_ring[claimed % chunk_ring_size];
+		const uint32_t state = slot.state.load();
+		if (state == CHUNK_COMPRESSED) // handed over already compressed behind chunks that were not, skip past it
+		{
+			if (chunks_claimed.compare_exchange_weak(claimed, claimed + 1)) claimed++;
+			continue;
+		}
+		if (state != CHUNK_UNCOMPRESSED) break;
+		if (slot.blocks > 0) // take next sub-block of oldest chunk; we hold the pool mutex, so nobody else is claiming
 		{
-			write_chunk(active);
+			if (slot.blocks_claimed > 0 && !slot.prepared.load()) break; // first sub-block is still picking the codec
+			sequence = claimed;
+			block = slot.blocks_claimed++;
+			if (slot.blocks_claimed == slot.blocks) chunks_claimed.store(claimed + 1);
+			return pool_job::compress;
 		}
-		// if not done and no work done, wait a bit
-		else if (!done_compressing)
+		if (chunks_claimed.compare_exchange_weak(claimed, claimed + 1)) // take oldest chunk to compress
 		{
-			usleep(2000);
+			sequence = claimed;
+			block = 0;
+			return pool_job::compress;
 		}
 	}
+	const uint64_t written = chunks_written.load();
+	if (!writing.load() && chunk_ring[written % chunk_ring_size].state.load() == CHUNK_COMPRESSED)
+	{
+		return pool_job::write;
+	}
+	return pool_job::none;
 }
 
-buffer file_writer::compress_chunk(buffer& uncompressed)
+void file_writer::compress_job(uint64_t sequence, uint32_t block)
 {
-	const uint64_t header_size = sizeof(uint64_t) * 2;
-	uint64_t compressed_size = 0;
-	uint64_t was_written = 0;
-	uint64_t was_read = 0;
-
-	if (p__compression_type == LAVATUBE_COMPRESSION_DENSITY)
+	chunk_slot& slot = chunk_ring[sequence % chunk_ring_size];
+	assert(slot.state.load() == CHUNK_UNCOMPRESSED);
+	if (slot.blocks == 0)
 	{
-		 compressed_size = density_compress_safe_size(uncompressed.size()) + header_size;
+		slot.data = compress_chunk(slot.data);
 	}
-	else if (p__compression_type == LAVATUBE_COMPRESSION_LZ4)
+	else
+	{
+		if (block == 0) // keep codec selection off the producer thread
+		{
+			slot.codec = select_codec(slot.data.data(), slot.data.size());
+			slot.compressed = begin_subblocks(slot.data.size(), slot.codec);
+			slot.prepared.store(true);
+			if (slot.blocks > 1) compression_pool::instance().wake(slot.blocks - 1);
+		}
+		compress_subblock(slot.compressed, slot.data.data(), slot.data.size(), block, slot.codec);
+		if (slot.blocks_done.fetch_add(1) + 1 < slot.blocks) return; // the last one to finish wraps up the chunk
+		finish_subblocks(slot.compressed, slot.data.size(), slot.codec);
+		chunk_buffer_pool::instance().recycle(slot.data);
+		slot.data = slot.compressed;
+		slot.compressed = buffer();
+	}
+	chunks_compressed++;
+	slot.state.store(CHUNK_COMPRESSED);
+	compression_pool::instance().record_depth(this);
+	write_out();
+}
+
+void file_writer::write_out()
+{
+	while (1)
 	{
-		compressed_size = LZ4_COMPRESSBOUND(uncompressed.size()) + header_size;
+		// only one thread may write to our file at a time; if someone else is, they will pick up our chunk
+		if (writing.exchange(true)) return;
+		while (1)
+		{
+			const uint64_t written = chunks_written.load();
+			chunk_slot& slot = chunk_ring[written % chunk_ring_size];
+			if (slot.state.load() != CHUNK_COMPRESSED) break;
+			const uint64_t bytes = slot.bytes;
+			store_chunk(slot.data);
+			slot.state.store(CHUNK_EMPTY);
+			uint64_t expected = written; // if it was handed over already compressed, nobody may have claimed past it yet
+			chunks_claimed.compare_exchange_strong(expected, written + 1);
+			chunks_written.store(written + 1);
+			chunks_written.notify_all();
+			compression_pool::instance().release(bytes);
+		}
+		writing.store(false);
+		// check if a chunk was finished while we were letting go of the writing flag
+		const uint64_t written = chunks_written.load();
+		if (chunk_ring[written % chunk_ring_size].state.load() != CHUNK_COMPRESSED) return;
 	}
-	else if (p__compression_type == LAVATUBE_COMPRESSION_UNCOMPRESSED)
+}
+
+void file_writer::wait_for_writeout()
+{
+	uint64_t written = chunks_written.load();
+	while (written != chunks_submitted.load())
 	{
-		compressed_size = uncompressed.size() + header_size;
+		chunks_written.wait(written);
+		written = chunks_written.load();
 	}
-	else ABORT("Bad compression type: %d", (int)p__compression_type);
+}
 
-	buffer compressed(compressed_size);
+uint64_t file_writer::compress_bound(uint8_t codec, uint64_t size) const
+{
+	if (codec == LAVATUBE_COMPRESSION_DENSITY) return density_compress_safe_size(size);
+	else if (codec == LAVATUBE_COMPRESSION_LZ4) return LZ4_COMPRESSBOUND(size);
+	else if (codec == LAVATUBE_COMPRESSION_UNCOMPRESSED) return size;
+	ABORT("Bad compression type: %d", (int)codec);
+}
 
-	if (p__compression_type == LAVATUBE_COMPRESSION_DENSITY)
+uint64_t file_writer::compress_block(uint8_t codec, const char* source, uint64_t size, char* destination, uint64_t capacity)
+{
+	if (codec == LAVATUBE_COMPRESSION_DENSITY)
 	{
-		density_processing_result result = density_compress((const uint8_t *)uncompressed.data(), uncompressed.size(),
-		                                                    (uint8_t *)compressed.data() + header_size, compressed.size(),
-		                                                    (DENSITY_ALGORITHM)p__compression_level);
+		// the compression level only applies to the algorithm it was chosen for
+		const DENSITY_ALGORITHM level = (p__compression_type == LAVATUBE_COMPRESSION_DENSITY && p__compression_level) ? (DENSITY_ALGORITHM)p__compression_level : DENSITY_ALGORITHM_CHEETAH;
+		density_processing_result result = density_compress((const uint8_t *)source, size, (uint8_t *)destination, capacity, level);
 		if (result.state != DENSITY_STATE_OK)
 		{
 			ABORT("Failed to compress buffer - aborting from compression thread");
 		}
-		was_written = result.bytesWritten;
-		was_read = result.bytesRead;
+		assert(result.bytesRead == size);
+		return result.bytesWritten;
 	}
-	else if (p__compression_type == LAVATUBE_COMPRESSION_LZ4)
+	else if (codec == LAVATUBE_COMPRESSION_LZ4)
 	{
-		int result = LZ4_compress_fast(uncompressed.data(), compressed.data() + header_size, uncompressed.size(), compressed_size, p__compression_level);
+		const int level = (p__compression_type == LAVATUBE_COMPRESSION_LZ4) ? p__compression_level : 1;
+		int result = LZ4_compress_fast(source, destination, size, capacity, level);
 		if (result == 0) ABORT("Failed to compress buffer - aborting from compression thread");
-		was_written = result;
-		was_read = uncompressed.size();
+		return result;
 	}
-	else // uncompressed
+	// uncompressed
+	memcpy(destination, source, size);
+	return size;
+}
+
+/// Estimate the Shannon entropy of a chunk in bits per byte from a few evenly spaced samples.
+static double sample_entropy(const char* data, uint64_t size)
+{
+	const uint64_t samples = 16;
+	const uint64_t sample_size = 1024;
+	uint32_t histogram[256] = {};
+	uint64_t total = 0;
+	if (size <= samples * sample_size)
+	{
+		for (uint64_t i = 0; i < size; i++) histogram[(uint8_t)data[i]]++;
+		total = size;
+	}
+	else for (uint64_t s = 0; s < samples; s++)
+	{
+		const uint8_t* sample = (const uint8_t*)data + s * ((size - sample_size) / (samples - 1));
+		for (uint64_t i = 0; i < sample_size; i++) histogram[sample[i]]++;
+		total += sample_size;
+	}
+	double entropy = 0.0;
+	for (unsigned i = 0; i < 256; i++)
+	{
+		if (histogram[i] == 0) continue;
+		const double p = (double)histogram[i] / (double)total;
+		entropy -= p * log2(p);
+	}
+	return entropy;
+}
+
+uint8_t file_writer::select_codec(const char* data, uint64_t size)
+{
+	uint8_t codec = p__compression_type;
+	if (adaptive_codec && codec != LAVATUBE_COMPRESSION_UNCOMPRESSED)
+	{
+		// When we are falling behind the application, stop spending time on data that does not compress well
+		// earlier, and do not spend any time on trial compression.
+		const bool backlogged = chunks_submitted.load() - chunks_compressed.load() >= chunk_ring_size / 4;
+		const double entropy = sample_entropy(data, size);
+		if (entropy >= (backlogged ? adaptive_backlog_entropy : adaptive_entropy))
+		{
+			codec = LAVATUBE_COMPRESSION_UNCOMPRESSED; // looks like already compressed data
+		}
+		else if (!backlogged && size >= trial_size * 4)
+		{
+			// try both algorithms on a piece from the middle of the chunk, and keep whichever wins
+			const char* sample = data + (size - trial_size) / 2;
+			std::vector<char> scratch(std::max(compress_bound(LAVATUBE_COMPRESSION_DENSITY, trial_size), compress_bound(LAVATUBE_COMPRESSION_LZ4, trial_size)));
+			const uint64_t density_size = compress_block(LAVATUBE_COMPRESSION_DENSITY, sample, trial_size, scratch.data(), scratch.size());
+			const uint64_t lz4_size = compress_block(LAVATUBE_COMPRESSION_LZ4, sample, trial_size, scratch.data(), scratch.size());
+			const uint64_t best = std::min(density_size, lz4_size);
+			if (best * 10 > trial_size * 9) codec = LAVATUBE_COMPRESSION_UNCOMPRESSED; // saves less than 10%
+			else codec = (density_size < lz4_size) ? LAVATUBE_COMPRESSION_DENSITY : LAVATUBE_COMPRESSION_LZ4;
+		}
+	}
+	codec_chunks[codec]++;
+	return codec;
+}
+
+void file_writer::write_chunk_tag(buffer& compressed, uint8_t codec, uint8_t layout) const
+{
+	if (stream_version < LAVATUBE_STREAM_VERSION_TAGGED) return;
+	chunk_tag tag;
+	tag.codec = codec;
+	tag.layout = layout;
+	memcpy(compressed.data() + sizeof(uint64_t) * 2, &tag, sizeof(tag));
+}
+
+buffer file_writer::compress_chunk(buffer& uncompressed)
+{
+	buffer compressed = compress_span(uncompressed.data(), uncompressed.size());
+	chunk_buffer_pool::instance().recycle(uncompressed);
+	return compressed;
+}
+
+buffer file_writer::compress_span(const char* data, uint64_t size)
+{
+	const uint8_t codec = select_codec(data, size);
+	if (subblock_size)
 	{
-		memcpy(compressed.data() + header_size, uncompressed.data(), uncompressed.size());
-		was_written = compressed.size();
-		was_read = uncompressed.size();
+		buffer compressed = begin_subblocks(size, codec);
+		const uint32_t blocks = (size + subblock_size - 1) / subblock_size;
+		for (uint32_t i = 0; i < blocks; i++) compress_subblock(compressed, data, size, i, codec);
+		finish_subblocks(compressed, size, codec);
+		return compressed;
 	}
-	uncompressed.release();
+
+	const uint64_t header_size = sizeof(uint64_t) * 2;
+	const uint64_t payload_start = header_size + chunk_tag_size();
+	// quirk kept for compatibility, untagged uncompressed chunks claim to be this much bigger and readers skip the extra bytes
+	const uint64_t extra = (codec == LAVATUBE_COMPRESSION_UNCOMPRESSED && stream_version < LAVATUBE_STREAM_VERSION_TAGGED) ? header_size : 0;
+	const uint64_t compressed_size = compress_bound(codec, size) + payload_start + extra;
+	buffer compressed = acquire_buffer(compressed_size);
+	write_chunk_tag(compressed, codec, LAVATUBE_CHUNK_LAYOUT_SINGLE);
+	uint64_t was_written = compress_block(codec, data, size, compressed.data() + payload_start, compressed_size - payload_start - extra);
+	const uint64_t was_read = size;
+	memset(compressed.data() + payload_start + was_written, 0, extra);
+	was_written += extra;
+	was_written += chunk_tag_size();
 	uint64_t header[2] = { was_written, was_read }; // store compressed and uncompressed sizes
 	memcpy(compressed.data(), header, header_size); // use memcpy to avoid aliasing issues
 	compressed.shrink(was_written + header_size);
-	compressed_sizes.push_back(was_written);
-	uncompressed_sizes.push_back(was_read);
 	DLOG3("Filewriter thread %d handing over compressed buffer of %lu bytes, was %lu bytes uncompressed", mTid, (unsigned long)(was_written + header_size), (unsigned long)was_read);
 	return compressed;
 }
 
-void file_writer::compressor()
+buffer file_writer::begin_subblocks(uint64_t size, uint8_t codec)
+{
+	const uint64_t table_start = sizeof(uint64_t) * 2 + chunk_tag_size();
+	const uint32_t blocks = (size + subblock_size - 1) / subblock_size;
+	buffer compressed = acquire_buffer(table_start + subblock_table_size(blocks) + blocks * compress_bound(codec, subblock_size));
+	write_chunk_tag(compressed, codec, LAVATUBE_CHUNK_LAYOUT_SUBBLOCKS);
+	const subblock_table_header table = { blocks, subblock_size };
+	memcpy(compressed.data() + table_start, &table, sizeof(table));
+	return compressed;
+}
+
+void file_writer::compress_subblock(buffer& compressed, const char* data, uint64_t size, uint32_t block, uint8_t codec)
+{
+	// each sub-block is compressed into its own worst case sized area, so that sub-blocks can be compressed in parallel
+	const uint64_t table_start = sizeof(uint64_t) * 2 + chunk_tag_size();
+	const uint32_t blocks = (size + subblock_size - 1) / subblock_size;
+	const uint64_t bound = compress_bound(codec, subblock_size);
+	const uint64_t offset = (uint64_t)block * subblock_size;
+	const uint64_t block_size = std::min<uint64_t>(subblock_size, size - offset);
+	char* destination = compressed.data() + table_start + subblock_table_size(blocks) + block * bound;
+	const uint32_t was_written = compress_block(codec, data + offset, block_size, destination, bound);
+	memcpy(compressed.data() + table_start + sizeof(subblock_table_header) + sizeof(uint32_t) * block, &was_written, sizeof(was_written));
+}
+
+void file_writer::finish_subblocks(buffer& compressed, uint64_t size, uint8_t codec)
+{
+	const uint64_t header_size = sizeof(uint64_t) * 2;
+	const uint64_t table_start = header_size + chunk_tag_size();
+	const uint32_t blocks = (size + subblock_size - 1) / subblock_size;
+	const uint64_t bound = compress_bound(codec, subblock_size);
+	const char* payload = compressed.data() + table_start;
+	uint64_t position = table_start + subblock_table_size(blocks);
+	for (uint32_t i = 0; i < blocks; i++) // move sub-blocks together
+	{
+		const uint32_t block_size = subblock_compressed_size(payload, i);
+		memmove(compressed.data() + position, compressed.data() + table_start + subblock_table_size(blocks) + i * bound, block_size);
+		position += block_size;
+	}
+	uint64_t header[2] = { position - header_size, size };
+	memcpy(compressed.data(), header, header_size);
+	compressed.shrink(position);
+	DLOG3("Filewriter thread %d handing over compressed buffer of %lu bytes in %u sub-blocks, was %lu bytes uncompressed", mTid, (unsigned long)position, (unsigned)blocks, (unsigned long)size);
+}
+
+buffer file_writer::acquire_buffer(uint_fast32_t size)
+{
+	bool hit = false;
+	buffer buf = chunk_buffer_pool::instance().acquire(size, hit);
+	if (hit) pool_hits++;
+	else pool_misses++;
+	return buf;
+}
+
+// --- chunk buffer pool
+
+chunk_buffer_pool& chunk_buffer_pool::instance()
+{
+	// never destroyed, since writers may be finalized from static destructors
+	static chunk_buffer_pool* pool = new chunk_buffer_pool;
+	return *pool;
+}
+
+buffer chunk_buffer_pool::acquire(uint_fast32_t size, bool& hit)
+{
+	mutex.lock();
+	int best = -1;
+	for (unsigned i = 0; i < idle.size(); i++) // find the smallest buffer that fits
+	{
+		const uint64_t capacity = idle[i].mCapacity;
+		if (capacity >= size && capacity <= (uint64_t)size * max_waste_factor && (best == -1 || capacity < idle[best].mCapacity)) best = i;
+	}
+	if (best != -1)
+	{
+		buffer buf = idle[best];
+		idle[best] = idle.back();
+		idle.pop_back();
+		idle_bytes -= buf.mCapacity;
+		mutex.unlock();
+		buf.shrink(size);
+		hit = true;
+		return buf;
+	}
+	mutex.unlock();
+	hit = false;
+	buffer buf(size);
+	if (size >= min_recycled_size) prefault(buf.data(), size);
+	return buf;
+}
+
+void chunk_buffer_pool::prefault(char* ptr, uint64_t size)
+{
+	const uint64_t page = getpagesize();
+#ifdef MADV_POPULATE_WRITE
+	// only round out to pages that the buffer already partly covers, so this never reaches memory that is not ours
+	const uint64_t start = aligned_start((uintptr_t)ptr, page);
+	const uint64_t end = aligned_size((uintptr_t)ptr + size, page);
+	if (madvise((void*)start, end - start, MADV_POPULATE_WRITE) != 0) // needs linux 5.14
+#endif
+	{
+		for (uint64_t offset = 0; offset < size; offset += page) ((volatile char*)ptr)[offset] = 0;
+	}
+}
+
+void chunk_buffer_pool::recycle(buffer& buf)
+{
+	if (!buf.data()) return;
+	if (buf.mCapacity < min_recycled_size)
+	{
+		buf.release();
+		return;
+	}
+	mutex.lock();
+	if (idle.size() < max_idle_buffers && idle_bytes + buf.mCapacity <= (uint64_t)p__chunk_pool_size * 1024 * 1024)
+	{
+		buf.shrink(buf.mCapacity);
+		idle.push_back(buf);
+		idle_bytes += buf.mCapacity;
+		mutex.unlock();
+		buf = buffer();
+		return;
+	}
+	mutex.unlock();
+	buf.release();
+}
+
+void chunk_buffer_pool::trim()
+{
+	lava::lock_guard lock(mutex);
+	for (buffer& buf : idle) buf.release();
+	idle.clear();
+	idle_bytes = 0;
+}
+
+// --- compression pool
+
+unsigned compression_pool::worker_count()
+{
+	if (p__compression_threads > 0) return p__compression_threads;
+	// leave most of the cores for the app
+	const unsigned cores = std::thread::hardware_concurrency();
+	return std::clamp(cores / 4, 1u, 4u);
+}
+
+compression_pool& compression_pool::instance()
+{
+	// never destroyed, since writers may be finalized from static destructors
+	static compression_pool* pool = new compression_pool;
+	return *pool;
+}
+
+void compression_pool::attach(file_writer* writer)
 {
-	// lock, grab pointer to uncompressed, make new compressed, unlock, compress, sleep, repeat
+	lava::lock_guard lifecycle(lifecycle_mutex);
+	mutex.lock();
+	writers.push_back(writer);
+	mutex.unlock();
+	if (threads.size()) return;
+	done.store(false);
+	stall_ns.store(0);
+	stalls.store(0);
+	peak_inflight_bytes.store(0);
+	peak_queue_depth.store(0);
+	peak_compress_backlog.store(0);
+	peak_writeout_backlog.store(0);
+	const unsigned count = worker_count();
+	for (unsigned i = 0; i < count; i++) threads.emplace_back(&compression_pool::worker, this);
+	DLOG("Launched %u compression workers", count);
+}
+
+void compression_pool::detach(file_writer* writer)
+{
+	lava::lock_guard lifecycle(lifecycle_mutex);
+	uint32_t seen = release_epoch.load();
+	mutex.lock();
+	writers.erase(std::remove(writers.begin(), writers.end(), writer), writers.end());
+	const bool last = writers.empty();
+	unsigned users = writer->pool_users;
+	mutex.unlock();
+	while (users) // wait for workers to let go of it, since it is about to go away
+	{
+		release_epoch.wait(seen);
+		seen = release_epoch.load();
+		mutex.lock();
+		users = writer->pool_users;
+		mutex.unlock();
+	}
+	if (!last) return;
+	done.store(true);
+	work_epoch.fetch_add(1);
+	work_epoch.notify_all();
+	for (std::thread& t : threads) t.join();
+	threads.clear();
+	chunk_buffer_pool::instance().trim(); // nobody is tracing anymore, so give the memory back
+}
+
+static void update_max(std::atomic_uint64_t& peak, uint64_t value)
+{
+	uint64_t old = peak.load();
+	while (value > old && !peak.compare_exchange_weak(old, value)) {}
+}
+
+void compression_pool::reserve(const file_writer* writer, uint64_t bytes)
+{
+	const uint64_t budget = (uint64_t)p__inflight_budget * 1024 * 1024;
+	uint64_t start = 0;
+	while (budget > 0)
+	{
+		const uint32_t seen = budget_epoch.load();
+		if (inflight_bytes.load() + bytes <= budget || writer->chunks_written.load() == writer->chunks_submitted.load()) break;
+		if (!start) start = gettime();
+		budget_waiters++;
+		budget_epoch.wait(seen);
+		budget_waiters--;
+	}
+	if (start) record_stall(start);
+	update_max(peak_inflight_bytes, inflight_bytes.fetch_add(bytes) + bytes);
+}
+
+void compression_pool::release(uint64_t bytes)
+{
+	inflight_bytes.fetch_sub(bytes);
+	if (budget_waiters.load())
+	{
+		budget_epoch.fetch_add(1);
+		budget_epoch.notify_all();
+	}
+}
+
+void compression_pool::record_stall(uint64_t start)
+{
+	stall_ns.fetch_add(gettime() - start);
+	stalls++;
+}
+
+void compression_pool::record_depth(const file_writer* writer)
+{
+	// read in this order so that we never see more chunks written than compressed, or compressed than submitted
+	const uint64_t written = writer->chunks_written.load();
+	const uint64_t compressed = writer->chunks_compressed.load();
+	const uint64_t submitted = writer->chunks_submitted.load();
+	update_max(peak_queue_depth, submitted - written);
+	update_max(peak_compress_backlog, submitted - compressed);
+	update_max(peak_writeout_backlog, compressed - written);
+}
+
+compression_pool::statistics compression_pool::stats() const
+{
+	statistics s;
+	s.stall_ns = stall_ns.load();
+	s.stalls = stalls.load();
+	s.peak_inflight_bytes = peak_inflight_bytes.load();
+	s.peak_queue_depth = peak_queue_depth.load();
+	s.peak_compress_backlog = peak_compress_backlog.load();
+	s.peak_writeout_backlog = peak_writeout_backlog.load();
+	return s;
+}
+
+bool compression_pool::run_job()
+{
+	file_writer* writer = nullptr;
+	uint64_t sequence = 0;
+	uint32_t block = 0;
+	file_writer::pool_job type = file_writer::pool_job::none;
+	mutex.lock();
+	const unsigned size = writers.size();
+	for (unsigned i = 0; i < size && type == file_writer::pool_job::none; i++)
+	{
+		const unsigned index = (next_writer + i) % size;
+		type = writers[index]->take_job(sequence, block);
+		if (type != file_writer::pool_job::none)
+		{
+			writer = writers[index];
+			writer->pool_users++;
+			next_writer = index + 1;
+		}
+	}
+	mutex.unlock();
+	if (!writer) return false;
+	if (type == file_writer::pool_job::compress) writer->compress_job(sequence, block);
+	else writer->write_out();
+	mutex.lock();
+	writer->pool_users--; // after this we may no longer touch this writer, since it may be finalized
+	mutex.unlock();
+	release_epoch.fetch_add(1);
+	release_epoch.notify_all();
+	return true;
+}
+
+void compression_pool::worker()
+{
+	// steal a chunk from any writer, compress, write out whatever is next in line, repeat
 	set_thread_name("compressor");
 	while (1)
 	{
-		buffer uncompressed;
-		chunk_mutex.lock();
-		// try to steal uncompressed buffer
-		if (uncompressed_chunks.size()) // we have buffers to compress
+		const uint32_t seen = work_epoch.load();
+		if (run_job()) continue;
+		// note that we only exit thread if we have no more work to do
+		if (done.load()) break;
+		// sleep until a writer hands over more work; if any was handed over since we started looking, we return immediately
+		sleepers++;
+		work_epoch.wait(seen);
+		sleepers--;
+	}
+}
+
+// --- patch scan pool
+
+unsigned patch_scan_pool::thread_count()
+{
+	if (p__scan_threads > 0) return p__scan_threads;
+	// diffing is mostly limited by memory bandwidth, which a few cores will saturate
+	const unsigned cores = std::thread::hardware_concurrency();
+	return std::clamp(cores / 2, 1u, 8u);
+}
+
+patch_scan_pool::~patch_scan_pool()
+{
+	done.store(true);
+	epoch.fetch_add(1);
+	epoch.notify_all();
+	for (std::thread& t : threads) t.join();
+}
+
+void patch_scan_pool::run(unsigned tasks, const std::function<void(unsigned)>& fn)
+{
+	const unsigned count = thread_count();
+	if (count <= 1 || tasks <= 1 || !busy.try_lock()) // if another thread is using the pool, do it all ourselves
+	{
+		for (unsigned i = 0; i < tasks; i++) fn(i);
+		return;
+	}
+	if (threads.empty())
+	{
+		for (unsigned i = 0; i < count - 1; i++) threads.emplace_back(&patch_scan_pool::worker, this);
+		DLOG("Launched %u memory scan workers", count - 1);
+	}
+	mutex.lock();
+	job = &fn;
+	next_task = 0;
+	task_count = tasks;
+	pending.store(tasks);
+	mutex.unlock();
+	epoch.fetch_add(1);
+	epoch.notify_all();
+	work();
+	uint32_t left = pending.load();
+	while (left) // wait for the workers to finish what they took
+	{
+		pending.wait(left);
+		left = pending.load();
+	}
+	mutex.lock();
+	job = nullptr; // so that late workers do not touch it
+	mutex.unlock();
+	busy.unlock();
+}
+
+void patch_scan_pool::run_grouped(const std::vector<scan_area>& areas, const std::function<void(unsigned)>& fn)
+{
+	// group tasks with overlapping areas
+	std::vector<unsigned> order(areas.size());
+	for (unsigned i = 0; i < areas.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&areas](unsigned a, unsigned b)
+	{
+		if (areas[a].memory != areas[b].memory) return areas[a].memory < areas[b].memory;
+		if (areas[a].first != areas[b].first) return areas[a].first < areas[b].first;
+		return a < b;
+	});
+	std::vector<std::vector<unsigned>> groups;
+	uint64_t group_last = 0;
+	for (unsigned i = 0; i < order.size(); i++)
+	{
+		const scan_area& area = areas[order[i]];
+		if (i == 0 || area.memory != areas[order[i - 1]].memory || area.first > group_last)
 		{
-			// take oldest chunk to compress
-			uncompressed = uncompressed_chunks.back();
-			uncompressed_chunks.pop_back();
+			groups.emplace_back();
+			group_last = area.last;
 		}
-		// note that we only exit thread if we have no more work to do
-		else if (done_feeding)
+		groups.back().push_back(order[i]);
+		group_last = std::max(group_last, area.last);
+	}
+	for (std::vector<unsigned>& group : groups) std::sort(group.begin(), group.end()); // back in submission order
+	// start with the biggest groups, so that we do not end up waiting for one big group at the end
+	std::vector<uint64_t> group_size(groups.size(), 0);
+	for (unsigned i = 0; i < groups.size(); i++) for (unsigned index : groups[i]) group_size[i] += areas[index].last - areas[index].first + 1;
+	std::vector<unsigned> group_order(groups.size());
+	for (unsigned i = 0; i < groups.size(); i++) group_order[i] = i;
+	std::stable_sort(group_order.begin(), group_order.end(), [&group_size](unsigned a, unsigned b) { return group_size[a] > group_size[b]; });
+
+	run(groups.size(), [&](unsigned task)
+	{
+		for (unsigned index : groups[group_order[task]]) fn(index);
+	});
+}
+
+void patch_scan_pool::work()
+{
+	while (1)
+	{
+		mutex.lock();
+		if (!job || next_task == task_count)
 		{
-			chunk_mutex.unlock();
-			break; // exit thread
+			mutex.unlock();
+			return;
 		}
-		chunk_mutex.unlock();
-		// compress it
-		if (uncompressed.size() > 0)
+		const std::function<void(unsigned)>* fn = job;
+		const unsigned task = next_task++;
+		mutex.unlock();
+		(*fn)(task);
+		if (pending.fetch_sub(1) == 1) pending.notify_all();
+	}
+}
+
+void patch_scan_pool::worker()
+{
+	set_thread_name("memscan");
+	uint32_t seen = 0;
+	while (1)
+	{
+		epoch.wait(seen);
+		seen = epoch.load();
+		if (done.load()) break;
+		work();
+	}
+}
+
+// --- span worker
+
+span_worker::~span_worker()
+{
+	done.store(true);
+	epoch.fetch_add(1);
+	epoch.notify_all();
+	mutex.lock();
+	std::thread t = std::move(thread);
+	mutex.unlock();
+	if (t.joinable()) t.join();
+}
+
+void span_worker::run(const file_writer& owner, stream_span* span, uint64_t bytes, uint64_t budget, std::function<void(file_writer&)>&& fn)
+{
+	// if we are over budget, wait until the worker catches up, unless it has nothing to work on
+	uint32_t left = pending.load();
+	if (budget && left && inflight_bytes.load() + bytes > budget)
+	{
+		const uint64_t start = gettime();
+		while (left && inflight_bytes.load() + bytes > budget)
 		{
-			buffer compressed = compress_chunk(uncompressed);
+			pending.wait(left);
+			left = pending.load();
+		}
+		stall_ns += gettime() - start;
+		stalls++;
+	}
+	inflight_bytes += bytes;
+	pending++;
+	jobs++;
+	mutex.lock();
+	if (!thread.joinable()) thread = std::thread(&span_worker::worker, this);
+	queue.push_back({ &owner, span, bytes, std::move(fn) });
+	mutex.unlock();
+	epoch.fetch_add(1);
+	epoch.notify_one();
+}
 
-			if (multithreaded_write)
-			{
-				chunk_mutex.lock();
-				compressed_chunks.push_front(compressed);
-				chunk_mutex.unlock();
-			}
-			else write_chunk(compressed);
+void span_worker::drain()
+{
+	uint32_t left = pending.load();
+	while (left)
+	{
+		pending.wait(left);
+		left = pending.load();
+	}
+}
+
+void span_worker::worker()
+{
+	set_thread_name("spanwriter");
+	file_writer out;
+	while (1)
+	{
+		const uint32_t seen = epoch.load();
+		mutex.lock();
+		if (queue.empty())
+		{
+			mutex.unlock();
+			if (done.load()) break;
+			epoch.wait(seen); // returns at once if work was added since we looked
+			continue;
 		}
-		// if not done and no work done, wait a bit
-		else if (!done_feeding)
+		job j = std::move(queue.front());
+		queue.pop_front();
+		mutex.unlock();
+		out.write_spans_for(*j.owner);
+		j.fn(out);
+		out.fill_span(j.span);
+		inflight_bytes -= j.bytes;
+		pending--;
+		pending.notify_all();
+	}
+}
+
+// --- host memory clones
+
+char* clone_alloc(uint64_t size)
+{
+	void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED) ABORT("Failed to reserve %lu bytes for memory clone: %s", (unsigned long)size, strerror(errno));
+	return (char*)ptr;
+}
+
+void clone_free(char* clone, uint64_t size)
+{
+	munmap(clone, size);
+}
+
+void clone_commit(char* ptr, uint64_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+	static std::atomic_bool unsupported { false };
+	if (size < clone_commit_min || unsupported.load(std::memory_order_relaxed)) return;
+	const uint64_t page = getpagesize();
+	const uint64_t start = aligned_start((uintptr_t)ptr, page);
+	const uint64_t end = aligned_size((uintptr_t)ptr + size, page);
+	if (madvise((void*)start, end - start, MADV_POPULATE_WRITE) != 0 && errno == EINVAL)
+	{
+		unsupported.store(true, std::memory_order_relaxed); // older kernel, pages fault in one at a time instead
+	}
+#else
+	(void)ptr;
+	(void)size;
+#endif
+}
+
+uint64_t clone_resident(const char* clone, uint64_t size)
+{
+	// Pages we only ever read from are all backed by the kernel's shared zero page, which mincore() counts as
+	// resident. The page map tells them apart from our own pages, since those are mapped by us alone.
+	const uint64_t page = getpagesize();
+	const uint64_t pages = aligned_size(size, page) / page;
+	const int fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd == -1) return 0;
+	std::vector<uint64_t> entries(std::min<uint64_t>(pages, 4096));
+	uint64_t resident = 0;
+	for (uint64_t done = 0; done < pages; )
+	{
+		const uint64_t count = std::min<uint64_t>(pages - done, entries.size());
+		const off_t at = ((uintptr_t)clone / page + done) * sizeof(uint64_t);
+		if (pread(fd, entries.data(), count * sizeof(uint64_t), at) != (ssize_t)(count * sizeof(uint64_t))) break;
+		for (uint64_t i = 0; i < count; i++)
 		{
-			usleep(2000);
+			const bool present = entries[i] & (1ull << 63);
+			const bool swapped = entries[i] & (1ull << 62);
+			const bool exclusive = entries[i] & (1ull << 56);
+			if (swapped || (present && exclusive)) resident++;
 		}
+		done += count;
 	}
+	close(fd);
+	return resident * page;
 }
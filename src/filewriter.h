@@ -5,12 +5,176 @@
 #include <thread>
 #include <cstdint>
 #include <list>
+#include <array>
+#include <algorithm>
+#include <vector>
+#include <functional>
 #include <cstring>
 #include <stdio.h>
 
 #include "lavamutex.h"
+#include "file_format.h"
 #include "util.h"
 
+class file_writer;
+
+/// Capture-wide pool of worker threads that compress and write out chunks for all attached file
+/// writers, so that the number of tracer threads does not grow with the number of app threads.
+/// Workers steal the oldest waiting chunk from any writer, and each writer makes sure its chunks
+/// are written to disk in the order they were handed over. Idle workers sleep on a futex until
+/// a writer hands over a chunk. Writers that hand over more than LAVATUBE_INFLIGHT_BUDGET
+/// megabytes that are not yet on disk are made to wait until the pool catches up.
+class compression_pool
+{
+	compression_pool(const compression_pool&) = delete;
+	compression_pool& operator=(const compression_pool&) = delete;
+
+public:
+	compression_pool() {}
+
+	static compression_pool& instance();
+
+	/// Start feeding chunks from this writer to the pool. Launches worker threads if needed.
+	void attach(file_writer* writer);
+
+	/// Stop feeding chunks from this writer. All its work must be done. Stops worker threads when
+	/// the last writer is detached.
+	void detach(file_writer* writer);
+
+	/// Tell the workers that there is new work available. Wake them all if there is more than one job.
+	inline void wake(unsigned jobs = 1)
+	{
+		work_epoch.fetch_add(1);
+		if (sleepers.load() && jobs > 1) work_epoch.notify_all();
+		else if (sleepers.load()) work_epoch.notify_one();
+	}
+
+	/// Number of worker threads we will run while any writer is attached.
+	static unsigned worker_count();
+
+	/// Back-pressure statistics since workers were last launched
+	struct statistics
+	{
+		uint64_t stall_ns = 0; // total time writers spent waiting for the pool to catch up
+		uint64_t stalls = 0; // number of times writers had to wait
+		uint64_t peak_inflight_bytes = 0; // most bytes handed over but not yet written out
+		uint64_t peak_queue_depth = 0; // most chunks any one writer had on their way to disk
+		uint64_t peak_compress_backlog = 0; // most chunks any one writer had waiting for compression
+		uint64_t peak_writeout_backlog = 0; // most compressed chunks any one writer had waiting for writeout
+	};
+	statistics stats() const;
+
+private:
+	friend class file_writer;
+
+	/// Account for bytes handed over by a writer. If this would take us over our in-flight budget, waits
+	/// until enough has been written out, unless the writer has nothing in flight itself.
+	void reserve(const file_writer* writer, uint64_t bytes);
+	/// Account for bytes written out.
+	void release(uint64_t bytes);
+	void record_stall(uint64_t start);
+	void record_depth(const file_writer* writer);
+
+	void worker(); // runs in separate threads, moves chunks from uncompressed to compressed to disk
+	bool run_job(); // returns false if there was no work to be found
+
+	lava::mutex lifecycle_mutex; // serializes attach and detach, held while launching or joining workers
+	lava::mutex mutex;
+	std::vector<file_writer*> writers GUARDED_BY(mutex);
+	unsigned next_writer GUARDED_BY(mutex) = 0; // where to start looking for work, for fairness
+	std::vector<std::thread> threads;
+	std::atomic_bool done { false };
+	/// Bumped whenever work is added, idle workers wait for it to change
+	std::atomic_uint32_t work_epoch { 0 };
+	std::atomic_uint32_t sleepers { 0 };
+	/// Bumped whenever a worker lets go of a writer, detach waits for it to change
+	std::atomic_uint32_t release_epoch { 0 };
+	std::atomic_uint64_t inflight_bytes { 0 };
+	/// Bumped whenever in-flight bytes are written out while writers are waiting on the budget
+	std::atomic_uint32_t budget_epoch { 0 };
+	std::atomic_uint32_t budget_waiters { 0 };
+	std::atomic_uint64_t stall_ns { 0 };
+	std::atomic_uint64_t stalls { 0 };
+	std::atomic_uint64_t peak_inflight_bytes { 0 };
+	std::atomic_uint64_t peak_queue_depth { 0 };
+	std::atomic_uint64_t peak_compress_backlog { 0 };
+	std::atomic_uint64_t peak_writeout_backlog { 0 };
+};
+
+/// Capture-wide cache of idle chunk buffers, both uncompressed and compressed, so that we do not
+/// allocate and fault in fresh memory for every chunk. Holds at most LAVATUBE_CHUNK_POOL_SIZE
+/// megabytes of idle buffers; anything beyond that is freed.
+class chunk_buffer_pool
+{
+	chunk_buffer_pool(const chunk_buffer_pool&) = delete;
+	chunk_buffer_pool& operator=(const chunk_buffer_pool&) = delete;
+
+public:
+	chunk_buffer_pool() {}
+
+	static chunk_buffer_pool& instance();
+
+	/// Get a buffer of the given size, recycled if we have a suitable one. Sets hit if it was recycled.
+	buffer acquire(uint_fast32_t size, bool& hit);
+
+	/// Give back a buffer for reuse. The buffer is emptied.
+	void recycle(buffer& buf);
+
+	/// Free all idle buffers.
+	void trim();
+
+private:
+	/// Never hand out a buffer more than this many times larger than what was asked for
+	static constexpr unsigned max_waste_factor = 2;
+	/// Never keep more than this many idle buffers, so that lookups stay cheap
+	static constexpr unsigned max_idle_buffers = 32;
+	/// Smaller buffers are cheap to allocate, and would only take up room in our idle list
+	static constexpr unsigned min_recycled_size = 4096;
+
+	/// Fault in a freshly allocated buffer up front, so that compressing into it does not take a page fault per page
+	static void prefault(char* ptr, uint64_t size);
+
+	lava::mutex mutex;
+	std::vector<buffer> idle GUARDED_BY(mutex);
+	uint64_t idle_bytes GUARDED_BY(mutex) = 0;
+};
+
+/// One implementation of the host memory diffing used by file_writer::find_patch_start() and file_writer::write_patch().
+/// All implementations must give exactly the same results; they only differ in which CPU features they use.
+struct patch_kernel
+{
+	const char* name;
+	/// Return the first 8-byte word that differs, or the start of the remainder if only that differs, or size when unchanged
+	uint64_t (*find_change)(const char* orig, const char* chng, uint64_t size);
+	/// Copy 8-byte words from chng to orig for as long as they differ, and return the number of bytes copied
+	uint64_t (*copy_change)(char* __restrict__ orig, const char* __restrict__ chng, uint64_t size);
+};
+
+/// One run of changed bytes found by file_writer::diff_patch(), with its offset from the end of the previous run
+struct patch_run
+{
+	uint32_t offset;
+	uint32_t size;
+};
+
+/// Part of a host memory that a scan task diffs, so that tasks on overlapping parts can be kept in order
+struct scan_area
+{
+	unsigned memory; // which memory; areas of different memories never overlap
+	uint64_t first;
+	uint64_t last; // inclusive
+};
+
+/// A part of a stream that is reserved with file_writer::reserve_span() and written later, possibly by another thread
+struct stream_span
+{
+	buffer prefix; // what the owner had in its current chunk when the span was reserved, joined up with the span later
+	std::list<buffer> chunks; // contents, oldest first, set by file_writer::fill_span()
+	uint64_t size = 0; // total size of the contents
+	std::function<void(uint64_t size)> on_written; // called by the owner once the span is part of its stream
+	std::atomic_bool filled { false };
+};
+
 class file_writer
 {
 	file_writer(const file_writer&) = delete;
@@ -24,33 +188,15 @@ class file_writer
 		// move chunk into list of chunks to compress
 		if (holding)
 		{
-			held_chunks.push_front(chunk);
-		}
-		else if (multithreaded_compress)
-		{
-			lava::lock_guard lock(chunk_mutex);
-			uncompressed_chunks.push_front(chunk);
+			held_chunks.push_front({ chunk });
 		}
 		else
 		{
-			buffer compressed = compress_chunk(chunk);
-			if (multithreaded_write)
-			{
-				lava::lock_guard lock(chunk_mutex);
-				compressed_chunks.push_front(compressed);
-			}
-			else write_chunk(compressed);
+			submit_chunk(chunk);
 		}
 
-		// create a new chunk for writing into (we could employ a free list here as a possible optimization)
-		if (size > uncompressed_chunk_size) // make sure our new chunk is big enough
-		{
-			chunk = buffer(size);
-		}
-		else
-		{
-			chunk = buffer(uncompressed_chunk_size);
-		}
+		// get a new chunk for writing into, making sure it is big enough
+		chunk = acquire_buffer(std::max<size_t>(size, uncompressed_chunk_size));
 		uidx = 0;
 	}
 
@@ -162,8 +308,20 @@ public:
 
 	/// Write out diff of memory area. Returns number of bytes written out.
 	uint64_t write_patch(char* __restrict__ orig, const char* __restrict__ chng, uint32_t offset, uint64_t size); // returns bytes changed
+	/// Find what write_patch() would write out, and update the clone, but do not write anything. Safe to call from any
+	/// thread, as long as nobody else touches the same part of the clone. Returns number of bytes changed.
+	static uint64_t diff_patch(char* __restrict__ orig, const char* __restrict__ chng, uint32_t offset, uint64_t size, std::vector<patch_run>& runs);
+	/// Write out a patch found by diff_patch(), exactly as write_patch() would have. orig is the same pointer as given to diff_patch().
+	void write_patch_runs(const char* orig, const std::vector<patch_run>& runs);
 	/// Return the first 8-byte block containing a change, relative to offset, or size when unchanged.
 	static uint64_t find_patch_start(const char* orig, const char* chng, uint64_t offset, uint64_t size);
+	/// Diffing kernels supported by this CPU, with the fastest last
+	static const std::vector<const patch_kernel*>& patch_kernels();
+	/// Diffing kernel used by find_patch_start() and write_patch(), picked the first time it is needed
+	static const patch_kernel& active_patch_kernel();
+	/// Change diffing kernel, only for testing. Not thread safe.
+	static void use_patch_kernel(const patch_kernel& kernel);
+	/// Write out a span of memory as a complete patch, with the given offset and size
 	void write_memory_span(const char* ptr, uint64_t offset, uint64_t size);
 	void write_memory(const char* const ptr, uint64_t offset, uint64_t size);
 
@@ -174,31 +332,25 @@ public:
 
 	void disable_multithreaded_compress()
 	{
-		chunk_mutex.lock();
-		done_compressing.exchange(false);
-		if (compressor_thread.joinable()) compressor_thread.join();
+		wait_for_writeout();
 		multithreaded_compress = false;
-		chunk_mutex.unlock();
 	}
 
 	void disable_multithreaded_writeout()
 	{
-		chunk_mutex.lock();
-		done_feeding.exchange(false);
-		if (serializer_thread.joinable()) serializer_thread.join();
+		wait_for_writeout();
 		multithreaded_write = false;
-		chunk_mutex.unlock();
 	}
 
 	void self_test()
 	{
-		lava::lock_guard lock(chunk_mutex);
-		if (done_compressing.load()) assert(done_feeding.load());
+		assert(chunks_written.load() <= chunks_claimed.load());
+		assert(chunks_claimed.load() <= chunks_submitted.load());
 		if (!holding) assert(held_chunks.size() == 0);
 	}
 
 protected:
-	// these only written to by worker thread until the end when they are read out
+	// these only written to by the thread writing out chunks until the end when they are read out
 	std::vector<uint64_t> compressed_sizes;
 	std::vector<uint64_t> uncompressed_sizes;
 
@@ -206,45 +358,247 @@ public:
 	/// Stop sending packets to compression, useful if you want to keep pointers to written memory to keep working
 	inline void freeze() { if (!holding) holding = true; }
 
-	/// Start compressing packets again, any pointers to written data must now be assumed invalid
+	/// Start compressing packets again, any pointers to written data must now be assumed invalid. If we have
+	/// reserved spans that are not yet filled, we keep holding on to everything from the first of them.
 	inline void thaw()
 	{
 		if (!holding) return;
-		chunk_mutex.lock();
-		uncompressed_chunks.splice(uncompressed_chunks.begin(), held_chunks);
-		chunk_mutex.unlock();
+		while (held_chunks.size()) // oldest chunk is at the back
+		{
+			if (held_chunks.back().span && !take_span(held_chunks.back().span)) return;
+			else if (held_chunks.back().compressed) submit_compressed(held_chunks.back().data);
+			else if (!held_chunks.back().span) submit_chunk(held_chunks.back().data);
+			held_chunks.pop_back();
+		}
 		holding = false;
 	}
 
+	/// Reserve a place in the stream for data that is written later, possibly by another thread, through fill_span().
+	/// Everything written after it is held back until then. Its size is added to uncompressed_bytes once it is in
+	/// the stream, which happens in thaw().
+	stream_span* reserve_span();
+	/// Hand over everything written to this writer so far as the contents of a span reserved by another writer, and
+	/// start over. The span must not be touched afterwards.
+	void fill_span(stream_span* span);
+	/// Make this writer write contents for spans of the given writer, with the same encoding
+	void write_spans_for(const file_writer& owner) { stream_version = owner.stream_version; holding = true; span_writer = true; }
+	/// Number of reserved spans not yet in the stream
+	int count_held_spans() const { return std::count_if(held_chunks.begin(), held_chunks.end(), [](const held_chunk& h) { return h.span != nullptr; }); }
+
 	// These are for test writing
-	int count_held_chunks() { lava::lock_guard lock(chunk_mutex); return held_chunks.size(); }
-	int count_uncompressed_chunks() { lava::lock_guard lock(chunk_mutex); return uncompressed_chunks.size(); }
-	int count_compressed_chunks() { lava::lock_guard lock(chunk_mutex); return compressed_chunks.size(); }
+	int count_held_chunks() { return held_chunks.size(); }
+	int count_uncompressed_chunks() { return chunks_submitted.load() - chunks_claimed.load(); }
+	int count_compressed_chunks() { return chunks_claimed.load() - chunks_written.load(); } // including those being compressed
+	uint64_t count_written_chunks() { return chunks_written.load(); }
+	uint64_t count_pool_hits() const { return pool_hits.load(); } // chunk buffers we got recycled
+	uint64_t count_pool_misses() const { return pool_misses.load(); } // chunk buffers we had to allocate
+	uint64_t count_codec_chunks(uint8_t codec) const { return codec_chunks.at(codec).load(); } // chunks compressed with this algorithm
+	uint64_t count_direct_bytes() const { return direct_bytes; } // bytes compressed straight from the app's memory
 
 	uint64_t uncompressed_bytes = 0; // total amount of uncompressed bytes written so far
 
 private:
-	void compressor(); // runs in separate thread, moves chunks from uncompressed to compressed
-	void serializer(); // runs in separate thread, moves chunks from compressed to disk
+	friend class compression_pool;
+
+	/// Maximum number of chunks that can be on their way to disk at once for each writer
+	static constexpr unsigned chunk_ring_size = 64;
+
+	/// Chunks with a sampled entropy above this many bits per byte are stored uncompressed in adaptive mode,
+	/// and the lower limit applies when we have a compression backlog
+	static constexpr double adaptive_entropy = 7.5;
+	static constexpr double adaptive_backlog_entropy = 6.0;
+	/// Size of the piece of each chunk we trial compress in adaptive mode
+	static constexpr uint64_t trial_size = 16 * 1024;
+	/// Spans at least this big are compressed without copying them first when we compress on the calling thread anyway
+	static constexpr int64_t default_direct_span_size = 1024 * 1024;
+	/// Uncompressed chunks at least this big are padded, so that readers can move the next chunk out of their file mapping
+	static constexpr uint64_t stored_padding_threshold = 64 * stored_chunk_alignment;
+
+	enum chunk_state : uint32_t { CHUNK_EMPTY, CHUNK_UNCOMPRESSED, CHUNK_COMPRESSED };
+
+	/// One entry in our ring of chunks on their way to disk, indexed by chunk sequence number
+	struct chunk_slot
+	{
+		std::atomic<uint32_t> state { CHUNK_EMPTY };
+		buffer data;
+		uint64_t bytes = 0; // size accounted against the in-flight budget
+		/// For sub-block streams, the compressed chunk being assembled by the workers
+		buffer compressed;
+		uint32_t blocks = 0; // number of sub-blocks, or zero if the chunk is compressed as a whole
+		uint8_t codec = LAVATUBE_COMPRESSION_UNCOMPRESSED; // compression algorithm picked for the sub-blocks
+		uint32_t blocks_claimed = 0; // guarded by the pool mutex
+		std::atomic_bool prepared { false }; // codec picked and compressed buffer set up by the worker that claimed the first sub-block
+		std::atomic_uint32_t blocks_done { 0 };
+	};
+
+	enum class pool_job { none, compress, write };
+
+	/// Chunk held back from compression, or a reserved span
+	struct held_chunk
+	{
+		buffer data;
+		stream_span* span = nullptr;
+		bool compressed = false; // already compressed by write_direct(), only waiting for its turn to be written out
+	};
+
+	void submit_chunk(buffer& uncompressed); // hand over a full chunk for compression and writeout
+	void submit_compressed(buffer& compressed); // hand over an already compressed chunk for writeout
+	void write_direct(const char* data, uint64_t size); // compress a span into chunks of its own, without copying it first
+	/// Whether a memory span is big enough to compress directly from where it is, rather than copying it into our chunk
+	inline bool direct_span(uint64_t size) const
+	{
+		const int64_t threshold = (p__direct_span_size >= 0) ? p__direct_span_size : (multithreaded_compress ? 0 : default_direct_span_size);
+		return !span_writer && threshold > 0 && size >= (uint64_t)threshold; // spans are handed over uncompressed
+	}
+	void publish_chunk(buffer& data, chunk_state state); // put chunk in our ring
+	bool take_span(stream_span* span); // put a filled span into our stream, returns false if it is not yet filled
+	pool_job take_job(uint64_t& sequence, uint32_t& block); // called from compression pool with pool mutex held
+	void compress_job(uint64_t sequence, uint32_t block); // called from compression pool to compress a claimed chunk or sub-block
+	void write_out(); // write out all chunks that are next in line, if nobody else is doing it
+	void wait_for_writeout(); // wait until all chunks handed over have been written to disk
 	buffer compress_chunk(buffer& uncompressed); // returns compressed buffer
+	buffer compress_span(const char* data, uint64_t size); // returns compressed buffer, leaves the input alone
+	uint64_t compress_bound(uint8_t codec, uint64_t size) const; // worst case compressed size
+	uint64_t compress_block(uint8_t codec, const char* source, uint64_t size, char* destination, uint64_t capacity); // returns compressed size
+	uint8_t select_codec(const char* data, uint64_t size); // pick compression algorithm for a chunk
+	inline uint64_t chunk_tag_size() const { return (stream_version >= LAVATUBE_STREAM_VERSION_TAGGED) ? sizeof(chunk_tag) : 0; }
+	void write_chunk_tag(buffer& compressed, uint8_t codec, uint8_t layout) const; // only for tagged streams
+	buffer begin_subblocks(uint64_t size, uint8_t codec); // returns buffer with room for all sub-blocks
+	void compress_subblock(buffer& compressed, const char* data, uint64_t size, uint32_t block, uint8_t codec);
+	void finish_subblocks(buffer& compressed, uint64_t size, uint8_t codec); // pack sub-blocks together and fill in chunk header
+	void store_chunk(buffer& compressed); // write out compressed chunk and record its sizes
+	uint64_t stored_padding(const buffer& compressed) const; // bytes to pad a chunk with, see stored_chunk_alignment
 	void write_chunk(buffer& active);
+	buffer acquire_buffer(uint_fast32_t size); // get a chunk buffer from the shared buffer pool
+	void write_patch_run(uint32_t offset, const char* data, uint32_t size); // one run of changed bytes of a patch
+	void write_patch_span(uint32_t offset, const char* data, uint64_t size); // encode as patch records, only for patch opcode streams
+	void write_patch_record(uint32_t offset, uint32_t opcode, uint32_t size, const char* payload, uint32_t payload_size);
 
 	int mTid = -1; // only used for logging
+	uint8_t stream_version = LAVATUBE_STREAM_VERSION_CHUNKED;
+	uint32_t subblock_size = 0; // uncompressed size of each sub-block, if we write a sub-block stream
+	bool adaptive_codec = false; // pick compression algorithm for each chunk
 	bool multithreaded_compress = true;
 	bool multithreaded_write = true;
 	bool holding = false;
-	lava::mutex chunk_mutex;
+	bool span_writer = false; // writes contents for spans of another writer, see write_spans_for()
+	bool attached = false; // whether we are feeding the compression pool
 	FILE* fp = nullptr;
+	// only touched by the thread writing out chunks
+	uint64_t file_bytes = 0; // bytes written to our file so far
+	uint64_t stream_start = 0; // file offset of our first chunk
+	uint64_t stored_bytes = 0; // uncompressed bytes in the chunks written so far
 	size_t uncompressed_chunk_size = 1024 * 1024 * 64; // use 64mb chunks by default
 	unsigned uidx = 0; // index into current uncompressed chunk
 	buffer chunk; // current uncompressed chunk
-	/// the first chunk in this list is current, the rest are waiting for compression
-	std::list<buffer> held_chunks;
-	std::list<buffer> uncompressed_chunks GUARDED_BY(chunk_mutex);
-	std::list<buffer> compressed_chunks GUARDED_BY(chunk_mutex);
-	std::atomic_bool done_feeding;
-	std::atomic_bool done_compressing;
+	/// chunks and reserved spans held back from compression, newest first
+	std::list<held_chunk> held_chunks;
+	/// Single producer, multiple consumer ring of chunks on their way to disk. Only the owning thread
+	/// adds chunks, any pool worker may claim one for compression, and only the worker holding the
+	/// writing flag may write them out.
+	std::array<chunk_slot, chunk_ring_size> chunk_ring;
+	std::atomic_uint64_t chunks_submitted { 0 }; // also the sequence number of the next chunk
+	std::atomic_uint64_t chunks_claimed { 0 }; // also the sequence number of the next chunk to compress
+	std::atomic_uint64_t chunks_compressed { 0 }; // counted before they are marked as compressed
+	std::atomic_uint64_t chunks_written { 0 }; // also the sequence number of the next chunk to write
+	std::atomic_bool writing { false }; // someone is currently writing out our chunks
+	unsigned pool_users = 0; // number of pool workers working on our chunks, guarded by the pool mutex
+	std::atomic_uint64_t pool_hits { 0 };
+	std::atomic_uint64_t pool_misses { 0 };
+	std::array<std::atomic_uint64_t, LAVATUBE_COMPRESSION_LZ4 + 1> codec_chunks {};
+	uint64_t direct_bytes = 0;
 	std::string mFilename;
-	std::thread compressor_thread;
-	std::thread serializer_thread;
 };
+
+/// Small fork-join pool for diffing host memory on several threads at once. The calling thread takes part too.
+class patch_scan_pool
+{
+	patch_scan_pool(const patch_scan_pool&) = delete;
+	patch_scan_pool& operator=(const patch_scan_pool&) = delete;
+
+public:
+	patch_scan_pool() {}
+	~patch_scan_pool();
+
+	/// Run fn(0) to fn(tasks - 1) spread over the pool, and return when all are done. Launches worker threads
+	/// the first time it is needed. If another thread is already running tasks on the pool, the calling
+	/// thread runs all of its tasks by itself instead of waiting.
+	void run(unsigned tasks, const std::function<void(unsigned)>& fn);
+
+	/// Run fn(i) for each area spread over the pool. Tasks whose areas overlap are run one after another on the same
+	/// thread in the order given, since each must see the clone as the ones before it left it. This gives the same
+	/// result as running them all in order.
+	void run_grouped(const std::vector<scan_area>& areas, const std::function<void(unsigned)>& fn);
+
+	/// Number of threads taking part in each run, including the caller
+	static unsigned thread_count();
+
+private:
+	void worker();
+	void work(); // take tasks until there are none left
+
+	lava::mutex busy; // held by the thread currently running tasks on the pool
+	lava::mutex mutex;
+	const std::function<void(unsigned)>* job GUARDED_BY(mutex) = nullptr;
+	unsigned next_task GUARDED_BY(mutex) = 0;
+	unsigned task_count GUARDED_BY(mutex) = 0;
+	std::atomic_uint32_t pending { 0 }; // tasks not yet done in the current run
+	std::atomic_uint32_t epoch { 0 }; // bumped for every run, idle workers wait for it to change
+	std::atomic_bool done { false };
+	std::vector<std::thread> threads;
+};
+
+/// Background thread that writes out work handed over by tracer threads into stream spans that they reserved with
+/// file_writer::reserve_span(), one job at a time in the order they were handed over. Threads that hand over work
+/// while more than their budget of bytes is still waiting for us are made to wait until we catch up.
+class span_worker
+{
+	span_worker(const span_worker&) = delete;
+	span_worker& operator=(const span_worker&) = delete;
+
+public:
+	span_worker() {}
+	~span_worker();
+
+	/// Call fn on our thread with a writer that writes into the given span of the owner, then fill the span with it.
+	/// The bytes are only used for the budget. Launches the worker thread the first time it is needed.
+	void run(const file_writer& owner, stream_span* span, uint64_t bytes, uint64_t budget, std::function<void(file_writer&)>&& fn);
+
+	/// Wait until all work handed over so far is done
+	void drain();
+
+	// statistics
+	std::atomic_uint64_t jobs { 0 };
+	std::atomic_uint64_t stalls { 0 }; // number of times threads had to wait for us to catch up
+	std::atomic_uint64_t stall_ns { 0 }; // total time spent waiting for that
+
+private:
+	struct job
+	{
+		const file_writer* owner;
+		stream_span* span;
+		uint64_t bytes;
+		std::function<void(file_writer&)> fn;
+	};
+
+	void worker();
+
+	lava::mutex mutex;
+	std::list<job> queue GUARDED_BY(mutex);
+	std::thread thread GUARDED_BY(mutex);
+	std::atomic_uint32_t epoch { 0 }; // bumped whenever work is added, the idle worker waits for it to change
+	std::atomic_uint32_t pending { 0 }; // jobs handed over and not yet done
+	std::atomic_uint64_t inflight_bytes { 0 };
+	std::atomic_bool done { false };
+};
+
+/// Our copies of host visible device memory, used to find what the app changed. Only address space is reserved up
+/// front, so a big allocation that the app barely touches does not double its memory use. Pages that were never
+/// written read as zero.
+char* clone_alloc(uint64_t size);
+void clone_free(char* clone, uint64_t size);
+/// Commit the pages under part of a clone that we are about to update in one go, instead of taking a page fault for
+/// each of them in the middle of diffing. Small ranges are left to fault in on their own.
+void clone_commit(char* ptr, uint64_t size);
+/// How many bytes of a clone are actually backed by memory
+uint64_t clone_resident(const char* clone, uint64_t size);
@@ -256,11 +256,11 @@ static void prepare_import_binding(trackedobject* object_data, trackedmemory* me
 	object_data->memory_flags = memory_data->propertyFlags;
 }
 
-static void finish_import_binding(trackedobject* object_data, trackedmemory* memory_data, VkDeviceMemory memory,
+static void finish_import_binding(trackedobject* object_data, trackedmemory_trace* memory_data, VkDeviceMemory memory,
 	VkDeviceSize memory_offset)
 {
 	lava_writer& writer = lava_writer::instance();
-	lava::lock_guard guard(writer.memory_mutex);
+	writer.lock_memory(memory_data);
 	object_data->backing = memory;
 	object_data->offset = memory_offset;
 	object_data->accessible = (memory_data->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
@@ -284,6 +284,7 @@ static void finish_import_binding(trackedobject* object_data, trackedmemory* mem
 			overlap_start - memory_offset, update.data.data() + overlap_start - update.offset,
 			overlap_end - overlap_start, nullptr);
 	}
+	writer.unlock_memory(memory_data);
 }
 
 static VkResult VKAPI_CALL import_vkBindBufferMemory(VkDevice device, VkBuffer buffer, VkDeviceMemory memory,
@@ -291,7 +292,7 @@ static VkResult VKAPI_CALL import_vkBindBufferMemory(VkDevice device, VkBuffer b
 {
 	lava_writer& writer = lava_writer::instance();
 	trackedbuffer* object_data = writer.records.VkBuffer_index.at(buffer);
-	trackedmemory* memory_data = writer.records.VkDeviceMemory_index.at(memory);
+	trackedmemory_trace* memory_data = writer.records.VkDeviceMemory_index.at(memory);
 	if (writer.file_writer().use_result.result == VK_SUCCESS) prepare_import_binding(object_data, memory_data, memoryOffset);
 	const VkResult result = trace_vkBindBufferMemory(device, buffer, memory, memoryOffset);
 	if (result == VK_SUCCESS) finish_import_binding(object_data, memory_data, memory, memoryOffset);
@@ -303,7 +304,7 @@ static VkResult VKAPI_CALL import_vkBindImageMemory(VkDevice device, VkImage ima
 {
 	lava_writer& writer = lava_writer::instance();
 	trackedimage* object_data = writer.records.VkImage_index.at(image);
-	trackedmemory* memory_data = writer.records.VkDeviceMemory_index.at(memory);
+	trackedmemory_trace* memory_data = writer.records.VkDeviceMemory_index.at(memory);
 	if (writer.file_writer().use_result.result == VK_SUCCESS) prepare_import_binding(object_data, memory_data, memoryOffset);
 	const VkResult result = trace_vkBindImageMemory(device, image, memory, memoryOffset);
 	if (result == VK_SUCCESS) finish_import_binding(object_data, memory_data, memory, memoryOffset);
@@ -427,7 +428,7 @@ static void import_memory_update(void* user_data, const VulkanMemoryUpdate& upda
 		DIE("Invalid gfxreconstruct memory update at block %lu", (unsigned long)update.block_index);
 	}
 	lava_writer& writer = lava_writer::instance();
-	trackedmemory* memory_data = writer.records.VkDeviceMemory_index.at(update.memory);
+	trackedmemory_trace* memory_data = writer.records.VkDeviceMemory_index.at(update.memory);
 	const uint64_t relation_id = reinterpret_cast<uintptr_t>(update.memory);
 	if ((memory_data->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) == 0)
 	{
@@ -447,7 +448,7 @@ static void import_memory_update(void* user_data, const VulkanMemoryUpdate& upda
 			(unsigned long)update.memory_offset, (unsigned long)update.data_size);
 	}
 
-	lava::lock_guard guard(writer.memory_mutex);
+	writer.lock_memory(memory_data);
 	const uint64_t update_start = update.memory_offset;
 	const uint64_t update_end = update_start + update.data_size;
 	uint32_t emitted = 0;
@@ -526,6 +527,7 @@ static void import_memory_update(void* user_data, const VulkanMemoryUpdate& upda
 		DLOG2("Retained gfxreconstruct memory update at block %lu until a resource is bound",
 			(unsigned long)update.block_index);
 	}
+	writer.unlock_memory(memory_data);
 }
 
 static void import_device_address_fixups(void* user_data, const VulkanDeviceAddressFixups& fixups)
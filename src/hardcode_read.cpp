@@ -1151,6 +1151,7 @@ static bool is_known_replay_as_address(VkDeviceAddress address)
 static void replay_cli_publish_object_wait(lava_file_reader& reader, cli_thread_state state, VkObjectType object_type, uint32_t object_index,
 	uint32_t aux_index = CONTAINER_INVALID_INDEX)
 {
+	reader.gpu_wait_start = gettime();
 	if (!reader.parent || !reader.parent->cli_service.load(std::memory_order_acquire)) return;
 	reader.cli_wait_thread.store(-1, std::memory_order_relaxed);
 	reader.cli_wait_packet.store(UINT32_MAX, std::memory_order_relaxed);
@@ -1162,6 +1163,11 @@ static void replay_cli_publish_object_wait(lava_file_reader& reader, cli_thread_
 
 static void replay_cli_clear_object_wait(lava_file_reader& reader, cli_thread_state state)
 {
+	if (reader.gpu_wait_start)
+	{
+		reader.gpu_waits.add(gettime() - reader.gpu_wait_start);
+		reader.gpu_wait_start = 0;
+	}
 	if (!reader.parent || !reader.parent->cli_service.load(std::memory_order_acquire)) return;
 	if (reader.cli_state.load(std::memory_order_acquire) != state) return;
 	reader.cli_wait_object_type.store(VK_OBJECT_TYPE_UNKNOWN, std::memory_order_relaxed);
@@ -22,6 +22,10 @@ static std::vector<VkExtensionProperties> instance_extension_properties GUARDED_
 // any memory type, since they may be highly specialized, but we can split them.
 static VkPhysicalDeviceMemoryProperties virtual_memory_properties GUARDED_BY(frame_mutex) = {};
 static uint32_t remap_memory_types_to_real[VK_MAX_MEMORY_TYPES] GUARDED_BY(frame_mutex);
+// With LAVATUBE_CACHED_MEMORY, host visible memory that the CPU reads slowly is instead allocated
+// from a compatible host cached memory type while capturing, since we read all of it a lot when
+// looking for changes. The app still sees, and the trace still stores, the memory type it asked for.
+static uint32_t backing_memory_types[VK_MAX_MEMORY_TYPES] GUARDED_BY(frame_mutex);
 
 #ifndef VK_ANDROID_FRAME_BOUNDARY_EXTENSION_NAME
 #define VK_ANDROID_FRAME_BOUNDARY_EXTENSION_NAME "VK_ANDROID_frame_boundary"
@@ -345,37 +349,64 @@ static void trace_post_vkGetPhysicalDeviceSurfaceCapabilitiesKHR(lava_file_write
 	}
 }
 
-static void extend_bits(VkMemoryRequirements* pMemoryRequirements)
+/// Translate the real memory type bits to our presented memory types. A presented type is supported
+/// only if both the real type it stands for and the real type we back it with are supported.
+static void translate_memory_type_bits(VkMemoryRequirements* pMemoryRequirements, const char* object_type, uint32_t create_flags)
 {
 	frame_mutex.lock();
 	assert(virtual_memory_properties.memoryTypeCount > 0);
-	// extend the bits with our virtual memory types
-	for (uint32_t i = real_memory_properties.memoryTypeCount; i < virtual_memory_properties.memoryTypeCount; i++)
+	const uint32_t real_bits = pMemoryRequirements->memoryTypeBits;
+	uint32_t bits = 0;
+	for (uint32_t i = 0; i < virtual_memory_properties.memoryTypeCount; i++)
 	{
-		if ((1 << remap_memory_types_to_real[i]) & pMemoryRequirements->memoryTypeBits) // is supported?
-		{
-			pMemoryRequirements->memoryTypeBits |= 1 << i; // yes, set
-		}
-		else
+		const uint32_t requested = 1u << remap_memory_types_to_real[i];
+		const uint32_t backing = 1u << backing_memory_types[i];
+		if ((real_bits & requested) && (real_bits & backing)) bits |= 1u << i;
+	}
+	if (real_bits != 0 && bits == 0)
+	{
+		for (uint32_t i = 0; i < virtual_memory_properties.memoryTypeCount; i++)
 		{
-			pMemoryRequirements->memoryTypeBits &= ~(1 << i); // no, clear
+			ELOG("\tmemory type %u -> real type %u backed by real type %u", i, remap_memory_types_to_real[i], backing_memory_types[i]);
 		}
+		ABORT("No memory type left for %s (flags=%u memoryTypeBits=%u) after backing memory types with host cached memory, try without LAVATUBE_CACHED_MEMORY",
+		      object_type, create_flags, real_bits);
 	}
+	pMemoryRequirements->memoryTypeBits = bits;
 	frame_mutex.unlock();
 }
 
+/// Which real memory type to allocate from. Special allocations that we have not validated with a
+/// host cached backing use the real memory type the app asked for, which also supports the object.
+static uint32_t backing_memory_type(const VkMemoryAllocateInfo* pAllocateInfo) REQUIRES(frame_mutex)
+{
+	const uint32_t index = pAllocateInfo->memoryTypeIndex;
+	const uint32_t real = remap_memory_types_to_real[index];
+	if (backing_memory_types[index] == real) return real;
+	if (p__external_memory || find_extension(pAllocateInfo, VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO)
+	    || find_extension(pAllocateInfo, VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT)
+	    || find_extension(pAllocateInfo, VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR)
+	    || find_extension(pAllocateInfo, VK_STRUCTURE_TYPE_IMPORT_ANDROID_HARDWARE_BUFFER_INFO_ANDROID)
+	    || find_extension(pAllocateInfo, VK_STRUCTURE_TYPE_IMPORT_MEMORY_WIN32_HANDLE_INFO_KHR))
+	{
+		WLOG("Not backing imported or exported memory of memory type %u with host cached memory", index);
+		return real;
+	}
+	return backing_memory_types[index];
+}
+
 static void trace_post_vkGetBufferMemoryRequirements(lava_file_writer& writer, VkDevice device, VkBuffer buffer, VkMemoryRequirements* pMemoryRequirements)
 {
 	auto* buffer_data = writer.parent->records.VkBuffer_index.at(buffer);
 	buffer_data->req = *pMemoryRequirements; // if this is not set here, we'll request this info explicitly on bind
-	extend_bits(pMemoryRequirements);
+	translate_memory_type_bits(pMemoryRequirements, "VkBuffer", buffer_data->flags);
 }
 
 static void trace_post_vkGetImageMemoryRequirements(lava_file_writer& writer, VkDevice device, VkImage image, VkMemoryRequirements* pMemoryRequirements)
 {
 	auto* image_data = writer.parent->records.VkImage_index.at(image);
 	image_data->req = *pMemoryRequirements; // if this is not set here, we'll request this info explicitly on bind
-	extend_bits(pMemoryRequirements);
+	translate_memory_type_bits(pMemoryRequirements, "VkImage", image_data->flags);
 }
 
 static void inject_dedicated_allocation(lava_file_writer& writer, VkBaseOutStructure* pMemoryRequirements, bool image)
@@ -430,7 +461,7 @@ static void trace_post_vkGetImageMemoryRequirements2KHR(lava_file_writer& writer
 static void trace_post_vkGetDeviceBufferMemoryRequirements(lava_file_writer& writer, VkDevice device, const VkDeviceBufferMemoryRequirements* pInfo, VkMemoryRequirements2* pMemoryRequirements)
 {
 	inject_dedicated_allocation(writer, (VkBaseOutStructure*)pMemoryRequirements, false);
-	extend_bits(&pMemoryRequirements->memoryRequirements);
+	translate_memory_type_bits(&pMemoryRequirements->memoryRequirements, "VkBuffer", pInfo->pCreateInfo->flags);
 }
 
 static void trace_post_vkGetDeviceBufferMemoryRequirementsKHR(lava_file_writer& writer, VkDevice device, const VkDeviceBufferMemoryRequirements* pInfo, VkMemoryRequirements2* pMemoryRequirements)
@@ -441,7 +472,7 @@ static void trace_post_vkGetDeviceBufferMemoryRequirementsKHR(lava_file_writer&
 static void trace_post_vkGetDeviceImageMemoryRequirements(lava_file_writer& writer, VkDevice device, const VkDeviceImageMemoryRequirements* pInfo, VkMemoryRequirements2* pMemoryRequirements)
 {
 	inject_dedicated_allocation(writer, (VkBaseOutStructure*)pMemoryRequirements, true);
-	extend_bits(&pMemoryRequirements->memoryRequirements);
+	translate_memory_type_bits(&pMemoryRequirements->memoryRequirements, "VkImage", pInfo->pCreateInfo->flags);
 }
 
 static void trace_post_vkGetDeviceImageMemoryRequirementsKHR(lava_file_writer& writer, VkDevice device, const VkDeviceImageMemoryRequirements* pInfo, VkMemoryRequirements2* pMemoryRequirements)
@@ -466,11 +497,11 @@ static void trace_post_vkGetDeviceImageSparseMemoryRequirementsKHR(lava_file_wri
 
 static void trace_post_vkBindImageMemory(lava_file_writer& writer, VkResult result, VkDevice device, VkImage image, VkDeviceMemory memory, VkDeviceSize memoryOffset)
 {
-	writer.parent->memory_mutex.lock();
 	assert(memory != VK_NULL_HANDLE);
 	assert(result == VK_SUCCESS);
 	auto* image_data = writer.parent->records.VkImage_index.at(image);
 	auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(memory);
+	writer.parent->lock_memory(memory_data);
 	assert(image_data->backing == 0); // cannot re-bind
 	image_data->backing = memory;
 	image_data->offset = memoryOffset;
@@ -482,16 +513,16 @@ static void trace_post_vkBindImageMemory(lava_file_writer& writer, VkResult resu
 	image_data->accessible = ((image_data->tiling != TILING_OPTIMAL) && (memory_data->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT));
 	memory_data->bind(image_data);
 	image_data->enter_bound();
-	writer.parent->memory_mutex.unlock();
+	writer.parent->unlock_memory(memory_data);
 }
 
 static void trace_post_vkBindBufferMemory(lava_file_writer& writer, VkResult result, VkDevice device, VkBuffer buffer, VkDeviceMemory memory, VkDeviceSize memoryOffset)
 {
-	writer.parent->memory_mutex.lock();
 	assert(memory != VK_NULL_HANDLE);
 	assert(result == VK_SUCCESS);
 	auto* buffer_data = writer.parent->records.VkBuffer_index.at(buffer);
 	auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(memory);
+	writer.parent->lock_memory(memory_data);
 	assert(buffer_data->backing == 0); // cannot re-bind
 	buffer_data->backing = memory;
 	buffer_data->offset = memoryOffset;
@@ -504,7 +535,7 @@ static void trace_post_vkBindBufferMemory(lava_file_writer& writer, VkResult res
 	buffer_data->accessible = (memory_data->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
 	memory_data->bind(buffer_data);
 	buffer_data->enter_bound();
-	writer.parent->memory_mutex.unlock();
+	writer.parent->unlock_memory(memory_data);
 }
 
 static void trace_post_vkBindImageMemory2(lava_file_writer& writer, VkResult result, VkDevice device, uint32_t bindInfoCount, const VkBindImageMemoryInfo* pBindInfos)
@@ -540,12 +571,12 @@ static void trace_post_vkGetTensorMemoryRequirementsARM(lava_file_writer& writer
 	auto* tensor_data = writer.parent->records.VkTensorARM_index.at(pInfo->tensor);
 	tensor_data->req = pMemoryRequirements->memoryRequirements;
 	tensor_data->size = pMemoryRequirements->memoryRequirements.size;
-	extend_bits(&pMemoryRequirements->memoryRequirements);
+	translate_memory_type_bits(&pMemoryRequirements->memoryRequirements, "VkTensorARM", 0);
 }
 
 static void trace_post_vkGetDeviceTensorMemoryRequirementsARM(lava_file_writer& writer, VkDevice device, const VkDeviceTensorMemoryRequirementsARM* pInfo, VkMemoryRequirements2* pMemoryRequirements)
 {
-	extend_bits(&pMemoryRequirements->memoryRequirements);
+	translate_memory_type_bits(&pMemoryRequirements->memoryRequirements, "VkTensorARM", pInfo->pCreateInfo->flags);
 }
 
 static void trace_post_vkGetDataGraphPipelineSessionMemoryRequirementsARM(lava_file_writer& writer, VkDevice device,
@@ -559,11 +590,11 @@ static void trace_post_vkGetDataGraphPipelineSessionMemoryRequirementsARM(lava_f
 static void trace_post_vkBindTensorMemoryARM(lava_file_writer& writer, VkResult result, VkDevice device, uint32_t bindInfoCount, const VkBindTensorMemoryInfoARM* pBindInfos)
 {
 	if (result != VK_SUCCESS) return;
-	writer.parent->memory_mutex.lock();
 	for (unsigned i = 0; i < bindInfoCount; i++)
 	{
 		auto* tensor_data = writer.parent->records.VkTensorARM_index.at(pBindInfos[i].tensor);
 		auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(pBindInfos[i].memory);
+		writer.parent->lock_memory(memory_data);
 		assert(tensor_data->backing == 0); // cannot re-bind
 		tensor_data->backing = pBindInfos[i].memory;
 		tensor_data->offset = pBindInfos[i].memoryOffset;
@@ -578,19 +609,19 @@ static void trace_post_vkBindTensorMemoryARM(lava_file_writer& writer, VkResult
 		tensor_data->size = tensor_data->req.size;
 		memory_data->bind(tensor_data);
 		tensor_data->enter_bound();
+		writer.parent->unlock_memory(memory_data);
 	}
-	writer.parent->memory_mutex.unlock();
 }
 
 static void trace_post_vkBindDataGraphPipelineSessionMemoryARM(lava_file_writer& writer, VkResult result, VkDevice device, uint32_t bindInfoCount,
 	const VkBindDataGraphPipelineSessionMemoryInfoARM* pBindInfos)
 {
 	if (result != VK_SUCCESS) return;
-	writer.parent->memory_mutex.lock();
 	for (unsigned i = 0; i < bindInfoCount; i++)
 	{
 		auto* session_data = writer.parent->records.VkDataGraphPipelineSessionARM_index.at(pBindInfos[i].session);
 		auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(pBindInfos[i].memory);
+		writer.parent->lock_memory(memory_data);
 		auto& binding = session_data->get_binding(pBindInfos[i].bindPoint, pBindInfos[i].objectIndex);
 		binding.memory_flags = memory_data->propertyFlags;
 		binding.backing = pBindInfos[i].memory;
@@ -605,8 +636,8 @@ static void trace_post_vkBindDataGraphPipelineSessionMemoryARM(lava_file_writer&
 			wrap_vkGetDataGraphPipelineSessionMemoryRequirementsARM(device, &info, &req);
 			copy_recorded_memory_requirements(binding.reqs, &req);
 		}
+		writer.parent->unlock_memory(memory_data);
 	}
-	writer.parent->memory_mutex.unlock();
 }
 
 static void trace_post_vkCmdBindDescriptorSets(lava_file_writer& writer,
@@ -1067,14 +1098,7 @@ static void handle_descriptor_update_template(lava_file_writer& writer, VkDescri
 
 static void merge_descriptor_touched(trackeddescriptorset_trace* dst, const trackeddescriptorset_trace* src)
 {
-	for (const auto& pair : src->touched)
-	{
-		if (dst->touched.count(pair.first) > 0)
-		{
-			for (const auto& r : pair.second.list()) dst->touched[pair.first].add(r.first, r.last);
-		}
-		else dst->touched[pair.first] = pair.second;
-	}
+	dst->touched.merge(src->touched);
 }
 
 static void handle_VkCopyDescriptorSets(lava_file_writer& writer, uint32_t descriptorCopyCount, const VkCopyDescriptorSet* pDescriptorCopies)
@@ -1607,14 +1631,25 @@ static void touch_all_address_taken_buffers(lava_file_writer& writer, trackedcmd
 	}
 }
 
-// combine all updates for each memory into one update list for each device memory object, so we keep the number of map operations to a minimum
-static void queue_update(lava_file_writer& writer, trackedqueue* t, VkCommandBuffer cmdbuf, std::unordered_map<VkDeviceMemory, range>& ranges_by_memory, std::unordered_set<trackedcmdbuffer_trace*>& cmdbufs)
+// find all device memory objects that a command buffer uses, so that we can lock them before looking at them
+static void queue_memories(lava_file_writer& writer, VkCommandBuffer cmdbuf, std::vector<trackedmemory_trace*>& memories)
 {
 	auto* cmdbuf_data = writer.parent->records.VkCommandBuffer_index.at(cmdbuf);
 	if (cmdbuf_data->uses_device_address_shader)
 	{
 		touch_all_address_taken_buffers(writer, cmdbuf_data);
 	}
+	for (const auto& pair : cmdbuf_data->touched)
+	{
+		if (pair.first->backing == VK_NULL_HANDLE) continue;
+		memories.push_back(writer.parent->records.VkDeviceMemory_index.at(pair.first->backing));
+	}
+}
+
+// combine all updates for each memory into one update list for each device memory object, so we keep the number of map operations to a minimum
+static void queue_update(lava_file_writer& writer, trackedqueue* t, VkCommandBuffer cmdbuf, std::unordered_map<VkDeviceMemory, range>& ranges_by_memory, std::unordered_set<trackedcmdbuffer_trace*>& cmdbufs)
+{
+	auto* cmdbuf_data = writer.parent->records.VkCommandBuffer_index.at(cmdbuf);
 
 	// find span of all device memory objects used
 	for (const auto& pair : cmdbuf_data->touched)
@@ -1641,32 +1676,68 @@ static void queue_update(lava_file_writer& writer, trackedqueue* t, VkCommandBuf
 	}
 }
 
-static void begin_object_update_packet(lava_file_writer& writer, const trackeddevice* device_data, trackedobject* object_data,
-	VkMarkedOffsetsARM* ar, uint64_t*& sizeptr, uint64_t& payload_start)
+static uint8_t update_packet_type(const trackedobject* object_data)
 {
 	switch (object_data->object_type)
 	{
-	case VK_OBJECT_TYPE_IMAGE: writer.begin_packet(PACKET_IMAGE_UPDATE2); break;
-	case VK_OBJECT_TYPE_BUFFER: writer.begin_packet(PACKET_BUFFER_UPDATE2); break;
-	case VK_OBJECT_TYPE_TENSOR_ARM: writer.begin_packet(PACKET_TENSOR_UPDATE); break;
-	default: assert(false); break;
+	case VK_OBJECT_TYPE_IMAGE: return PACKET_IMAGE_UPDATE2;
+	case VK_OBJECT_TYPE_BUFFER: return PACKET_BUFFER_UPDATE2;
+	case VK_OBJECT_TYPE_TENSOR_ARM: return PACKET_TENSOR_UPDATE;
+	default: assert(false); return PACKET_BUFFER_UPDATE2;
 	}
-	writer.write_handle(device_data);
-	writer.write_handle(object_data);
-	sizeptr = writer.write_later_uint64_t(); // this locks the write chunks
-	payload_start = writer.uncompressed_bytes;
+}
+
+/// A handle as lava_file_writer::write_handle() would write it, taken when the packet is reserved or begun
+struct captured_handle
+{
+	uint32_t index;
+	int8_t thread;
+	uint32_t packet;
+
+	captured_handle(const trackable* t) : index(t->index), thread(t->last_modified.thread), packet(t->last_modified.packet)
+	{
+		assert(!t->is_state(trackable::states::uninitialized) && !t->is_state(trackable::states::destroyed));
+	}
+	void write(file_writer& out) const { out.write_uint32_t(index); out.write_int8_t(thread); out.write_uint32_t(packet); }
+};
+
+/// Layout of an object update packet after its packet type and size. The deferred diff worker writes these packets
+/// too, without a lava_file_writer, so this is the only place that may know what goes where.
+struct object_update_layout
+{
+	uint64_t* sizeptr = nullptr; // where the payload size goes once we know it
+	uint64_t payload_start = 0;
+
+	void begin(file_writer& out, const captured_handle& device, const captured_handle& object, uint16_t flags)
+	{
+		device.write(out);
+		object.write(out);
+		sizeptr = out.write_later_uint64_t(); // this locks the write chunks
+		payload_start = out.uncompressed_bytes;
+		out.write_uint16_t(flags);
+	}
+
+	void end(file_writer& out)
+	{
+		*sizeptr = out.uncompressed_bytes - payload_start; // includes size of flags and anything beyond until the end of our packet
+	}
+};
+
+static void begin_object_update_packet(lava_file_writer& writer, const trackeddevice* device_data, trackedobject* object_data,
+	VkMarkedOffsetsARM* ar, object_update_layout& layout)
+{
+	writer.begin_packet(update_packet_type(object_data));
 	uint16_t flags = 0;
 	if (ar) flags |= PACKET_FLAG_HAS_PNEXT;
-	writer.write_uint16_t(flags);
+	layout.begin(writer, device_data, object_data, flags);
 	if (ar) write_extension(writer, (VkBaseOutStructure*)ar);
 }
 
-static void end_object_update_packet(lava_file_writer& writer, trackedobject* object_data, uint64_t* sizeptr,
-	uint64_t payload_start, uint64_t written)
+static void end_object_update_packet(lava_file_writer& writer, trackedobject* object_data, object_update_layout& layout, uint64_t written)
 {
 	object_data->updates++;
 	object_data->written += written;
-	*sizeptr = writer.uncompressed_bytes - payload_start; // includes size of flags and anything beyond until the end of our packet
+	layout.end(writer);
 	writer.end_packet();
 }
 
@@ -1680,11 +1751,10 @@ uint64_t write_object_update_packet(lava_file_writer& writer, const trackeddevic
 	assert(size <= object_data->size - offset);
 	if (size == 0) return 0;
 
-	uint64_t* sizeptr = nullptr;
-	uint64_t payload_start = 0;
-	begin_object_update_packet(writer, device_data, object_data, markings, sizeptr, payload_start);
+	object_update_layout layout;
+	begin_object_update_packet(writer, device_data, object_data, markings, layout);
 	writer.write_memory_span(data, offset, size);
-	end_object_update_packet(writer, object_data, sizeptr, payload_start, size);
+	end_object_update_packet(writer, object_data, layout, size);
 	return size;
 }
 
@@ -1698,21 +1768,204 @@ static uint64_t write_out_object(lava_file_writer& writer, const auto* device_da
 	offset += patch_start;
 	size -= patch_start;
 
-	uint64_t* sizeptr = nullptr;
-	uint64_t payload_start = 0;
-	begin_object_update_packet(writer, device_data, object_data, ar, sizeptr, payload_start);
+	object_update_layout layout;
+	begin_object_update_packet(writer, device_data, object_data, ar, layout);
 	const uint64_t written = writer.write_patch(cloneptr, changedptr, offset, size);
-	end_object_update_packet(writer, object_data, sizeptr, payload_start, written);
+	end_object_update_packet(writer, object_data, layout, written);
 	return written;
 }
 
+/// One touched range of an object to diff against our clone of its memory
+struct memory_scan_job
+{
+	trackedobject* object_data;
+	char* cloneptr; // start of object in our clone
+	char* changedptr; // start of object in the mapped memory
+	uint64_t offset; // relative to the object
+	uint64_t size;
+	range area; // in the device memory, to find jobs touching the same part of the clone
+	unsigned memory; // which device memory, in the order we mapped them
+	uint64_t patch_start = 0;
+	uint64_t changed = 0;
+	std::vector<patch_run> runs;
+};
+
+/// Below this many bytes to scan, it is not worth waking up the scan workers
+static constexpr uint64_t parallel_scan_threshold = 4 * 1024 * 1024;
+
+/// Diff all jobs, spread over our scan pool. Jobs that touch the same part of the same clone are kept together
+/// and done in order, which gives the same result as doing them all in order.
+static void scan_memory(lava_writer& instance, std::vector<memory_scan_job>& jobs)
+{
+	auto scan = [&jobs](unsigned index)
+	{
+		memory_scan_job& job = jobs[index];
+		job.patch_start = file_writer::find_patch_start(job.cloneptr, job.changedptr, job.offset, job.size);
+		if (job.patch_start == job.size) return;
+		job.changed = file_writer::diff_patch(job.cloneptr, job.changedptr, job.offset + job.patch_start, job.size - job.patch_start, job.runs);
+	};
+	uint64_t total = 0;
+	for (const memory_scan_job& job : jobs) total += job.size;
+	if (total < parallel_scan_threshold || patch_scan_pool::thread_count() <= 1)
+	{
+		for (unsigned i = 0; i < jobs.size(); i++) scan(i);
+		return;
+	}
+
+	std::vector<scan_area> areas;
+	areas.reserve(jobs.size());
+	for (const memory_scan_job& job : jobs) areas.push_back({ job.memory, job.area.first, job.area.last });
+	instance.scan_pool.run_grouped(areas, scan);
+}
+
+/// Diff only the parts of a scan job on guarded memory that the app wrote to since we last diffed them
+static void push_guarded_jobs(std::vector<memory_scan_job>& jobs, trackedmemory_trace* memory_data, const memory_scan_job& job)
+{
+	page_guard& guard = page_guard::instance();
+	const uint64_t delta = (memory_data->ptr - memory_data->guard->base) - memory_data->offset; // from device memory offset to guarded offset
+	std::vector<range> dirty;
+	guard.dirty_ranges(memory_data->guard, job.area.first + delta, job.area.last + delta, dirty);
+	guard.clean(memory_data->guard, job.area.first + delta, job.area.last + delta); // any writes from now on fault again
+	uint64_t kept = 0;
+	for (const range& d : dirty)
+	{
+		memory_scan_job part = job;
+		part.area = { d.first - delta, d.last - delta };
+		part.offset = part.area.first - job.object_data->offset;
+		part.size = d.last - d.first + 1;
+		kept += part.size;
+		jobs.push_back(part);
+	}
+	guard.scanned_bytes += kept;
+	guard.avoided_bytes += job.size - kept;
+}
+
+/// Wait until the deferred diff worker is done with this memory, so that our clone of it is up to date
+static void wait_for_deferred_diffs(trackedmemory_trace* memory_data)
+{
+	uint32_t pending = memory_data->deferred_diffs.load();
+	while (pending)
+	{
+		memory_data->deferred_diffs.wait(pending);
+		pending = memory_data->deferred_diffs.load();
+	}
+}
+
+/// An object update that is diffed and written out by the deferred diff worker
+struct deferred_update
+{
+	memory_scan_job job; // with its patch start already found
+	uint8_t packet_type;
+	captured_handle device;
+	captured_handle object;
+	uint64_t snapshot; // where in the snapshot the part of the job from its patch start begins
+};
+
+/// Diff a deferred update against our clone, and write out its packet exactly as memory_update() would have
+static void write_deferred_update(file_writer& out, deferred_update& update, const char* snapshot)
+{
+	memory_scan_job& job = update.job;
+	const uint64_t offset = job.offset + job.patch_start;
+	const uint64_t size = job.size - job.patch_start;
+	job.changed = file_writer::diff_patch(job.cloneptr, snapshot - offset, offset, size, job.runs);
+
+	const uint64_t packet_start = out.uncompressed_bytes;
+	out.write_uint8_t(update.packet_type);
+	uint32_t* packet_size = out.write_later_uint32_t(0);
+	object_update_layout layout;
+	layout.begin(out, update.device, update.object, 0);
+	out.write_patch_runs(job.cloneptr, job.runs);
+	layout.end(out);
+	if (out.uncompressed_bytes - packet_start > UINT32_MAX) ABORT("Deferred update packet is too large: %lu bytes", (unsigned long)(out.uncompressed_bytes - packet_start));
+	*packet_size = (uint32_t)(out.uncompressed_bytes - packet_start);
+	job.object_data->written += job.changed;
+}
+
+/// Find which jobs have changes and take a snapshot of them, then leave the diffing and writing out to our deferred
+/// diff worker, which writes the update packets into a place we reserve for them in our stream. Returns false if the
+/// jobs have to be done right away instead, because some of them overlap, and each must see the clone as the one
+/// before it left it.
+static bool defer_memory_update(lava_file_writer& writer, const trackeddevice* device_data, const std::vector<trackedmemory_trace*>& memories,
+	std::vector<memory_scan_job>& jobs)
+{
+	std::vector<unsigned> order(jobs.size());
+	for (unsigned i = 0; i < jobs.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&jobs](unsigned a, unsigned b)
+	{
+		if (jobs[a].memory != jobs[b].memory) return jobs[a].memory < jobs[b].memory;
+		return jobs[a].area.first < jobs[b].area.first;
+	});
+	uint64_t last = 0;
+	for (unsigned i = 0; i < order.size(); i++)
+	{
+		const memory_scan_job& job = jobs[order[i]];
+		if (i > 0 && job.memory == jobs[order[i - 1]].memory && job.area.first <= last) return false;
+		if (i == 0 || job.memory != jobs[order[i - 1]].memory) last = job.area.last;
+		else last = std::max(last, job.area.last);
+	}
+
+	// finding where the changes start only reads memory, so it costs no more than the copy below
+	auto find = [&jobs](unsigned index)
+	{
+		memory_scan_job& job = jobs[index];
+		job.patch_start = file_writer::find_patch_start(job.cloneptr, job.changedptr, job.offset, job.size);
+	};
+	uint64_t scanned = 0;
+	for (const memory_scan_job& job : jobs) scanned += job.size;
+	if (scanned >= parallel_scan_threshold) writer.parent->scan_pool.run(jobs.size(), find);
+	else for (unsigned i = 0; i < jobs.size(); i++) find(i);
+
+	std::vector<deferred_update> updates;
+	uint64_t total = 0;
+	for (memory_scan_job& job : jobs)
+	{
+		if (job.patch_start == job.size) continue;
+		updates.push_back({ job, update_packet_type(job.object_data), device_data, job.object_data, total });
+		total += job.size - job.patch_start;
+	}
+	if (updates.empty()) return true;
+
+	// taking a snapshot of the changed parts is all that the app has to wait for
+	bool hit = false;
+	buffer snapshot = chunk_buffer_pool::instance().acquire(total, hit);
+	for (const deferred_update& update : updates)
+	{
+		const memory_scan_job& job = update.job;
+		memcpy(snapshot.data() + update.snapshot, job.changedptr + job.offset + job.patch_start, job.size - job.patch_start);
+		job.object_data->updates++;
+	}
+	for (trackedmemory_trace* memory_data : memories) memory_data->deferred_diffs++;
+	stream_span* span = writer.reserve_packets(updates.size());
+	writer.parent->deferred_diff.run(writer, span, total, (uint64_t)p__deferred_diff * 1024 * 1024, [updates = std::move(updates), snapshot, memories](file_writer& out) mutable
+	{
+		for (deferred_update& update : updates) write_deferred_update(out, update, snapshot.data() + update.snapshot);
+		chunk_buffer_pool::instance().recycle(snapshot);
+		for (trackedmemory_trace* memory_data : memories)
+		{
+			if (memory_data->deferred_diffs.fetch_sub(1) == 1) memory_data->deferred_diffs.notify_all();
+		}
+	});
+	return true;
+}
+
 static void memory_update(lava_file_writer& writer, trackedqueue* queue_data, const std::unordered_map<VkDeviceMemory, range>& ranges_by_memory, std::unordered_set<trackedcmdbuffer_trace*>& cmdbufs)
 {
-	// for each, map and update
+	struct mapping
+	{
+		VkDeviceMemory memory;
+		trackedmemory_trace* memory_data;
+		bool restore;
+	};
+	std::vector<mapping> mappings;
+	std::vector<memory_scan_job> jobs;
+	const auto* device_data = writer.parent->records.VkDevice_index.at(queue_data->device);
+
+	// for each, map and find what needs to be diffed
 	for (const auto& pair : ranges_by_memory) // devicememory + max used memory span pair
 	{
 		auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(pair.first);
 		assert(memory_data->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT); // or how else could it have been mmapped earlier?
+		wait_for_deferred_diffs(memory_data);
 		bool restore = false;
 		char* ptr = nullptr;
 		unsigned long binding_offset = 0; // at which offset the memory map is bound at
@@ -1733,6 +1986,8 @@ static void memory_update(lava_file_writer& writer, trackedqueue* queue_data, co
 			if (memory_data->ptr) // remove old memory mapping, if any
 			{
 				NEVER("Remapping existing persistent memory %u to flush it, mapping to offset=%lu size=%lu", memory_data->index, binding_offset, binding_size);
+				if (memory_data->guard) page_guard::instance().remove(memory_data->guard);
+				memory_data->guard = nullptr;
 				wrap_vkUnmapMemory(queue_data->device, memory_data->backing);
 				restore = true;
 			}
@@ -1740,8 +1995,10 @@ static void memory_update(lava_file_writer& writer, trackedqueue* queue_data, co
 			VkResult result = wrap_vkMapMemory(queue_data->device, memory_data->backing, binding_offset, binding_size, 0, (void**)&ptr);
 			assert(result == VK_SUCCESS);
 		}
+		const unsigned memory_order = mappings.size();
+		mappings.push_back({ pair.first, memory_data, restore });
+		if (memory_data->guard) page_guard::instance().collect(memory_data->guard);
 
-		const auto* device_data = writer.parent->records.VkDevice_index.at(queue_data->device);
 		for (auto& cmdbuf_data : cmdbufs)
 		{
 			for (auto& objpair : cmdbuf_data->touched) // object pointer + touched range pair
@@ -1749,8 +2006,6 @@ static void memory_update(lava_file_writer& writer, trackedqueue* queue_data, co
 				trackedobject* object_data = objpair.first;
 				if (object_data->backing != pair.first) continue; // belongs to different device memory
 				assert(object_data->destroyed.frame == UINT32_MAX);
-				uint64_t written = 0;
-				[[maybe_unused]] uint64_t scanned = 0;
 				char* cloneptr = memory_data->clone + object_data->offset;
 				char* changedptr = ptr + object_data->offset - binding_offset;
 				for (const auto& r : objpair.second.list()) // go through list of touched ranges for our object
@@ -1759,21 +2014,42 @@ static void memory_update(lava_file_writer& writer, trackedqueue* queue_data, co
 					assert(r2.last < object_data->offset + object_data->size);
 					range v = memory_data->exposed.fetch(r2, memory_data->ptr != nullptr);
 					if (!v.valid()) continue;
-					written += write_out_object(writer, device_data, object_data, cloneptr, changedptr, v.first - object_data->offset, v.last - v.first + 1, nullptr);
-					scanned += v.last - v.first + 1;
-					NEVER("flushing obj %u (%lu, %lu) -> (%lu, %lu) -> (%lu, %lu), exposed after (%lu, %lu), total written %lu, memory %u; binding_offset=%lu binding_size=%lu ptr=%p",
+					if (memory_data->guard) push_guarded_jobs(jobs, memory_data, { object_data, cloneptr, changedptr, v.first - object_data->offset, v.last - v.first + 1, v, memory_order });
+					else jobs.push_back({ object_data, cloneptr, changedptr, v.first - object_data->offset, v.last - v.first + 1, v, memory_order });
+					NEVER("flushing obj %u (%lu, %lu) -> (%lu, %lu) -> (%lu, %lu), exposed after (%lu, %lu), memory %u; binding_offset=%lu binding_size=%lu ptr=%p",
 					      object_data->index, r.first, r.last, r2.first, r2.last, v.first, v.last, memory_data->exposed.span().first, memory_data->exposed.span().last,
-					      (unsigned long)object_data->written, memory_data->index, binding_offset, binding_size, memory_data->ptr);
+					      memory_data->index, binding_offset, binding_size, memory_data->ptr);
 				}
-				NEVER("%s(%u) offset=%u size=%u memory=%u(total size=%u) written=%u scanned=%u cmdbuf=%u source=%d", pretty_print_VkObjectType(object_data->object_type), (unsigned)object_data->index, (unsigned)object_data->offset, (unsigned)object_data->size, memory_data->index, (unsigned)memory_data->allocationSize, (unsigned)written, (unsigned)scanned, cmdbuf_data->index, (int)object_data->source);
 			}
 		}
+	}
 
-		if (restore || !memory_data->ptr) wrap_vkUnmapMemory(queue_data->device, pair.first);
-		if (restore) // restore old memory mapping, if any
+	std::vector<trackedmemory_trace*> memories;
+	for (const mapping& m : mappings) memories.push_back(m.memory_data);
+	if (!p__deferred_diff || !defer_memory_update(writer, device_data, memories, jobs))
+	{
+		// diff it all, possibly on several threads, then write out the results in the same order as we found them
+		scan_memory(*writer.parent, jobs);
+		for (memory_scan_job& job : jobs)
 		{
-			VkResult result = wrap_vkMapMemory(queue_data->device, memory_data->backing, memory_data->offset, memory_data->size, 0, (void**)&memory_data->ptr);
+			if (job.patch_start == job.size) continue;
+			object_update_layout layout;
+			begin_object_update_packet(writer, device_data, job.object_data, nullptr, layout);
+			writer.write_patch_runs(job.cloneptr, job.runs);
+			end_object_update_packet(writer, job.object_data, layout, job.changed);
+			NEVER("%s(%u) offset=%u size=%u written=%u", pretty_print_VkObjectType(job.object_data->object_type), (unsigned)job.object_data->index,
+			      (unsigned)job.offset, (unsigned)job.size, (unsigned)job.changed);
+		}
+	}
+
+	for (const mapping& m : mappings)
+	{
+		if (m.restore || !m.memory_data->ptr) wrap_vkUnmapMemory(queue_data->device, m.memory);
+		if (m.restore) // restore old memory mapping, if any
+		{
+			VkResult result = wrap_vkMapMemory(queue_data->device, m.memory_data->backing, m.memory_data->offset, m.memory_data->size, 0, (void**)&m.memory_data->ptr);
 			assert(result == VK_SUCCESS);
+			if (m.memory_data->propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) m.memory_data->guard = page_guard::instance().add(m.memory_data->ptr, m.memory_data->size);
 		}
 	}
 }
@@ -1787,7 +2063,16 @@ static void trace_pre_vkQueueSubmit2(VkQueue queue, uint32_t submitCount, const
 	queue_data->self_test();
 	if (queue_data->explicit_host_updates) return;
 
-	instance.memory_mutex.lock();
+	// lock only the device memory we need, so that submits touching different memory can run in parallel
+	std::vector<trackedmemory_trace*> memories;
+	for (unsigned i = 0; i < submitCount; i++)
+	{
+		for (unsigned j = 0; j < pSubmits[i].commandBufferInfoCount; j++)
+		{
+			queue_memories(writer, pSubmits[i].pCommandBufferInfos[j].commandBuffer, memories);
+		}
+	}
+	instance.lock_memories(memories);
 	std::unordered_map<VkDeviceMemory, range> ranges_by_memory;
 	std::unordered_set<trackedcmdbuffer_trace*> cmdbufs;
 	for (unsigned i = 0; i < submitCount; i++)
@@ -1798,7 +2083,7 @@ static void trace_pre_vkQueueSubmit2(VkQueue queue, uint32_t submitCount, const
 		}
 	}
 	memory_update(writer, queue_data, ranges_by_memory, cmdbufs);
-	instance.memory_mutex.unlock();
+	instance.unlock_memories(memories);
 }
 
 static void trace_pre_vkQueueSubmit2KHR(VkQueue queue, uint32_t submitCount, const VkSubmitInfo2* pSubmits, VkFence fence)
@@ -1814,7 +2099,16 @@ static void trace_pre_vkQueueSubmit(VkQueue queue, uint32_t submitCount, const V
 	queue_data->self_test();
 	if (queue_data->explicit_host_updates) return;
 
-	instance.memory_mutex.lock();
+	// lock only the device memory we need, so that submits touching different memory can run in parallel
+	std::vector<trackedmemory_trace*> memories;
+	for (unsigned i = 0; i < submitCount; i++)
+	{
+		for (unsigned j = 0; j < pSubmits[i].commandBufferCount; j++)
+		{
+			queue_memories(writer, pSubmits[i].pCommandBuffers[j], memories);
+		}
+	}
+	instance.lock_memories(memories);
 	std::unordered_map<VkDeviceMemory, range> ranges_by_memory;
 	std::unordered_set<trackedcmdbuffer_trace*> cmdbufs;
 	for (unsigned i = 0; i < submitCount; i++)
@@ -1825,7 +2119,7 @@ static void trace_pre_vkQueueSubmit(VkQueue queue, uint32_t submitCount, const V
 		}
 	}
 	memory_update(writer, queue_data, ranges_by_memory, cmdbufs);
-	instance.memory_mutex.unlock();
+	instance.unlock_memories(memories);
 }
 
 static void trace_post_queue_submit_fence(VkFence fence)
@@ -1883,12 +2177,48 @@ void trace_post_vkDestroyInstance(lava_file_writer& writer, VkInstance instance,
 	real_memory_properties = {};
 	virtual_memory_properties = {};
 	memset(remap_memory_types_to_real, 0, sizeof(remap_memory_types_to_real));
+	memset(backing_memory_types, 0, sizeof(backing_memory_types));
 	instance_extension_properties.clear();
 	reset_all(&inst.records);
 
 	frame_mutex.unlock();
 }
 
+/// Pick which real memory type to back each presented memory type with. Host visible memory types that are not
+/// host cached get the host cached type with the fewest extra properties, preferably in the same heap.
+static void setup_backing_memory() REQUIRES(frame_mutex)
+{
+	for (uint32_t i = 0; i < virtual_memory_properties.memoryTypeCount; i++) backing_memory_types[i] = remap_memory_types_to_real[i];
+	if (!p__cached_memory) return;
+	const VkMemoryPropertyFlags special = VK_MEMORY_PROPERTY_PROTECTED_BIT | VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT;
+	for (uint32_t i = 0; i < virtual_memory_properties.memoryTypeCount; i++)
+	{
+		const VkMemoryType& requested = virtual_memory_properties.memoryTypes[i];
+		const VkMemoryType& real = real_memory_properties.memoryTypes[remap_memory_types_to_real[i]];
+		if (!(requested.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) || (real.propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)) continue;
+		if (requested.propertyFlags & special) continue;
+		const VkMemoryPropertyFlags needed = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | (requested.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		int best = -1;
+		unsigned best_cost = UINT32_MAX;
+		for (uint32_t j = 0; j < real_memory_properties.memoryTypeCount; j++)
+		{
+			const VkMemoryType& candidate = real_memory_properties.memoryTypes[j];
+			if ((candidate.propertyFlags & needed) != needed || (candidate.propertyFlags & special)) continue;
+			const unsigned cost = __builtin_popcount(candidate.propertyFlags & ~needed) * 2 + (candidate.heapIndex != real.heapIndex);
+			if (cost < best_cost) { best = j; best_cost = cost; }
+		}
+		if (best == -1)
+		{
+			WLOG("No host cached memory type can back memory type %u (flags=%u), using it as it is", i, (unsigned)requested.propertyFlags);
+			continue;
+		}
+		backing_memory_types[i] = best;
+		ILOG("Backing memory type %u (flags=%u heap=%u) with host cached memory type %u (flags=%u heap=%u)", i, (unsigned)requested.propertyFlags,
+		     (unsigned)requested.heapIndex, (unsigned)best, (unsigned)real_memory_properties.memoryTypes[best].propertyFlags,
+		     (unsigned)real_memory_properties.memoryTypes[best].heapIndex);
+	}
+}
+
 // TBD - nuke any PROTECTED_BIT memory types
 static void setup_virtual_memory(VkPhysicalDevice physicalDevice) REQUIRES(frame_mutex)
 {
@@ -1927,6 +2257,7 @@ static void setup_virtual_memory(VkPhysicalDevice physicalDevice) REQUIRES(frame
 			ELOG("Wanted to create virtual memory type, but we used up all available memory types - we may run into issues!");
 		}
 	}
+	setup_backing_memory();
 }
 
 static void trace_post_vkGetPhysicalDeviceMemoryProperties(lava_file_writer& writer, VkPhysicalDevice physicalDevice, VkPhysicalDeviceMemoryProperties* pMemoryProperties)
@@ -1936,7 +2267,7 @@ static void trace_post_vkGetPhysicalDeviceMemoryProperties(lava_file_writer& wri
 	{
 		real_memory_properties = *pMemoryProperties;
 		virtual_memory_properties = *pMemoryProperties;
-		for (uint32_t i = 0; i < virtual_memory_properties.memoryTypeCount; i++) remap_memory_types_to_real[i] = i;
+		for (uint32_t i = 0; i < virtual_memory_properties.memoryTypeCount; i++) remap_memory_types_to_real[i] = backing_memory_types[i] = i;
 	}
 	if (virtual_memory_properties.memoryTypeCount == 0) // called before vkCreateDevice
 	{
@@ -2671,6 +3002,7 @@ VKAPI_ATTR uint64_t VKAPI_CALL trace_vkGetDeviceTracingObjectPropertyTRACETOOLTE
 	lava_writer& tracer = lava_writer::instance();
 	lava_file_writer& writer = tracer.file_writer();
 	uint64_t retval = 0;
+	if (valueType == VK_TRACING_OBJECT_PROPERTY_UPDATES_BYTES_TRACETOOLTEST) tracer.deferred_diff.drain(); // count what is still being diffed
 	switch (valueType)
 	{
 	case VK_TRACING_OBJECT_PROPERTY_INDEX_TRACETOOLTEST:
@@ -2785,12 +3117,13 @@ VKAPI_ATTR void VKAPI_CALL trace_vkSyncBufferTRACETOOLTEST(VkDevice device, VkBu
 	const auto* device_data = writer.parent->records.VkDevice_index.at(device);
 	auto* buffer_data = writer.parent->records.VkBuffer_index.at(buffer);
 	auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(buffer_data->backing);
-	writer.parent->memory_mutex.lock();
+	writer.parent->lock_memory(memory_data);
+	wait_for_deferred_diffs(memory_data);
 	if (!memory_data->clone)
 	{
-		memory_data->clone = (char*)calloc(1, memory_data->allocationSize);
+		memory_data->clone = clone_alloc(memory_data->allocationSize);
 	}
-	writer.parent->memory_mutex.unlock();
+	writer.parent->unlock_memory(memory_data);
 	if (memory_data->ptr != nullptr) ABORT("Memory cannot be memory mapped already when running vkSyncBufferTRACETOOLTEST!");
 	range v = memory_data->exposed.fetch_os(buffer_data->offset, buffer_data->size, false); // clear exposure
 	(void)v;
@@ -2953,12 +3286,12 @@ static uint32_t trace_checksum_buffer_range(lava_file_writer& writer, VkDevice d
 	VkDeviceSize offset, VkDeviceSize size, const char* name)
 {
 	auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(buffer_data->backing);
-	writer.parent->memory_mutex.lock();
+	writer.parent->lock_memory(memory_data);
 	if (!memory_data->clone)
 	{
-		memory_data->clone = (char*)calloc(1, memory_data->allocationSize);
+		memory_data->clone = clone_alloc(memory_data->allocationSize);
 	}
-	writer.parent->memory_mutex.unlock();
+	writer.parent->unlock_memory(memory_data);
 	if (size == VK_WHOLE_SIZE)
 	{
 		size = buffer_data->size - offset;
@@ -3126,8 +3459,8 @@ void trace_post_vkMapMemory(lava_file_writer& writer, VkResult result, VkDevice
 {
 	if (result != VK_SUCCESS || !ppData || !*ppData) return;
 
-	writer.parent->memory_mutex.lock();
 	auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(memory);
+	writer.parent->lock_memory(memory_data);
 	memory_data->ptr = (char*)*ppData;
 	memory_data->offset = offset;
 
@@ -3142,15 +3475,17 @@ void trace_post_vkMapMemory(lava_file_writer& writer, VkResult result, VkDevice
 
 	if (!memory_data->clone)
 	{
-		memory_data->clone = (char*)calloc(1, memory_data->allocationSize);
+		memory_data->clone = clone_alloc(memory_data->allocationSize);
 	}
 
 	if (memory_data->propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)
 	{
 		memory_data->exposed.add_os(offset, memory_data->size);
+		assert(!memory_data->guard);
+		memory_data->guard = page_guard::instance().add(memory_data->ptr, memory_data->size);
 	}
 
-	writer.parent->memory_mutex.unlock();
+	writer.parent->unlock_memory(memory_data);
 }
 
 void trace_post_vkMapMemory2KHR(lava_file_writer& writer, VkResult result, VkDevice device, const VkMemoryMapInfoKHR* pMemoryMapInfo, void** ppData)
@@ -3169,12 +3504,14 @@ static void trace_post_vkUnmapMemory_common(lava_file_writer& writer, VkDeviceMe
 {
 	if (memory == VK_NULL_HANDLE) return;
 
-	writer.parent->memory_mutex.lock();
 	auto* memory_data = writer.parent->records.VkDeviceMemory_index.at(memory);
+	writer.parent->lock_memory(memory_data);
+	if (memory_data->guard) page_guard::instance().remove(memory_data->guard);
+	memory_data->guard = nullptr;
 	memory_data->ptr = nullptr;
 	memory_data->offset = 0;
 	memory_data->size = 0;
-	writer.parent->memory_mutex.unlock();
+	writer.parent->unlock_memory(memory_data);
 }
 
 void trace_post_vkUnmapMemory(lava_file_writer& writer, VkDevice device, VkDeviceMemory memory)
@@ -3240,13 +3577,16 @@ static bool capture_clamp_mapped_flush_range(const VkMappedMemoryRange& range, c
 
 void trace_post_vkFlushMappedMemoryRanges(lava_file_writer& writer, VkResult result, VkDevice device, uint32_t memoryRangeCount, const VkMappedMemoryRange* pMemoryRanges)
 {
-	lava::lock_guard guard(writer.parent->memory_mutex);
 	if (result != VK_SUCCESS)
 	{
 		WLOG("Ignoring vkFlushMappedMemoryRanges for capture bookkeeping after driver returned %s", errorString(result));
 		return;
 	}
 	const auto* device_data = writer.parent->records.VkDevice_index.at(device);
+	std::vector<trackedmemory_trace*> memories(memoryRangeCount);
+	for (unsigned i = 0; i < memoryRangeCount; i++) memories[i] = writer.parent->records.VkDeviceMemory_index.at(pMemoryRanges[i].memory);
+	writer.parent->lock_memories(memories);
+	for (trackedmemory_trace* memory_data : memories) wait_for_deferred_diffs(memory_data);
 	// The memory must be memory mapped
 	for (unsigned i = 0; i < memoryRangeCount; i++)
 	{
@@ -3262,6 +3602,7 @@ void trace_post_vkFlushMappedMemoryRanges(lava_file_writer& writer, VkResult res
 		// Handle VK_ARM_explicit_host_updates and/or VK_ARM_trace_helpers
 		if (device_data->explicit_host_updates || ar)
 		{
+			if (memory_data->guard) page_guard::instance().collect(memory_data->guard);
 			for (auto& pair : memory_data->usage)
 			{
 				if (pair.first > mapped_end) continue; // our beginning is later than its end
@@ -3272,6 +3613,24 @@ void trace_post_vkFlushMappedMemoryRanges(lava_file_writer& writer, VkResult res
 				char* changedptr = memory_data->ptr + object_data->offset - memory_data->offset;
 				uint64_t start = std::max<uint64_t>(object_data->offset, mapped_start) - object_data->offset;
 				uint64_t end = std::min<uint64_t>(object_data->offset + object_data->size, mapped_end) - object_data->offset;
+				if (memory_data->guard && end > start) // only diff between the first and last page written to
+				{
+					page_guard& guard = page_guard::instance();
+					const uint64_t delta = (memory_data->ptr - memory_data->guard->base) - memory_data->offset + object_data->offset;
+					std::vector<range> dirty;
+					guard.dirty_ranges(memory_data->guard, start + delta, end - 1 + delta, dirty);
+					guard.clean(memory_data->guard, start + delta, end - 1 + delta);
+					const uint64_t before = end - start;
+					if (!dirty.empty())
+					{
+						start = dirty.front().first - delta;
+						end = dirty.back().last - delta + 1;
+					}
+					else if (!ar) end = start;
+					guard.scanned_bytes += end - start;
+					guard.avoided_bytes += before - (end - start);
+					if (end == start) continue;
+				}
 				std::vector<range> changed_spans;
 				const uint64_t changed = collect_patch_spans(cloneptr, changedptr, start, end - start, changed_spans);
 				VkMarkedOffsetsARM adjusted = {};
@@ -3329,6 +3688,7 @@ void trace_post_vkFlushMappedMemoryRanges(lava_file_writer& writer, VkResult res
 			}
 		}
 	}
+	writer.parent->unlock_memories(memories);
 }
 
 void trace_pre_vkFreeMemory(VkDevice device, VkDeviceMemory memory, const VkAllocationCallbacks* pAllocator)
@@ -3343,16 +3703,20 @@ void trace_pre_vkFreeMemory(VkDevice device, VkDeviceMemory memory, const VkAllo
 		// "If a memory object is mapped at the time it is freed, it is implicitly unmapped."
 		if (memory_data->ptr && (memory_data->propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
 		{
-			instance.memory_mutex.lock();
+			instance.lock_memory(memory_data);
+			if (memory_data->guard) page_guard::instance().remove(memory_data->guard);
+			memory_data->guard = nullptr;
 			memory_data->ptr = nullptr;
 			memory_data->offset = 0;
 			memory_data->size = 0;
-			instance.memory_mutex.unlock();
+			instance.unlock_memory(memory_data);
 		}
 
+		wait_for_deferred_diffs(memory_data);
 		if (memory_data->clone)
 		{
-			free(memory_data->clone);
+			memory_data->freed_clone_resident = clone_resident(memory_data->clone, memory_data->allocationSize);
+			clone_free(memory_data->clone, memory_data->allocationSize);
 			memory_data->clone = nullptr;
 		}
 
@@ -4,6 +4,7 @@
 #include "jsoncpp/json/writer.h"
 
 #include "json_helpers.h"
+#include "filewriter.h"
 
 static bool valid_change_source(const change_source& c)
 {
@@ -275,6 +276,25 @@ Json::Value trackedmemory_json(const trackedmemory* t)
 	return v;
 }
 
+Json::Value trackedmemory_trace_json(const trackedmemory_trace* t)
+{
+	Json::Value v = trackedmemory_json(t);
+	if (t->contention) v["lock_contention"] = (Json::Value::UInt64)t->contention;
+	if (t->clone) v["clone_resident"] = (Json::Value::UInt64)clone_resident(t->clone, t->allocationSize);
+	else if (t->freed_clone_resident) v["clone_resident"] = (Json::Value::UInt64)t->freed_clone_resident;
+	if (p__cached_memory && (t->backing_flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) && !(t->propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)) // allocated from host cached memory instead of what the app asked for
+	{
+		Json::Value& backing = v["capture_backing"];
+		backing["requested_type"] = t->requested_type;
+		backing["requested_flags"] = (unsigned)t->propertyFlags;
+		backing["requested_heap"] = t->requested_heap;
+		backing["backing_type"] = t->backing_type;
+		backing["backing_flags"] = (unsigned)t->backing_flags;
+		backing["backing_heap"] = t->backing_heap;
+	}
+	return v;
+}
+
 Json::Value trackedfence_json(const trackedfence* t)
 {
 	Json::Value v = trackable_json(t);
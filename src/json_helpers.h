@@ -23,6 +23,7 @@ Json::Value trackeddescriptorset_trace_json(const trackeddescriptorset_trace* t)
 Json::Value trackedqueue_json(const trackedqueue* t);
 Json::Value trackedevent_trace_json(const trackedevent_trace* t);
 Json::Value trackedmemory_json(const trackedmemory* t);
+Json::Value trackedmemory_trace_json(const trackedmemory_trace* t);
 Json::Value trackedfence_json(const trackedfence* t);
 Json::Value trackedsemaphore_json(const trackedsemaphore* t);
 Json::Value trackedpipeline_json(const trackedpipeline* t);
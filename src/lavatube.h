@@ -13,6 +13,7 @@
 #include "vulkan/vulkan.h"
 #include "util.h"
 #include "rangetracking.h"
+#include "pageguard.h"
 #include "vulkan_ext.h"
 #include "containers.h"
 
@@ -203,7 +204,7 @@ struct trackedmemory : trackable
 	/// Data structure used to track usage of Vulkan objects. We can use this to
 	/// make sure we recreate them together again on replay if they are aliased.
 	/// For now, this only supports 1-to-1 aliasing. Only used during capture.
-	std::multimap<VkDeviceSize, trackedobject*> usage; // do not touch unless you hold the memory mutex
+	std::multimap<VkDeviceSize, trackedobject*> usage; // during capture, do not touch unless you hold its mutex
 
 	void bind(trackedobject* obj);
 	void unbind(trackedobject* obj);
@@ -921,7 +922,7 @@ struct trackedcmdbuffer_trace : trackedcmdbuffer
 		VkDeviceSize offset = 0;
 		VkIndexType indexType = VK_INDEX_TYPE_MAX_ENUM; // VK_INDEX_TYPE_UINT16, VK_INDEX_TYPE_UINT32 or VK_INDEX_TYPE_UINT8_EXT
 	} indexBuffer;
-	std::unordered_map<trackedobject*, exposure> touched; // track memory updates
+	touched_ranges<trackedobject*> touched; // track memory updates
 	bool uses_device_address_shader = false;
 
 	void touch_index_buffer(VkDeviceSize firstIndex, VkDeviceSize indexCount)
@@ -945,16 +946,12 @@ struct trackedcmdbuffer_trace : trackedcmdbuffer
 	{
 		if (!data->accessible) return;
 		if (size == VK_WHOLE_SIZE) size = data->size - offset;
-		touched[data].add_os(offset, size);
+		touched.add_os(data, offset, size);
 	}
 
-	void touch_merge(const std::unordered_map<trackedobject*, exposure>& other)
+	void touch_merge(const touched_ranges<trackedobject*>& other)
 	{
-		for (const auto& pair : other)
-		{
-			if (touched.count(pair.first) > 0) for (auto& r : pair.second.list()) touched[pair.first].add(r.first, r.last); // merge in
-			else touched[pair.first] = pair.second; // just insert
-		}
+		touched.merge(other);
 	}
 
 	void self_test() const
@@ -1033,14 +1030,14 @@ struct trackeddescriptorset : trackable
 struct trackeddescriptorset_trace : trackeddescriptorset
 {
 	using trackeddescriptorset::trackeddescriptorset; // inherit constructor
-	std::unordered_map<trackedobject*, exposure> touched; // track memory updates
+	touched_ranges<trackedobject*> touched; // track memory updates
 	std::map<uint64_t, VkDescriptorBufferInfo> dynamic_buffers; // binding<<32 | array index, resolved on bind
 
 	void touch(trackedobject* data, VkDeviceSize offset, VkDeviceSize size, unsigned line = 0)
 	{
 		if (!data->accessible) return;
 		if (size == VK_WHOLE_SIZE) size = data->size - offset;
-		touched[data].add_os(offset, size);
+		touched.add_os(data, offset, size);
 	}
 
 	void self_test() const
@@ -1139,6 +1136,30 @@ struct trackedcommandpool_trace : trackable
 	std::unordered_set<trackedcmdbuffer_trace*> commandbuffers;
 };
 
+struct trackedmemory_trace : trackedmemory
+{
+	using trackedmemory::trackedmemory; // inherit constructor
+	/// We cannot allow the app to map or unmap this memory while we are scanning it. Take it
+	/// through lava_writer::lock_memory() or lock_memories(), never directly.
+	lava::mutex mutex;
+	/// How many times a thread had to wait for another thread to release the mutex above,
+	/// only changed while holding it
+	uint64_t contention = 0;
+	/// How much of our clone was backed by memory when the app freed it
+	uint64_t freed_clone_resident = 0;
+	/// Write-protection of our current mapping, if we use the page guard for it
+	page_guard::region* guard = nullptr;
+	/// Queue submits whose diffing against our clone is still waiting for the deferred diff worker
+	std::atomic_uint32_t deferred_diffs { 0 };
+	/// The memory type the app asked for, as presented to it, and the real memory type we allocated it from,
+	/// which differ when we back it with host cached memory. propertyFlags above belong to the requested type.
+	uint32_t requested_type = 0;
+	uint32_t requested_heap = 0;
+	uint32_t backing_type = 0;
+	uint32_t backing_heap = 0;
+	VkMemoryPropertyFlags backing_flags = 0;
+};
+
 struct trackedrenderpass : trackable
 {
 	using trackable::trackable; // inherit constructor
@@ -793,6 +793,9 @@ static void normalize_frames_json(Json::Value& value)
 	value.removeMember("compressed_sizes");
 	value.removeMember("uncompressed_sizes");
 	value.removeMember("packet_checkpoints");
+	value.removeMember("chunk_pool_hits");
+	value.removeMember("chunk_pool_misses");
+	value.removeMember("chunk_codecs");
 }
 
 static void normalize_tracking_json(Json::Value& value, const std::map<unsigned, std::string>& dict)
@@ -804,6 +807,15 @@ static void normalize_tracking_json(Json::Value& value, const std::map<unsigned,
 	}
 	if (!value.isObject()) return;
 
+	value.removeMember("capture_writeout");
+	value.removeMember("capture_memory_locks");
+	value.removeMember("lock_contention");
+	value.removeMember("capture_clones");
+	value.removeMember("clone_resident");
+	value.removeMember("capture_page_guard");
+	value.removeMember("capture_cached_memory");
+	value.removeMember("capture_deferred_diff");
+	value.removeMember("capture_backing");
 	if (value.isMember("api_created") && value["api_created"].isUInt())
 	{
 		value["api_created"] = map_api_id(dict, value["api_created"].asUInt());
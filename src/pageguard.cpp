@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <thread>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/userfaultfd.h>
+#endif
+
+#include "pageguard.h"
+#include "util.h"
+
+// The fault handlers must not take locks or allocate, so they look regions up in a fixed table
+static constexpr unsigned max_regions = 4096;
+static std::atomic<page_guard::region*> regions[max_regions];
+static std::atomic_uint32_t region_count { 0 }; // slots in use or used before
+static std::atomic_uint32_t handlers_running { 0 };
+/// Faults on a removed region are ignored for this long, to let any that raced with the removal retry
+static constexpr uint64_t retire_ns = 1000000000ull;
+static struct sigaction old_action;
+static int uffd = -1;
+static uint64_t page_size = 0;
+
+static page_guard::region* find_region(uintptr_t address)
+{
+	const uint32_t count = region_count.load(std::memory_order_acquire);
+	page_guard::region* found = nullptr;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		page_guard::region* r = regions[i].load(std::memory_order_acquire);
+		if (!r || address < (uintptr_t)r->base || address >= (uintptr_t)r->base + r->size) continue;
+		if (!r->retired.load()) return r;
+		found = r; // the memory may have been mapped again at the same address, so keep looking
+	}
+	return found;
+}
+
+static void write_protect(page_guard::region* r, uint64_t first_page, uint64_t count, bool enable)
+{
+	char* start = r->base + first_page * page_size;
+	const uint64_t size = count * page_size;
+#ifdef UFFDIO_WRITEPROTECT_MODE_WP
+	if (r->uffd)
+	{
+		struct uffdio_writeprotect wp = {};
+		wp.range.start = (uintptr_t)start;
+		wp.range.len = size;
+		wp.mode = enable ? UFFDIO_WRITEPROTECT_MODE_WP : 0; // lifting it also wakes up the faulting thread
+		ioctl(uffd, UFFDIO_WRITEPROTECT, &wp);
+		return;
+	}
+#endif
+	mprotect(start, size, enable ? PROT_READ : PROT_READ | PROT_WRITE);
+}
+
+/// Called from the fault handlers. Returns false if the fault was not caused by us.
+static bool handle_write(uintptr_t address)
+{
+	handlers_running.fetch_add(1);
+	page_guard::region* r = find_region(address);
+	bool ours = (r != nullptr);
+	if (r && r->retired.load())
+	{
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		ours = ((uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec) - r->retired.load() < retire_ns; // if so, it is writable again
+	}
+	else if (r)
+	{
+		const uint64_t page = (address - (uintptr_t)r->base) / page_size;
+		while (r->spin.test_and_set(std::memory_order_acquire)) {}
+		r->written[page / 64].fetch_or(1ull << (page % 64), std::memory_order_relaxed);
+		write_protect(r, page, 1, false);
+		r->spin.clear(std::memory_order_release);
+		page_guard::instance().faults.fetch_add(1, std::memory_order_relaxed);
+	}
+	handlers_running.fetch_sub(1);
+	return ours;
+}
+
+static void segv_handler(int sig, siginfo_t* info, void* context)
+{
+	if (handle_write((uintptr_t)info->si_addr)) return;
+	// not ours, so pass it on
+	if (old_action.sa_flags & SA_SIGINFO)
+	{
+		if (old_action.sa_sigaction) old_action.sa_sigaction(sig, info, context);
+	}
+	else if (old_action.sa_handler == SIG_DFL || old_action.sa_handler == SIG_IGN)
+	{
+		signal(SIGSEGV, SIG_DFL); // and crash as normal when the instruction is retried
+	}
+	else old_action.sa_handler(sig);
+}
+
+page_guard& page_guard::instance()
+{
+	static page_guard* guard = new page_guard;
+	return *guard;
+}
+
+page_guard::modes page_guard::mode()
+{
+	return (modes)std::min<uint_fast8_t>(p__page_guard, (uint_fast8_t)modes::mprotect);
+}
+
+bool page_guard::init_uffd()
+{
+#if defined(UFFD_FEATURE_PAGEFAULT_FLAG_WP) && defined(UFFD_USER_MODE_ONLY)
+	uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	if (uffd == -1)
+	{
+		DLOG("Page guard cannot use userfaultfd: %s", strerror(errno));
+		return false;
+	}
+	struct uffdio_api api = {};
+	api.api = UFFD_API;
+	api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+	if (ioctl(uffd, UFFDIO_API, &api) == -1 || !(api.features & UFFD_FEATURE_PAGEFAULT_FLAG_WP))
+	{
+		DLOG("Page guard cannot use userfaultfd write-protection: %s", strerror(errno));
+		close(uffd);
+		uffd = -1;
+		return false;
+	}
+#ifdef UFFD_FEATURE_WP_UNPOPULATED
+	// a second handshake is needed to ask for optional features; the first told us what is available
+	const uint64_t available = api.features;
+	close(uffd);
+	uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	api = {};
+	api.api = UFFD_API;
+	api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP | (available & UFFD_FEATURE_WP_UNPOPULATED);
+	if (uffd == -1 || ioctl(uffd, UFFDIO_API, &api) == -1)
+	{
+		if (uffd != -1) close(uffd);
+		uffd = -1;
+		return false;
+	}
+	uffd_unpopulated = (api.features & UFFD_FEATURE_WP_UNPOPULATED);
+#endif
+	std::thread(&page_guard::uffd_thread_func, this).detach();
+	return true;
+#else
+	return false;
+#endif
+}
+
+void page_guard::uffd_thread_func()
+{
+#ifdef UFFD_FEATURE_PAGEFAULT_FLAG_WP
+	set_thread_name("pageguard");
+	struct pollfd fd = {};
+	fd.fd = uffd;
+	fd.events = POLLIN;
+	while (1)
+	{
+		const int r = poll(&fd, 1, -1);
+		if (r == -1 && errno == EINTR) continue;
+		if (r == -1) ABORT("Failed poll on userfaultfd: %s", strerror(errno));
+		struct uffd_msg msg;
+		const ssize_t len = read(uffd, &msg, sizeof(msg));
+		if (len == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+		if (len != sizeof(msg)) ABORT("Failed read on userfaultfd: %s", strerror(errno));
+		if (msg.event != UFFD_EVENT_PAGEFAULT || !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) continue;
+		if (!handle_write(msg.arg.pagefault.address)) // removed while faulting, make sure the thread wakes up
+		{
+			struct uffdio_range range = { aligned_start(msg.arg.pagefault.address, page_size), page_size };
+			ioctl(uffd, UFFDIO_WAKE, &range);
+		}
+	}
+#endif
+}
+
+void page_guard::sweep()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	const uint64_t now = (uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec;
+	std::vector<region*> expired;
+	for (auto it = retired.begin(); it != retired.end(); )
+	{
+		if (now - (*it)->retired.load() < retire_ns) { ++it; continue; }
+		for (uint32_t i = 0; i < region_count.load(); i++) if (regions[i].load() == *it) regions[i].store(nullptr);
+		expired.push_back(*it);
+		it = retired.erase(it);
+	}
+	if (expired.empty()) return;
+	while (handlers_running.load() > 0) std::this_thread::yield(); // anyone who found one of them is done with it
+	for (region* r : expired) delete r;
+}
+
+page_guard::region* page_guard::add(char* ptr, uint64_t size)
+{
+	if (mode() == modes::off || size == 0) return nullptr;
+	lava::lock_guard guard(mutex);
+	sweep();
+	if (page_size == 0) page_size = getpagesize();
+	if (mode() == modes::automatic && !uffd_tried)
+	{
+		uffd_tried = true;
+		if (init_uffd()) ILOG("Page guard using userfaultfd write-protection where possible");
+	}
+
+	region* r = new region;
+	r->base = (char*)aligned_start((uintptr_t)ptr, page_size);
+	r->size = aligned_size((uintptr_t)ptr + size, page_size) - (uintptr_t)r->base;
+	r->pages = r->size / page_size;
+	r->uffd = false;
+	r->written.reset(new std::atomic_uint64_t[(r->pages + 63) / 64]);
+	for (uint64_t i = 0; i < (r->pages + 63) / 64; i++) r->written[i].store(0);
+	r->dirty.resize((r->pages + 63) / 64, UINT64_MAX); // we do not know what happened before we started watching
+	uint32_t slot = 0;
+	while (slot < region_count.load() && regions[slot].load() != nullptr) slot++;
+	if (slot == max_regions)
+	{
+		WLOG("Too many mapped memory areas for the page guard, not watching %lu bytes at %p", (unsigned long)size, ptr);
+		delete r;
+		return nullptr;
+	}
+	regions[slot].store(r);
+	if (slot == region_count.load()) region_count.store(slot + 1, std::memory_order_release);
+
+#if defined(UFFDIO_REGISTER_MODE_WP) && defined(MADV_POPULATE_WRITE)
+	if (uffd != -1 && mode() == modes::automatic)
+	{
+		struct uffdio_register reg = {};
+		reg.range.start = (uintptr_t)r->base;
+		reg.range.len = r->size;
+		reg.mode = UFFDIO_REGISTER_MODE_WP;
+		if (ioctl(uffd, UFFDIO_REGISTER, &reg) == 0)
+		{
+			// pages that are not populated yet cannot be write-protected on older kernels
+			if ((reg.ioctls & (1ull << _UFFDIO_WRITEPROTECT)) && (uffd_unpopulated || madvise(r->base, r->size, MADV_POPULATE_WRITE) == 0))
+			{
+				r->uffd = true;
+			}
+			else
+			{
+				struct uffdio_range range = { (uintptr_t)r->base, r->size };
+				ioctl(uffd, UFFDIO_UNREGISTER, &range);
+			}
+		}
+	}
+#endif
+	if (!r->uffd && !handler_installed)
+	{
+		struct sigaction sa = {};
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_sigaction = segv_handler;
+		if (sigaction(SIGSEGV, &sa, &old_action) != 0) ABORT("Failed to set up page guard signal handler: %s", strerror(errno));
+		handler_installed = true;
+	}
+	write_protect(r, 0, r->pages, true);
+	if (r->uffd) uffd_regions++;
+	else mprotect_regions++;
+	return r;
+}
+
+void page_guard::remove(region* r)
+{
+	lava::lock_guard guard(mutex);
+	while (r->spin.test_and_set(std::memory_order_acquire)) {}
+#ifdef UFFDIO_REGISTER_MODE_WP
+	if (r->uffd)
+	{
+		write_protect(r, 0, r->pages, false);
+		struct uffdio_range range = { (uintptr_t)r->base, r->size };
+		ioctl(uffd, UFFDIO_UNREGISTER, &range);
+	}
+	else
+#endif
+	write_protect(r, 0, r->pages, false);
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	r->retired.store((uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec);
+	r->spin.clear(std::memory_order_release);
+	retired.push_back(r);
+	sweep();
+}
+
+void page_guard::collect(region* r)
+{
+	while (r->spin.test_and_set(std::memory_order_acquire)) {}
+	for (uint64_t word = 0; word < r->dirty.size(); word++)
+	{
+		uint64_t written = r->written[word].exchange(0, std::memory_order_relaxed);
+		r->dirty[word] |= written;
+		while (written) // protect each run of written pages with one call
+		{
+			const unsigned first = __builtin_ctzll(written);
+			const uint64_t shifted = written >> first;
+			const unsigned count = (shifted == UINT64_MAX) ? 64 : __builtin_ctzll(~shifted);
+			write_protect(r, word * 64 + first, count, true);
+			written = (first + count >= 64) ? 0 : written & (~0ull << (first + count));
+		}
+	}
+	r->spin.clear(std::memory_order_release);
+}
+
+void page_guard::dirty_ranges(const region* r, uint64_t first, uint64_t last, std::vector<range>& out) const
+{
+	assert(first <= last && last < r->size);
+	uint64_t page = first / page_size;
+	const uint64_t last_page = last / page_size;
+	while (page <= last_page)
+	{
+		if (!(r->dirty[page / 64] & (1ull << (page % 64)))) { page++; continue; }
+		const uint64_t start = page;
+		while (page <= last_page && (r->dirty[page / 64] & (1ull << (page % 64)))) page++;
+		out.push_back({ std::max(first, start * page_size), std::min(last, page * page_size - 1) });
+	}
+}
+
+void page_guard::clean(region* r, uint64_t first, uint64_t last)
+{
+	assert(first <= last && last < r->size);
+	const uint64_t start = (first + page_size - 1) / page_size; // only whole pages
+	const uint64_t end = (last + 1) / page_size;
+	for (uint64_t page = start; page < end; page++) r->dirty[page / 64] &= ~(1ull << (page % 64));
+}
@@ -0,0 +1,71 @@
+// Finding which pages of mapped host memory the app writes to, by write-protecting them
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "lavamutex.h"
+#include "rangetracking.h"
+
+/// Watches for writes to mapped memory. Each region is write-protected, and the first write to a page
+/// marks it dirty and lifts the protection for that page until we look at it again. Uses userfaultfd
+/// write-protection where the kernel and the memory support it, and mprotect plus a SIGSEGV handler
+/// otherwise. Regions must only be used while holding the lock of the memory they belong to.
+class page_guard
+{
+	page_guard(const page_guard&) = delete;
+	page_guard& operator=(const page_guard&) = delete;
+
+public:
+	enum class modes : uint8_t { off, automatic, mprotect };
+
+	struct region
+	{
+		char* base; // page aligned start of what we protect
+		uint64_t size; // page aligned size of what we protect
+		uint64_t pages;
+		bool uffd; // protected with userfaultfd, otherwise with mprotect
+		std::atomic_flag spin = ATOMIC_FLAG_INIT; // orders fault handling against collect()
+		std::atomic_uint64_t retired { 0 }; // when it was removed, faults that raced with the removal are ignored for a while
+		std::unique_ptr<std::atomic_uint64_t[]> written; // pages written since collect(), set by the fault handler
+		std::vector<uint64_t> dirty; // pages written since we last diffed them
+	};
+
+	/// Never destroyed, since app threads may still write to guarded memory while the process exits
+	static page_guard& instance();
+	static modes mode();
+
+	/// Start watching writes to the given mapped memory. All of it starts out dirty. Returns null if it
+	/// cannot be protected.
+	region* add(char* ptr, uint64_t size);
+	/// Stop watching and make the memory writable again. The region must not be used afterwards.
+	void remove(region* r);
+	/// Move the pages written since last time over to the dirty set, and write-protect them again.
+	void collect(region* r);
+	/// Append the dirty parts of the given range, in bytes relative to the region base, clipped to the range.
+	void dirty_ranges(const region* r, uint64_t first, uint64_t last, std::vector<range>& out) const;
+	/// Forget dirty pages that lie entirely inside the given range, since we just diffed it.
+	void clean(region* r, uint64_t first, uint64_t last);
+
+	// statistics
+	std::atomic_uint64_t faults { 0 };
+	std::atomic_uint64_t uffd_regions { 0 };
+	std::atomic_uint64_t mprotect_regions { 0 };
+	std::atomic_uint64_t scanned_bytes { 0 }; // diffed in guarded memory
+	std::atomic_uint64_t avoided_bytes { 0 }; // would have been diffed without the guard
+
+private:
+	page_guard() {}
+	bool init_uffd() REQUIRES(mutex);
+	void uffd_thread_func();
+	void sweep() REQUIRES(mutex);
+
+	lava::mutex mutex; // guards adding and removing regions
+	bool uffd_tried GUARDED_BY(mutex) = false;
+	bool handler_installed GUARDED_BY(mutex) = false;
+	bool uffd_unpopulated GUARDED_BY(mutex) = false; // kernel protects pages that are not yet populated
+	std::vector<region*> retired GUARDED_BY(mutex);
+};
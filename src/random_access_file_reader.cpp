@@ -88,6 +88,10 @@ void random_access_file_reader::initialize()
 		mCompressionAlgorithm = static_cast<uint8_t>(mMappedData[magic_size + 1]);
 		stream_offset = header_size;
 	}
+	if (mStreamVersion > LAVATUBE_STREAM_VERSION_PATCH_OPCODES)
+	{
+		ABORT("Unsupported stream version %u in random-access input \"%s\"", static_cast<unsigned>(mStreamVersion), mFilename.c_str());
+	}
 
 	if (mCompressionAlgorithm != LAVATUBE_COMPRESSION_DENSITY
 	    && mCompressionAlgorithm != LAVATUBE_COMPRESSION_LZ4
@@ -127,12 +131,45 @@ void random_access_file_reader::initialize()
 			ABORT("Uncompressed size overflow in random-access input \"%s\"", mFilename.c_str());
 		}
 
-		random_access_chunk_info info;
-		info.compressed_offset = stream_offset;
-		info.compressed_size = compressed_size;
-		info.uncompressed_offset = uncompressed_offset;
-		info.uncompressed_size = uncompressed_size;
-		mChunks.push_back(info);
+		// tagged streams tell us how each chunk is stored, otherwise the stream header does
+		uint64_t payload_offset = stream_offset;
+		uint64_t payload_size = compressed_size;
+		uint8_t codec = mCompressionAlgorithm;
+		uint8_t layout = (mStreamVersion == LAVATUBE_STREAM_VERSION_SUBBLOCKS) ? LAVATUBE_CHUNK_LAYOUT_SUBBLOCKS : LAVATUBE_CHUNK_LAYOUT_SINGLE;
+		if (mStreamVersion >= LAVATUBE_STREAM_VERSION_TAGGED)
+		{
+			chunk_tag tag;
+			if (compressed_size <= sizeof(tag))
+			{
+				ABORT("Truncated chunk tag at offset %lu in random-access input \"%s\"",
+				      static_cast<unsigned long>(stream_offset - chunk_header_size), mFilename.c_str());
+			}
+			memcpy(&tag, mMappedData + stream_offset, sizeof(tag));
+			if (tag.codec > LAVATUBE_COMPRESSION_LZ4 || tag.layout > LAVATUBE_CHUNK_LAYOUT_SUBBLOCKS)
+			{
+				ABORT("Invalid chunk tag at offset %lu in random-access input \"%s\"",
+				      static_cast<unsigned long>(stream_offset - chunk_header_size), mFilename.c_str());
+			}
+			codec = tag.codec;
+			layout = tag.layout;
+			payload_offset += sizeof(tag);
+			payload_size -= sizeof(tag);
+		}
+
+		if (layout == LAVATUBE_CHUNK_LAYOUT_SUBBLOCKS)
+		{
+			add_subblocks(payload_offset, payload_size, uncompressed_offset, uncompressed_size, codec);
+		}
+		else
+		{
+			random_access_chunk_info info;
+			info.compressed_offset = payload_offset;
+			info.compressed_size = payload_size;
+			info.uncompressed_offset = uncompressed_offset;
+			info.uncompressed_size = uncompressed_size;
+			info.codec = codec;
+			mChunks.push_back(info);
+		}
 
 		stream_offset += compressed_size;
 		uncompressed_offset += uncompressed_size;
@@ -144,6 +181,47 @@ void random_access_file_reader::initialize()
 	else madvise(const_cast<void*>(mZipMapping.map_base), mZipMapping.map_length, MADV_RANDOM);
 }
 
+void random_access_file_reader::add_subblocks(uint64_t payload_offset, uint64_t payload_size, uint64_t uncompressed_offset, uint64_t uncompressed_size, uint8_t codec)
+{
+	const char* payload = mMappedData + payload_offset;
+	subblock_table_header table;
+	if (payload_size < sizeof(table))
+	{
+		ABORT("Truncated sub-block table at offset %lu in random-access input \"%s\"", static_cast<unsigned long>(payload_offset), mFilename.c_str());
+	}
+	memcpy(&table, payload, sizeof(table));
+	if (table.block_count == 0 || table.block_size == 0 || subblock_table_size(table.block_count) > payload_size
+	    || (uncompressed_size + table.block_size - 1) / table.block_size != table.block_count)
+	{
+		ABORT("Invalid sub-block table at offset %lu in random-access input \"%s\"", static_cast<unsigned long>(payload_offset), mFilename.c_str());
+	}
+
+	uint64_t offset = subblock_table_size(table.block_count);
+	uint64_t remaining = uncompressed_size;
+	for (uint32_t i = 0; i < table.block_count; i++)
+	{
+		random_access_chunk_info info;
+		info.compressed_offset = payload_offset + offset;
+		info.compressed_size = subblock_compressed_size(payload, i);
+		info.uncompressed_offset = uncompressed_offset + (uncompressed_size - remaining);
+		info.uncompressed_size = std::min<uint64_t>(table.block_size, remaining);
+		info.codec = codec;
+		if (info.compressed_size == 0 || info.compressed_size > payload_size - offset)
+		{
+			ABORT("Sub-block %u at offset %lu exceeds its chunk in random-access input \"%s\"", i,
+			      static_cast<unsigned long>(payload_offset), mFilename.c_str());
+		}
+		mChunks.push_back(info);
+		offset += info.compressed_size;
+		remaining -= info.uncompressed_size;
+	}
+	if (offset != payload_size)
+	{
+		ABORT("Sub-blocks do not fill their chunk at offset %lu in random-access input \"%s\"",
+		      static_cast<unsigned long>(payload_offset), mFilename.c_str());
+	}
+}
+
 size_t random_access_file_reader::find_chunk(uint64_t position) const
 {
 	assert(position < mTotalUncompressed);
@@ -175,7 +253,7 @@ void random_access_file_reader::load_chunk(size_t chunk_index)
 		ABORT("Chunk %zu in random-access input \"%s\" is too large", chunk_index, mFilename.c_str());
 	}
 
-	if (mCompressionAlgorithm == LAVATUBE_COMPRESSION_DENSITY)
+	if (info.codec == LAVATUBE_COMPRESSION_DENSITY)
 	{
 		const uint64_t destination_size = density_decompress_safe_size(info.uncompressed_size);
 		if (destination_size > SIZE_MAX)
@@ -197,7 +275,7 @@ void random_access_file_reader::load_chunk(size_t chunk_index)
 	else
 	{
 		mChunkData.resize(static_cast<size_t>(info.uncompressed_size));
-		if (mCompressionAlgorithm == LAVATUBE_COMPRESSION_LZ4)
+		if (info.codec == LAVATUBE_COMPRESSION_LZ4)
 		{
 			if (info.compressed_size > INT_MAX || info.uncompressed_size > INT_MAX)
 			{
@@ -212,14 +290,12 @@ void random_access_file_reader::load_chunk(size_t chunk_index)
 		}
 		else
 		{
-			assert(mCompressionAlgorithm == LAVATUBE_COMPRESSION_UNCOMPRESSED);
+			assert(info.codec == LAVATUBE_COMPRESSION_UNCOMPRESSED);
 			// Version 3 file_writer streams include the chunk header size in compressed_size for
-			// uncompressed chunks. The streaming reader consumes those streams by copying only
-			// uncompressed_size bytes and advancing by the larger stored compressed_size.
-			const uint64_t header_size = sizeof(uint64_t) * 2;
-			const bool legacy_size_valid = info.uncompressed_size <= std::numeric_limits<uint64_t>::max() - header_size
-				&& info.compressed_size == info.uncompressed_size + header_size;
-			if (info.compressed_size != info.uncompressed_size && !legacy_size_valid)
+			// uncompressed chunks, and big uncompressed chunks may be padded (see stored_chunk_alignment).
+			// The streaming reader consumes those streams by copying only uncompressed_size bytes and
+			// advancing by the larger stored compressed_size.
+			if (info.compressed_size < info.uncompressed_size)
 			{
 				ABORT("Uncompressed chunk %zu has mismatched sizes in random-access input \"%s\"", chunk_index, mFilename.c_str());
 			}
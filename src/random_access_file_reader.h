@@ -13,6 +13,8 @@
 #include "packfile.h"
 #include "util.h"
 
+/// One independently decompressible block of the stream. For sub-block streams, this is a sub-block, so that
+/// reads only need to decompress the sub-block they touch; otherwise it is a whole chunk.
 struct random_access_chunk_info
 {
 	/// Offset of the compressed payload from the start of the mapped stream entry.
@@ -21,6 +23,8 @@ struct random_access_chunk_info
 	/// Offset of this chunk in the logical uncompressed stream.
 	uint64_t uncompressed_offset = 0;
 	uint64_t uncompressed_size = 0;
+	/// Compression algorithm of this chunk, which can vary from chunk to chunk in tagged streams.
+	uint8_t codec = LAVATUBE_COMPRESSION_DENSITY;
 };
 
 /// Synchronous seekable reader for a chunk-compressed lavatube stream. Construction scans only
@@ -102,6 +106,8 @@ private:
 	}
 
 	void initialize();
+	/// Add directory entries for each sub-block of a chunk in a sub-block stream.
+	void add_subblocks(uint64_t payload_offset, uint64_t payload_size, uint64_t uncompressed_offset, uint64_t uncompressed_size, uint8_t codec);
 	size_t find_chunk(uint64_t position) const;
 	void load_chunk(size_t chunk_index);
 
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <map>
 #include <utility>
 #include <vector>
 
@@ -27,15 +28,18 @@ struct exposure
 	/// Return span of overlapping elements
 	range overlap(const exposure& e, uint64_t offset = 0) const
 	{
-		normalize();
-		e.normalize();
 		range retval = range::invalid();
-		if (e.r.empty() || r.empty()) return retval;
-		if (e.r.front().first > UINT64_MAX - offset) return retval;
+		if (e.size() == 0 || size() == 0) return retval;
+		const range other_span = e.span();
+		const range our_span = span();
+		if (other_span.first > UINT64_MAX - offset) return retval;
 
-		const uint64_t first_other = e.r.front().first + offset;
-		const uint64_t last_other = (e.r.back().last > UINT64_MAX - offset) ? UINT64_MAX : e.r.back().last + offset;
-		if (last_other < r.front().first || first_other > r.back().last) return retval;
+		const uint64_t first_other = other_span.first + offset;
+		const uint64_t last_other = (other_span.last > UINT64_MAX - offset) ? UINT64_MAX : other_span.last + offset;
+		if (last_other < our_span.first || first_other > our_span.last) return retval;
+		if (tree_mode || e.tree_mode || std::min(size(), e.size()) * 32 < std::max(size(), e.size())) return overlap_probed(e, offset);
+		normalize();
+		e.normalize();
 		if (e.r.size() == 1 && r.size() == 1)
 		{
 			return {
@@ -84,6 +88,7 @@ struct exposure
 	/// Return span of all contained elements
 	range span() const
 	{
+		if (tree_mode) return { tree.begin()->first, tree.rbegin()->second };
 		if (r.empty()) return range::invalid();
 		if (reversed) return { r.back().first, r.front().last };
 		return { r.front().first, r.back().last };
@@ -92,6 +97,91 @@ struct exposure
 	void add(uint64_t start, uint64_t end)
 	{
 		assert(start <= end);
+		if (!tree_mode && r.size() > tree_threshold && !(reversed ? (end != UINT64_MAX && end + 1 < r.back().first) : start >= r.back().first))
+		{
+			to_tree(); // would insert in the middle
+		}
+		if (tree_mode) tree_add(start, end);
+		else add_sorted(start, end);
+	}
+
+	inline range fetch_os(uint64_t offset, uint64_t size, bool is_mapped) { if (size == 0) return range::invalid(); return fetch(offset, offset + size - 1, is_mapped); }
+	inline range fetch(range v, bool is_mapped) { return fetch(v.first, v.last, is_mapped); }
+
+	/// Return the smallest exposed area inside the given region, or an invalid range if none.
+	/// is_mapped means is true if area is currently memory mapped, false if not. If not,
+	/// we remove the returned range.
+	range fetch(uint64_t start, uint64_t end, bool is_mapped)
+	{
+		assert(start <= end);
+		if (!tree_mode && !is_mapped && r.size() > tree_threshold) to_tree(); // would remove from the middle
+		if (!tree_mode) return fetch_sorted(start, end, is_mapped);
+		const range retval = tree_fetch(start, end, is_mapped);
+		if (tree.size() < tree_threshold / 4) to_sorted();
+		return retval;
+	}
+
+	void self_test() const
+	{
+		if (tree_mode)
+		{
+			assert(r.empty() || r.size() == tree.size()); // only a copy for list()
+			assert(!tree.empty());
+			uint64_t prev = 0;
+			bool first = true;
+			for (const auto& pair : tree)
+			{
+				assert(pair.first <= pair.second);
+				assert(first || pair.first > prev);
+				first = false;
+				prev = pair.second;
+			}
+			return;
+		}
+		normalize();
+		uint64_t prev = 0;
+		bool first = true;
+		for (auto& s : r)
+		{
+			assert(s.first <= s.last);
+			assert(first || s.first > prev);
+			first = false;
+			prev = s.last;
+			(void)prev; // silence compiler warning for release builds
+			(void)first; // ditto
+		}
+	}
+
+	inline const std::vector<range>& list() const
+	{
+		if (tree_mode) // make a sorted copy
+		{
+			r.clear();
+			for (const auto& pair : tree) r.push_back({ pair.first, pair.second });
+			return r;
+		}
+		normalize();
+		return r;
+	}
+	inline size_t bytes() const
+	{
+		size_t v = 0;
+		if (tree_mode) for (const auto& pair : tree) v += 1 + pair.second - pair.first;
+		else for (auto& s : r) v += 1 + s.last - s.first;
+		return v;
+	}
+	inline void clear() { r.clear(); tree.clear(); reversed = false; tree_mode = false; }
+	inline size_t size() const { return tree_mode ? tree.size() : r.size(); }
+	inline bool is_tree() const { return tree_mode; }
+
+	/// Above this many separate ranges, we move them into a balanced tree once we need to add or remove ranges in the
+	/// middle, so that this stays cheap. Appending stays in the sorted list. We go back to a list when we drop below
+	/// a quarter of this.
+	static constexpr size_t tree_threshold = 512;
+
+private:
+	void add_sorted(uint64_t start, uint64_t end)
+	{
 		if (r.empty())
 		{
 			r.push_back({start, end});
@@ -159,15 +249,8 @@ struct exposure
 		r.erase(r.begin() + first + 1, r.begin() + current);
 	}
 
-	inline range fetch_os(uint64_t offset, uint64_t size, bool is_mapped) { if (size == 0) return range::invalid(); return fetch(offset, offset + size - 1, is_mapped); }
-	inline range fetch(range v, bool is_mapped) { return fetch(v.first, v.last, is_mapped); }
-
-	/// Return the smallest exposed area inside the given region, or an invalid range if none.
-	/// is_mapped means is true if area is currently memory mapped, false if not. If not,
-	/// we remove the returned range.
-	range fetch(uint64_t start, uint64_t end, bool is_mapped)
+	range fetch_sorted(uint64_t start, uint64_t end, bool is_mapped)
 	{
-		assert(start <= end);
 		normalize();
 		range retval = range::invalid();
 		if (r.empty() || end < r.front().first || start > r.back().last) return retval;
@@ -206,7 +289,8 @@ struct exposure
 			return retval;
 		}
 
-		for (size_t i = 0; i < r.size(); )
+		auto from = std::lower_bound(r.begin(), r.end(), start, [](const range& s, uint64_t value) { return s.last < value; });
+		for (size_t i = (size_t)(from - r.begin()); i < r.size(); )
 		{
 			auto& s = r[i];
 			if (s.first > end) break;
@@ -260,28 +344,128 @@ struct exposure
 		return retval;
 	}
 
-	void self_test() const
+	void to_tree()
 	{
 		normalize();
-		uint64_t prev = 0;
-		bool first = true;
-		for (auto& s : r)
+		for (const range& s : r) tree.emplace_hint(tree.end(), s.first, s.last);
+		r.clear();
+		tree_mode = true;
+	}
+
+	void to_sorted()
+	{
+		r.clear();
+		for (const auto& pair : tree) r.push_back({ pair.first, pair.second });
+		tree.clear();
+		tree_mode = false;
+	}
+
+	void tree_add(uint64_t start, uint64_t end)
+	{
+		r.clear(); // no longer a valid copy
+		auto iter = tree.upper_bound(start);
+		if (iter != tree.begin())
 		{
-			assert(s.first <= s.last);
-			assert(first || s.first > prev);
-			first = false;
-			prev = s.last;
-			(void)prev; // silence compiler warning for release builds
-			(void)first; // ditto
+			auto prev = std::prev(iter);
+			if (prev->second == UINT64_MAX || prev->second + 1 >= start) iter = prev; // touches or overlaps us
+		}
+		while (iter != tree.end() && (end == UINT64_MAX || iter->first <= end + 1))
+		{
+			start = std::min(start, iter->first);
+			end = std::max(end, iter->second);
+			iter = tree.erase(iter);
+		}
+		tree.emplace_hint(iter, start, end);
+	}
+
+	range tree_fetch(uint64_t start, uint64_t end, bool is_mapped)
+	{
+		range retval = range::invalid();
+		auto iter = tree.upper_bound(start);
+		if (iter != tree.begin() && std::prev(iter)->second >= start) iter = std::prev(iter);
+		while (iter != tree.end() && iter->first <= end)
+		{
+			const uint64_t s_first = iter->first;
+			const uint64_t s_last = iter->second;
+			const uint64_t first = std::max(s_first, start);
+			const uint64_t last = std::min(s_last, end);
+			if (!retval.valid()) retval = { first, last };
+			else retval.last = std::max(retval.last, last); // ranges come in order
+			if (is_mapped)
+			{
+				iter++;
+				continue;
+			}
+			r.clear(); // no longer a valid copy
+			if (s_first >= start && s_last <= end) // consumed entirely
+			{
+				iter = tree.erase(iter);
+				continue;
+			}
+			if (s_first < start) // remove from end, and maybe split in two
+			{
+				iter->second = start - 1;
+				iter++;
+				if (s_last <= end) continue;
+			}
+			else iter = tree.erase(iter); // remove from start
+			tree.emplace_hint(iter, end + 1, s_last);
+			break;
+		}
+		return retval;
+	}
+
+	/// Find the part of the given region that overlaps any of our ranges
+	range probe(uint64_t first, uint64_t last) const
+	{
+		range retval = range::invalid();
+		if (tree_mode)
+		{
+			auto iter = tree.upper_bound(first);
+			if (iter != tree.begin() && std::prev(iter)->second >= first) iter = std::prev(iter);
+			if (iter == tree.end() || iter->first > last) return retval;
+			retval.first = std::max(iter->first, first);
+			auto end = std::prev(tree.upper_bound(last)); // exists, since iter is before it
+			retval.last = std::min(end->second, last);
+			return retval;
 		}
+		normalize();
+		auto iter = std::lower_bound(r.begin(), r.end(), first, [](const range& s, uint64_t value) { return s.last < value; });
+		if (iter == r.end() || iter->first > last) return retval;
+		retval.first = std::max(iter->first, first);
+		auto end = std::upper_bound(r.begin(), r.end(), last, [](uint64_t value, const range& s) { return value < s.first; }) - 1;
+		retval.last = std::min(end->last, last);
+		return retval;
 	}
 
-	inline const std::vector<range>& list() const { normalize(); return r; }
-	inline size_t bytes() const { size_t v = 0; for (auto& s : r) { v += 1 + s.last - s.first; } return v; }
-	inline void clear() { r.clear(); reversed = false; }
-	inline size_t size() const { return r.size(); }
+	/// overlap() when either side is a tree or much bigger: look up each range of the smaller side in the bigger side
+	range overlap_probed(const exposure& e, uint64_t offset) const
+	{
+		range retval = range::invalid();
+		auto merge = [&retval](range v)
+		{
+			if (!v.valid()) return;
+			if (!retval.valid()) retval = v;
+			else retval = { std::min(retval.first, v.first), std::max(retval.last, v.last) };
+		};
+		if (e.size() <= size())
+		{
+			for (const range& s : e.list())
+			{
+				if (s.first > UINT64_MAX - offset) break;
+				merge(probe(s.first + offset, (s.last > UINT64_MAX - offset) ? UINT64_MAX : s.last + offset));
+			}
+			return retval;
+		}
+		for (const range& s : list())
+		{
+			if (s.last < offset) continue;
+			const range v = e.probe((s.first < offset) ? 0 : s.first - offset, s.last - offset);
+			if (v.valid()) merge({ v.first + offset, (v.last > UINT64_MAX - offset) ? UINT64_MAX : v.last + offset });
+		}
+		return retval;
+	}
 
-private:
 	void normalize() const
 	{
 		if (!reversed) return;
@@ -289,6 +473,127 @@ private:
 		reversed = false;
 	}
 
-	mutable std::vector<range> r;
+	mutable std::vector<range> r; // sorted ranges, or a copy of the tree made for list()
 	mutable bool reversed = false;
+	std::map<uint64_t, uint64_t> tree; // first to last of each range, once we have too many for a sorted list
+	bool tree_mode = false;
+};
+
+/// Touched ranges of a number of objects, as command buffers and descriptor sets collect them while recording. Objects
+/// are looked up in a small open-addressed table, and the object we looked up last is tried first, since the same
+/// object is often touched many times in a row. Entries are kept in a flat list and reused with their range storage
+/// after clear(), which is O(1), so recording stops allocating once a command buffer has been reset a few times.
+template<typename T>
+class touched_ranges
+{
+public:
+	struct entry
+	{
+		T first; // the object
+		exposure second; // its touched ranges
+	};
+
+	/// Add by offset + size
+	inline void add_os(T key, uint64_t offset, uint64_t size) { if (size > 0) get(key).add(offset, offset + size - 1); }
+
+	/// Add all touched ranges of another set
+	void merge(const touched_ranges& other)
+	{
+		if (&other == this) return; // would change nothing
+		for (const entry& e : other)
+		{
+			const bool existing = (find(e.first) != nullptr);
+			exposure& dst = get(e.first);
+			if (!existing) dst = e.second; // reuses our storage
+			else for (const range& r : e.second.list()) dst.add(r.first, r.last);
+		}
+	}
+
+	/// Return the touched ranges of the object, adding it if it is not already there
+	exposure& get(T key)
+	{
+		if (last < used && entries[last].first == key) return entries[last].second;
+		if ((used + 1) * 2 > slots.size()) grow();
+		const uint32_t mask = slots.size() - 1;
+		for (uint32_t i = hash(key) & mask; ; i = (i + 1) & mask)
+		{
+			slot& s = slots[i];
+			if (s.generation != generation)
+			{
+				s = { generation, used };
+				if (used == entries.size()) entries.emplace_back();
+				entry& e = entries[used];
+				e.first = key;
+				e.second.clear();
+				last = used++;
+				return e.second;
+			}
+			if (entries[s.index].first == key)
+			{
+				last = s.index;
+				return entries[s.index].second;
+			}
+		}
+	}
+
+	/// Return the touched ranges of the object, or null if it was not touched
+	const exposure* find(T key) const
+	{
+		if (slots.empty()) return nullptr;
+		const uint32_t mask = slots.size() - 1;
+		for (uint32_t i = hash(key) & mask; ; i = (i + 1) & mask)
+		{
+			const slot& s = slots[i];
+			if (s.generation != generation) return nullptr;
+			if (entries[s.index].first == key) return &entries[s.index].second;
+		}
+	}
+
+	inline size_t count(T key) const { return find(key) ? 1 : 0; }
+	inline size_t size() const { return used; }
+	inline bool empty() const { return used == 0; }
+	/// Forget all objects, but keep our storage for reuse
+	inline void clear()
+	{
+		used = 0;
+		last = UINT32_MAX;
+		if (++generation == 0) // wrapped around, so old slots could look current
+		{
+			std::fill(slots.begin(), slots.end(), slot{ 0, 0 });
+			generation = 1;
+		}
+	}
+
+	inline const entry* begin() const { return entries.data(); }
+	inline const entry* end() const { return entries.data() + used; }
+	inline entry* begin() { return entries.data(); }
+	inline entry* end() { return entries.data() + used; }
+
+private:
+	struct slot
+	{
+		uint32_t generation; // slot is only in use if this is our current generation
+		uint32_t index; // into entries
+	};
+
+	static inline uint32_t hash(T key) { return (uint32_t)(((uint64_t)(uintptr_t)key * 0x9e3779b97f4a7c15ull) >> 32); }
+
+	void grow()
+	{
+		slots.assign(std::max<size_t>(16, slots.size() * 2), slot{ 0, 0 });
+		generation = 1;
+		const uint32_t mask = slots.size() - 1;
+		for (uint32_t index = 0; index < used; index++)
+		{
+			uint32_t i = hash(entries[index].first) & mask;
+			while (slots[i].generation == generation) i = (i + 1) & mask;
+			slots[i] = { generation, index };
+		}
+	}
+
+	std::vector<entry> entries; // only the first used are in use, the rest are kept for their storage
+	std::vector<slot> slots; // power of two sized, never more than half full
+	uint32_t used = 0;
+	uint32_t generation = 1;
+	uint32_t last = UINT32_MAX; // entry we looked up last
 };
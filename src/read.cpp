@@ -86,6 +86,7 @@ static bool requested_extensions_contains(const std::vector<std::string>& extens
 
 lava_file_reader::lava_file_reader(lava_reader* _parent, const std::string& path, int mytid, int frames, const Json::Value& frameinfo, size_t uncompressed_size, size_t uncompressed_target, int start, int end)
 	: file_reader(packed_open("thread_" + std::to_string(mytid) + ".bin", path), mytid, uncompressed_size, uncompressed_target, start == 0)
+	, waited_on(_parent->threads.size())
 {
 	parent = _parent;
 	run_type = parent->run_type;
@@ -190,6 +191,7 @@ uint8_t lava_file_reader::step()
 	}
 	release_checkpoint();
 	current_packet_start = read_position;
+	set_checkpoint(); // keep the whole packet around, since it may be looked at again through stream_data()
 	const uint8_t r = read_uint8_t();
 	assert(r != 0); // invalid value for instrtype
 	current_packet_size = read_uint32_t();
@@ -231,7 +233,14 @@ void lava_file_reader::complete_packet()
 	}
 	current_packet_open = false;
 	current.packet++;
-	parent->thread_packet_numbers->at(current.thread).fetch_add(1, std::memory_order_relaxed);
+	parent->thread_packet_numbers->at(current.thread).fetch_add(1); // must be seen by waiters before we check for them below
+	lava_reader::packet_waiters& w = parent->thread_packet_waiters->at(current.thread);
+	if (w.waiters.load())
+	{
+		w.wake.fetch_add(1);
+		w.wake.notify_all();
+		if (parent->scheduler) parent->scheduler->wake(parent->thread_packet_numbers->at(current.thread));
+	}
 	pool.reset();
 }
 
@@ -473,6 +482,7 @@ void print_params_packet(callback_context& cb)
 lava_reader::~lava_reader()
 {
 	delete thread_packet_numbers;
+	delete thread_packet_waiters;
 	for (auto& t : thread_streams)
 	{
 		delete t;
@@ -480,6 +490,16 @@ lava_reader::~lava_reader()
 	thread_streams.clear();
 }
 
+static Json::Value wait_stats_json(const wait_stats& stats)
+{
+	Json::Value v;
+	v["count"] = (Json::UInt64)stats.count.load(std::memory_order_relaxed);
+	v["time_ns"] = (Json::UInt64)stats.time_ns.load(std::memory_order_relaxed);
+	v["histogram"] = Json::arrayValue;
+	for (const auto& bucket : stats.histogram) v["histogram"].append((Json::UInt64)bucket.load(std::memory_order_relaxed));
+	return v;
+}
+
 void lava_reader::finalize()
 {
 	const double total_time_ms = ((gettime() - mStartTime.load()) / 1000000UL);
@@ -491,6 +511,7 @@ void lava_reader::finalize()
 	out["time"] = total_time_ms;
 	uint64_t runner = 0;
 	uint64_t worker = 0;
+	uint64_t decompressed = 0;
 	for (unsigned i = 0; i < threads.size(); i++)
 	{
 		uint64_t runner_local = 0;
@@ -499,6 +520,7 @@ void lava_reader::finalize()
 		DLOG("CPU time thread %u - readahead worker %lu, API runner %lu", i, (long unsigned)worker_local, (long unsigned)runner_local);
 		runner += runner_local;
 		worker += worker_local;
+		decompressed += thread_streams[i]->measured_bytes();
 	}
 	struct timespec stop_process_cpu_usage;
 	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &stop_process_cpu_usage) != 0)
@@ -514,10 +536,36 @@ void lava_reader::finalize()
 	{
 		process_time = diff_timespec(&stop_process_cpu_usage, &process_cpu_usage);
 	}
+	if (scheduler) runner += scheduler->cpu_time(); // trace threads move between workers, so measure those instead
 	if (is_replay()) ILOG("CPU time spent in ms - readahead workers %lu, API runners %lu, full process %lu", (long unsigned)worker, (long unsigned)runner, (long unsigned)process_time);
+	const double worker_per_byte = decompressed ? (double)worker * 1000.0 / (double)decompressed : 0.0; // in nanoseconds
+	if (is_replay() && decompressed) ILOG("Decompressed %lu mb using %.3f ns of CPU time per byte", (long unsigned)(decompressed / (1024 * 1024)), worker_per_byte);
 	out["readahead_workers_time"] = worker;
+	out["decompressed_bytes"] = (Json::Value::UInt64)decompressed;
+	out["decompressor_ns_per_byte"] = worker_per_byte;
 	out["api_runners_time"] = runner;
 	out["process_time"] = process_time;
+	out["threads"] = Json::arrayValue;
+	for (unsigned i = 0; i < threads.size(); i++)
+	{
+		const lava_file_reader& reader = *thread_streams[i];
+		Json::Value v;
+		v["thread"] = i;
+		v["handle_waits"] = wait_stats_json(reader.handle_waits);
+		v["barrier_waits"] = wait_stats_json(reader.barrier_waits);
+		v["decompressor_starvation"] = wait_stats_json(reader.starved);
+		v["decompressed_bytes"] = (Json::Value::UInt64)reader.measured_bytes();
+		v["gpu_waits"] = wait_stats_json(reader.gpu_waits);
+		v["waited_on"] = Json::arrayValue;
+		for (unsigned j = 0; j < reader.waited_on.size(); j++)
+		{
+			if (reader.waited_on[j].count.load(std::memory_order_relaxed) == 0) continue;
+			Json::Value w = wait_stats_json(reader.waited_on[j]);
+			w["thread"] = j;
+			v["waited_on"].append(w);
+		}
+		out["threads"].append(v);
+	}
 	if (out_fptr)
 	{
 		write_json(out_fptr, out);
@@ -633,6 +681,7 @@ void lava_reader::init_metadata(const std::string& path)
 	// initialize threads -- note that this happens before threading begins, so thread safe
 	threads.resize(num_threads);
 	thread_packet_numbers = new std::vector<std::atomic_uint_fast32_t>(num_threads);
+	thread_packet_waiters = new std::vector<packet_waiters>(num_threads);
 }
 
 void lava_reader::init(const std::string& path)
@@ -18,6 +18,7 @@
 #include "containers.h"
 #include "lavatube.h"
 #include "filereader.h"
+#include "replay_scheduler.h"
 #include "jsoncpp/json/value.h"
 #include "replay_screenshot.h"
 
@@ -149,6 +150,12 @@ public:
 	void request_stop(VkDevice cleanup_device = VK_NULL_HANDLE)
 	{
 		mStopRequested.store(true, std::memory_order_release);
+		if (thread_packet_waiters) for (packet_waiters& w : *thread_packet_waiters) // wake everyone waiting on another thread
+		{
+			w.wake.fetch_add(1);
+			w.wake.notify_all();
+		}
+		if (scheduler) scheduler->wake_all();
 		if (cleanup_device != VK_NULL_HANDLE)
 		{
 			const uintptr_t requested = reinterpret_cast<uintptr_t>(cleanup_device);
@@ -161,6 +168,18 @@ public:
 
 	std::vector<std::atomic_uint_fast32_t>* thread_packet_numbers = nullptr; // thread local packet numbers
 
+	/// Threads waiting for packets of another thread to complete sleep on its wake counter. It is only bumped when
+	/// someone waits, so that completing packets costs nothing extra otherwise.
+	struct packet_waiters
+	{
+		std::atomic_uint32_t waiters { 0 };
+		std::atomic_uint32_t wake { 0 };
+	};
+	std::vector<packet_waiters>* thread_packet_waiters = nullptr;
+
+	/// Set when we replay trace threads as fibers on fewer worker threads
+	replay_scheduler* scheduler = nullptr;
+
 	// This is thread safe since we allocate it all before threading begins.
 	address_remapper<trackedobject> device_address_remapping;
 	address_remapper<trackedaccelerationstructure> acceleration_structure_address_remapping;
@@ -332,7 +351,7 @@ public:
 
 	inline int thread_index() const { return current.thread; }
 	inline uint64_t stream_position() const { return read_position; }
-	inline const char* stream_data(uint64_t pos) const { return uncompressed_data + pos; }
+	inline const char* stream_data(uint64_t pos) const { return window_pointer(pos); }
 	inline uint64_t packet_start() const { return current_packet_start; }
 	inline uint64_t packet_end() const { return current_packet_end; }
 	inline uint32_t packet_size() const { return current_packet_size; }
@@ -357,6 +376,8 @@ public:
 	inline void read_handle_array(uint32_t* dest, uint32_t length) { for (uint32_t i = 0; i < length; i++) dest[i] = read_handle(); }
 #endif
 	inline void read_barrier();
+	/// Wait until the given thread has completed the given number of packets
+	inline void wait_for_packets(int thread, uint32_t packets, wait_stats& stats);
 	const std::vector<unsigned>& barrier_packet_indices() const { return current_barrier_packet_indices; }
 	uint16_t read_apicall();
 
@@ -371,29 +392,26 @@ public:
 	{
 		char* ptr = buf;
 		uint32_t offset;
-		uint32_t size;
+		uint32_t field;
 		uint64_t changed = 0;
 		do {
 			offset = read_uint32_t();
 			ptr += offset;
 			// cppcheck-suppress nullPointerRedundantCheck
 			assert(maxsize == 0 || ptr <= buf + maxsize);
-			size = read_uint32_t();
-			check_space(size);
-			const char* uptr = uncompressed_data + read_position;
+			field = read_uint32_t();
+			const uint32_t size = read_patch_record(buf ? ptr : nullptr, field);
 			if (buf && size)
 			{
-				memcpy(ptr, uptr, size);
 				const VkDeviceSize base_offset = (VkDeviceSize)(ptr - buf);
 				regions.register_source(base_offset, size, current, 1, 0, object_type, object_index);
 			}
-			read_position += size;
 			ptr += size;
 			changed += size;
 			// cppcheck-suppress nullPointerRedundantCheck
 			assert(maxsize == 0 || ptr <= buf + maxsize);
 		}
-		while (!(offset == 0 && size == 0));
+		while (!(offset == 0 && field == 0));
 		return changed;
 	}
 
@@ -463,6 +481,16 @@ public:
 	std::deque<VkAccelerationStructureBuildSizesInfoKHR> pending_as_build_sizes;
 	std::deque<internal_buffer> pending_as_storage_buffers;
 
+	// Wait profiling. Handle and barrier waits are also counted for each thread waited on.
+	wait_stats handle_waits;
+	wait_stats barrier_waits;
+	wait_stats gpu_waits;
+	std::vector<wait_stats> waited_on;
+	uint64_t gpu_wait_start = 0;
+
+	/// Set when this trace thread is replayed as a fiber, see replay_scheduler
+	replay_scheduler::fiber* fiber = nullptr;
+
 	/// Is this reader's thread terminated?
 	std::atomic_bool terminated{ false };
 
@@ -508,6 +536,64 @@ private:
 	uint32_t isolated_print_frame = 0;
 };
 
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#endif
+}
+
+inline void lava_file_reader::wait_for_packets(int thread, uint32_t packets, wait_stats& stats)
+{
+	const std::atomic_uint_fast32_t& completed = parent->thread_packet_numbers->at(thread);
+	const uint64_t start = gettime();
+	auto done = [&]()
+	{
+		const uint64_t ns = gettime() - start;
+		stats.add(ns);
+		if (thread < (int)waited_on.size()) waited_on[thread].add(ns);
+	};
+	if (fiber) // let another trace thread have our worker while we wait
+	{
+		for (unsigned i = 0; i < 64 && completed.load(std::memory_order_acquire) < packets; i++) cpu_relax();
+		while (completed.load(std::memory_order_acquire) < packets)
+		{
+			if (parent->stop_requested()) throw_stop_requested();
+			parent->scheduler->park(fiber, completed, packets, parent->thread_packet_waiters->at(thread).waiters);
+		}
+		done();
+		return;
+	}
+	// Most waits are short, so spin a little before we go to sleep
+	for (unsigned i = 0; i < 256; i++)
+	{
+		if (completed.load(std::memory_order_acquire) >= packets)
+		{
+			done();
+			return;
+		}
+		if (i < 192) cpu_relax();
+		else std::this_thread::yield();
+	}
+	lava_reader::packet_waiters& w = parent->thread_packet_waiters->at(thread);
+	w.waiters.fetch_add(1); // must be seen by complete_packet() before we check the packet count below
+	while (true)
+	{
+		const uint32_t seen = w.wake.load();
+		if (completed.load() >= packets) break;
+		if (parent->stop_requested())
+		{
+			w.waiters.fetch_sub(1);
+			throw_stop_requested();
+		}
+		w.wake.wait(seen);
+	}
+	w.waiters.fetch_sub(1);
+	done();
+}
+
 inline void lava_file_reader::read_barrier()
 {
 	const unsigned size = read_uint8_t();
@@ -530,11 +616,7 @@ inline void lava_file_reader::read_barrier()
 			cli_wait_packet.store(packet_index, std::memory_order_relaxed);
 			cli_state.store(cli_thread_state::wait_barrier, std::memory_order_release);
 		}
-		while (i != current.thread && packet_index > parent->thread_packet_numbers->at(i).load(std::memory_order_relaxed))
-		{
-			if (parent->stop_requested()) throw_stop_requested();
-			usleep(1);
-		}
+		if (i != current.thread && packet_index > parent->thread_packet_numbers->at(i).load(std::memory_order_relaxed)) wait_for_packets(i, packet_index, barrier_waits);
 		if (publish_wait) cli_state.store(cli_thread_state::running, std::memory_order_release);
 	}
 	DLOG2("[t%02d] Passed thread barrier, waited for %u threads", (int)current.thread, size);
@@ -563,12 +645,7 @@ inline uint32_t lava_file_reader::read_handle(DEBUGPARAM(const char* name))
 		cli_wait_packet.store(req_packet, std::memory_order_relaxed);
 		cli_state.store(cli_thread_state::wait_handle, std::memory_order_release);
 	}
-	while (req_packet >= completed_packets)
-	{
-		if (parent->stop_requested()) throw_stop_requested();
-		usleep(1);
-		completed_packets = parent->thread_packet_numbers->at(req_thread).load(std::memory_order_relaxed);
-	}
+	if (req_packet >= completed_packets) wait_for_packets(req_thread, req_packet + 1, handle_waits);
 	if (publish_wait) cli_state.store(cli_thread_state::running, std::memory_order_release);
 	return index;
 }
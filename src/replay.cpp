@@ -483,6 +483,10 @@ void usage()
 	printf("--screenshot-prefix p  Prefix for screenshot PNG names, producing p<frame>.png\n");
 	printf("--skip-missing-input   Exit with code 77 if the input trace file does not exist\n");
 	printf("--no-multithreaded-io  Do not do decompression and file read in a separate thread. May save some CPU load and memory.\n");
+	printf("--replay-threads num   Replay all trace threads on this many threads (default one for each trace thread)\n");
+	printf("--decompression-threads num  Decompress all trace threads on at most this many threads (default picked based on core count)\n");
+	printf("--huge-pages           Decompress into memory backed by transparent huge pages\n");
+	printf("--prefault             Fault in memory for the readahead buffer before starting replay\n");
 	printf("-s/--sandbox level     Set security sandbox level (from 1 to 3, with 3 the most strict, default %d)\n", (int)p__sandbox_level);
 	printf("--skip-remove-unused   Do not attempt to cleverly remove unused features and extensions\n");
 	printf("--device-fault-report  Track more data for device fault diagnosis\n");
@@ -1207,11 +1211,13 @@ static void service_listener(service_client_state* client_state)
 	}
 }
 
-static void replay_thread(int thread_id)
+static void replay_thread(int thread_id, replay_scheduler::fiber* fiber)
 {
 	lava_file_reader& t = replayer.file_reader(thread_id);
 	t.cli_state.store(cli_thread_state::running, std::memory_order_release);
-	t.bind_runner_thread();
+	t.fiber = fiber;
+	if (fiber) t.skip_runner_measurement();
+	else t.bind_runner_thread();
 	if (t.start_measurement_on_thread_entry()) t.start_measurement();
 	uint8_t instrtype;
 	try
@@ -1248,9 +1254,22 @@ static void run_multithreaded()
 {
 	if (p__sandbox_level >= 3) sandbox_level_three();
 
-	for (unsigned i = 0; i < replayer.threads.size(); i++)
+	const unsigned count = replayer.threads.size();
+	if (p__replay_threads > 0 && p__replay_threads < count && !replay_scheduler::supported())
+	{
+		WLOG("Cannot replay %u trace threads on %u threads on this platform, using one thread for each", count, (unsigned)p__replay_threads);
+	}
+	else if (p__replay_threads > 0 && p__replay_threads < count)
 	{
-		replayer.threads[i] = std::thread(replay_thread, i);
+		static replay_scheduler scheduler(count, p__replay_threads); // kept alive for late stop requests
+		replayer.scheduler = &scheduler;
+		scheduler.run([](unsigned i, replay_scheduler::fiber* fiber) { replay_thread(i, fiber); });
+		return;
+	}
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		replayer.threads[i] = std::thread(replay_thread, i, nullptr);
 	}
 
 	for (unsigned i = 0; i < replayer.threads.size(); i++)
@@ -1480,6 +1499,22 @@ int main(int argc, char **argv)
 		{
 			p__disable_multithread_read = 1;
 		}
+		else if (match(argv[i], nullptr, "--replay-threads", remaining))
+		{
+			p__replay_threads = get_int(argv[++i], remaining);
+		}
+		else if (match(argv[i], nullptr, "--decompression-threads", remaining))
+		{
+			p__decompression_threads = get_int(argv[++i], remaining);
+		}
+		else if (match(argv[i], nullptr, "--huge-pages", remaining))
+		{
+			p__huge_pages = 1;
+		}
+		else if (match(argv[i], nullptr, "--prefault", remaining))
+		{
+			p__prefault = 1;
+		}
 		else if (match(argv[i], "-w", "--wsi", remaining))
 		{
 			wsi = get_str(argv[++i], remaining);
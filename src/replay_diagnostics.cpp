@@ -138,10 +138,38 @@ std::string replay_diagnostics_thread_wait_description(lava_reader& replayer, la
 	return replay_diagnostics_object_wait_description(snapshot);
 }
 
+static std::string replay_diagnostics_wait_summary(const wait_stats& stats)
+{
+	const uint64_t count = stats.count.load(std::memory_order_relaxed);
+	if (count == 0) return "-";
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%lu, %.1f ms", (unsigned long)count, ns_to_ms(stats.time_ns.load(std::memory_order_relaxed)));
+	return buf;
+}
+
+static std::string replay_diagnostics_most_waited_on(const lava_file_reader& reader)
+{
+	int thread = -1;
+	uint64_t most = 0;
+	for (unsigned i = 0; i < reader.waited_on.size(); i++)
+	{
+		const uint64_t time_ns = reader.waited_on[i].time_ns.load(std::memory_order_relaxed);
+		if (time_ns > most)
+		{
+			most = time_ns;
+			thread = (int)i;
+		}
+	}
+	if (thread < 0) return "-";
+	char buf[64];
+	snprintf(buf, sizeof(buf), "thread %d, %.1f ms", thread, ns_to_ms(most));
+	return buf;
+}
+
 std::string replay_diagnostics_threads_response(lava_reader& replayer)
 {
 	data_table out;
-	out.set_headers({"Thread", "Name", "State", "Packet", "Waiting On"});
+	out.set_headers({"Thread", "Name", "State", "Packet", "Waiting On", "Handle Waits", "Barrier Waits", "Starved", "GPU Waits", "Most Waited On"});
 	for (unsigned i = 0; i < replayer.threads.size(); i++)
 	{
 		lava_file_reader& reader = replayer.file_reader(i);
@@ -152,7 +180,12 @@ std::string replay_diagnostics_threads_response(lava_reader& replayer)
 			thread_name ? thread_name : "",
 			replay_diagnostics_thread_state_name(state),
 			std::to_string(reader.cli_packet.load(std::memory_order_relaxed)),
-			replay_diagnostics_thread_wait_description(replayer, reader, state)
+			replay_diagnostics_thread_wait_description(replayer, reader, state),
+			replay_diagnostics_wait_summary(reader.handle_waits),
+			replay_diagnostics_wait_summary(reader.barrier_waits),
+			replay_diagnostics_wait_summary(reader.starved),
+			replay_diagnostics_wait_summary(reader.gpu_waits),
+			replay_diagnostics_most_waited_on(reader)
 		});
 	}
 	return out.to_markdown();
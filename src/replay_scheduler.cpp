@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#ifndef __ANDROID__
+#include <ucontext.h>
+#endif
+
+#include "replay_scheduler.h"
+#include "util.h"
+
+#ifdef __ANDROID__
+// Bionic has no ucontext functions, so we cannot switch fibers there
+struct replay_scheduler::fiber {};
+bool replay_scheduler::supported() { return false; }
+replay_scheduler::replay_scheduler(unsigned, unsigned _workers) : workers(_workers) { ABORT("Replay thread scheduling not supported on this platform"); }
+replay_scheduler::~replay_scheduler() {}
+void replay_scheduler::run(const std::function<void(unsigned, fiber*)>&) {}
+void replay_scheduler::park(fiber*, const std::atomic_uint_fast32_t&, uint32_t, std::atomic_uint32_t&) {}
+void replay_scheduler::wake(const std::atomic_uint_fast32_t&) {}
+void replay_scheduler::wake_all() {}
+void replay_scheduler::worker_func() {}
+void replay_scheduler::make_ready(fiber*) {}
+void replay_scheduler::fiber_entry(unsigned, unsigned) {}
+#else
+
+// Same as the default thread stack size, since Vulkan drivers may compile shaders on our stack. Only what is
+// actually used is backed by memory.
+static const size_t stack_size = (sizeof(void*) == 8 ? 8 : 1) * 1024 * 1024;
+
+struct replay_scheduler::fiber
+{
+	unsigned index = 0;
+	replay_scheduler* owner = nullptr;
+	ucontext_t context;
+	ucontext_t* worker = nullptr; // context of the worker thread currently running us
+	char* stack = nullptr; // lowest page is a guard page
+	bool done = false;
+	// what we are parking on
+	const std::atomic_uint_fast32_t* counter = nullptr;
+	uint32_t target = 0;
+	std::atomic_uint32_t* waiters = nullptr;
+};
+
+bool replay_scheduler::supported()
+{
+	return true;
+}
+
+replay_scheduler::replay_scheduler(unsigned count, unsigned _workers) : workers(std::max(1u, std::min(_workers, count)))
+{
+	const size_t page_size = sysconf(_SC_PAGE_SIZE);
+	for (unsigned i = 0; i < count; i++)
+	{
+		fiber* f = new fiber;
+		f->index = i;
+		f->owner = this;
+		f->stack = (char*)mmap(nullptr, stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (f->stack == MAP_FAILED) ABORT("Failed to allocate replay fiber stack: %s", strerror(errno));
+		if (mprotect(f->stack, page_size, PROT_NONE) != 0) ABORT("Failed to protect replay fiber stack: %s", strerror(errno));
+		if (getcontext(&f->context) != 0) ABORT("Failed to get replay fiber context: %s", strerror(errno));
+		f->context.uc_stack.ss_sp = f->stack + page_size;
+		f->context.uc_stack.ss_size = stack_size - page_size;
+		f->context.uc_link = nullptr; // we never return from fiber_entry
+		const uintptr_t ptr = (uintptr_t)f;
+		makecontext(&f->context, (void (*)())fiber_entry, 2, (unsigned)((uint64_t)ptr >> 32), (unsigned)(ptr & 0xffffffff));
+		fibers.push_back(f);
+	}
+}
+
+replay_scheduler::~replay_scheduler()
+{
+	assert(threads.empty());
+	for (fiber* f : fibers)
+	{
+		munmap(f->stack, stack_size);
+		delete f;
+	}
+}
+
+void replay_scheduler::fiber_entry(unsigned hi, unsigned lo)
+{
+	fiber* f = (fiber*)(uintptr_t)(((uint64_t)hi << 32) | (uint64_t)lo);
+	f->owner->fiber_body(f->index, f);
+	f->done = true;
+	setcontext(f->worker); // back to the worker for good
+	ABORT("Failed to leave finished replay fiber");
+}
+
+void replay_scheduler::run(const std::function<void(unsigned, fiber*)>& body)
+{
+	fiber_body = body;
+	mutex.lock();
+	for (fiber* f : fibers) ready.push_back(f);
+	mutex.unlock();
+	ILOG("Replaying %u trace threads on %u worker threads", (unsigned)fibers.size(), workers);
+	for (unsigned i = 0; i < workers; i++) threads.emplace_back(&replay_scheduler::worker_func, this);
+	for (std::thread& t : threads) t.join();
+	threads.clear();
+	DLOG("Replay fibers parked %lu times", (unsigned long)park_count.load());
+}
+
+void replay_scheduler::make_ready(fiber* f)
+{
+	ready.push_back(f);
+	epoch.fetch_add(1);
+	if (sleepers.load()) epoch.notify_one();
+}
+
+void replay_scheduler::worker_func()
+{
+	set_thread_name("replay worker");
+	struct timespec start_cpu_usage = {};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start_cpu_usage);
+	ucontext_t context;
+	while (true)
+	{
+		const uint32_t seen = epoch.load();
+		fiber* f = nullptr;
+		mutex.lock();
+		const bool all_done = finished == fibers.size();
+		if (!ready.empty())
+		{
+			f = ready.front();
+			ready.pop_front();
+		}
+		mutex.unlock();
+		if (all_done) break;
+		if (!f)
+		{
+			sleepers++;
+			epoch.wait(seen);
+			sleepers--;
+			continue;
+		}
+
+		f->worker = &context;
+		if (swapcontext(&context, &f->context) != 0) ABORT("Failed to switch to replay fiber: %s", strerror(errno));
+
+		// The fiber has switched back to us, so it is now safe to let another worker pick it up
+		lava::lock_guard lock(mutex);
+		if (f->done)
+		{
+			finished++;
+			if (finished == fibers.size())
+			{
+				epoch.fetch_add(1);
+				epoch.notify_all();
+			}
+			continue;
+		}
+		park_count.fetch_add(1, std::memory_order_relaxed);
+		f->waiters->fetch_add(1); // must be seen by whoever raises the counter before we check it below
+		if (released || f->counter->load() >= f->target)
+		{
+			f->waiters->fetch_sub(1);
+			make_ready(f);
+		}
+		else parked.push_back(f);
+	}
+	struct timespec stop_cpu_usage = {};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stop_cpu_usage);
+	worker_cpu_time.fetch_add(diff_timespec(&stop_cpu_usage, &start_cpu_usage), std::memory_order_relaxed);
+}
+
+void replay_scheduler::park(fiber* f, const std::atomic_uint_fast32_t& counter, uint32_t target, std::atomic_uint32_t& waiters)
+{
+	f->counter = &counter;
+	f->target = target;
+	f->waiters = &waiters;
+	if (swapcontext(&f->context, f->worker) != 0) ABORT("Failed to switch away from replay fiber: %s", strerror(errno));
+	// we may now be running on another worker thread
+}
+
+void replay_scheduler::wake(const std::atomic_uint_fast32_t& counter)
+{
+	lava::lock_guard lock(mutex);
+	for (auto iter = parked.begin(); iter != parked.end(); )
+	{
+		fiber* f = *iter;
+		if (f->counter == &counter && counter.load() >= f->target)
+		{
+			f->waiters->fetch_sub(1);
+			make_ready(f);
+			iter = parked.erase(iter);
+		}
+		else iter++;
+	}
+}
+
+void replay_scheduler::wake_all()
+{
+	lava::lock_guard lock(mutex);
+	released = true;
+	for (fiber* f : parked)
+	{
+		f->waiters->fetch_sub(1);
+		make_ready(f);
+	}
+	parked.clear();
+}
+
+#endif
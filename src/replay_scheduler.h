@@ -0,0 +1,71 @@
+// Running the replay of many trace threads on fewer worker threads
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "lavamutex.h"
+
+/// Runs a number of replay threads as fibers on a smaller pool of worker threads. A fiber that has to wait for
+/// another fiber to reach some point parks and gives its worker to another fiber, instead of blocking the worker.
+/// Fibers only switch when they park, so they may move between worker threads, but never in the middle of a
+/// Vulkan call. Waits that block a worker in other ways, such as host waits on the GPU, still block it.
+class replay_scheduler
+{
+	replay_scheduler(const replay_scheduler&) = delete;
+	replay_scheduler& operator=(const replay_scheduler&) = delete;
+
+public:
+	struct fiber;
+
+	/// Whether fibers can be used on this platform at all
+	static bool supported();
+
+	replay_scheduler(unsigned fibers, unsigned workers);
+	~replay_scheduler();
+
+	/// Run body(i, fiber) for each fiber i on the worker threads, and return when all of them are done.
+	void run(const std::function<void(unsigned, fiber*)>& body);
+
+	/// Called from inside a fiber. Let other fibers run until the counter reaches the target or wake_all() is called.
+	/// While we are parked, the waiters count is raised, so that whoever raises the counter knows to call wake().
+	void park(fiber* f, const std::atomic_uint_fast32_t& counter, uint32_t target, std::atomic_uint32_t& waiters);
+
+	/// Make fibers parked on this counter runnable if it has reached their target
+	void wake(const std::atomic_uint_fast32_t& counter);
+
+	/// Make all parked fibers runnable, and never park any fiber again. Used to stop replay.
+	void wake_all();
+
+	unsigned worker_count() const { return workers; }
+	/// Number of times a fiber had to park
+	uint64_t parks() const { return park_count.load(std::memory_order_relaxed); }
+	/// CPU time spent by worker threads that are done, in microseconds
+	uint64_t cpu_time() const { return worker_cpu_time.load(std::memory_order_relaxed); }
+
+private:
+	void worker_func();
+	void make_ready(fiber* f) REQUIRES(mutex);
+	static void fiber_entry(unsigned hi, unsigned lo);
+
+	const unsigned workers;
+	std::vector<fiber*> fibers;
+	std::function<void(unsigned, fiber*)> fiber_body;
+	std::vector<std::thread> threads;
+
+	lava::mutex mutex;
+	std::deque<fiber*> ready GUARDED_BY(mutex);
+	std::vector<fiber*> parked GUARDED_BY(mutex);
+	unsigned finished GUARDED_BY(mutex) = 0;
+	bool released GUARDED_BY(mutex) = false;
+
+	std::atomic_uint32_t epoch { 0 }; // bumped when there is something new to run, or everything is done
+	std::atomic_uint32_t sleepers { 0 };
+	std::atomic_uint64_t park_count { 0 };
+	std::atomic_uint64_t worker_cpu_time { 0 };
+};
@@ -388,22 +388,39 @@ VkPresentModeKHR p__realpresentmode = (VkPresentModeKHR)get_env_int("LAVATUBE_VI
 uint_fast8_t p__realimages = get_env_int("LAVATUBE_VIRTUALSWAPCHAIN_IMAGES", 0); // zero means do not override
 const char* p__save_pipelinecache = getenv("LAVATUBE_SAVE_PIPELINECACHE");
 const char* p__load_pipelinecache = getenv("LAVATUBE_LOAD_PIPELINECACHE");
+const char* p__patch_kernel = getenv("LAVATUBE_PATCH_KERNEL"); // null means pick the best one
 uint_fast8_t p__dedicated_allocation = get_env_bool("LAVATUBE_DEDICATED_ALLOCATION", 1);
 uint_fast8_t p__custom_allocator = get_env_bool("LAVATUBE_CUSTOM_ALLOCATOR", 0);
 uint_fast8_t p__no_anisotropy = get_env_bool("LAVATUBE_NO_ANISOTROPY", 0);
 uint_fast8_t p__delay_fence_success_frames = get_env_int("LAVATUBE_DELAY_FENCE_SUCCESS_FRAMES", 0); // off by default
 uint64_t p__delay_fence_success_timeout_threshold = get_env_uint64("LAVATUBE_DELAY_FENCE_SUCCESS_TIMEOUT_THRESHOLD", 0);
 int p__chunksize = get_env_int("LAVATUBE_CHUNK_SIZE", 64 * 1024 * 1024);
+int p__subblock_size = get_env_int("LAVATUBE_SUBBLOCK_SIZE", 0); // zero means chunks are not split into sub-blocks
+int p__direct_span_size = get_env_int("LAVATUBE_DIRECT_SPAN_SIZE", -1); // negative means only when compressing on the calling thread
 uint_fast8_t p__external_memory = get_env_bool("LAVATUBE_EXTERNAL_MEMORY", 0);
 uint_fast8_t p__disable_multithread_writeout = get_env_bool("LAVATUBE_DISABLE_MULTITHREADED_WRITEOUT", 0);
 uint_fast8_t p__disable_multithread_compress = get_env_bool("LAVATUBE_DISABLE_MULTITHREADED_COMPRESS", 0);
+uint_fast8_t p__compression_threads = get_env_int("LAVATUBE_COMPRESSION_THREADS", 0); // zero means pick based on core count
+uint_fast8_t p__scan_threads = get_env_int("LAVATUBE_SCAN_THREADS", 0); // zero means pick based on core count
+int p__chunk_pool_size = get_env_int("LAVATUBE_CHUNK_POOL_SIZE", 256); // in megabytes, zero disables recycling
+int p__inflight_budget = get_env_int("LAVATUBE_INFLIGHT_BUDGET", 1024); // in megabytes, zero means unlimited
 uint_fast8_t p__disable_multithread_read = get_env_bool("LAVATUBE_DISABLE_MULTITHREADED_READ", 0);
 uint_fast8_t p__allow_stalls = get_env_bool("LAVATUBE_ALLOW_STALLS", true);
 uint_fast16_t p__preload = get_env_int("LAVATUBE_PRELOAD_SIZE", 128); // two default size packets by default
+uint_fast16_t p__replay_threads = get_env_int("LAVATUBE_REPLAY_THREADS", 0); // zero means one for each trace thread
+uint_fast8_t p__decompression_threads = get_env_int("LAVATUBE_DECOMPRESSION_THREADS", 0); // zero means pick based on core count
+int p__uncompressed_window = get_env_int("LAVATUBE_UNCOMPRESSED_WINDOW", 0); // in megabytes, zero means map the whole stream
+uint_fast8_t p__huge_pages = get_env_bool("LAVATUBE_HUGE_PAGES", 0);
+uint_fast8_t p__prefault = get_env_bool("LAVATUBE_PREFAULT", 0);
 uint_fast8_t p__compression_type = get_env_int("LAVATUBE_COMPRESSION_TYPE", LAVATUBE_COMPRESSION_DENSITY);
 uint_fast16_t p__compression_level = get_env_int("LAVATUBE_COMPRESSION_LEVEL", 0); // zero means default
+uint_fast8_t p__adaptive_compression = get_env_bool("LAVATUBE_ADAPTIVE_COMPRESSION", 0);
+uint_fast8_t p__patch_opcodes = get_env_bool("LAVATUBE_PATCH_OPCODES", 0);
 uint_fast8_t p__sandbox_level = get_env_int("LAVATUBE_SANDBOX_LEVEL", 1);
 uint_fast8_t p__trust_host_flushes = get_env_int("LAVATUBE_TRUST_HOST_FLUSHING", 0); // disable active tracking
+uint_fast8_t p__page_guard = get_env_int("LAVATUBE_PAGE_GUARD", 0); // 1 picks userfaultfd or mprotect, 2 forces mprotect
+uint_fast8_t p__cached_memory = get_env_bool("LAVATUBE_CACHED_MEMORY", 0);
+int p__deferred_diff = get_env_int("LAVATUBE_DEFERRED_DIFF", 0); // in megabytes of snapshots waiting for the worker, zero means diff on submit
 int_fast32_t p__suballocator_heap_size = get_env_int("LAVATUBE_SUBALLOCATOR_HEAP_SIZE", -1);
 uint_fast8_t p__delete_empty_trace = get_env_bool("LAVATUBE_DELETE_EMPTY_TRACE", 0);
 uint_fast8_t p__skip_remove_unused = get_env_bool("LAVATUBE_SKIP_REMOVE_UNUSED", 0);
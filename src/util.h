@@ -105,6 +105,7 @@ extern VkPresentModeKHR p__realpresentmode;
 extern uint_fast8_t p__realimages;
 extern const char* p__save_pipelinecache;
 extern const char* p__load_pipelinecache;
+extern const char* p__patch_kernel;
 extern uint_fast8_t p__dedicated_allocation;
 extern uint_fast8_t p__custom_allocator;
 extern uint_fast8_t p__no_anisotropy;
@@ -112,16 +113,32 @@ extern uint_fast8_t p__delay_fence_success_frames;
 extern uint64_t p__delay_fence_success_timeout_threshold;
 extern FILE* p__debug_destination;
 extern int p__chunksize;
+extern int p__subblock_size;
+extern int p__direct_span_size;
 extern uint_fast8_t p__external_memory;
 extern uint_fast8_t p__disable_multithread_writeout;
 extern uint_fast8_t p__disable_multithread_compress;
+extern uint_fast8_t p__compression_threads;
+extern uint_fast8_t p__scan_threads;
+extern int p__chunk_pool_size;
+extern int p__inflight_budget;
 extern uint_fast8_t p__disable_multithread_read;
 extern uint_fast8_t p__allow_stalls;
 extern uint_fast16_t p__preload;
+extern uint_fast16_t p__replay_threads;
+extern uint_fast8_t p__decompression_threads;
+extern int p__uncompressed_window;
+extern uint_fast8_t p__huge_pages;
+extern uint_fast8_t p__prefault;
 extern uint_fast8_t p__compression_type;
 extern uint_fast16_t p__compression_level;
+extern uint_fast8_t p__adaptive_compression;
+extern uint_fast8_t p__patch_opcodes;
 extern uint_fast8_t p__sandbox_level;
 extern uint_fast8_t p__trust_host_flushes;
+extern uint_fast8_t p__page_guard;
+extern uint_fast8_t p__cached_memory;
+extern int p__deferred_diff;
 extern int_fast32_t p__suballocator_heap_size;
 extern uint_fast8_t p__delete_empty_trace;
 extern uint_fast8_t p__skip_remove_unused;
@@ -259,14 +276,15 @@ struct buffer
 {
 	char* mPtr = nullptr;
 	uint_fast32_t mSize = 0;
+	uint_fast32_t mCapacity = 0; // allocated size, which is kept if we shrink
 
 	inline const char* data() const noexcept { return mPtr; }
 	inline char* data() noexcept { return mPtr; }
 	inline uint_fast32_t size() const noexcept { return mSize; }
 	inline void shrink(uint_fast32_t _size) noexcept { mSize = _size; }
 	buffer() noexcept {}
-	buffer(uint_fast32_t _size) noexcept { mPtr = (char*)malloc(_size); mSize = _size; }
-	inline void release() noexcept { free(mPtr); mPtr = nullptr; mSize = 0; }
+	buffer(uint_fast32_t _size) noexcept { mPtr = (char*)malloc(_size); mSize = _size; mCapacity = _size; }
+	inline void release() noexcept { free(mPtr); mPtr = nullptr; mSize = 0; mCapacity = 0; }
 };
 
 static __attribute__((const)) inline uint64_t aligned_size(uint64_t size, uint64_t alignment) { return size + alignment - 1ull - (size + alignment - 1ull) % alignment; }
@@ -222,6 +222,7 @@ void lava_file_writer::write_thread_barrier(const std::vector<uint32_t>& packet_
 
 lava_file_writer::~lava_file_writer()
 {
+	parent->deferred_diff.drain(); // all our spans must be filled before we can wrap up
 	end_packet();
 	self_test();
 	file_writer::finalize();
@@ -246,6 +247,12 @@ lava_file_writer::~lava_file_writer()
 	v["compressed_sizes"] = Json::arrayValue;
 	for (const auto i : uncompressed_sizes) v["uncompressed_sizes"].append((Json::Value::UInt64)i);
 	for (const auto i : compressed_sizes) v["compressed_sizes"].append((Json::Value::UInt64)i);
+	v["chunk_pool_hits"] = (Json::Value::UInt64)count_pool_hits();
+	v["chunk_pool_misses"] = (Json::Value::UInt64)count_pool_misses();
+	v["chunk_codecs"] = Json::objectValue;
+	v["chunk_codecs"]["uncompressed"] = (Json::Value::UInt64)count_codec_chunks(LAVATUBE_COMPRESSION_UNCOMPRESSED);
+	v["chunk_codecs"]["density"] = (Json::Value::UInt64)count_codec_chunks(LAVATUBE_COMPRESSION_DENSITY);
+	v["chunk_codecs"]["lz4"] = (Json::Value::UInt64)count_codec_chunks(LAVATUBE_COMPRESSION_LZ4);
 	v["packet_checkpoints"] = Json::arrayValue;
 	for (const packet_checkpoint& checkpoint : packet_checkpoints)
 	{
@@ -273,9 +280,8 @@ void lava_file_writer::new_frame(int global_frame)
 	self_test();
 }
 
-void lava_file_writer::begin_packet(uint8_t type)
+void lava_file_writer::add_checkpoint()
 {
-	end_packet();
 	const uint64_t chunk_offset = current_chunk_uncompressed_offset();
 	if (packet_checkpoints.empty() || chunk_offset > checkpoint_chunk_offset)
 	{
@@ -285,6 +291,12 @@ void lava_file_writer::begin_packet(uint8_t type)
 		packet_checkpoints.push_back(checkpoint);
 		checkpoint_chunk_offset = chunk_offset;
 	}
+}
+
+void lava_file_writer::begin_packet(uint8_t type)
+{
+	end_packet();
+	add_checkpoint();
 	current.packet_type = type;
 	if (type != PACKET_VULKAN_API_CALL) current.call_id = UINT16_MAX;
 	packet_start = uncompressed_bytes;
@@ -309,6 +321,23 @@ void lava_file_writer::end_packet()
 	current.packet++;
 }
 
+stream_span* lava_file_writer::reserve_packets(uint32_t count)
+{
+	end_packet();
+	add_checkpoint();
+	stream_span* span = reserve_span();
+	// positions we record from now on do not include the span until it is in our stream
+	const size_t frame_mark = frames.size();
+	const size_t checkpoint_mark = packet_checkpoints.size();
+	span->on_written = [this, frame_mark, checkpoint_mark](uint64_t size)
+	{
+		for (size_t i = frame_mark; i < frames.size(); i++) frames[i].start_pos += size;
+		for (size_t i = checkpoint_mark; i < packet_checkpoints.size(); i++) packet_checkpoints[i].position += size;
+	};
+	current.packet += count;
+	return span;
+}
+
 // --- trace writer
 
 static lava_writer _instance;
@@ -482,6 +511,7 @@ void lava_writer::serialize()
 {
 	lava::lock_guard lock(frame_mutex);
 	assert(!mPath.empty());
+	deferred_diff.drain(); // so that our tracking info is complete
 
 	// write dictionary to JSON file
 	std::string dict_path = mPath + "/dictionary.json";
@@ -563,6 +593,81 @@ void lava_writer::serialize()
 		merge_tracking_field(tracking, mInputTracking, "updates");
 		merge_tracking_field(tracking, mInputTracking, "written");
 	}
+	// how much the app was held back by compression and disk writeout
+	const compression_pool::statistics stats = compression_pool::instance().stats();
+	Json::Value& writeout = tracking["capture_writeout"];
+	writeout["inflight_budget"] = (Json::Value::UInt64)p__inflight_budget * 1024 * 1024;
+	writeout["peak_inflight_bytes"] = (Json::Value::UInt64)stats.peak_inflight_bytes;
+	writeout["stall_time_ns"] = (Json::Value::UInt64)stats.stall_ns;
+	writeout["stalls"] = (Json::Value::UInt64)stats.stalls;
+	writeout["peak_queue_depth"] = (Json::Value::UInt64)stats.peak_queue_depth;
+	writeout["peak_compress_backlog"] = (Json::Value::UInt64)stats.peak_compress_backlog;
+	writeout["peak_writeout_backlog"] = (Json::Value::UInt64)stats.peak_writeout_backlog;
+	// how often app threads had to wait for each other to get at the same device memory
+	Json::Value& locks = tracking["capture_memory_locks"];
+	locks["contention"] = (Json::Value::UInt64)memory_lock_contention.load();
+	locks["wait_time_ns"] = (Json::Value::UInt64)memory_lock_wait_ns.load();
+	// how much memory our clones of host visible memory actually used, compared to their full size
+	uint64_t clone_reserved = 0;
+	uint64_t clone_resident_total = 0;
+	for (const trackedmemory_trace* memory_data : records.VkDeviceMemory_index.iterate())
+	{
+		if (!memory_data || (!memory_data->clone && !memory_data->freed_clone_resident)) continue;
+		clone_reserved += memory_data->allocationSize;
+		clone_resident_total += memory_data->clone ? clone_resident(memory_data->clone, memory_data->allocationSize) : memory_data->freed_clone_resident;
+	}
+	Json::Value& clones = tracking["capture_clones"];
+	clones["reserved"] = (Json::Value::UInt64)clone_reserved;
+	clones["resident"] = (Json::Value::UInt64)clone_resident_total;
+	ILOG("Memory clones use %lu of %lu reserved bytes", (unsigned long)clone_resident_total, (unsigned long)clone_reserved);
+	if (p__cached_memory)
+	{
+		// how much memory we allocated from host cached memory types instead of what the app asked for, by type
+		std::map<std::pair<uint32_t, uint32_t>, std::pair<uint64_t, uint64_t>> backed; // requested and backing type -> count and size
+		for (const trackedmemory_trace* memory_data : records.VkDeviceMemory_index.iterate())
+		{
+			if (!memory_data || !(memory_data->backing_flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) || (memory_data->propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)) continue;
+			auto& totals = backed[{ memory_data->requested_type, memory_data->backing_type }];
+			totals.first++;
+			totals.second += memory_data->allocationSize;
+		}
+		Json::Value& cached = tracking["capture_cached_memory"];
+		cached = Json::arrayValue;
+		for (const auto& pair : backed)
+		{
+			Json::Value v;
+			v["requested_type"] = pair.first.first;
+			v["backing_type"] = pair.first.second;
+			v["allocations"] = (Json::Value::UInt64)pair.second.first;
+			v["bytes"] = (Json::Value::UInt64)pair.second.second;
+			cached.append(v);
+			ILOG("Memory type %u backed by host cached memory type %u in %lu allocations totalling %lu bytes", pair.first.first, pair.first.second,
+			     (unsigned long)pair.second.first, (unsigned long)pair.second.second);
+		}
+	}
+	if (page_guard::mode() != page_guard::modes::off)
+	{
+		// how much diffing of persistently mapped memory the page guard saved us
+		const page_guard& guard = page_guard::instance();
+		Json::Value& pg = tracking["capture_page_guard"];
+		pg["mode"] = (Json::Value::UInt)page_guard::mode();
+		pg["faults"] = (Json::Value::UInt64)guard.faults.load();
+		pg["uffd_regions"] = (Json::Value::UInt64)guard.uffd_regions.load();
+		pg["mprotect_regions"] = (Json::Value::UInt64)guard.mprotect_regions.load();
+		pg["scanned_bytes"] = (Json::Value::UInt64)guard.scanned_bytes.load();
+		pg["avoided_bytes"] = (Json::Value::UInt64)guard.avoided_bytes.load();
+		ILOG("Page guard diffed %lu bytes and avoided diffing %lu bytes, with %lu write faults", (unsigned long)guard.scanned_bytes.load(),
+		     (unsigned long)guard.avoided_bytes.load(), (unsigned long)guard.faults.load());
+	}
+	if (p__deferred_diff)
+	{
+		// how much diffing we moved off the submitting threads, and how often they had to wait for it anyway
+		Json::Value& dd = tracking["capture_deferred_diff"];
+		dd["budget"] = (Json::Value::UInt64)p__deferred_diff * 1024 * 1024;
+		dd["jobs"] = (Json::Value::UInt64)deferred_diff.jobs.load();
+		dd["stalls"] = (Json::Value::UInt64)deferred_diff.stalls.load();
+		dd["stall_time_ns"] = (Json::Value::UInt64)deferred_diff.stall_ns.load();
+	}
 	write_json(mPath + "/tracking.json", tracking);
 
 }
@@ -643,6 +748,28 @@ void lava_writer::prepare_threads(unsigned count)
 	}
 }
 
+void lava_writer::lock_memory(trackedmemory_trace* memory_data)
+{
+	if (memory_data->mutex.try_lock()) return;
+	const uint64_t start = gettime();
+	memory_data->mutex.lock();
+	memory_data->contention++;
+	memory_lock_contention.fetch_add(1, std::memory_order_relaxed);
+	memory_lock_wait_ns.fetch_add(gettime() - start, std::memory_order_relaxed);
+}
+
+void lava_writer::lock_memories(std::vector<trackedmemory_trace*>& memories)
+{
+	std::sort(memories.begin(), memories.end(), [](const trackedmemory_trace* a, const trackedmemory_trace* b) { return a->index < b->index; });
+	memories.erase(std::unique(memories.begin(), memories.end()), memories.end());
+	for (trackedmemory_trace* memory_data : memories) lock_memory(memory_data);
+}
+
+void lava_writer::unlock_memories(const std::vector<trackedmemory_trace*>& memories)
+{
+	for (auto it = memories.rbegin(); it != memories.rend(); ++it) (*it)->mutex.unlock();
+}
+
 lava_file_writer& lava_writer::file_writer()
 {
 	if (tid == -1) // this thread does not yet have its own lava_file_writer, so create one
@@ -141,6 +141,9 @@ public:
 	inline void write_api_command(uint16_t id);
 	void begin_packet(uint8_t type);
 	void end_packet();
+	/// Reserve a place in our stream for the given number of packets, which another thread writes later into the
+	/// returned span. They get the next packet indices, as if we had written them here.
+	stream_span* reserve_packets(uint32_t count);
 
 	inline void write_VkAccelerationStructureNV(VkAccelerationStructureNV val) {} // TBD
 
@@ -181,6 +184,8 @@ public:
 	}
 
 private:
+	void add_checkpoint();
+
 	std::string mPath;
 	std::vector<framedata> frames;
 	std::vector<packet_checkpoint> packet_checkpoints;
@@ -240,8 +245,22 @@ public:
 
 	trace_data<lava_file_writer*> thread_streams;
 
-	/// We cannot allow the app to map or unmap memory while we are scanning it
-	lava::mutex memory_mutex;
+	/// Lock one device memory object. Counts how often we had to wait for another thread to release it.
+	void lock_memory(trackedmemory_trace* memory_data) ACQUIRE(memory_data->mutex) NO_THREAD_SAFETY_ANALYSIS;
+	void unlock_memory(trackedmemory_trace* memory_data) RELEASE(memory_data->mutex) { memory_data->mutex.unlock(); }
+	/// Lock several device memory objects. They are always taken in order of index, so that two threads
+	/// locking overlapping sets cannot deadlock. Sorts the list and removes duplicates from it.
+	void lock_memories(std::vector<trackedmemory_trace*>& memories) NO_THREAD_SAFETY_ANALYSIS;
+	void unlock_memories(const std::vector<trackedmemory_trace*>& memories) NO_THREAD_SAFETY_ANALYSIS;
+
+	// device memory lock statistics
+	std::atomic_uint64_t memory_lock_contention { 0 }; // times we had to wait for a device memory lock
+	std::atomic_uint64_t memory_lock_wait_ns { 0 }; // total time spent waiting for them
+
+	/// Workers for diffing host memory on queue submit
+	patch_scan_pool scan_pool;
+	/// Worker for diffing host memory after queue submit, if we do that
+	span_worker deferred_diff;
 
 	void self_test() const
 	{
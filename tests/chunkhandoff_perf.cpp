@@ -0,0 +1,132 @@
+// Measures how quickly a full chunk gets from a tracing thread through the compression pool to disk,
+// how much CPU the compression pool burns while it has nothing to do, and what large memory uploads
+// cost the tracing thread with and without compressing them straight from the app's memory.
+
+#include "filewriter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+static uint64_t get_scale()
+{
+	const char* value = getenv("LAVATUBE_CHUNKHANDOFF_PERF_SCALE");
+	if (!value || value[0] == '\0') return 1;
+	const uint64_t scale = strtoull(value, nullptr, 10);
+	return scale == 0 ? 1 : scale;
+}
+
+static uint64_t cpu_time_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void print_header()
+{
+	printf("%-30s %12s %12s %12s %12s %12s\n", "name", "handoffs", "min_ns", "median_ns", "p99_ns", "max_ns");
+}
+
+// Fill a chunk exactly, then write one more value to force the handoff, and spin until the chunk has
+// been compressed and written out. Time from the handoff to the chunk being on disk.
+static void run_handoff(const char* name, unsigned chunk_size, uint64_t handoffs)
+{
+	const char* filename = "chunkhandoff_perf.bin";
+	std::vector<uint64_t> latencies;
+	latencies.reserve(handoffs);
+	file_writer file(0);
+	file.change_default_chunk_size(chunk_size);
+	file.set(filename);
+	file.write_uint64_t(0);
+	for (uint64_t i = 0; i < handoffs; i++)
+	{
+		for (unsigned j = 1; j < chunk_size / sizeof(uint64_t); j++) file.write_uint64_t(i * j); // fill up the chunk
+		const uint64_t expected = file.count_written_chunks() + 1;
+		const auto start = std::chrono::steady_clock::now();
+		file.write_uint64_t(i); // does not fit, so hands over the full chunk
+		while (file.count_written_chunks() < expected) std::this_thread::yield();
+		const auto end = std::chrono::steady_clock::now();
+		latencies.push_back((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+	}
+	file.finalize();
+	unlink(filename);
+	std::sort(latencies.begin(), latencies.end());
+	printf("%-30s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n", name, handoffs, latencies.front(),
+	       latencies[latencies.size() / 2], latencies[std::min<size_t>(latencies.size() - 1, latencies.size() * 99 / 100)], latencies.back());
+}
+
+// Keep a writer attached to the compression pool without feeding it anything, and measure how much CPU time
+// the rest of the process used in the meantime.
+static void run_idle(unsigned milliseconds)
+{
+	const char* filename = "chunkhandoff_perf.bin";
+	file_writer file(0);
+	file.set(filename);
+	usleep(50 * 1000); // let workers settle
+	const auto start = std::chrono::steady_clock::now();
+	const uint64_t process_start = cpu_time_ns(CLOCK_PROCESS_CPUTIME_ID);
+	const uint64_t thread_start = cpu_time_ns(CLOCK_THREAD_CPUTIME_ID);
+	usleep(milliseconds * 1000);
+	const uint64_t thread_end = cpu_time_ns(CLOCK_THREAD_CPUTIME_ID);
+	const uint64_t process_end = cpu_time_ns(CLOCK_PROCESS_CPUTIME_ID);
+	const auto end = std::chrono::steady_clock::now();
+	file.finalize();
+	unlink(filename);
+	const uint64_t wall_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+	const uint64_t worker_ns = (process_end - process_start) - (thread_end - thread_start);
+	printf("\n%-30s %12s %12s %12s\n", "name", "workers", "wall_ns", "worker_cpu_ns");
+	printf("%-30s %12u %12" PRIu64 " %12" PRIu64 "  (%.4f%% of one core)\n", "idle_pool", compression_pool::worker_count(),
+	       wall_ns, worker_ns, wall_ns ? 100.0 * (double)worker_ns / (double)wall_ns : 0.0);
+}
+
+// Upload the same big span over and over. Time how long the tracing thread spends in write_memory_span(),
+// and how long until everything is on disk.
+static void run_span(const char* name, uint64_t span_size, uint64_t spans, bool multithreaded, int direct_span_size)
+{
+	const char* filename = "chunkhandoff_perf.bin";
+	const int saved_direct_span_size = p__direct_span_size;
+	p__direct_span_size = direct_span_size;
+	std::vector<char> memory(span_size);
+	for (uint64_t i = 0; i < span_size; i++) memory[i] = (i % 4096 < 1024) ? (char)(i * 2654435761u >> 13) : (char)(i / 64);
+	file_writer file(0);
+	file.set(filename);
+	if (!multithreaded) file.disable_multithreaded_compress();
+	uint64_t submit_ns = 0;
+	const auto start = std::chrono::steady_clock::now();
+	for (uint64_t i = 0; i < spans; i++)
+	{
+		const auto before = std::chrono::steady_clock::now();
+		file.write_memory_span(memory.data(), 0, span_size);
+		submit_ns += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - before).count();
+	}
+	file.finalize();
+	const uint64_t total_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	const uint64_t direct = file.count_direct_bytes();
+	unlink(filename);
+	p__direct_span_size = saved_direct_span_size;
+	printf("%-30s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12.2f\n", name, spans, direct, submit_ns / spans, total_ns / spans,
+	       submit_ns ? (double)(span_size * spans) / (double)submit_ns * 1e9 / (1024.0 * 1024.0 * 1024.0) : 0.0);
+}
+
+int main()
+{
+	const uint64_t scale = get_scale();
+	printf("chunkhandoff_perf scale=%" PRIu64 " workers=%u\n", scale, compression_pool::worker_count());
+	print_header();
+	run_handoff("handoff_4K", 4 * 1024, 2000 * scale);
+	run_handoff("handoff_64K", 64 * 1024, 1000 * scale);
+	run_handoff("handoff_1M", 1024 * 1024, 200 * scale);
+	run_idle(1000 * scale);
+	printf("\n%-30s %12s %12s %12s %12s %12s\n", "name", "spans", "direct_bytes", "submit_ns", "total_ns", "submit_GiB/s");
+	run_span("span_16M_copy", 16 * 1024 * 1024, 16 * scale, true, 0);
+	run_span("span_16M_direct", 16 * 1024 * 1024, 16 * scale, true, 1024 * 1024);
+	run_span("span_16M_copy_caller", 16 * 1024 * 1024, 16 * scale, false, 0);
+	run_span("span_16M_direct_caller", 16 * 1024 * 1024, 16 * scale, false, 1024 * 1024);
+	return 0;
+}
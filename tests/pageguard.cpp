@@ -0,0 +1,93 @@
+// Unit test for the write-protect based dirty page tracking
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <thread>
+
+#include "util.h"
+#include "pageguard.h"
+
+static void test_guard(page_guard::modes mode)
+{
+	p__page_guard = (uint_fast8_t)mode;
+	page_guard& guard = page_guard::instance();
+	const uint64_t page = getpagesize();
+	const uint64_t pages = 100;
+	char* mem = (char*)mmap(nullptr, pages * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(mem != MAP_FAILED);
+	mem[0] = 1;
+
+	// start the watch in the middle of a page, it should still cover that whole page
+	page_guard::region* r = guard.add(mem + 10, pages * page - 20);
+	assert(r);
+	assert(r->base == mem);
+	assert(r->size == pages * page);
+	const uint64_t before = guard.faults.load();
+	std::vector<range> dirty;
+	guard.collect(r);
+	guard.dirty_ranges(r, 0, r->size - 1, dirty);
+	assert(dirty.size() == 1); // everything is dirty to begin with
+	assert(dirty[0].first == 0 && dirty[0].last == r->size - 1);
+	guard.clean(r, 0, r->size - 1);
+	dirty.clear();
+	guard.dirty_ranges(r, 0, r->size - 1, dirty);
+	assert(dirty.size() == 0);
+
+	// reading does not fault, writing does
+	assert(mem[0] == 1);
+	assert(guard.faults.load() == before);
+	mem[5 * page] = 1;
+	mem[5 * page + 1] = 2; // same page, now writable
+	mem[6 * page + 100] = 3;
+	std::thread t([&]{ mem[70 * page] = 4; memset(mem + 98 * page, 5, 2 * page); });
+	t.join();
+	assert(guard.faults.load() - before == 5);
+	guard.collect(r);
+	guard.dirty_ranges(r, 0, r->size - 1, dirty);
+	assert(dirty.size() == 3);
+	assert(dirty[0].first == 5 * page && dirty[0].last == 7 * page - 1);
+	assert(dirty[1].first == 70 * page && dirty[1].last == 71 * page - 1);
+	assert(dirty[2].first == 98 * page && dirty[2].last == 100 * page - 1);
+
+	// clipping, and only cleaning whole pages
+	dirty.clear();
+	guard.dirty_ranges(r, 6 * page + 10, 70 * page + 10, dirty);
+	assert(dirty.size() == 2);
+	assert(dirty[0].first == 6 * page + 10 && dirty[0].last == 7 * page - 1);
+	assert(dirty[1].first == 70 * page && dirty[1].last == 70 * page + 10);
+	guard.clean(r, 5 * page + 1, 71 * page - 1);
+	dirty.clear();
+	guard.dirty_ranges(r, 0, r->size - 1, dirty);
+	assert(dirty.size() == 2);
+	assert(dirty[0].first == 5 * page && dirty[0].last == 6 * page - 1);
+	assert(dirty[1].first == 98 * page);
+
+	// collected pages are protected again
+	mem[6 * page] = 6;
+	assert(guard.faults.load() - before == 6);
+	guard.collect(r);
+	dirty.clear();
+	guard.dirty_ranges(r, 0, r->size - 1, dirty);
+	assert(dirty.size() == 2);
+	assert(dirty[0].first == 5 * page && dirty[0].last == 7 * page - 1);
+
+	// writable again after removal
+	guard.remove(r);
+	memset(mem, 7, pages * page);
+	assert(guard.faults.load() - before == 6);
+	munmap(mem, pages * page);
+}
+
+int main()
+{
+	test_guard(page_guard::modes::mprotect);
+	assert(page_guard::instance().mprotect_regions.load() == 1);
+	test_guard(page_guard::modes::automatic); // uses userfaultfd if it can, otherwise mprotect again
+	printf("Page guard regions: %u userfaultfd, %u mprotect\n", (unsigned)page_guard::instance().uffd_regions.load(), (unsigned)page_guard::instance().mprotect_regions.load());
+	assert(page_guard::instance().uffd_regions.load() + page_guard::instance().mprotect_regions.load() == 2);
+	p__page_guard = 0;
+	assert(page_guard::instance().add((char*)&p__page_guard, 1) == nullptr);
+	return 0;
+}
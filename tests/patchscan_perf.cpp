@@ -64,11 +64,12 @@ static void print_header()
 	       "name", "operations", "bytes_examined", "time_ns", "ns/op", "GiB/s", "checksum");
 }
 
+// Unless given, the bytes examined per operation are worked out from where the scan stopped
 static void run_case(const char* name, const std::vector<char>& original, const std::vector<char>& changed,
-	uint64_t offset, uint64_t size, uint64_t target_bytes, scan_function scan)
+	uint64_t offset, uint64_t size, uint64_t target_bytes, scan_function scan, uint64_t bytes_per_operation = 0)
 {
 	const uint64_t expected = scan(original.data(), changed.data(), offset, size);
-	const uint64_t bytes_per_operation = expected == size ? size : std::min<uint64_t>(size, expected + sizeof(uint64_t));
+	if (bytes_per_operation == 0) bytes_per_operation = expected == size ? size : std::min<uint64_t>(size, expected + sizeof(uint64_t));
 	const uint64_t operations = std::min<uint64_t>(10000000, std::max<uint64_t>(16, target_bytes / bytes_per_operation));
 	const auto start = std::chrono::steady_clock::now();
 	uint64_t checksum = 0;
@@ -86,16 +87,112 @@ static void run_case(const char* name, const std::vector<char>& original, const
 	       name, operations, bytes_examined, ns, ns_per_operation, gib_per_second, checksum);
 }
 
+// Before: the word by word and 256-byte memcmp scans we used to have. After: every diffing kernel this CPU supports.
 static void run_comparison(const char* name, const std::vector<char>& original, const std::vector<char>& changed,
 	uint64_t offset, uint64_t size, uint64_t target_bytes)
 {
-	assert(find_patch_start_word(original.data(), changed.data(), offset, size) ==
-	       find_patch_start_chunked(original.data(), changed.data(), offset, size));
+	const uint64_t expected = find_patch_start_word(original.data(), changed.data(), offset, size);
+	assert(expected == find_patch_start_chunked(original.data(), changed.data(), offset, size));
 	char implementation_name[96];
 	snprintf(implementation_name, sizeof(implementation_name), "word_%s", name);
 	run_case(implementation_name, original, changed, offset, size, target_bytes, find_patch_start_word);
 	snprintf(implementation_name, sizeof(implementation_name), "chunked256_%s", name);
 	run_case(implementation_name, original, changed, offset, size, target_bytes, find_patch_start_chunked);
+	for (const patch_kernel* kernel : file_writer::patch_kernels())
+	{
+		file_writer::use_patch_kernel(*kernel);
+		assert(file_writer::find_patch_start(original.data(), changed.data(), offset, size) == expected);
+		snprintf(implementation_name, sizeof(implementation_name), "%s_%s", kernel->name, name);
+		run_case(implementation_name, original, changed, offset, size, target_bytes, file_writer::find_patch_start);
+	}
+	file_writer::use_patch_kernel(*file_writer::patch_kernels().back());
+}
+
+// Find every changed word in the area, the way write_patch() skips over unchanged memory
+template<scan_function scan> static uint64_t walk_changes(const char* original, const char* changed, uint64_t offset, uint64_t size)
+{
+	uint64_t pos = 0;
+	uint64_t found = 0;
+	while (pos < size)
+	{
+		pos += scan(original, changed, offset + pos, size - pos);
+		if (pos >= size) break;
+		found++;
+		pos += sizeof(uint64_t);
+	}
+	return found;
+}
+
+static void run_walk_comparison(const char* name, const std::vector<char>& original, const std::vector<char>& changed, uint64_t target_bytes)
+{
+	const uint64_t size = original.size();
+	const uint64_t expected = walk_changes<find_patch_start_word>(original.data(), changed.data(), 0, size);
+	char implementation_name[96];
+	snprintf(implementation_name, sizeof(implementation_name), "word_%s", name);
+	run_case(implementation_name, original, changed, 0, size, target_bytes, walk_changes<find_patch_start_word>, size);
+	snprintf(implementation_name, sizeof(implementation_name), "chunked256_%s", name);
+	run_case(implementation_name, original, changed, 0, size, target_bytes, walk_changes<find_patch_start_chunked>, size);
+	for (const patch_kernel* kernel : file_writer::patch_kernels())
+	{
+		file_writer::use_patch_kernel(*kernel);
+		assert((walk_changes<file_writer::find_patch_start>(original.data(), changed.data(), 0, size)) == expected);
+		snprintf(implementation_name, sizeof(implementation_name), "%s_%s", kernel->name, name);
+		run_case(implementation_name, original, changed, 0, size, target_bytes, walk_changes<file_writer::find_patch_start>, size);
+	}
+	file_writer::use_patch_kernel(*file_writer::patch_kernels().back());
+}
+
+// Change a share of randomly picked 8-byte words, given in parts per million
+static void benchmark_density(uint64_t size, uint64_t target_bytes)
+{
+	std::vector<char> original(size, 0);
+	uint64_t state = 88172645463325252ull;
+	for (const uint64_t ppm : { 100ull, 1000ull, 10000ull, 100000ull, 500000ull })
+	{
+		std::vector<char> changed(size, 0);
+		for (uint64_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+		{
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			if (state % 1000000 < ppm) changed[i + state % sizeof(uint64_t)] = 1;
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "walk_density_%.2f%%_%" PRIu64 "K", (double)ppm / 10000.0, size / 1024);
+		run_walk_comparison(name, original, changed, target_bytes);
+	}
+}
+
+// Scan a big unchanged area in 1mb objects, one after another or spread over the scan pool the way queue submits do
+static constexpr uint64_t scan_object_size = 1024 * 1024;
+static patch_scan_pool scan_pool;
+
+static uint64_t scan_objects_serial(const char* original, const char* changed, uint64_t offset, uint64_t size)
+{
+	uint64_t sum = 0;
+	for (uint64_t pos = offset; pos < offset + size; pos += scan_object_size) sum += file_writer::find_patch_start(original, changed, pos, scan_object_size);
+	return sum;
+}
+
+static uint64_t scan_objects_parallel(const char* original, const char* changed, uint64_t offset, uint64_t size)
+{
+	std::atomic_uint64_t sum { 0 };
+	scan_pool.run(size / scan_object_size, [&](unsigned task)
+	{
+		sum += file_writer::find_patch_start(original, changed, offset + task * scan_object_size, scan_object_size);
+	});
+	return sum.load();
+}
+
+static void benchmark_parallel_scan(uint64_t size, uint64_t target_bytes)
+{
+	std::vector<char> original(size, 0);
+	std::vector<char> changed(size, 0);
+	char name[64];
+	snprintf(name, sizeof(name), "objects_serial_%" PRIu64 "M", size / (1024 * 1024));
+	run_case(name, original, changed, 0, size, target_bytes, scan_objects_serial, size);
+	snprintf(name, sizeof(name), "objects_parallel%u_%" PRIu64 "M", patch_scan_pool::thread_count(), size / (1024 * 1024));
+	run_case(name, original, changed, 0, size, target_bytes, scan_objects_parallel, size);
 }
 
 static void benchmark_size(uint64_t size, uint64_t target_bytes)
@@ -131,12 +228,15 @@ int main()
 {
 	const uint64_t scale = get_scale();
 	const uint64_t target_bytes = 1024ull * 1024ull * 1024ull * scale;
-	printf("patchscan_perf scale=%" PRIu64 " target_bytes_per_case=%" PRIu64 "\n", scale, target_bytes);
+	printf("patchscan_perf scale=%" PRIu64 " target_bytes_per_case=%" PRIu64 " kernel=%s\n", scale, target_bytes, file_writer::active_patch_kernel().name);
 	print_header();
 	benchmark_size(4 * 1024, target_bytes);
 	benchmark_size(256 * 1024, target_bytes);
 	benchmark_size(4 * 1024 * 1024, target_bytes);
 	benchmark_size(64 * 1024 * 1024, target_bytes);
+	benchmark_density(256 * 1024, target_bytes);
+	benchmark_density(64 * 1024 * 1024, target_bytes);
+	benchmark_parallel_scan(256 * 1024 * 1024, target_bytes);
 	printf("%-30s %12u %14u %12u %12.2f %12.2f %14" PRIu64 "\n", "sink", 0u, 0u, 0u, 0.0, 0.0, (uint64_t)perf_sink);
 	return 0;
 }
@@ -1,3 +1,5 @@
+#include "filewriter.h"
+
 #include <algorithm>
 #include <assert.h>
 #include <chrono>
@@ -146,6 +148,37 @@ static uint64_t patch_coalesced(char* original, const char* changed, uint64_t si
 	return written;
 }
 
+static const patch_kernel* current_kernel = nullptr;
+
+// The same loop as file_writer::write_patch(), without writing out the patches
+static uint64_t patch_kernel_loop(char* original, const char* changed, uint64_t size)
+{
+	uint64_t total_left = size;
+	uint64_t written = 0;
+	while (total_left)
+	{
+		const uint64_t identical = current_kernel->find_change(original, changed, total_left);
+		original += identical;
+		changed += identical;
+		total_left -= identical;
+		const uint64_t copied = current_kernel->copy_change(original, changed, total_left);
+		original += copied;
+		changed += copied;
+		total_left -= copied;
+		written += copied;
+		if (total_left < sizeof(uint64_t))
+		{
+			if (memcmp(original, changed, total_left) != 0)
+			{
+				memcpy(original, changed, total_left);
+				written += total_left;
+			}
+			total_left = 0;
+		}
+	}
+	return written;
+}
+
 static uint64_t get_scale()
 {
 	const char* value = getenv("LAVATUBE_PATCHWRITE_PERF_SCALE");
@@ -203,6 +236,15 @@ static void compare_case(const char* pattern, uint64_t size, const std::vector<c
 	run_case(name, first, second, target_bytes, patch_chunked);
 	snprintf(name, sizeof(name), "coalesced512_%s_%" PRIu64 "K", pattern, size / 1024);
 	run_case(name, first, second, target_bytes, patch_coalesced);
+	for (const patch_kernel* kernel : file_writer::patch_kernels())
+	{
+		current_kernel = kernel;
+		std::fill(candidate.begin(), candidate.end(), 0);
+		const uint64_t kernel_written = patch_kernel_loop(candidate.data(), first.data(), size);
+		if (kernel_written != expected_written || candidate != expected) abort();
+		snprintf(name, sizeof(name), "%s_%s_%" PRIu64 "K", kernel->name, pattern, size / 1024);
+		run_case(name, first, second, target_bytes, patch_kernel_loop);
+	}
 }
 
 static void benchmark_size(uint64_t size, uint64_t target_bytes)
@@ -240,6 +282,28 @@ static void benchmark_size(uint64_t size, uint64_t target_bytes)
 		memset(second.data() + i, 0xaa, std::min<uint64_t>(sizeof(uint64_t), size - i));
 	}
 	compare_case("alternating_8", size, first, second, target_bytes);
+
+	// randomly picked words changed, given in parts per million
+	uint64_t state = 88172645463325252ull;
+	for (const uint64_t ppm : { 1000ull, 10000ull, 100000ull, 500000ull })
+	{
+		std::fill(first.begin(), first.end(), 0);
+		std::fill(second.begin(), second.end(), 0);
+		for (uint64_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+		{
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			if (state % 1000000 < ppm)
+			{
+				memset(first.data() + i, 0x55, sizeof(uint64_t));
+				memset(second.data() + i, 0xaa, sizeof(uint64_t));
+			}
+		}
+		char pattern[32];
+		snprintf(pattern, sizeof(pattern), "density_%.1f%%", (double)ppm / 10000.0);
+		compare_case(pattern, size, first, second, target_bytes);
+	}
 }
 
 static void benchmark_steelnomad(uint64_t target_bytes)
@@ -267,7 +331,7 @@ int main()
 {
 	const uint64_t scale = get_scale();
 	const uint64_t target_bytes = 512ull * 1024ull * 1024ull * scale;
-	printf("patchwrite_perf scale=%" PRIu64 " target_bytes_per_case=%" PRIu64 "\n", scale, target_bytes);
+	printf("patchwrite_perf scale=%" PRIu64 " target_bytes_per_case=%" PRIu64 " kernel=%s\n", scale, target_bytes, file_writer::active_patch_kernel().name);
 	print_header();
 	benchmark_size(4 * 1024, target_bytes);
 	benchmark_size(256 * 1024, target_bytes);
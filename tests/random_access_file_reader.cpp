@@ -7,6 +7,7 @@
 #include <string>
 #include <vector>
 
+#include "filereader.h"
 #include "filewriter.h"
 #include "packfile.h"
 #include "random_access_file_reader.h"
@@ -121,6 +122,116 @@ static void test_direct_random_access(uint_fast8_t compression_algorithm)
 	unlink(filename.c_str());
 }
 
+static void test_subblock_random_access(uint_fast8_t compression_algorithm)
+{
+	const std::string filename = "random_access_reader_subblocks_" + std::to_string(compression_algorithm) + ".bin";
+	const std::vector<uint8_t> payload = make_random_access_payload(4096);
+	const int saved_subblock_size = p__subblock_size;
+	p__subblock_size = 100; // not a divisor of the chunk size, so the last sub-block of each chunk is short
+	write_random_access_payload(filename, payload, compression_algorithm, 512);
+	p__subblock_size = saved_subblock_size;
+
+	{
+		random_access_file_reader reader(filename);
+		assert(reader.version() == LAVATUBE_STREAM_VERSION_SUBBLOCKS);
+		assert(reader.size() == payload.size());
+		check_chunk_directory(reader);
+		for (const random_access_chunk_info& info : reader.chunks()) assert(info.uncompressed_size <= 100);
+
+		// only the sub-block we read from should be decompressed
+		reader.seek(1000);
+		const uint8_t value = reader.read_uint8_t();
+		assert(value == payload[1000]);
+		assert(reader.decompression_count() == 1);
+
+		// crossing both sub-block and chunk boundaries
+		reader.seek(450);
+		std::vector<uint8_t> output(600);
+		reader.read_array(output.data(), output.size());
+		assert(std::equal(output.begin(), output.end(), payload.begin() + 450));
+
+		reader.seek(0);
+		std::vector<uint8_t> everything(payload.size());
+		reader.read_array(everything.data(), everything.size());
+		assert(everything == payload);
+	}
+
+	unlink(filename.c_str());
+}
+
+static void test_adaptive_random_access()
+{
+	const std::string filename = "random_access_reader_adaptive.bin";
+	const size_t chunk_size = 4096; // too small for trial compression, so the preferred algorithm is used
+	std::vector<uint8_t> payload(chunk_size * 3);
+	for (size_t i = 0; i < chunk_size * 2; i++) payload[i] = static_cast<uint8_t>(i % 16); // compresses well
+	uint64_t state = 0x2545f4914f6cdd1dull;
+	for (size_t i = chunk_size * 2; i < payload.size(); i++) // does not compress at all
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		payload[i] = static_cast<uint8_t>(state >> 32);
+	}
+
+	const uint_fast8_t saved_adaptive = p__adaptive_compression;
+	const uint_fast8_t saved_compression_type = p__compression_type;
+	const uint_fast16_t saved_compression_level = p__compression_level;
+	p__adaptive_compression = 1;
+	p__compression_type = LAVATUBE_COMPRESSION_DENSITY;
+	p__compression_level = 0;
+	{
+		file_writer writer(0);
+		writer.disable_multithreaded_compress(); // so that the algorithm is picked when a chunk is handed over
+		writer.change_default_chunk_size(chunk_size);
+		writer.set(filename);
+		for (size_t i = 0; i < payload.size(); i++)
+		{
+			writer.write_uint8_t(payload[i]);
+			if (i == chunk_size) p__compression_type = LAVATUBE_COMPRESSION_LZ4; // first chunk was handed over by this write
+		}
+		writer.finalize();
+		assert(writer.count_codec_chunks(LAVATUBE_COMPRESSION_DENSITY) == 1);
+		assert(writer.count_codec_chunks(LAVATUBE_COMPRESSION_LZ4) == 1);
+		assert(writer.count_codec_chunks(LAVATUBE_COMPRESSION_UNCOMPRESSED) == 1);
+	}
+	p__adaptive_compression = saved_adaptive;
+	p__compression_type = saved_compression_type;
+	p__compression_level = saved_compression_level;
+
+	{
+		random_access_file_reader reader(filename);
+		assert(reader.version() == LAVATUBE_STREAM_VERSION_TAGGED);
+		assert(reader.chunks().size() == 3);
+		assert(reader.chunks().at(0).codec == LAVATUBE_COMPRESSION_DENSITY);
+		assert(reader.chunks().at(1).codec == LAVATUBE_COMPRESSION_LZ4);
+		assert(reader.chunks().at(2).codec == LAVATUBE_COMPRESSION_UNCOMPRESSED);
+		assert(reader.chunks().at(2).compressed_size == chunk_size);
+
+		reader.seek(chunk_size * 2 + 10);
+		const uint8_t value = reader.read_uint8_t();
+		assert(value == payload[chunk_size * 2 + 10]);
+		assert(reader.decompression_count() == 1);
+
+		reader.seek(0);
+		std::vector<uint8_t> everything(payload.size());
+		reader.read_array(everything.data(), everything.size());
+		assert(everything == payload);
+	}
+
+	{
+		file_reader reader(filename, 0, payload.size(), payload.size());
+		assert(reader.version() == LAVATUBE_STREAM_VERSION_TAGGED);
+		for (size_t i = 0; i < payload.size(); i++)
+		{
+			const uint8_t value = reader.read_uint8_t();
+			assert(value == payload[i]);
+		}
+	}
+
+	unlink(filename.c_str());
+}
+
 static void test_packed_random_access()
 {
 	const std::string directory = "random_access_reader_pack_dir";
@@ -217,6 +328,10 @@ int main()
 	test_direct_random_access(LAVATUBE_COMPRESSION_UNCOMPRESSED);
 	test_direct_random_access(LAVATUBE_COMPRESSION_DENSITY);
 	test_direct_random_access(LAVATUBE_COMPRESSION_LZ4);
+	test_subblock_random_access(LAVATUBE_COMPRESSION_UNCOMPRESSED);
+	test_subblock_random_access(LAVATUBE_COMPRESSION_DENSITY);
+	test_subblock_random_access(LAVATUBE_COMPRESSION_LZ4);
+	test_adaptive_random_access();
 	test_packed_random_access();
 	test_legacy_headerless_density_stream();
 
@@ -238,6 +238,134 @@ static void test_fragmented_overlap()
 	assert((r.overlap(r2) == range{5, 27}));
 }
 
+// Compare against one flag per byte, through enough fragments to switch to a tree and back
+static void test_exposure_tree()
+{
+	const uint64_t bytes = 16384;
+	std::vector<bool> model(bytes, false);
+	exposure r;
+	exposure small;
+	small.add(100, 300);
+	small.add(5000, 5000);
+	uint64_t seed = 1;
+	auto next = [&seed](uint64_t max) { seed = seed * 6364136223846793005ull + 1442695040888963407ull; return (seed >> 33) % max; };
+
+	for (uint64_t i = 0; i < bytes; i += 4) r.add(i, i + 1); // many disjoint fragments
+	for (uint64_t i = 0; i < bytes; i += 4) model[i] = model[i + 1] = true;
+	assert(!r.is_tree()); // appending is fine in a list
+	assert(r.size() == bytes / 4);
+	r.add(2, 2);
+	model[2] = true;
+	assert(r.is_tree());
+	assert(r.size() == bytes / 4);
+	r.self_test();
+	bool went_back = false;
+
+	for (int round = 0; round < 20000; round++)
+	{
+		const uint64_t start = next(bytes);
+		const uint64_t end = std::min(bytes - 1, start + next(round < 10000 ? 8 : 256));
+		const int op = (int)next(4);
+		if (op == 0 && round < 10000)
+		{
+			r.add(start, end);
+			for (uint64_t j = start; j <= end; j++) model[j] = true;
+		}
+		else if (op <= 2)
+		{
+			range expected = range::invalid();
+			for (uint64_t j = start; j <= end; j++) if (model[j]) { if (!expected.valid()) expected.first = j; expected.last = j; }
+			const bool mapped = (op == 1);
+			const range v = r.fetch(start, end, mapped);
+			assert(v.valid() == expected.valid());
+			if (v.valid()) assert_equal(v, expected);
+			if (!mapped) for (uint64_t j = start; j <= end; j++) model[j] = false;
+		}
+		else
+		{
+			range expected = range::invalid();
+			for (uint64_t j = 0; j < bytes; j++) if (model[j] && ((j >= 100 + start && j <= 300 + start) || j == 5000 + start))
+			{
+				if (!expected.valid()) expected.first = j;
+				expected.last = j;
+			}
+			const range v = r.overlap(small, start);
+			assert(v.valid() == expected.valid());
+			if (v.valid()) assert_equal(v, expected);
+			const range v2 = small.overlap(r, 0);
+			range expected2 = range::invalid();
+			for (uint64_t j = 0; j < bytes; j++) if (model[j] && ((j >= 100 && j <= 300) || j == 5000))
+			{
+				if (!expected2.valid()) expected2.first = j;
+				expected2.last = j;
+			}
+			assert(v2.valid() == expected2.valid());
+			if (v2.valid()) assert_equal(v2, expected2);
+		}
+		if (!r.is_tree()) went_back = true;
+		r.self_test();
+	}
+	assert(went_back);
+
+	uint64_t total = 0;
+	uint64_t fragments = 0;
+	for (uint64_t j = 0; j < bytes; j++)
+	{
+		total += model[j];
+		if (model[j] && (j == 0 || !model[j - 1])) fragments++;
+	}
+	assert(r.bytes() == total);
+	assert(r.size() == fragments);
+	for (const range& s : r.list()) for (uint64_t j = s.first; j <= s.last; j++) assert(model[j]);
+	r.clear();
+	assert(!r.is_tree() && r.size() == 0);
+}
+
+static void test_touched_ranges()
+{
+	int objects[100];
+	touched_ranges<int*> t;
+	assert(t.size() == 0 && t.empty());
+	assert(t.find(&objects[0]) == nullptr);
+	t.add_os(&objects[0], 0, 16);
+	t.add_os(&objects[0], 16, 16); // merges with the last
+	t.add_os(&objects[1], 100, 0); // empty, not added
+	assert(t.size() == 1);
+	assert((t.find(&objects[0])->span() == range{0, 31}));
+	for (int i = 0; i < 100; i++) t.add_os(&objects[i], i * 10, 5); // grows the table
+	assert(t.size() == 100);
+	assert(t.count(&objects[99]) == 1);
+	assert(t.find(&objects[0])->size() == 1); // 0-4 merged into 0-31
+	assert(t.find(&objects[50])->bytes() == 5);
+	uint64_t seen = 0;
+	for (const auto& pair : t) seen += pair.second.bytes();
+	assert(seen == 32 + 99 * 5);
+
+	touched_ranges<int*> other;
+	other.add_os(&objects[50], 600, 10);
+	other.add_os(&objects[0], 1000, 1);
+	t.merge(other);
+	t.merge(t); // changes nothing
+	assert(t.size() == 100);
+	assert(t.find(&objects[50])->size() == 2);
+	touched_ranges<int*> fresh;
+	fresh.merge(other);
+	assert(fresh.size() == 2);
+	assert((fresh.find(&objects[0])->span() == range{1000, 1000}));
+
+	t.clear(); // keeps storage, forgets objects
+	assert(t.size() == 0);
+	assert(t.find(&objects[50]) == nullptr);
+	t.add_os(&objects[50], 8, 8);
+	assert(t.size() == 1);
+	assert(t.find(&objects[50])->size() == 1);
+	assert((t.find(&objects[50])->span() == range{8, 15}));
+	t.clear();
+	for (int i = 0; i < 100; i++) t.add_os(&objects[i], 0, 1);
+	assert(t.size() == 100);
+	for (int i = 0; i < 100; i++) assert(t.find(&objects[i])->bytes() == 1);
+}
+
 int main()
 {
 	test_exposure();
@@ -246,5 +374,7 @@ int main()
 	test_merge_does_not_shrink();
 	test_repeated_prepend();
 	test_fragmented_overlap();
+	test_exposure_tree();
+	test_touched_ranges();
 	return 0;
 }
@@ -5,6 +5,7 @@
 #include <chrono>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <unordered_map>
 
 static volatile uint64_t perf_sink = 0;
 
@@ -186,6 +187,132 @@ static void bench_fetch_fragmented_split(uint64_t scale)
 	finish_benchmark("fetch_fragmented_split", repeats * fragments, timer, checksum);
 }
 
+// Sparse streaming uploads, where one memory object collects a great many small exposed ranges
+static const uint64_t sparse_fragments = 100000;
+
+// Visit the fragments in a scattered order that still covers each of them once
+static uint64_t scattered(uint64_t i)
+{
+	return (i * 7919) % sparse_fragments;
+}
+
+static void bench_sparse_add_scattered(uint64_t scale)
+{
+	const uint64_t repeats = 2 * scale;
+	benchmark_timer timer = start_benchmark();
+	uint64_t checksum = 0;
+	for (uint64_t repeat = 0; repeat < repeats; repeat++)
+	{
+		exposure r;
+		for (uint64_t i = 0; i < sparse_fragments; i++) r.add(scattered(i) * 64, scattered(i) * 64 + 15);
+		assert(r.size() == sparse_fragments);
+		checksum += r.size() + r.span().last;
+	}
+	finish_benchmark("sparse_add_scattered", repeats * sparse_fragments, timer, checksum);
+}
+
+static void bench_sparse_fetch_scattered(uint64_t scale)
+{
+	const uint64_t repeats = 2 * scale;
+	benchmark_timer timer = start_benchmark();
+	uint64_t checksum = 0;
+	for (uint64_t repeat = 0; repeat < repeats; repeat++)
+	{
+		exposure r;
+		for (uint64_t i = 0; i < sparse_fragments; i++) r.add(i * 64, i * 64 + 15);
+		for (uint64_t i = 0; i < sparse_fragments; i++)
+		{
+			const uint64_t pos = scattered(i) * 64;
+			range v = r.fetch(pos + 4, pos + 7, false); // splits the fragment in two
+			assert((v == range{ pos + 4, pos + 7 }));
+			checksum += v.first;
+		}
+		assert(r.size() == sparse_fragments * 2);
+		checksum += r.bytes();
+	}
+	finish_benchmark("sparse_fetch_split", repeats * sparse_fragments, timer, checksum);
+}
+
+static void bench_sparse_overlap(uint64_t scale)
+{
+	const uint64_t iterations = 100000 * scale;
+	exposure r;
+	for (uint64_t i = 0; i < sparse_fragments; i++) r.add(i * 64, i * 64 + 15);
+	exposure touched; // what a command buffer touched in this memory
+	touched.add(0, 7);
+	touched.add(40, 47);
+	benchmark_timer timer = start_benchmark();
+	uint64_t checksum = 0;
+	for (uint64_t i = 0; i < iterations; i++)
+	{
+		range v = r.overlap(touched, scattered(i % sparse_fragments) * 64);
+		assert(v.valid());
+		checksum += v.first + v.last;
+	}
+	finish_benchmark("sparse_overlap_small", iterations, timer, checksum);
+}
+
+// Many draws touching a few hundred objects each, as command buffer recording does, then a reset
+template<typename Touch, typename Reset>
+static uint64_t record_draws(uint64_t frames, Touch touch, Reset reset)
+{
+	const uint64_t objects = 1024;
+	const uint64_t draws = 2048;
+	static int handles[objects];
+	uint64_t checksum = 0;
+	for (uint64_t frame = 0; frame < frames; frame++)
+	{
+		for (uint64_t draw = 0; draw < draws; draw++)
+		{
+			touch(&handles[draw % objects], (draw / objects) * 256, 256); // vertex buffer, appended
+			touch(&handles[(draw * 7) % objects], 0, 64); // uniforms, same range again
+			touch(&handles[(draw * 13) % objects], (draw % 16) * 128, 64); // descriptor set, fragmented
+		}
+		checksum += reset();
+	}
+	return checksum;
+}
+
+static void bench_touch_unordered_map(uint64_t scale)
+{
+	const uint64_t frames = 64 * scale;
+	std::unordered_map<int*, exposure> touched;
+	benchmark_timer timer = start_benchmark();
+	const uint64_t checksum = record_draws(frames, [&](int* key, uint64_t offset, uint64_t size) { touched[key].add_os(offset, size); },
+		[&]() { const uint64_t n = touched.size(); touched.clear(); return n; });
+	finish_benchmark("touch_unordered_map", frames * 2048 * 3, timer, checksum);
+}
+
+static void bench_touch_flat(uint64_t scale)
+{
+	const uint64_t frames = 64 * scale;
+	touched_ranges<int*> touched;
+	benchmark_timer timer = start_benchmark();
+	const uint64_t checksum = record_draws(frames, [&](int* key, uint64_t offset, uint64_t size) { touched.add_os(key, offset, size); },
+		[&]() { const uint64_t n = touched.size(); touched.clear(); return n; });
+	finish_benchmark("touch_flat", frames * 2048 * 3, timer, checksum);
+}
+
+static void bench_touch_merge(uint64_t scale)
+{
+	const uint64_t repeats = 4096 * scale;
+	const uint64_t objects = 256;
+	static int handles[objects];
+	touched_ranges<int*> secondary;
+	for (uint64_t i = 0; i < objects; i++) secondary.add_os(&handles[i], i * 64, 64);
+	touched_ranges<int*> primary;
+	benchmark_timer timer = start_benchmark();
+	uint64_t checksum = 0;
+	for (uint64_t repeat = 0; repeat < repeats; repeat++)
+	{
+		primary.add_os(&handles[repeat % objects], 0, 16);
+		primary.merge(secondary);
+		checksum += primary.size();
+		primary.clear();
+	}
+	finish_benchmark("touch_merge_secondary", repeats * objects, timer, checksum);
+}
+
 int main()
 {
 	const uint64_t scale = get_scale();
@@ -198,6 +325,12 @@ int main()
 	bench_overlap_fragmented_miss(scale);
 	bench_fetch_single_mapped(scale);
 	bench_fetch_fragmented_split(scale);
+	bench_sparse_add_scattered(scale);
+	bench_sparse_fetch_scattered(scale);
+	bench_sparse_overlap(scale);
+	bench_touch_unordered_map(scale);
+	bench_touch_flat(scale);
+	bench_touch_merge(scale);
 	print_row("sink", 0, 0, 0.0, (uint64_t)perf_sink);
 	return 0;
 }
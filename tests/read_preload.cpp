@@ -1,6 +1,8 @@
 #include <algorithm>
+#include <bit>
 #include <chrono>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <unistd.h>
@@ -23,7 +25,8 @@ static void write_payload(const std::string& filename, const std::vector<uint8_t
 	file_writer file(0);
 	file.change_default_chunk_size(chunk_size);
 	file.set(filename);
-	file.write_array(payload.data(), payload.size());
+	// write it in pieces, since one big write would end up in a single chunk
+	for (size_t offset = 0; offset < payload.size(); offset += 64) file.write_array(payload.data() + offset, std::min<size_t>(64, payload.size() - offset));
 	file.finalize();
 }
 
@@ -40,8 +43,15 @@ static void test_preload0_cross_chunk_read()
 		file_reader reader(filename, 0, payload.size(), payload.size());
 		reader.self_test();
 
+		// the decompressor stays no more than two chunks ahead of us, so this first read has to wait for it
 		std::vector<uint8_t> out(payload.size(), 0);
-		size_t offset = 0;
+		size_t offset = 2048;
+		reader.read_array(out.data(), offset);
+		assert(reader.starved.count.load() == 1);
+		assert(reader.starved.time_ns.load() > 0);
+		const unsigned bucket = std::min<unsigned>(wait_stats::buckets - 1, std::bit_width(reader.starved.time_ns.load() / 1000));
+		assert(reader.starved.histogram[bucket].load() == 1);
+
 		while (offset < out.size())
 		{
 			const size_t chunk = std::min<size_t>(300, out.size() - offset);
@@ -51,6 +61,11 @@ static void test_preload0_cross_chunk_read()
 
 		assert(out == payload);
 		reader.self_test();
+
+		// any time we caught up with the decompressor is recorded, with its latency in the histogram
+		uint64_t bucketed = 0;
+		for (const auto& b : reader.starved.histogram) bucketed += b.load();
+		assert(bucketed == reader.starved.count.load());
 	}
 
 	unlink(filename.c_str());
@@ -85,6 +100,257 @@ static void test_start_measurement_caps_wait_to_target()
 	unlink(filename.c_str());
 }
 
+struct progress_reader : public file_reader
+{
+	using file_reader::file_reader;
+	uint64_t ahead() const { return uncompressed_bytes.load() - read_position; }
+	uint64_t position() const { return read_position; }
+	uint64_t window() const { return window_size; }
+	const char* data(uint64_t pos) const { return window_pointer(pos); }
+	uint64_t moved() const { return moved_bytes.load(); }
+	void hold() { set_checkpoint(); }
+	void release() { release_checkpoint(); }
+};
+
+// Without a preload we should stay about one chunk ahead of the reader, and get the next chunk to it as soon as it
+// has caught up, rather than whenever the decompressor next looks.
+static void test_throttled_read_ahead()
+{
+	const std::string filename = "read_preload_throttle.bin";
+	const size_t chunk_size = 64 * 1024;
+	const std::vector<uint8_t> payload = make_payload(16 * 1024 * 1024);
+
+	p__preload = 0;
+	p__allow_stalls = 1;
+	{
+		file_writer file(0);
+		file.change_default_chunk_size(chunk_size);
+		file.set(filename);
+		for (size_t offset = 0; offset < payload.size(); offset += 4096) file.write_array(payload.data() + offset, 4096);
+		file.finalize();
+	}
+
+	{
+		progress_reader reader(filename, 0, payload.size(), payload.size(), false);
+		std::vector<uint8_t> out(payload.size(), 0);
+		size_t offset = 0;
+		while (offset < out.size())
+		{
+			if (offset % (1024 * 1024) == 0)
+			{
+				usleep(10000); // let the decompressor get as far ahead as it wants to
+				assert(reader.ahead() <= 2 * chunk_size);
+			}
+			const size_t size = std::min<size_t>(4096, out.size() - offset);
+			reader.read_array(out.data() + offset, size);
+			offset += size;
+		}
+		assert(out == payload);
+		reader.self_test();
+
+		// we caught up with the decompressor on most chunks, but should not have had to wait long for it
+		const uint64_t waits = reader.starved.count.load();
+		if (waits > 0) assert(reader.starved.time_ns.load() / waits < 500 * 1000);
+	}
+
+	unlink(filename.c_str());
+}
+
+// A stream much bigger than its window must still read back correctly, including reads that wrap around the end
+// of the window, and data we hold on to with a checkpoint must not be overwritten.
+static void test_uncompressed_window()
+{
+	const std::string filename = "read_preload_window.bin";
+	const size_t chunk_size = 64 * 1024;
+	const std::vector<uint8_t> payload = make_payload(16 * 1024 * 1024);
+	const int saved_window = p__uncompressed_window;
+
+	p__preload = 1;
+	p__allow_stalls = 1;
+	p__uncompressed_window = 1;
+	{
+		file_writer file(0);
+		file.change_default_chunk_size(chunk_size);
+		file.set(filename);
+		for (size_t offset = 0; offset < payload.size(); offset += 4096) file.write_array(payload.data() + offset, 4096);
+		file.finalize();
+	}
+
+	{
+		progress_reader reader(filename, 0, payload.size(), payload.size(), false);
+		assert(reader.window() == 1024 * 1024);
+		reader.start_measurement();
+		std::vector<uint8_t> out(payload.size(), 0);
+		size_t offset = 0;
+		while (offset < out.size())
+		{
+			// hold on to a "packet" of up to 300kb while the decompressor keeps going
+			const size_t packet = std::min<size_t>(300 * 1024 - 7, out.size() - offset);
+			const uint64_t start = reader.position();
+			reader.hold();
+			for (size_t done = 0; done < packet; )
+			{
+				const size_t size = std::min<size_t>(1000, packet - done);
+				reader.read_array(out.data() + offset + done, size);
+				done += size;
+			}
+			usleep(1000);
+			assert(memcmp(reader.data(start), payload.data() + start, packet) == 0);
+			assert(reader.ahead() <= reader.window());
+			reader.self_test();
+			reader.release();
+			offset += packet;
+		}
+		assert(out == payload);
+		assert(reader.done());
+	}
+
+	unlink(filename.c_str());
+	p__uncompressed_window = saved_window;
+}
+
+// Huge pages and prefaulting must not change what we read, with or without a window, and we should be told how
+// much we decompressed while measuring.
+static void test_huge_pages_and_prefault()
+{
+	const std::string filename = "read_preload_huge.bin";
+	const std::vector<uint8_t> payload = make_payload(8 * 1024 * 1024);
+	const int saved_window = p__uncompressed_window;
+
+	p__preload = 2;
+	p__allow_stalls = 1;
+	p__huge_pages = 1;
+	p__prefault = 1;
+	{
+		file_writer file(0);
+		file.change_default_chunk_size(256 * 1024);
+		file.set(filename);
+		for (size_t offset = 0; offset < payload.size(); offset += 4096) file.write_array(payload.data() + offset, 4096);
+		file.finalize();
+	}
+
+	for (int window : { 0, 4 })
+	{
+		p__uncompressed_window = window;
+		progress_reader reader(filename, 0, payload.size(), payload.size(), false);
+		std::vector<uint8_t> out(payload.size(), 0);
+		reader.read_array(out.data(), 4096);
+		reader.start_measurement();
+		for (size_t offset = 4096; offset < out.size(); offset += 4096) reader.read_array(out.data() + offset, 4096);
+		assert(out == payload);
+		uint64_t worker = 0;
+		uint64_t runner = 0;
+		reader.stop_measurement(worker, runner);
+		assert(reader.measured_bytes() > 0 && reader.measured_bytes() <= payload.size());
+	}
+
+	unlink(filename.c_str());
+	p__uncompressed_window = saved_window;
+	p__huge_pages = 0;
+	p__prefault = 0;
+}
+
+// Stored chunks should mostly be moved out of the file mapping rather than copied, which needs the writer to keep
+// big chunks lined up with pages, in both untagged and tagged streams.
+static void test_stored_zero_copy()
+{
+	const std::string filename = "read_preload_stored.bin";
+	const std::vector<uint8_t> payload = make_payload(5 * 4 * 1024 * 1024 + 12345);
+	const uint_fast8_t saved_compression_type = p__compression_type;
+	const uint_fast8_t saved_adaptive = p__adaptive_compression;
+
+	p__preload = 0;
+	p__allow_stalls = 1;
+	p__compression_type = LAVATUBE_COMPRESSION_UNCOMPRESSED;
+	for (int adaptive : { 0, 1 })
+	{
+		p__adaptive_compression = adaptive; // gives us a tagged stream
+		{
+			file_writer file(0);
+			file.change_default_chunk_size(4 * 1024 * 1024);
+			file.set(filename);
+			for (size_t offset = 0; offset < payload.size(); offset += 4096)
+			{
+				file.write_array(payload.data() + offset, std::min<size_t>(4096, payload.size() - offset));
+			}
+			file.finalize();
+		}
+		progress_reader reader(filename, 0, payload.size(), payload.size());
+		std::vector<uint8_t> out(payload.size(), 0);
+		for (size_t offset = 0; offset < out.size(); offset += 1000)
+		{
+			reader.read_array(out.data() + offset, std::min<size_t>(1000, out.size() - offset));
+		}
+		assert(out == payload);
+		assert(reader.done());
+		assert(reader.moved() >= payload.size() * 3 / 4);
+	}
+
+	unlink(filename.c_str());
+	p__compression_type = saved_compression_type;
+	p__adaptive_compression = saved_adaptive;
+}
+
+// Several readers share one decompression worker, one of them with much more data than the others. All of
+// them must get their data, and readers must be able to go away while the worker may be busy with them.
+static void test_shared_decompression_pool()
+{
+	const unsigned count = 4;
+	const uint_fast8_t saved_threads = p__decompression_threads;
+	p__preload = 0;
+	p__allow_stalls = 1;
+	p__decompression_threads = 1;
+	std::vector<std::string> filenames;
+	std::vector<std::vector<uint8_t>> payloads;
+	for (unsigned i = 0; i < count; i++)
+	{
+		filenames.push_back("read_preload_pool_" + std::to_string(i) + ".bin");
+		payloads.push_back(make_payload(i == 0 ? 256 * 1024 : 8192));
+		file_writer file(0);
+		file.change_default_chunk_size(4096);
+		file.set(filenames.back());
+		for (size_t offset = 0; offset < payloads.back().size(); offset += 1024) file.write_array(payloads.back().data() + offset, 1024);
+		file.finalize();
+	}
+
+	std::vector<file_reader*> readers;
+	for (unsigned i = 0; i < count; i++) readers.push_back(new file_reader(filenames[i], i, payloads[i].size(), payloads[i].size()));
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < count; i++)
+	{
+		threads.emplace_back([&, i]
+		{
+			file_reader& reader = *readers[i];
+			reader.start_measurement();
+			std::vector<uint8_t> out(payloads[i].size(), 0);
+			for (size_t offset = 0; offset < out.size(); offset += 100)
+			{
+				reader.read_array(out.data() + offset, std::min<size_t>(100, out.size() - offset));
+			}
+			assert(out == payloads[i]);
+			assert(reader.done());
+			uint64_t worker = 0;
+			uint64_t runner = 0;
+			reader.stop_measurement(worker, runner);
+			reader.self_test();
+		});
+	}
+	for (std::thread& t : threads) t.join();
+	for (file_reader* reader : readers) delete reader;
+
+	// go away before reading everything
+	{
+		file_reader big(filenames[0], 0, payloads[0].size(), payloads[0].size());
+		file_reader small(filenames[1], 1, payloads[1].size(), payloads[1].size());
+		std::vector<uint8_t> out(100, 0);
+		small.read_array(out.data(), out.size());
+		assert(std::equal(out.begin(), out.end(), payloads[1].begin()));
+	}
+
+	for (const std::string& filename : filenames) unlink(filename.c_str());
+	p__decompression_threads = saved_threads;
+}
+
 int main()
 {
 	const uint_fast16_t saved_preload = p__preload;
@@ -92,6 +358,11 @@ int main()
 
 	test_preload0_cross_chunk_read();
 	test_start_measurement_caps_wait_to_target();
+	test_throttled_read_ahead();
+	test_uncompressed_window();
+	test_huge_pages_and_prefault();
+	test_stored_zero_copy();
+	test_shared_decompression_pool();
 
 	p__preload = saved_preload;
 	p__allow_stalls = saved_allow_stalls;
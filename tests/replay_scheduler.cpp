@@ -0,0 +1,89 @@
+// Unit test for running many replay threads as fibers on fewer worker threads
+
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "util.h"
+#include "replay_scheduler.h"
+
+struct fake_thread
+{
+	std::atomic_uint_fast32_t packets { 0 };
+	std::atomic_uint32_t waiters { 0 };
+};
+
+// Complete a packet and wake up anyone waiting for it, like lava_file_reader::complete_packet()
+static void complete(replay_scheduler& scheduler, fake_thread& t)
+{
+	t.packets.fetch_add(1);
+	if (t.waiters.load()) scheduler.wake(t.packets);
+}
+
+static void wait_for(replay_scheduler& scheduler, replay_scheduler::fiber* self, fake_thread& t, uint32_t packets)
+{
+	while (t.packets.load() < packets) scheduler.park(self, t.packets, packets, t.waiters);
+}
+
+// Each thread waits for the one before it to finish a packet before doing its own, so that
+// progress goes round and round the threads, which needs a switch for every packet.
+static void test_ring(unsigned count, unsigned workers)
+{
+	const uint32_t rounds = 200;
+	std::vector<fake_thread> threads(count);
+	replay_scheduler scheduler(count, workers);
+	assert(scheduler.worker_count() == std::min(count, workers));
+	scheduler.run([&](unsigned i, replay_scheduler::fiber* self)
+	{
+		for (uint32_t round = 0; round < rounds; round++)
+		{
+			if (i > 0) wait_for(scheduler, self, threads[i - 1], round + 1);
+			else if (round > 0) wait_for(scheduler, self, threads[count - 1], round);
+			if (i > 0) assert(threads[i - 1].packets.load() > threads[i].packets.load());
+			complete(scheduler, threads[i]);
+		}
+	});
+	for (const fake_thread& t : threads)
+	{
+		assert(t.packets.load() == rounds);
+		assert(t.waiters.load() == 0);
+	}
+	if (workers == 1) assert(scheduler.parks() >= (count - 1) * rounds);
+}
+
+// Waking everyone up lets waiting threads see that we are stopping, even if what they wait for never happens
+static void test_wake_all()
+{
+	std::vector<fake_thread> threads(4);
+	std::atomic_bool stop { false };
+	std::atomic_uint32_t stopped { 0 };
+	replay_scheduler scheduler(4, 2);
+	scheduler.run([&](unsigned i, replay_scheduler::fiber* self)
+	{
+		if (i == 0)
+		{
+			while (stopped.load() < 2) scheduler.park(self, threads[0].packets, 0, threads[0].waiters); // yields
+			stop.store(true);
+			scheduler.wake_all();
+			return;
+		}
+		stopped++;
+		while (!stop.load()) scheduler.park(self, threads[0].packets, 1000, threads[0].waiters);
+	});
+	assert(stop.load());
+	assert(threads[0].waiters.load() == 0);
+}
+
+int main()
+{
+	if (!replay_scheduler::supported()) return 77;
+	test_ring(2, 1);
+	test_ring(16, 1);
+	test_ring(16, 3);
+	test_ring(64, 8);
+	test_ring(4, 8); // more workers than threads
+	test_wake_all();
+	return 0;
+}
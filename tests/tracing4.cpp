@@ -411,6 +411,11 @@ static void trace_4()
 	trace_vkFreeMemory(vulkan.device, target_memory, nullptr);
 	trace_vkFreeCommandBuffers(vulkan.device, command_pool, num_buffers + 1, command_buffers.data());
 	trace_vkDestroyCommandPool(vulkan.device, command_pool, nullptr);
+	if (p__direct_span_size > 0 && buffer_size >= (unsigned)p__direct_span_size) // uploads must have skipped the staging copy
+	{
+		const uint64_t direct = lava_writer::instance().file_writer().count_direct_bytes();
+		assert(direct > 0);
+	}
 	test_done(vulkan);
 }
 
@@ -0,0 +1,146 @@
+// Test of backing host visible memory with host cached memory during capture
+
+#include "tests/common.h"
+#include "write.h"
+
+#define TEST_NAME "tracing_cached_memory"
+#define BUFFER_SIZE (1024 * 1024)
+
+static int count_updates = 0;
+
+static void trace()
+{
+	p__trust_host_flushes = 1;
+	p__cached_memory = 1;
+
+	vulkan_req_t reqs;
+	vulkan_setup_t vulkan = test_init(TEST_NAME, reqs);
+	lava_writer& writer = lava_writer::instance();
+	VkResult result;
+
+	// the app must see the same memory types and heaps as without backing them with cached memory
+	VkPhysicalDeviceMemoryProperties presented = {};
+	VkPhysicalDeviceMemoryProperties real = {};
+	trace_vkGetPhysicalDeviceMemoryProperties(vulkan.physical, &presented);
+	wrap_vkGetPhysicalDeviceMemoryProperties(vulkan.physical, &real);
+	assert(presented.memoryTypeCount >= real.memoryTypeCount);
+	assert(presented.memoryHeapCount == real.memoryHeapCount);
+	for (uint32_t i = 0; i < real.memoryTypeCount; i++)
+	{
+		assert((presented.memoryTypes[i].propertyFlags & ~real.memoryTypes[i].propertyFlags) == 0); // nothing added, in particular not host cached
+		assert(presented.memoryTypes[i].heapIndex == real.memoryTypes[i].heapIndex);
+	}
+	bool have_cached_coherent = false;
+	for (uint32_t j = 0; j < real.memoryTypeCount; j++)
+	{
+		const uint32_t needed = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+		if ((real.memoryTypes[j].propertyFlags & needed) == needed) have_cached_coherent = true;
+	}
+
+	VkBufferCreateInfo buffer_info = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO, nullptr };
+	buffer_info.size = BUFFER_SIZE;
+	buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	VkBuffer buffer = VK_NULL_HANDLE;
+	result = trace_vkCreateBuffer(vulkan.device, &buffer_info, nullptr, &buffer);
+	check(result);
+	VkMemoryRequirements requirements = {};
+	trace_vkGetBufferMemoryRequirements(vulkan.device, buffer, &requirements);
+	assert(requirements.memoryTypeBits != 0);
+	for (uint32_t i = presented.memoryTypeCount; i < 32; i++) assert(!(requirements.memoryTypeBits & (1u << i)));
+
+	// prefer memory that is not already host cached, so that we test the substitution
+	uint32_t memory_type_index = UINT32_MAX;
+	const uint32_t wanted = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	for (uint32_t i = 0; i < presented.memoryTypeCount; i++)
+	{
+		if (!(requirements.memoryTypeBits & (1u << i)) || (presented.memoryTypes[i].propertyFlags & wanted) != wanted) continue;
+		if (memory_type_index == UINT32_MAX || !(presented.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)) memory_type_index = i;
+		if (!(presented.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT)) break;
+	}
+	assert(memory_type_index != UINT32_MAX);
+
+	VkMemoryAllocateInfo alloc_info = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, nullptr };
+	alloc_info.allocationSize = requirements.size;
+	alloc_info.memoryTypeIndex = memory_type_index;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	result = trace_vkAllocateMemory(vulkan.device, &alloc_info, nullptr, &memory);
+	check(result);
+	result = trace_vkBindBufferMemory(vulkan.device, buffer, memory, 0);
+	check(result);
+
+	// we keep both identities, and the app facing one is what goes into the trace
+	const trackedmemory_trace* memory_data = writer.records.VkDeviceMemory_index.at(memory);
+	assert(memory_data->requested_type == memory_type_index);
+	assert(memory_data->propertyFlags == presented.memoryTypes[memory_type_index].propertyFlags);
+	assert(memory_data->requested_heap == presented.memoryTypes[memory_type_index].heapIndex);
+	assert(memory_data->backing_type < real.memoryTypeCount);
+	assert(memory_data->backing_flags == real.memoryTypes[memory_data->backing_type].propertyFlags);
+	assert(memory_data->backing_flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	if (have_cached_coherent) assert(memory_data->backing_flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+	printf("Memory type %u (flags=%u) backed by memory type %u (flags=%u)\n", memory_type_index, (unsigned)memory_data->propertyFlags,
+	       memory_data->backing_type, (unsigned)memory_data->backing_flags);
+
+	char* ptr = nullptr;
+	result = trace_vkMapMemory(vulkan.device, memory, 0, VK_WHOLE_SIZE, 0, (void**)&ptr);
+	check(result);
+	for (unsigned i = 0; i < BUFFER_SIZE; i++) ptr[i] = (char)(i % 251);
+	VkMappedMemoryRange flush = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr };
+	flush.memory = memory;
+	flush.offset = 0;
+	flush.size = VK_WHOLE_SIZE;
+	result = trace_vkFlushMappedMemoryRanges(vulkan.device, 1, &flush);
+	check(result);
+	trace_vkUnmapMemory(vulkan.device, memory);
+
+	trace_vkDestroyBuffer(vulkan.device, buffer, nullptr);
+	trace_vkFreeMemory(vulkan.device, memory, nullptr);
+	test_done(vulkan);
+	p__cached_memory = 0;
+}
+
+static bool getnext(lava_file_reader& t)
+{
+	bool done = false;
+	const uint8_t instrtype = t.step();
+	if (instrtype == PACKET_VULKAN_API_CALL)
+	{
+		const uint16_t apicall = t.read_apicall();
+		if (apicall == 1) done = true; // is vkDestroyInstance
+	}
+	else if (instrtype == PACKET_THREAD_BARRIER)
+	{
+		t.read_barrier();
+	}
+	else if (instrtype == PACKET_IMAGE_UPDATE || instrtype == PACKET_IMAGE_UPDATE2)
+	{
+		update_image_packet(instrtype, t);
+	}
+	else if (instrtype == PACKET_BUFFER_UPDATE || instrtype == PACKET_BUFFER_UPDATE2)
+	{
+		update_buffer_packet(instrtype, t);
+		count_updates++;
+	}
+	else if (instrtype == PACKET_TENSOR_UPDATE)
+	{
+		update_tensor_packet(instrtype, t);
+	}
+	else assert(false);
+	return !done;
+}
+
+static void retrace()
+{
+	lava_reader r(TEST_NAME ".api");
+	test_register_replay_callbacks();
+	lava_file_reader& t = r.file_reader(0);
+	while (getnext(t)) {}
+	assert(count_updates == 1);
+}
+
+int main()
+{
+	trace();
+	retrace();
+	return 0;
+}
@@ -6,6 +6,7 @@
 #include "util.h"
 #include "read.h"
 #include "write.h"
+#include "packfile.h"
 
 #include "tests/tests.h"
 
@@ -356,6 +357,60 @@ void read_test_1()
 	assert(big.at(13) == 0);
 }
 
+// Packets written into a reserved span come before those we write after reserving it, so frames and checkpoints
+// recorded in the meantime must be moved up by its size once it is in.
+static void write_test_reserve_packets()
+{
+	const int saved_chunksize = p__chunksize;
+	p__chunksize = 64 * 1024; // so that we get checkpoints while the span is out
+	lava_writer& writer = lava_writer::instance();
+	writer.set("write_1_3");
+	lava_file_writer& file = writer.file_writer();
+	const uint64_t packet_size = 1 + 4 + 4; // type, size, payload
+
+	file.end_packet(); // close the thread barrier we start out with
+	writer.new_frame();
+	file.begin_packet(PACKET_BUFFER_UPDATE);
+	file.write_uint32_t(0);
+	file.end_packet();
+	const uint64_t span_size = 200 * 1024;
+	stream_span* span = file.reserve_packets(1);
+	writer.deferred_diff.run(file, span, span_size, 1024 * 1024, [span_size](file_writer& out)
+	{
+		std::vector<char> payload(span_size - 5, 7);
+		out.write_uint8_t(PACKET_BUFFER_UPDATE);
+		out.write_uint32_t((uint32_t)span_size);
+		out.write_array(payload.data(), payload.size());
+	});
+	writer.new_frame();
+	for (unsigned i = 0; i < 20000; i++)
+	{
+		file.begin_packet(PACKET_BUFFER_UPDATE);
+		file.write_uint32_t(i);
+		file.end_packet();
+	}
+	writer.serialize();
+	writer.finish();
+	p__chunksize = saved_chunksize;
+
+	Json::Value frameinfo = packed_json("frames_0.json", "write_1_3.api");
+	const Json::Value& frames = frameinfo["frames"];
+	assert(frames.size() == 2);
+	const uint64_t frame_start = frames[1]["position"].asUInt64();
+	const uint32_t frame_packet = frames[1]["packet"].asUInt();
+	assert(frame_packet == frames[0]["packet"].asUInt() + 2);
+	assert(frame_start == frames[0]["position"].asUInt64() + packet_size + span_size);
+	unsigned shifted = 0;
+	for (const Json::Value& checkpoint : frameinfo["packet_checkpoints"])
+	{
+		const uint32_t packet = checkpoint["packet"].asUInt();
+		if (packet < frame_packet) continue;
+		assert(checkpoint["position"].asUInt64() == frame_start + (packet - frame_packet) * packet_size);
+		shifted++;
+	}
+	assert(shifted > 0);
+}
+
 int main()
 {
 	ILOG("write_test_1");
@@ -367,5 +422,8 @@ int main()
 	write_test_1_2();
 	sync();
 	read_test_1_2();
+
+	ILOG("write_test_reserve_packets");
+	write_test_reserve_packets();
 	return 0;
 }
@@ -1,5 +1,6 @@
 #include <atomic>
 #include <algorithm>
+#include <bit>
 #include <numeric>
 #include <thread>
 #include <vector>
@@ -99,6 +100,137 @@ static void read_test(const char* name, int num_threads)
 	reader = nullptr;
 }
 
+// Thread 1 starts out with a barrier on the first two packets of thread 0, then uses a handle from its third packet
+static std::atomic_int wait_phase { 0 };
+static trackable waited_handle;
+
+static void set_wait_phase(int phase)
+{
+	wait_phase.store(phase);
+	wait_phase.notify_all();
+}
+
+static void wait_for_phase(int phase)
+{
+	int seen = wait_phase.load();
+	while (seen < phase)
+	{
+		wait_phase.wait(seen);
+		seen = wait_phase.load();
+	}
+}
+
+static void write_wait_thread_0()
+{
+	lava_file_writer& file = writer.file_writer();
+	file.begin_packet(PACKET_BUFFER_UPDATE);
+	file.write_uint32_t(1);
+	file.end_packet();
+	set_wait_phase(1);
+	wait_for_phase(2); // thread 1 now has its barrier
+	file.begin_packet(PACKET_BUFFER_UPDATE);
+	waited_handle.index = 7;
+	waited_handle.last_modified = file.current;
+	waited_handle.set_state(trackable::states::created);
+	file.write_uint32_t(2);
+	file.end_packet();
+	set_wait_phase(3);
+}
+
+static void write_wait_thread_1()
+{
+	wait_for_phase(1);
+	lava_file_writer& file = writer.file_writer();
+	set_wait_phase(2);
+	wait_for_phase(3);
+	file.begin_packet(PACKET_BUFFER_UPDATE);
+	file.write_handle(&waited_handle);
+	file.end_packet();
+}
+
+/// Hold thread 0 back until thread 1 has gone to sleep waiting for it
+static void wait_until_blocked_on_thread_0()
+{
+	const std::atomic_uint32_t& waiters = reader->thread_packet_waiters->at(0).waiters;
+	while (waiters.load() == 0) std::this_thread::yield();
+}
+
+static void read_wait_thread_0()
+{
+	lava_file_reader& r = reader->file_reader(0);
+	wait_until_blocked_on_thread_0(); // on its barrier
+	const uint8_t barrier_packet = r.step();
+	assert(barrier_packet == PACKET_THREAD_BARRIER);
+	r.read_barrier();
+	const uint8_t first_packet = r.step();
+	assert(first_packet == PACKET_BUFFER_UPDATE);
+	const uint32_t first = r.read_uint32_t();
+	assert(first == 1);
+	r.complete_packet();
+	const lava_file_reader& waiter = reader->file_reader(1);
+	while (waiter.barrier_waits.count.load() == 0) std::this_thread::yield(); // it stopped waiting on the barrier
+	wait_until_blocked_on_thread_0(); // on the handle
+	const uint8_t second_packet = r.step();
+	assert(second_packet == PACKET_BUFFER_UPDATE);
+	const uint32_t second = r.read_uint32_t();
+	assert(second == 2);
+	r.complete_packet();
+}
+
+static void read_wait_thread_1()
+{
+	lava_file_reader& r = reader->file_reader(1);
+	const uint8_t barrier_packet = r.step();
+	assert(barrier_packet == PACKET_THREAD_BARRIER);
+	r.read_barrier();
+	const uint8_t data_packet = r.step();
+	assert(data_packet == PACKET_BUFFER_UPDATE);
+	const uint32_t index = r.read_handle(DEBUGPARAM("waited_handle"));
+	assert(index == 7);
+	r.complete_packet();
+}
+
+static void check_single_wait(const wait_stats& stats)
+{
+	assert(stats.count.load() == 1);
+	assert(stats.time_ns.load() > 0);
+	const unsigned bucket = std::min<unsigned>(wait_stats::buckets - 1, std::bit_width(stats.time_ns.load() / 1000));
+	assert(stats.histogram[bucket].load() == 1);
+}
+
+static void test_cross_thread_waits()
+{
+	ILOG("write_2_4");
+	writer.set("write_2_4");
+	std::thread w0(write_wait_thread_0);
+	std::thread w1(write_wait_thread_1);
+	w0.join();
+	w1.join();
+	writer.serialize();
+	writer.finish();
+
+	reader = new lava_reader("write_2_4.api");
+	std::thread r0(read_wait_thread_0);
+	std::thread r1(read_wait_thread_1);
+	r0.join();
+	r1.join();
+	const lava_file_reader& waiter = reader->file_reader(1);
+	check_single_wait(waiter.barrier_waits);
+	check_single_wait(waiter.handle_waits);
+	assert(waiter.waited_on.size() == 2);
+	const wait_stats& on_thread_0 = waiter.waited_on[0];
+	assert(on_thread_0.count.load() == 2);
+	assert(on_thread_0.time_ns.load() == waiter.barrier_waits.time_ns.load() + waiter.handle_waits.time_ns.load());
+	uint64_t bucketed = 0;
+	for (const auto& bucket : on_thread_0.histogram) bucketed += bucket.load();
+	assert(bucketed == 2);
+	assert(waiter.waited_on[1].count.load() == 0);
+	assert(reader->file_reader(0).barrier_waits.count.load() == 0);
+	assert(reader->file_reader(0).handle_waits.count.load() == 0);
+	delete reader;
+	reader = nullptr;
+}
+
 int main()
 {
 	// populate with a number series
@@ -115,5 +247,7 @@ int main()
 	write_test("write_2_3", 16);
 	read_test("write_2_3", 16);
 
+	test_cross_thread_waits();
+
 	return 0;
 }
@@ -140,6 +140,58 @@ static void write_test_5()
 	file.write_uint32_t(0);
 }
 
+// All diffing kernels supported by this CPU must give the same results as the scalar one
+static void write_test_patch_kernels()
+{
+	const std::vector<const patch_kernel*>& kernels = file_writer::patch_kernels();
+	const patch_kernel& scalar = *kernels.front();
+	const patch_kernel& saved = file_writer::active_patch_kernel();
+	assert(strcmp(scalar.name, "scalar") == 0);
+	const uint64_t size = 4096 + 13;
+	uint64_t state = 88172645463325252ull;
+	auto next = [&state]() { state ^= state << 13; state ^= state >> 7; state ^= state << 17; return state; };
+	for (const unsigned density : { 0u, 1u, 10u, 50u, 90u, 100u }) // percent of bytes changed
+	{
+		std::vector<char> original(size);
+		for (char& c : original) c = (char)next();
+		std::vector<char> changed = original;
+		for (char& c : changed) if (next() % 100 < density) c = ~c;
+		for (unsigned round = 0; round < 64; round++)
+		{
+			const uint64_t offset = next() % 300;
+			const uint64_t length = next() % (size - offset + 1);
+			const uint64_t expected = scalar.find_change(original.data() + offset, changed.data() + offset, length);
+			std::vector<char> expected_clone = original;
+			const uint64_t expected_copied = scalar.copy_change(expected_clone.data() + offset, changed.data() + offset, length);
+			for (const patch_kernel* kernel : kernels)
+			{
+				assert(kernel->find_change(original.data() + offset, changed.data() + offset, length) == expected);
+				std::vector<char> clone = original;
+				assert(kernel->copy_change(clone.data() + offset, changed.data() + offset, length) == expected_copied);
+				assert(clone == expected_clone);
+			}
+		}
+		// the stream we write must not depend on the kernel either
+		uint64_t expected_written = 0;
+		uint64_t expected_bytes = 0;
+		for (const patch_kernel* kernel : kernels)
+		{
+			file_writer::use_patch_kernel(*kernel);
+			file_writer file(0);
+			file.set("write_4_kernels.bin");
+			std::vector<char> clone = original;
+			const uint64_t written = file.write_patch(clone.data(), changed.data(), 3, size - 3);
+			assert(memcmp(clone.data() + 3, changed.data() + 3, size - 3) == 0);
+			if (kernel == &scalar) { expected_written = written; expected_bytes = file.uncompressed_bytes; }
+			assert(written == expected_written);
+			assert(file.uncompressed_bytes == expected_bytes);
+			file.finalize();
+		}
+	}
+	file_writer::use_patch_kernel(saved);
+	unlink("write_4_kernels.bin");
+}
+
 int main()
 {
 	write_test_1();
@@ -147,5 +199,6 @@ int main()
 	write_test_3();
 	write_test_4();
 	write_test_5();
+	write_test_patch_kernels();
 	return 0;
 }
@@ -3,6 +3,7 @@
 #include <vector>
 #include <string>
 #include <inttypes.h>
+#include <thread>
 
 #include "util.h"
 
@@ -86,6 +87,518 @@ static void read_test_1(size_t bytes)
 	}
 }
 
+// Many writers with tiny chunks sharing the compression pool, so that chunks from the same file
+// are compressed out of order by different workers. Verify that they still land on disk in order.
+static void write_test_shared_pool()
+{
+	const unsigned threads = 6;
+	const uint32_t values = 100000;
+	const uint_fast8_t saved_threads = p__compression_threads;
+	p__compression_threads = 4;
+	std::vector<uint64_t> sizes(threads);
+	std::vector<uint64_t> hits(threads);
+	std::vector<std::thread> writers;
+	for (unsigned t = 0; t < threads; t++) writers.emplace_back([&sizes, &hits, t]()
+	{
+		file_writer file(t);
+		file.change_default_chunk_size(4096 + t * 128);
+		file.set("write5_pool_" + std::to_string(t) + ".bin");
+		for (uint32_t i = 0; i < values; i++) file.write_uint32_t(i * (t + 1));
+		file.finalize();
+		sizes[t] = file.uncompressed_bytes;
+		hits[t] = file.count_pool_hits();
+	});
+	for (std::thread& t : writers) t.join();
+	p__compression_threads = saved_threads;
+	uint64_t total_hits = 0;
+	for (uint64_t h : hits) total_hits += h;
+	assert(total_hits > 0); // chunk buffers should be recycled
+	for (unsigned t = 0; t < threads; t++)
+	{
+		const std::string filename = "write5_pool_" + std::to_string(t) + ".bin";
+		file_reader reader(filename, t, sizes[t], sizes[t]);
+		for (uint32_t i = 0; i < values; i++)
+		{
+			const uint32_t v = reader.read_uint32_t();
+			assert(v == i * (t + 1));
+		}
+		unlink(filename.c_str());
+	}
+}
+
+static void write_test_subblocks(bool multithreaded)
+{
+	const unsigned threads = 3;
+	const uint32_t values = 200000;
+	const int saved_subblock_size = p__subblock_size;
+	p__subblock_size = 1000; // does not divide chunk size or value size
+	std::vector<uint64_t> sizes(threads);
+	std::vector<std::thread> writers;
+	for (unsigned t = 0; t < threads; t++) writers.emplace_back([&sizes, multithreaded, t]()
+	{
+		file_writer file(t);
+		if (!multithreaded) file.disable_multithreaded_compress();
+		file.change_default_chunk_size(8192 + t * 64);
+		file.set("write5_subblocks_" + std::to_string(t) + ".bin");
+		for (uint32_t i = 0; i < values; i++) file.write_uint32_t(i ^ t);
+		file.finalize();
+		sizes[t] = file.uncompressed_bytes;
+	});
+	for (std::thread& t : writers) t.join();
+	p__subblock_size = saved_subblock_size;
+	for (unsigned t = 0; t < threads; t++)
+	{
+		const std::string filename = "write5_subblocks_" + std::to_string(t) + ".bin";
+		file_reader reader(filename, t, sizes[t], sizes[t]);
+		assert(reader.version() == LAVATUBE_STREAM_VERSION_SUBBLOCKS);
+		for (uint32_t i = 0; i < values; i++)
+		{
+			const uint32_t v = reader.read_uint32_t();
+			assert(v == (i ^ t));
+		}
+		unlink(filename.c_str());
+	}
+}
+
+static void write_test_adaptive(int subblock_size)
+{
+	const unsigned threads = 2;
+	const uint32_t values = 400000;
+	const uint_fast8_t saved_adaptive = p__adaptive_compression;
+	const int saved_subblock_size = p__subblock_size;
+	p__adaptive_compression = 1;
+	p__subblock_size = subblock_size;
+	std::vector<uint64_t> sizes(threads);
+	std::vector<uint64_t> stored(threads);
+	std::vector<uint64_t> compressed(threads);
+	std::vector<std::thread> writers;
+	for (unsigned t = 0; t < threads; t++) writers.emplace_back([&, t]()
+	{
+		file_writer file(t);
+		file.change_default_chunk_size(256 * 1024);
+		file.set("write5_adaptive_" + std::to_string(t) + ".bin");
+		uint32_t state = 2463534242u + t;
+		for (uint32_t i = 0; i < values; i++)
+		{
+			// alternate between stretches of noise and stretches of easily compressed data
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			file.write_uint32_t(((i / 65536) % 2) ? state : i % 7);
+		}
+		file.finalize();
+		sizes[t] = file.uncompressed_bytes;
+		stored[t] = file.count_codec_chunks(LAVATUBE_COMPRESSION_UNCOMPRESSED);
+		compressed[t] = file.count_codec_chunks(LAVATUBE_COMPRESSION_DENSITY) + file.count_codec_chunks(LAVATUBE_COMPRESSION_LZ4);
+	});
+	for (std::thread& t : writers) t.join();
+	p__adaptive_compression = saved_adaptive;
+	p__subblock_size = saved_subblock_size;
+	for (unsigned t = 0; t < threads; t++)
+	{
+		assert(stored[t] > 0);
+		assert(compressed[t] > 0);
+		const std::string filename = "write5_adaptive_" + std::to_string(t) + ".bin";
+		file_reader reader(filename, t, sizes[t], sizes[t]);
+		assert(reader.version() == LAVATUBE_STREAM_VERSION_TAGGED);
+		uint32_t state = 2463534242u + t;
+		for (uint32_t i = 0; i < values; i++)
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			const uint32_t v = reader.read_uint32_t();
+			assert(v == (((i / 65536) % 2) ? state : i % 7));
+		}
+		unlink(filename.c_str());
+	}
+}
+
+static void write_test_backpressure()
+{
+	const unsigned threads = 3;
+	const unsigned chunk_size = 64 * 1024;
+	const uint32_t values = 1024 * 1024;
+	const int saved_budget = p__inflight_budget;
+	p__inflight_budget = 1; // megabytes
+	std::vector<std::thread> writers;
+	for (unsigned t = 0; t < threads; t++) writers.emplace_back([t]()
+	{
+		file_writer file(t);
+		file.change_default_chunk_size(chunk_size);
+		file.set("write5_budget_" + std::to_string(t) + ".bin");
+		for (uint32_t i = 0; i < values; i++) file.write_uint32_t(i);
+		file.finalize();
+	});
+	for (std::thread& t : writers) t.join();
+	p__inflight_budget = saved_budget;
+	const compression_pool::statistics stats = compression_pool::instance().stats();
+	printf("Back-pressure: %lu stalls for %lu ns, peak %lu bytes in flight, peak queue depth %lu\n", (unsigned long)stats.stalls,
+	       (unsigned long)stats.stall_ns, (unsigned long)stats.peak_inflight_bytes, (unsigned long)stats.peak_queue_depth);
+	// each writer may go over budget by one chunk, if it has nothing else in flight
+	assert(stats.peak_inflight_bytes <= 1024 * 1024 + threads * chunk_size);
+	assert(stats.peak_queue_depth >= stats.peak_compress_backlog);
+	assert(stats.peak_queue_depth >= stats.peak_writeout_backlog);
+	for (unsigned t = 0; t < threads; t++) unlink(("write5_budget_" + std::to_string(t) + ".bin").c_str());
+}
+
+static void write_test_patch_opcodes()
+{
+	const uint64_t size = 1024 * 1024 + 13;
+	const uint_fast8_t saved_patch_opcodes = p__patch_opcodes;
+	p__patch_opcodes = 1;
+	std::vector<char> memory(size, 0);
+	uint32_t state = 2463534242u;
+	for (uint64_t i = 0; i < size; i++)
+	{
+		if (i < 256 * 1024) memory[i] = 0; // cleared memory
+		else if (i < 320 * 1024) memory[i] = 0x5a; // byte pattern
+		else if (i < 384 * 1024) memory[i] = "\xef\xbe\xad\xde"[i % 4]; // word pattern
+		else if (i < 448 * 1024) memory[i] = "lavatube"[i % 8] + (i % 3); // period of 24 bytes, only copies can catch it
+		else if (i < 512 * 1024) memory[i] = (i % 48 < 20) ? 'a' + (i % 48) : (char)(i % 48); // repeated structs
+		else
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			memory[i] = (char)state;
+		}
+	}
+	std::vector<char> clone(size, 0x5a);
+	std::vector<char> changed = memory;
+	changed[1000] = 1; // short raw change in the middle of the cleared memory
+	for (uint64_t i = 600 * 1024; i < 700 * 1024; i++) changed[i] = 0; // random memory cleared
+
+	file_writer file(0);
+	file.set("write5_patch_opcodes.bin");
+	file.write_uint32_t(1234);
+	file.write_memory_span(memory.data(), 0, size);
+	const uint64_t span_bytes = file.uncompressed_bytes - sizeof(uint32_t);
+	file.write_uint32_t(1234);
+	const uint64_t written = file.write_patch(clone.data(), memory.data(), 0, size);
+	file.write_uint32_t(1234);
+	file.write_patch(clone.data(), changed.data(), 0, size);
+	file.write_uint32_t(1234);
+	file.write_memory_span(memory.data() + 7, 7, 300);
+	file.write_memory_span(memory.data(), 0, 0);
+	file.write_uint32_t(1234);
+	file.finalize();
+	p__patch_opcodes = saved_patch_opcodes;
+	assert(written == size - 64 * 1024); // the byte pattern was already there
+	assert(clone == changed);
+	// everything but the random bytes should compress to almost nothing
+	printf("Patch opcodes: %lu bytes of memory written in %lu bytes\n", (unsigned long)size, (unsigned long)span_bytes);
+	assert(span_bytes < size - 512 * 1024 + 4096);
+
+	file_reader reader("write5_patch_opcodes.bin", 0, file.uncompressed_bytes, file.uncompressed_bytes);
+	assert(reader.version() == LAVATUBE_STREAM_VERSION_PATCH_OPCODES);
+	std::vector<char> result(size, 0x33);
+	assert(reader.read_uint32_t() == 1234);
+	assert(reader.read_patch(result.data(), size) == size);
+	assert(result == memory);
+	assert(reader.read_uint32_t() == 1234);
+	reader.read_patch(nullptr, size); // skip it
+	assert(reader.read_uint32_t() == 1234);
+	reader.read_patch(result.data(), size);
+	assert(result == changed);
+	assert(reader.read_uint32_t() == 1234);
+	assert(reader.read_patch(result.data(), size) == 300);
+	assert(reader.read_patch(result.data(), size) == 0);
+	assert(result == changed);
+	assert(reader.read_uint32_t() == 1234);
+	unlink("write5_patch_opcodes.bin");
+}
+
+static void write_test_direct_spans(bool multithreaded, int direct_span_size, int subblock_size, bool patch_opcodes)
+{
+	const uint64_t span = 1536 * 1024 + 5;
+	const int saved_direct_span_size = p__direct_span_size;
+	const int saved_subblock_size = p__subblock_size;
+	const uint_fast8_t saved_patch_opcodes = p__patch_opcodes;
+	p__direct_span_size = direct_span_size;
+	p__subblock_size = subblock_size;
+	p__patch_opcodes = patch_opcodes;
+	std::vector<char> memory(span);
+	uint32_t state = 2463534242u;
+	for (uint64_t i = 0; i < span; i++)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		memory[i] = (i < span / 2 || i % 4096 < 2048) ? (char)state : 0; // mostly noise, some cleared
+	}
+	std::vector<char> clone(span, 0x77); // so that the patch is one big change
+
+	file_writer file(0);
+	file.change_default_chunk_size(256 * 1024);
+	file.set("write5_direct.bin");
+	if (!multithreaded) file.disable_multithreaded_compress();
+	for (uint32_t i = 0; i < 1000; i++) file.write_uint32_t(i);
+	file.write_memory_span(memory.data(), 0, span);
+	uint32_t* later = file.write_later_uint32_t(); // freezes the writer, like a packet header does
+	const uint64_t patched = file.write_patch(clone.data(), memory.data(), 0, span);
+	*later = 1234;
+	file.thaw();
+	file.write_uint32_t(1234);
+	file.write_memory_span(memory.data() + 100, 100, 1000); // too small to go directly
+	for (uint32_t i = 0; i < 1000; i++) file.write_uint32_t(i);
+	file.finalize();
+	const uint64_t direct = file.count_direct_bytes();
+	p__direct_span_size = saved_direct_span_size;
+	p__subblock_size = saved_subblock_size;
+	p__patch_opcodes = saved_patch_opcodes;
+	assert(patched > 0);
+	if (patch_opcodes) assert(direct > 0 && direct < span * 2);
+	else assert(direct == span * 2);
+
+	file_reader reader("write5_direct.bin", 0, file.uncompressed_bytes, file.uncompressed_bytes);
+	std::vector<char> result(span, 0);
+	for (uint32_t i = 0; i < 1000; i++) assert(reader.read_uint32_t() == i);
+	assert(reader.read_patch(result.data(), span) == span);
+	assert(result == memory);
+	assert(reader.read_uint32_t() == 1234);
+	std::fill(result.begin(), result.end(), 0);
+	reader.read_patch(result.data(), span);
+	assert(result == memory);
+	assert(reader.read_uint32_t() == 1234);
+	assert(reader.read_patch(result.data(), span) == 1000);
+	for (uint32_t i = 0; i < 1000; i++) assert(reader.read_uint32_t() == i);
+	unlink("write5_direct.bin");
+}
+
+static std::vector<char> read_whole_file(const char* filename)
+{
+	FILE* fp = fopen(filename, "rb");
+	assert(fp);
+	std::vector<char> data;
+	char buf[4096];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) data.insert(data.end(), buf, buf + len);
+	fclose(fp);
+	return data;
+}
+
+// Diffing on the scan pool and writing out the results afterwards must give exactly what diffing and writing in one go gives
+static void write_test_parallel_scan()
+{
+	const uint64_t size = 8 * 1024 * 1024;
+	const unsigned objects = 64;
+	const uint64_t object_size = size / objects;
+	const uint_fast8_t saved_scan_threads = p__scan_threads;
+	p__scan_threads = 4;
+	std::vector<char> memory(size, 0);
+	uint32_t state = 2463534242u;
+	for (uint64_t i = 0; i < size; i++)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		if ((i / 4096) % 3 == 0) memory[i] = (char)state; // every third page changed
+		else if (state % 97 == 0) memory[i] = 1; // scattered small changes
+	}
+	struct job { uint64_t offset; uint64_t size; };
+	std::vector<job> jobs;
+	for (unsigned i = 0; i < objects; i++) jobs.push_back({ i * object_size, object_size });
+	jobs.push_back({ 3 * object_size + 100, 2 * object_size }); // overlaps two earlier jobs, so must see their changes
+
+	std::vector<char> serial_clone(size, 0);
+	file_writer serial(0);
+	serial.set("write5_scan_serial.bin");
+	for (unsigned i = 0; i < jobs.size(); i++)
+	{
+		serial.write_uint32_t(i);
+		serial.write_patch(serial_clone.data(), memory.data(), jobs[i].offset, jobs[i].size);
+	}
+	serial.finalize();
+
+	std::vector<char> parallel_clone(size, 0);
+	std::vector<std::vector<patch_run>> runs(jobs.size());
+	std::vector<uint64_t> changed(jobs.size(), 0);
+	patch_scan_pool pool;
+	pool.run(objects, [&](unsigned task)
+	{
+		changed[task] = file_writer::diff_patch(parallel_clone.data(), memory.data(), jobs[task].offset, jobs[task].size, runs[task]);
+	});
+	changed[objects] = file_writer::diff_patch(parallel_clone.data(), memory.data(), jobs[objects].offset, jobs[objects].size, runs[objects]);
+	assert(changed[objects] == 0);
+	file_writer parallel(0);
+	parallel.set("write5_scan_parallel.bin");
+	for (unsigned i = 0; i < jobs.size(); i++)
+	{
+		parallel.write_uint32_t(i);
+		parallel.write_patch_runs(parallel_clone.data(), runs[i]);
+	}
+	parallel.finalize();
+	p__scan_threads = saved_scan_threads;
+
+	assert(serial_clone == memory);
+	assert(parallel_clone == memory);
+	assert(read_whole_file("write5_scan_serial.bin") == read_whole_file("write5_scan_parallel.bin"));
+	unlink("write5_scan_serial.bin");
+	unlink("write5_scan_parallel.bin");
+
+	// overlapping tasks diffing the same clone against different data must run in order, as grouped scans do
+	std::vector<char> other(memory);
+	for (uint64_t i = 0; i < size; i += 4096 * 5) memset(other.data() + i, 0x5a, 512);
+	std::vector<scan_area> areas;
+	std::vector<const char*> sources;
+	for (const job& j : jobs) { areas.push_back({ 0, j.offset, j.offset + j.size - 1 }); sources.push_back(memory.data()); }
+	sources.back() = other.data(); // the overlapping job sees different data
+	areas.push_back({ 1, 0, size - 1 }); // same range in another memory never groups with the others
+	sources.push_back(other.data());
+	std::vector<char> serial_clones(size * 2, 0);
+	std::vector<char> grouped_clones(size * 2, 0);
+	std::vector<std::vector<patch_run>> serial_runs(areas.size());
+	std::vector<std::vector<patch_run>> grouped_runs(areas.size());
+	auto diff = [&](std::vector<char>& clones, std::vector<std::vector<patch_run>>& out, unsigned task)
+	{
+		const scan_area& area = areas[task];
+		file_writer::diff_patch(clones.data() + area.memory * size, sources[task], area.first, area.last - area.first + 1, out[task]);
+	};
+	for (unsigned i = 0; i < areas.size(); i++) diff(serial_clones, serial_runs, i);
+	p__scan_threads = 4;
+	pool.run_grouped(areas, [&](unsigned task) { diff(grouped_clones, grouped_runs, task); });
+	p__scan_threads = saved_scan_threads;
+	assert(!serial_runs[objects].empty()); // it did find the other data
+	for (unsigned i = 0; i < areas.size(); i++)
+	{
+		assert(serial_runs[i].size() == grouped_runs[i].size());
+		for (unsigned r = 0; r < serial_runs[i].size(); r++)
+		{
+			assert(serial_runs[i][r].offset == grouped_runs[i][r].offset && serial_runs[i][r].size == grouped_runs[i][r].size);
+		}
+	}
+	assert(serial_clones == grouped_clones);
+	const uint64_t overlap_first = jobs[objects].offset;
+	const uint64_t overlap_end = overlap_first + jobs[objects].size;
+	assert(memcmp(grouped_clones.data(), memory.data(), overlap_first) == 0);
+	assert(memcmp(grouped_clones.data() + overlap_first, other.data() + overlap_first, overlap_end - overlap_first) == 0);
+	assert(memcmp(grouped_clones.data() + overlap_end, memory.data() + overlap_end, size - overlap_end) == 0);
+	assert(memcmp(grouped_clones.data() + size, other.data(), size) == 0);
+}
+
+// Several threads submitting at once share one scan pool. Whoever finds it busy does its own tasks.
+static void write_test_shared_scan_pool()
+{
+	const uint_fast8_t saved_scan_threads = p__scan_threads;
+	p__scan_threads = 4;
+	patch_scan_pool pool;
+	const unsigned callers = 4;
+	const unsigned tasks = 200;
+	std::vector<std::atomic_uint32_t> done(callers * tasks);
+	std::vector<std::thread> threads;
+	for (unsigned c = 0; c < callers; c++)
+	{
+		threads.emplace_back([&, c]()
+		{
+			for (unsigned round = 0; round < 50; round++) pool.run(tasks, [&](unsigned task) { done[c * tasks + task]++; });
+		});
+	}
+	for (std::thread& t : threads) t.join();
+	p__scan_threads = saved_scan_threads;
+	for (const auto& count : done) assert(count.load() == 50);
+}
+
+// A big clone only takes up memory where we diffed changes into it
+static void write_test_sparse_clone()
+{
+	const uint64_t size = 256 * 1024 * 1024;
+	const uint64_t changed_offset = 64 * 1024 * 1024 + 128;
+	const uint64_t changed_size = 1024 * 1024;
+	const uint64_t slack = 2 * 4096 * 16; // page rounding, with room for big pages
+	char* clone = clone_alloc(size);
+	char* memory = clone_alloc(size); // stands in for the app's mostly untouched memory
+	assert(clone_resident(clone, size) == 0);
+	memset(memory + changed_offset, 0x3c, changed_size);
+	std::vector<patch_run> runs;
+	const uint64_t changed = file_writer::diff_patch(clone, memory, 0, size, runs);
+	assert(changed == changed_size);
+	assert(runs.size() == 1 && runs[0].offset == changed_offset && runs[0].size == changed_size);
+	assert(clone[changed_offset] == 0x3c && clone[changed_offset - 1] == 0);
+	const uint64_t resident = clone_resident(clone, size);
+	assert(resident >= changed_size && resident <= changed_size + slack);
+	clone_commit(clone + size / 2, changed_size); // may do nothing on older kernels
+	assert(clone[size / 2] == 0 && clone[size / 2 + changed_size - 1] == 0);
+	assert(clone_resident(clone, size) <= resident + changed_size + slack);
+	// a small change near the start must not commit the clone behind it
+	const uint64_t before = clone_resident(clone, size);
+	memory[100] = 0x11;
+	runs.clear();
+	assert(file_writer::diff_patch(clone, memory, 0, size, runs) > 0 && clone[100] == 0x11);
+	assert(clone_resident(clone, size) <= before + slack);
+	clone_free(memory, size);
+	clone_free(clone, size);
+}
+
+// Patches written later on a worker thread into spans reserved in the stream must give exactly the same stream as writing them in place
+static void write_test_deferred_spans(bool patch_opcodes)
+{
+	const uint64_t size = 2 * 1024 * 1024;
+	const unsigned rounds = 40;
+	const int saved_chunksize = p__chunksize;
+	const uint_fast8_t saved_patch_opcodes = p__patch_opcodes;
+	p__chunksize = 64 * 1024; // so that spans get split over chunks
+	p__patch_opcodes = patch_opcodes;
+	std::vector<char> memory(size, 0);
+	std::vector<char> serial_clone(size, 0);
+	std::vector<char> deferred_clone(size, 0);
+	file_writer serial(0);
+	serial.set("write5_deferred_serial.bin");
+	file_writer deferred(0);
+	deferred.set("write5_deferred.bin");
+	span_worker worker;
+	uint32_t state = 2463534242u;
+	for (unsigned round = 0; round < rounds; round++)
+	{
+		const uint64_t offset = (round * 37 * 4096) % (size / 2);
+		const uint64_t len = (round % 5 == 0) ? 0 : (round % 3 + 1) * 100000 + round;
+		for (uint64_t i = offset; i < offset + len; i++)
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			memory[i] = (round % 2) ? (char)state : (char)(i % 7); // noise or fills
+		}
+		const uint64_t area = size / 2 + round % 2;
+		serial.write_uint32_t(round);
+		serial.write_patch(serial_clone.data(), memory.data(), 0, area);
+		serial.write_uint32_t(round);
+
+		deferred.write_uint32_t(round);
+		stream_span* span = deferred.reserve_span();
+		std::vector<char> snapshot(memory.begin(), memory.begin() + area);
+		worker.run(deferred, span, area, 1024 * 1024, [&deferred_clone, snapshot, area](file_writer& out)
+		{
+			std::vector<patch_run> runs;
+			file_writer::diff_patch(deferred_clone.data(), snapshot.data(), 0, area, runs);
+			out.write_patch_runs(deferred_clone.data(), runs);
+		});
+		deferred.write_uint32_t(round);
+		if (round % 4 == 0) deferred.thaw(); // as at the end of a packet
+	}
+	worker.drain();
+	deferred.thaw();
+	assert(deferred.count_held_spans() == 0);
+	assert(worker.jobs.load() == rounds);
+	assert(deferred.uncompressed_bytes == serial.uncompressed_bytes);
+	const uint64_t stream_size = serial.uncompressed_bytes;
+	serial.finalize();
+	deferred.finalize();
+	p__chunksize = saved_chunksize;
+	p__patch_opcodes = saved_patch_opcodes;
+	assert(deferred_clone == serial_clone);
+
+	file_reader serial_reader("write5_deferred_serial.bin", 0, stream_size, stream_size);
+	file_reader deferred_reader("write5_deferred.bin", 0, stream_size, stream_size);
+	std::vector<char> expected(stream_size);
+	std::vector<char> result(stream_size);
+	serial_reader.read_array(expected.data(), stream_size);
+	deferred_reader.read_array(result.data(), stream_size);
+	assert(result == expected);
+	unlink("write5_deferred_serial.bin");
+	unlink("write5_deferred.bin");
+}
+
 int main()
 {
 	size_t bytes = write_test_1();
@@ -93,6 +606,22 @@ int main()
 	read_test_1(bytes);
 	unlink("write_5.bin");
 
+	write_test_shared_pool();
+	write_test_backpressure();
+	write_test_subblocks(true);
+	write_test_subblocks(false);
+	write_test_adaptive(0);
+	write_test_adaptive(10000);
+	write_test_patch_opcodes();
+	write_test_direct_spans(true, 64 * 1024, 0, false);
+	write_test_direct_spans(false, -1, 10000, false); // on by default when compressing on the calling thread
+	write_test_direct_spans(true, 64 * 1024, 0, true);
+	write_test_parallel_scan();
+	write_test_shared_scan_pool();
+	write_test_sparse_clone();
+	write_test_deferred_spans(false);
+	write_test_deferred_spans(true);
+
 	// warmup
 	for (int i = 2; i <= 16; i++) write_test_pattern_stride(false, i, 1);
 